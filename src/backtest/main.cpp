@@ -0,0 +1,670 @@
+#include "../watchdog/traffic_analyzer.h"
+#include "../watchdog/packet_parser.h"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <unistd.h>
+
+using namespace std;
+
+
+#define BATCH_PACKETS 4096		// packets parsed before they are handed to the analyzers
+#define MAX_IDLE_REPORTS 60		// max empty reports generated for a gap between packets (as in the watchdog)
+#define MAX_CONFIGS 64			// max configurations in the grid (each analyzer takes about 30 MB, mostly its flow table)
+
+
+/** @brief One configuration being backtested: an analyzer with its own key, timeslice and alert factor
+
+	Replays the shared packet stream into its analyzer, closing slices by packet timestamp the same way
+	a watchdog reading a pcap file does, and counts the reports, alerts and causes of the alerts.
+
+	Each configuration has a complete analyzer, detectors included, so its results are exactly those of
+	a watchdog with its settings. The detectors' tables are sized as in the watchdog (the flow table
+	alone holds 2^18 flows), so a configuration takes about 30 MB whatever the capture and
+	memory grows linearly with the grid, which is therefore capped at MAX_CONFIGS.
+	*/
+class BacktestConfig
+{
+
+private:
+
+	/** Name of the aggregation key (e.g. "dst") */
+	string m_keyName;
+
+	double m_timeslice;
+	long long m_sliceUsecs;
+	double m_alertFactor;
+
+	/** Slice the analyzer is collecting (-1 before the first packet) */
+	long long m_currentSlice;
+
+	unsigned long long m_reports;
+	unsigned long long m_alerts;
+
+	/** Number of alerts raised by each cause (e.g. "packets", "synflood"), in order of first appearance */
+	vector<pair<string, unsigned long long> > m_causes;
+
+
+	/** @brief Generates the report of the current slice and counts its alert causes */
+	void Report()
+	{
+		GenerateReport();
+		m_reports++;
+
+		if (!Analyzer().LastReportAlerted())
+		{
+			return;
+		}
+
+		m_alerts++;
+
+		istringstream issCauses(Analyzer().LastAlertCauses());
+		string cause;
+		while (issCauses >> cause)
+		{
+			size_t i = 0;
+			while (i < m_causes.size() && m_causes[i].first != cause)
+			{
+				i++;
+			}
+
+			if (i == m_causes.size())
+			{
+				m_causes.push_back(make_pair(cause, 0ULL));
+			}
+			m_causes[i].second++;
+		}
+	}
+
+
+protected:
+
+	/** @brief Constructor **/
+	BacktestConfig(const string& keyName, double timeslice, double alertFactor)
+	{
+		m_keyName = keyName;
+		m_timeslice = timeslice;
+		m_sliceUsecs = (long long)(timeslice * 1000000 + 0.5);
+		m_alertFactor = alertFactor;
+		m_currentSlice = -1;
+		m_reports = 0;
+		m_alerts = 0;
+	}
+
+	/** @brief Adds a packet to the analyzer **/
+	virtual void AddPacket(const PacketInfo& p) = 0;
+
+	/** @brief Generates the analyzer's report **/
+	virtual void GenerateReport() = 0;
+
+
+public:
+
+	virtual ~BacktestConfig() {}
+
+	/** @brief Returns the analyzer's configuration independent part **/
+	virtual TrafficAnalyzerBase& Analyzer() = 0;
+
+	/** @brief Loads CIDR groups into the analyzer **/
+	virtual bool LoadPrefixes(const string& filename) = 0;
+
+	/** @brief Closes the slices before the packet's (as CaptureShard does), then adds it **/
+	void Replay(const PacketInfo& p)
+	{
+		long long slice = p.ts_usecs / m_sliceUsecs;
+
+		if (m_currentSlice >= 0 && slice > m_currentSlice)
+		{
+			long long numReports = min(slice - m_currentSlice, (long long)MAX_IDLE_REPORTS);
+			for (long long i = 0; i < numReports; i++)
+			{
+				Report();
+			}
+		}
+
+		if (slice > m_currentSlice)
+		{
+			m_currentSlice = slice;
+		}
+
+		AddPacket(p);
+	}
+
+	/** @brief Reports the last slice (at the end of the capture) **/
+	void Finish()
+	{
+		if (m_currentSlice >= 0)
+		{
+			Report();
+		}
+	}
+
+	const string& KeyName() const { return m_keyName; }
+	double Timeslice() const { return m_timeslice; }
+	double AlertFactor() const { return m_alertFactor; }
+	unsigned long long Reports() const { return m_reports; }
+	unsigned long long Alerts() const { return m_alerts; }
+	const vector<pair<string, unsigned long long> >& Causes() const { return m_causes; }
+
+};
+
+
+/** @brief A BacktestConfig aggregating by KeyPolicy (with the watchdog's metrics) **/
+template <class KeyPolicy>
+class KeyedBacktestConfig : public BacktestConfig
+{
+
+private:
+
+	/** Silent analyzer (no logfile) */
+	TrafficAnalyzer<KeyPolicy, WATCHDOG_METRICS> m_analyzer;
+
+
+protected:
+
+	void AddPacket(const PacketInfo& p) { m_analyzer.AddPacket(p); }
+
+	void GenerateReport() { m_analyzer.GenerateReport(); }
+
+
+public:
+
+	KeyedBacktestConfig(const string& keyName, double timeslice, double alertFactor)
+		: BacktestConfig(keyName, timeslice, alertFactor), m_analyzer("")
+	{
+		m_analyzer.SetAlertFactor(alertFactor);
+	}
+
+	TrafficAnalyzerBase& Analyzer() { return m_analyzer; }
+
+	bool LoadPrefixes(const string& filename) { return m_analyzer.LoadPrefixes(filename); }
+
+};
+
+
+/** Creates a configuration aggregating by the key named KEYNAME (dst, src, dstport or protocol).
+	Returns NULL if there is no such key **/
+BacktestConfig* CreateConfig(const string& keyName, double timeslice, double alertFactor)
+{
+	if (keyName == "dst") return new KeyedBacktestConfig<DstKey>(keyName, timeslice, alertFactor);
+	if (keyName == "src") return new KeyedBacktestConfig<SrcKey>(keyName, timeslice, alertFactor);
+	if (keyName == "dstport") return new KeyedBacktestConfig<DstPortKey>(keyName, timeslice, alertFactor);
+	if (keyName == "protocol") return new KeyedBacktestConfig<ProtocolKey>(keyName, timeslice, alertFactor);
+	return NULL;
+}
+
+
+/** @brief Packets parsed once and replayed into every configuration **/
+struct PacketBatch
+{
+	vector<PacketInfo> packets;
+
+	/** Copied payloads (only kept when signatures are loaded) and each packet's offset into them */
+	vector<u_char> payloads;
+	vector<size_t> offsets;
+
+	size_t count;
+
+	/** TRUE for the (possibly empty) batch ending the capture */
+	bool last;
+};
+
+
+/** @brief Hands batches from the parser to the worker threads, each replaying them into its configurations
+
+	Two batches are used in turn, so the parser fills one while the workers replay the other. Every
+	worker replays every batch (into its own configurations only), so the analyzers need no locking.
+	*/
+class BatchPipeline
+{
+
+private:
+
+	PacketBatch m_batches[2];
+
+	mutex m_mtx;
+	condition_variable m_cv;
+
+	/** Number of batches handed to the workers */
+	long long m_published;
+
+	/** Number of batches each worker has replayed */
+	vector<long long> m_replayed;
+
+
+public:
+
+	BatchPipeline(size_t numWorkers)
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			m_batches[i].packets.resize(BATCH_PACKETS);
+			m_batches[i].offsets.resize(BATCH_PACKETS);
+			m_batches[i].count = 0;
+			m_batches[i].last = false;
+		}
+		m_published = 0;
+		m_replayed.assign(numWorkers, 0);
+	}
+
+	/** @brief Waits until the next batch to fill is no longer being replayed and returns it (emptied) **/
+	PacketBatch& NextToFill()
+	{
+		unique_lock<mutex> lock(m_mtx);
+		m_cv.wait(lock, [this] { return *min_element(m_replayed.begin(), m_replayed.end()) >= m_published - 1; });
+
+		PacketBatch& batch = m_batches[m_published % 2];
+		batch.count = 0;
+		batch.payloads.clear();
+		return batch;
+	}
+
+	/** @brief Hands the batch returned by NextToFill() to the workers **/
+	void Publish()
+	{
+		PacketBatch& batch = m_batches[m_published % 2];
+		for (size_t i = 0; i < batch.count; i++)
+		{
+			if (batch.packets[i].payload_len > 0)
+			{
+				batch.packets[i].payload = batch.payloads.data() + batch.offsets[i];
+			}
+		}
+
+		m_mtx.lock();
+		m_published++;
+		m_mtx.unlock();
+		m_cv.notify_all();
+	}
+
+	/** @brief Worker thread, replays every batch into its configurations until the last **/
+	void Replay(size_t worker, const vector<BacktestConfig*>& configs)
+	{
+		while (1)
+		{
+			unique_lock<mutex> lock(m_mtx);
+			m_cv.wait(lock, [this, worker] { return m_published > m_replayed[worker]; });
+			const PacketBatch& batch = m_batches[m_replayed[worker] % 2];
+			bool last = batch.last; // (the batch may be refilled as soon as it is marked replayed)
+			lock.unlock();
+
+			for (size_t c = 0; c < configs.size(); c++)
+			{
+				for (size_t i = 0; i < batch.count; i++)
+				{
+					configs[c]->Replay(batch.packets[i]);
+				}
+
+				if (last)
+				{
+					configs[c]->Finish();
+				}
+			}
+
+			lock.lock();
+			m_replayed[worker]++;
+			lock.unlock();
+			m_cv.notify_all();
+
+			if (last)
+			{
+				return;
+			}
+		}
+	}
+
+};
+
+
+/** Splits a comma separated list **/
+vector<string> SplitList(const string& list)
+{
+	vector<string> items;
+	istringstream iss(list);
+	string item;
+	while (getline(iss, item, ','))
+	{
+		items.push_back(item);
+	}
+	return items;
+}
+
+
+/** Prints usage instructions to console **/
+void PrintUsgInstr()
+{
+	cout << "\nBacktest Usage Instructions:\n\n";
+	cout << "> backtest [-r filename] [-k keys] [-t timeslices] [-a factors] [-s rulefile] [-p prefixfile] [-j threads]\n";
+	cout << "where\n";
+	cout << "-r, --read\t\tRead the specified pcap file (parsed once and replayed into every configuration)\n";
+	cout << "-k, --keys\t\tComma separated aggregation keys to test: dst,src,dstport,protocol (default = dst)\n";
+	cout << "-t, --timeslices\tComma separated timeslices in seconds to test (default = 1)\n";
+	cout << "-a, --alert\t\tComma separated alert factors to test (default = 3)\n";
+	cout << "-s, --signatures\tMatch payloads against the signatures in the specified rule file (as watchdog -s)\n";
+	cout << "-p, --prefixes\t\tAlso total and alert on the CIDR groups in the specified file (as watchdog -p)\n";
+	cout << "-j, --threads\t\tNumber of threads replaying the configurations (default = number of CPUs)\n";
+	cout << "Every combination of key, timeslice and factor is tested (at most " << MAX_CONFIGS << ", each taking about 30 MB); a table\n";
+	cout << "of the reports and alerts of each (with the number of alerts raised by each cause) is printed once the whole\n";
+	cout << "file has been replayed, with the malloc calls and final size of each configuration's per-timeslice arena.\n";
+}
+
+
+/** Parses cmd line arguments and saves options into fn args.
+	Returns TRUE if all opts are valid
+	Returns FALSE if anything goes wrong or if any opts are invalid **/
+bool ParseCmdLineArgs(int argc, char** argv, string& pcapfile, vector<string>& keys, vector<double>& timeslices,
+							vector<double>& factors, string& rulefile, string& prefixfile, int& numThreads)
+{
+	pcapfile = "";
+	keys.assign(1, "dst");
+	timeslices.assign(1, 1.0);
+	factors.assign(1, 3.0);
+	rulefile = "";
+	prefixfile = "";
+	numThreads = max(1, (int)thread::hardware_concurrency());
+
+	vector<string> items;
+	int c;
+
+	while ((c = getopt(argc, argv, "r:k:t:a:s:p:j:")) != -1)
+	{
+		switch (c)
+		{
+			case 'r':
+				pcapfile = optarg;
+				break;
+			case 'k':
+				keys = SplitList(optarg);
+				break;
+			case 't':
+				items = SplitList(optarg);
+				timeslices.clear();
+				for (size_t i = 0; i < items.size(); i++)
+				{
+					timeslices.push_back(atof(items[i].c_str()));
+					if (timeslices.back() < 0.1)
+					{
+						cout << "Error: timeslice must be at least 0.1 seconds\n";
+						return false;
+					}
+				}
+				break;
+			case 'a':
+				items = SplitList(optarg);
+				factors.clear();
+				for (size_t i = 0; i < items.size(); i++)
+				{
+					factors.push_back(atof(items[i].c_str()));
+					if (factors.back() <= 0)
+					{
+						cout << "Error: alert factor must be positive\n";
+						return false;
+					}
+				}
+				break;
+			case 's':
+				rulefile = optarg;
+				break;
+			case 'p':
+				prefixfile = optarg;
+				break;
+			case 'j':
+				numThreads = atoi(optarg);
+				if (numThreads < 1)
+				{
+					cout << "Error: number of threads must be positive\n";
+					return false;
+				}
+				break;
+			default:
+				return false;
+		}
+	}
+
+	if (pcapfile == "")
+	{
+		cout << "Error: must provide pcapfile\n";
+		return false;
+	}
+
+	if (keys.empty() || timeslices.empty() || factors.empty())
+	{
+		cout << "Error: must provide at least one key, timeslice and alert factor\n";
+		return false;
+	}
+
+	if (keys.size() * timeslices.size() * factors.size() > MAX_CONFIGS)
+	{
+		cout << "Error: " << keys.size() * timeslices.size() * factors.size() << " configurations requested, at most "
+			<< MAX_CONFIGS << " can be tested at once (each takes about 30 MB)\n";
+		return false;
+	}
+
+	return true;
+}
+
+
+/** Prints the comparison table: one row per configuration, with a column per alert cause seen. Each row
+	also gives the number of chunks its analyzer's per-slice arena requested from malloc and the arena's
+	final size, showing what a key or timeslice costs and that the arena settles at the busiest slice **/
+void PrintTable(const vector<unique_ptr<BacktestConfig> >& configs)
+{
+	vector<string> causes;
+	for (size_t c = 0; c < configs.size(); c++)
+	{
+		for (size_t i = 0; i < configs[c]->Causes().size(); i++)
+		{
+			if (find(causes.begin(), causes.end(), configs[c]->Causes()[i].first) == causes.end())
+			{
+				causes.push_back(configs[c]->Causes()[i].first);
+			}
+		}
+	}
+
+	cout << left << setw(10) << "key" << right << setw(10) << "timeslice" << setw(8) << "factor"
+		<< setw(10) << "reports" << setw(10) << "alerts" << setw(8) << "alert%" << setw(10) << "mallocs" << setw(10) << "arenaKB";
+	for (size_t i = 0; i < causes.size(); i++)
+	{
+		cout << setw(max((size_t)10, causes[i].length() + 2)) << causes[i];
+	}
+	cout << "\n";
+
+	for (size_t c = 0; c < configs.size(); c++)
+	{
+		BacktestConfig& config = *configs[c];
+		double rate = config.Reports() ? 100.0 * config.Alerts() / config.Reports() : 0;
+
+		cout << left << setw(10) << config.KeyName() << right << setw(10) << config.Timeslice() << setw(8) << config.AlertFactor()
+			<< setw(10) << config.Reports() << setw(10) << config.Alerts() << setw(8) << fixed << setprecision(1) << rate;
+		cout.unsetf(ios::fixed);
+		cout << setprecision(6);
+		cout << setw(10) << config.Analyzer().GetArenaMallocCalls() << setw(10) << config.Analyzer().GetArenaCapacity() / 1024;
+
+		for (size_t i = 0; i < causes.size(); i++)
+		{
+			unsigned long long count = 0;
+			for (size_t j = 0; j < config.Causes().size(); j++)
+			{
+				if (config.Causes()[j].first == causes[i])
+				{
+					count = config.Causes()[j].second;
+				}
+			}
+			cout << setw(max((size_t)10, causes[i].length() + 2)) << count;
+		}
+		cout << "\n";
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	string pcapfile;
+	vector<string> keys;
+	vector<double> timeslices;
+	vector<double> factors;
+	string rulefile;
+	string prefixfile;
+	int numThreads;
+
+	if (!ParseCmdLineArgs(argc, argv, pcapfile, keys, timeslices, factors, rulefile, prefixfile, numThreads))
+	{
+		PrintUsgInstr();
+		return 0;
+	}
+
+	/** Create a configuration for every combination **/
+	vector<unique_ptr<BacktestConfig> > configs;
+	for (size_t k = 0; k < keys.size(); k++)
+	{
+		for (size_t t = 0; t < timeslices.size(); t++)
+		{
+			for (size_t a = 0; a < factors.size(); a++)
+			{
+				BacktestConfig* pConfig = CreateConfig(keys[k], timeslices[t], factors[a]);
+				if (pConfig == NULL)
+				{
+					cout << "Error: unknown key " << keys[k] << "\n";
+					return 1;
+				}
+				configs.push_back(unique_ptr<BacktestConfig>(pConfig));
+
+				if (rulefile != "" && !pConfig->Analyzer().LoadSignatures(rulefile))
+				{
+					return 1;
+				}
+
+				if (prefixfile != "" && !pConfig->LoadPrefixes(prefixfile))
+				{
+					return 1;
+				}
+			}
+		}
+	}
+
+	/** Open the pcap file and choose the parser for its link type **/
+	char errbuf[PCAP_ERRBUF_SIZE];
+	pcap_t* pHandle = pcap_open_offline(pcapfile.c_str(), errbuf);
+	if (pHandle == NULL)
+	{
+		cout << "Error opening " << pcapfile << ": " << errbuf << "\n";
+		return 1;
+	}
+
+	bool (*parse)(const u_char*, u_int, PacketInfo&) = NULL;
+	switch (pcap_datalink(pHandle))
+	{
+		case DLT_EN10MB:
+			parse = ParsePacket<DLT_EN10MB>;
+			break;
+		case DLT_LINUX_SLL:
+			parse = ParsePacket<DLT_LINUX_SLL>;
+			break;
+		case DLT_RAW:
+			parse = ParsePacket<DLT_RAW>;
+			break;
+		case DLT_NULL:
+			parse = ParsePacket<DLT_NULL>;
+			break;
+		default:
+			cout << "Error: unsupported link type " << pcap_datalink(pHandle) << " in " << pcapfile << "\n";
+			pcap_close(pHandle);
+			return 1;
+	}
+
+	/** Start the workers, each replaying an equal share of the configurations **/
+	size_t numWorkers = min((size_t)numThreads, configs.size());
+	vector<vector<BacktestConfig*> > shares(numWorkers);
+	for (size_t c = 0; c < configs.size(); c++)
+	{
+		shares[c % numWorkers].push_back(configs[c].get());
+	}
+
+	BatchPipeline pipeline(numWorkers);
+	vector<thread> workers;
+	for (size_t w = 0; w < numWorkers; w++)
+	{
+		workers.push_back(thread(&BatchPipeline::Replay, &pipeline, w, cref(shares[w])));
+	}
+
+	/** Parse the file once, handing the packets to the workers in batches **/
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	unsigned long long packetsRead = 0, packetsParsed = 0;
+	bool keepPayloads = (rulefile != "");
+
+	PacketBatch* pBatch = &pipeline.NextToFill();
+	while (1)
+	{
+		pcap_pkthdr* header;
+		const u_char* frame;
+		int result = pcap_next_ex(pHandle, &header, &frame);
+
+		if (result == 1)
+		{
+			packetsRead++;
+
+			PacketInfo& p = pBatch->packets[pBatch->count];
+			if (!parse(frame, header->caplen, p))
+			{
+				continue;
+			}
+
+			p.ts_usecs = (long long)header->ts.tv_sec * 1000000 + header->ts.tv_usec;
+
+			// the payload is copied, as the next read overwrites libpcap's buffer (pointed to on Publish())
+			if (keepPayloads && p.payload_len > 0)
+			{
+				pBatch->offsets[pBatch->count] = pBatch->payloads.size();
+				pBatch->payloads.insert(pBatch->payloads.end(), p.payload, p.payload + p.payload_len);
+			}
+			else
+			{
+				p.payload = NULL;
+				p.payload_len = 0;
+			}
+
+			packetsParsed++;
+			if (++pBatch->count < BATCH_PACKETS)
+			{
+				continue;
+			}
+		}
+		else if (result == -1)
+		{
+			cout << "Error reading packets from " << pcapfile << ": " << pcap_geterr(pHandle) << "\n";
+		}
+
+		pBatch->last = (result != 1);
+		pipeline.Publish();
+
+		if (pBatch->last)
+		{
+			break;
+		}
+
+		pBatch = &pipeline.NextToFill();
+		pBatch->last = false;
+	}
+
+	for (size_t w = 0; w < workers.size(); w++)
+	{
+		workers[w].join();
+	}
+	pcap_close(pHandle);
+
+	double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	cout << "Replayed " << packetsParsed << " of " << packetsRead << " packets into " << configs.size()
+		<< " configurations on " << numWorkers << " threads in " << secs << " seconds\n\n";
+	PrintTable(configs);
+
+	return 0;
+}
@@ -0,0 +1,67 @@
+#include "../watchdog/blocklist.h"
+
+#include <iostream>
+#include <unistd.h>
+
+using namespace std;
+
+
+/** Prints usage instructions to console **/
+void PrintUsgInstr()
+{
+	cout << "\nBlocklist Usage Instructions:\n\n";
+	cout << "> blocklist [-r filename] [-w filename]\n";
+	cout << "where\n";
+	cout << "-r, --read\t\tRead the list of IPv4 addresses and CIDR prefixes (one per line) in the specified file\n";
+	cout << "-w, --write\t\tWrite the index (for watchdog -b) to the specified file\n";
+}
+
+
+/** Parses cmd line arguments and saves options into fn args.
+	Returns TRUE if all opts are valid 
+	Returns FALSE if anything goes wrong or if any opts are invalid **/
+bool ParseCmdLineArgs(int argc, char** argv, string& listfile, string& indexfile)
+{
+	listfile = "";
+	indexfile = "";
+
+	int c;
+
+	while ((c = getopt(argc, argv, "r:w:")) != -1)
+	{
+		switch (c)
+		{
+			case 'r':
+				listfile = optarg;
+				break;
+			case 'w':
+				indexfile = optarg;
+				break;
+			default:
+				return false;
+		}
+	}
+
+	if (listfile == "" || indexfile == "")
+	{
+		cout << "Error: must provide list and index file names" << endl;
+		return false;
+	}
+
+	return true;
+}
+
+
+int main(int argc, char** argv)
+{
+	string listfile;
+	string indexfile;
+
+	if (!ParseCmdLineArgs(argc, argv, listfile, indexfile))
+	{
+		PrintUsgInstr();
+		return 0;
+	}
+
+	return Blocklist::Build(listfile, indexfile) ? 0 : 1;
+}
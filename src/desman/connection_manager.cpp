@@ -6,15 +6,18 @@
 #include <string.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>			// poll()
 #include <sys/types.h>
 #include <sys/socket.h>		// socket library
 #include <netinet/in.h>		// socket structs (i.e. sockaddr_in, etc.)
 #include <arpa/inet.h>		// inet_aton() etc.
+#include <sys/un.h>			// sockaddr_un
 #include <ifaddrs.h>		// getifaddrs()
 
 
-#define MAXWATCHDOGS 10
-#define MAXBUFLEN 512
+#define MAXBUFLEN 4096			// bytes read from a watchdog at a time
+#define MAX_REPORT_LEN 65536	// a longer line is cut into several reports
 #define DESMAN_PORT 11353
 
 
@@ -38,10 +41,131 @@ void ConnectionManager::RemoveWatchdog(int fd)
 {
 	m_numWatchdogs--;
 	m_idMap.erase(fd);
+	m_partial.erase(fd);
+	m_queued.erase(fd);
+	m_rings.erase(fd);
 	close(fd);
 }
 
 
+/** Blocks until the whole message has been sent. MSG_NOSIGNAL keeps a watchdog that has gone away
+	from raising SIGPIPE (the error is returned instead).
+
+	@param fd The watchdog's sockfd
+	@param msg The message, without the terminating '\n'
+
+	@return TRUE if the message was sent, FALSE if an error occured
+	*/
+bool ConnectionManager::SendMessage(int fd, const string& msg) const
+{
+	string line = msg + "\n";
+	size_t sent = 0;
+
+	while (sent < line.length())
+	{
+		ssize_t bytes = send(fd, line.c_str() + sent, line.length() - sent, MSG_NOSIGNAL);
+		if (bytes == -1)
+		{
+			return false;
+		}
+		sent += bytes;
+	}
+
+	return true;
+}
+
+
+/** Called by ReceiveWDReports() when a watchdog's socket is readable. Appends what was received to the
+	partial line of the watchdog, then queues every whole line in it as a report.
+
+	@param fd The watchdog's sockfd
+
+	@return TRUE if data was received, FALSE if the connection was lost or an error occured
+	*/
+bool ConnectionManager::ReadWatchdog(int fd)
+{
+	char buf[MAXBUFLEN];
+	ssize_t bytes = recv(fd, buf, sizeof(buf), 0);
+	if (bytes <= 0)
+	{
+		return false;
+	}
+
+	m_partial[fd].append(buf, bytes);
+	QueueReports(fd);
+
+	return true;
+}
+
+
+/** Called by ReceiveWDReports() for a colocated watchdog each time it checks for reports. Reading the
+	ring makes no syscall; the eventfd is only reset once it has woken the desman, and the local socket
+	(on which a watchdog sends nothing) only read once it is readable, which means it was closed. The
+	ring is read after the socket, so the reports a watchdog wrote before it exited are still queued.
+
+	@param fd The sockfd of the watchdog's local socket
+	@param sockReadable TRUE if poll() found the local socket readable
+	@param woken TRUE if poll() found the ring's eventfd readable
+
+	@return TRUE if the watchdog is still connected (or left reports to queue), FALSE if the connection was lost
+	*/
+bool ConnectionManager::ReadRing(int fd, bool sockReadable, bool woken)
+{
+	ShmRing& ring = *m_rings[fd];
+
+	bool closed = false;
+	if (sockReadable)
+	{
+		char buf[MAXBUFLEN];
+		ssize_t bytes = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		closed = (bytes == 0 || (bytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK));
+	}
+
+	if (woken)
+	{
+		ring.ClearWakeup();
+	}
+
+	string& partial = m_partial[fd];
+	size_t before = partial.length();
+	ring.Read(partial);
+
+	if (closed && partial.length() == before)
+	{
+		return false;
+	}
+
+	QueueReports(fd);
+	return true;
+}
+
+
+/** Queues every whole line in the partial line of a watchdog as a report (a line longer than
+	MAX_REPORT_LEN is queued in pieces, so a watchdog can't make the desman buffer without bound).
+
+	@param fd The watchdog's sockfd
+	*/
+void ConnectionManager::QueueReports(int fd)
+{
+	string& partial = m_partial[fd];
+
+	size_t start = 0;
+	size_t end;
+	while ((end = partial.find('\n', start)) != string::npos)
+	{
+		m_queued[fd].push_back(partial.substr(start, end - start));
+		start = end + 1;
+	}
+	partial.erase(0, start);
+
+	if (partial.length() > MAX_REPORT_LEN)
+	{
+		m_queued[fd].push_back(partial);
+		partial.clear();
+	}
+}
+
+
 /** Called internally within InitializeSocket() method to determine the local ip of the host machine 
 	desman is running on. Uses getifaddrs() to determine the first valid ipv4 address (excluding localhost) 
 	and returns it via the ip_addr param. 
@@ -140,11 +264,102 @@ ConnectionManager::ConnectionManager(int numWDs, string logfile)
 {
 	m_numWatchdogs = numWDs;
 	m_logfile = logfile;
+	m_upstream = -1;
+}
+
+
+/** Called internally by EstablishWDConnections() method. Binds a unix socket to the abstract name
+	DESMAN_LOCAL_SOCKET (abstract, so nothing is left behind in the filesystem) and listens on it.
+
+	@return socket file descriptor of the listening socket, or -1 if any errors occured.
+	*/
+int ConnectionManager::InitializeLocalSocket() const
+{
+	int fd;
+	sockaddr_un sa;
+
+	memset((char *)&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path + 1, DESMAN_LOCAL_SOCKET, sizeof(sa.sun_path) - 2); // (sun_path[0] = 0 makes it abstract)
+	socklen_t len = offsetof(sockaddr_un, sun_path) + 1 + strlen(DESMAN_LOCAL_SOCKET);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+	{
+		return -1;
+	}
+
+	if (bind(fd, (sockaddr *)&sa, len) == -1 || listen(fd, SOMAXCONN) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/** Called internally by EstablishWDConnections() once a listening socket is readable. Accepts the
+	watchdog, sends it its ID and maps the ID to its sockfd. A colocated watchdog (on the local socket)
+	gets a new ShmRing along with its ID.
+
+	@param listener The listening socket
+	@param local TRUE if LISTENER is the local socket
+	@param id The ID to assign
+
+	@return TRUE if the watchdog was assigned its ID, FALSE if an error occured
+	*/
+bool ConnectionManager::AcceptWatchdog(int listener, bool local, int id)
+{
+	int watchdog;			// sockfd for this watchdog
+	sockaddr_in wdAddr;	// watchdog's address info will be stored in here
+
+	// accept incoming watchdog connection
+	socklen_t addrlen = sizeof(wdAddr);
+	if ((watchdog = accept(listener, local ? NULL : (sockaddr *)&wdAddr, local ? NULL : &addrlen)) == -1)
+	{
+		cout << "Error accepting connection to watchdog " << id << endl;
+		return false;
+	}
+
+	// log "incoming watchdog connection..." msg
+	string ipStr = local ? "this host (shared memory)" : "IP " + string(inet_ntoa(wdAddr.sin_addr));
+	LogMessage("Incoming watchdog connection from " + ipStr);
+
+	// assign watchdog an ID (with the ring to write its reports to if it is colocated)
+	ostringstream ossIdMsg;
+	ossIdMsg << "UID " << id;
+
+	bool sent;
+	if (local)
+	{
+		unique_ptr<ShmRing> pRing(new ShmRing());
+		sent = pRing->Create() && pRing->SendDescriptors(watchdog, ossIdMsg.str());
+		m_rings[watchdog] = move(pRing);
+	}
+	else
+	{
+		sent = SendMessage(watchdog, ossIdMsg.str());
+	}
+
+	if (!sent)
+	{
+		cout << "Error assigning watchdog id" << endl;
+		return false;
+	}
+
+	// log "Assigned UID to watchdog..." msg
+	ostringstream oss;
+	oss << "Assigned " << id << " to watchdog at " << ipStr;
+	LogMessage(oss.str());
+
+	m_idMap[watchdog] = id;
+	return true;
 }
 
 
 /**	First uses InitializeSocket() helper function to acquire and bind to a TCP socket using the host's local IP address.
-	Begins listening on the socket for incoming watchdog connections. Once a watchdog connects, a watchdog ID is assigned
+	Begins listening on the socket for incoming watchdog connections, and on the local socket for colocated ones
+	(unless another desman on the host already has it). Once a watchdog connects, a watchdog ID is assigned
 	and mapped to the watchdogs socket file descriptor for future communications. The ID is then sent back to that watchdog.
 	The function returns once m_numWatchdogs watchdogs are successfully connected (or an error occurs).
 
@@ -160,7 +375,7 @@ bool ConnectionManager::EstablishWDConnections()
 	}
 
 	// start listening for incoming WD connections 
-	if (listen(listener, MAXWATCHDOGS) == -1)
+	if (listen(listener, SOMAXCONN) == -1)
 	{
 		cout << "Error listening for connections\n";
 		return false;
@@ -168,41 +383,41 @@ bool ConnectionManager::EstablishWDConnections()
 
 	LogMessage("Listening on port 11353...");
 
-	// Wait to receive connection from each watchdog and assign ID
-	for (int i = 0; i < m_numWatchdogs; i++)
+	int localListener = InitializeLocalSocket();
+	if (localListener == -1)
 	{
-		int watchdog;			// sockfd for this watchdog
-		sockaddr_in wdAddr;	// watchdog's address info will be stored in here
-		int id = i + 1;			// id that we'll assign to this watchdog
+		cout << "Shared memory transport unavailable (local socket in use), colocated watchdogs must use TCP\n";
+	}
+
+	pollfd listeners[2];
+	listeners[0].fd = listener;
+	listeners[0].events = POLLIN;
+	listeners[1].fd = localListener; // (skipped by poll() if -1)
+	listeners[1].events = POLLIN;
 
-		// accept incoming watchdog connection
-		socklen_t addrlen = sizeof(wdAddr);
-		if ((watchdog = accept(listener, (sockaddr *)&wdAddr, &addrlen)) == -1)
+	// Wait to receive connection from each watchdog and assign ID
+	int id = 0;
+	while (id < m_numWatchdogs)
+	{
+		listeners[0].revents = listeners[1].revents = 0;
+		if (poll(listeners, 2, -1) == -1 && errno != EINTR)
 		{
-			cout << "Error accepting connection to watchdog " << id << endl;
+			cout << "Error calling poll()\n";
 			return false;
 		}
 
-		// log "incoming watchdog connection..." msg
-		string ipStr = inet_ntoa(wdAddr.sin_addr);
-		LogMessage("Incoming watchdog connection from IP " + ipStr);
-		
-		// assign watchdog an ID
-		ostringstream ossIdMsg;
-		ossIdMsg << "UID " << id;
-		if (send(watchdog, ossIdMsg.str().c_str(), ossIdMsg.str().length(), 0) == -1)
+		for (int l = 0; l < 2 && id < m_numWatchdogs; l++)
 		{
-			cout << "Error assigning watchdog id" << endl;
-			return false;
+			if (listeners[l].revents != 0 && !AcceptWatchdog(listeners[l].fd, l == 1, ++id))
+			{
+				return false;
+			}
 		}
+	}
 
-		// log "Assigned UID to watchdog..." msg
-		ostringstream oss;
-		oss << "Assigned " << id << " to watchdog at IP " << ipStr;
-		LogMessage(oss.str());
-
-		
-		m_idMap[watchdog] = id;
+	if (localListener != -1)
+	{
+		close(localListener);
 	}
 
 	LogMessage("All watchdogs connected...");
@@ -223,7 +438,7 @@ bool ConnectionManager::SendStartSignal() const
 
 	for (auto it = m_idMap.begin(); it != m_idMap.end(); it++)
 	{
-		if (send(it->first, startMsg.c_str(), startMsg.length(), 0) == -1)
+		if (!SendMessage(it->first, startMsg))
 		{
 			cout << "Error sending start signal to WD " << it->first << endl;
 			return false;
@@ -233,7 +448,7 @@ bool ConnectionManager::SendStartSignal() const
 	return true;
 }
 
-/** Should be called in a loop immediately after SendStartSignal() returns TRUE. Uses the select() function
+/** Should be called in a loop immediately after SendStartSignal() returns TRUE. Uses the poll() function
 	to monitor all incoming messages from watchdogs. Once a report is received from a watchdog, it is logged 
 	via the LogMessage() method. If connection to a watchdog is lost, RemoveWatchdog() is called causing that
 	watchdog to stop being tracked. The user is notified via console in the event that this occurs. If all
@@ -241,77 +456,281 @@ bool ConnectionManager::SendStartSignal() const
 	to the caller that the watchdogs have finished monitoring and the desman can terminate as well.
 
 	Once a report is received from each connected watchdog, the reports are returned to the caller in a vector 
-	via the reports param.
+	via the reports param. A watchdog that sent more than one report since the last call has the others
+	queued, to be returned by the following calls (one per call, in the order they were sent).
+
+	A colocated watchdog's ring is read on every pass without a syscall, and only polled (via its eventfd)
+	once PrepareToWait() finds it empty.
 
 	@param[out] reports A vector containing the watchdog reports received
+	@param[out] ids The ID of the watchdog that sent each report
 	
 	@param return TRUE if at least one watchdog is still connected. FALSE if all watchdogs have disconnected.
 	*/
-bool ConnectionManager::ReceiveWDReports(vector<string>& reports)
+bool ConnectionManager::ReceiveWDReports(vector<string>& reports, vector<int>& ids)
 {
 	reports.clear();
+	ids.clear();
+	m_reportFds.clear();
 
-	int reportsToRecv = m_numWatchdogs;
-
-	int fdMax = 0;
-	fd_set watchdogs;
-	FD_ZERO(&watchdogs); // make sure our fd_set is empty
-
-	// add all our watchdog FDs to the 'watchdogs' fdset and determine fdMax
+	// poll every watchdog we still need a report from (fd set to -1, which poll() skips, once it has sent one):
+	// its socket, and for a colocated watchdog the eventfd of its ring
+	vector<int> fds;
+	vector<pollfd> watchdogs;
 	for (auto it = m_idMap.begin(); it != m_idMap.end(); it++)
 	{
-		FD_SET(it->first, &watchdogs);
-		if (it->first > fdMax) fdMax = it->first;
+		auto ring = m_rings.find(it->first);
+
+		pollfd pfd;
+		pfd.fd = it->first;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		watchdogs.push_back(pfd);
+		pfd.fd = (ring != m_rings.end()) ? ring->second->EventFd() : -1;
+		watchdogs.push_back(pfd);
+
+		fds.push_back(it->first);
 	}
 
-	// loop until we've received reports from all of our watchdogs
-	while (reportsToRecv > 0)
+	size_t reportsToRecv = fds.size();
+
+	// loop until we've received reports from all of our watchdogs (reports already queued are taken first)
+	while (1)
 	{
-		
-		fd_set readFds = watchdogs;
+		int timeout = -1;
 
-		if (select(fdMax+1, &readFds, NULL, NULL, NULL) == -1) // Get fds that are ready to be read from
+		for (size_t i = 0; i < fds.size(); i++)
 		{
-			cout << "Error calling select()\n";
-		}
+			int fd = fds[i];
+			pollfd& sock = watchdogs[2 * i];
+			pollfd& event = watchdogs[2 * i + 1];
+			if (sock.fd == -1)
+			{
+				continue;
+			}
 
-		for (int i = 0; i <= fdMax; i++)
-		{
-			if (FD_ISSET(i, &watchdogs))
+			bool readable = (sock.revents != 0);
+			bool woken = (event.revents != 0);
+			sock.revents = event.revents = 0;
+
+			bool colocated = (event.fd != -1);
+			if ((colocated && !ReadRing(fd, readable, woken)) || (!colocated && readable && !ReadWatchdog(fd)))
 			{
-				char buf[MAXBUFLEN] = {0};
-				int bytes;
-				if ((bytes = recv(i, buf, sizeof(buf), 0)) <= 0)
+				// if we lost connection or an error occured, stop tracking this watchdog
+				cout << "Lost connection with watchdog " << m_idMap[fd] << endl;
+				RemoveWatchdog(fd);
+				sock.fd = event.fd = -1;
+				reportsToRecv--;
+				if (m_numWatchdogs == 0)
 				{
-					// if we lost connection or an error occured, stop tracking this watchdog
-					cout << "Lost connection with watchdog " << m_idMap[i] << endl;
-					RemoveWatchdog(i);
-					if (m_numWatchdogs == 0)
-					{
-						return false;
-					}
+					return false;
 				}
-				else // Received report successfully
+				continue;
+			}
+
+			deque<string>& queued = m_queued[fd];
+			if (!queued.empty()) // Received report successfully
+			{
+				string report = queued.front();
+				queued.pop_front();
+				reports.push_back(report); // add report to list
+				ids.push_back(m_idMap[fd]);
+				m_reportFds.push_back(fd);
+
+				// Insert ID into report so we can log it
+				ostringstream oss;
+				oss << " " << m_idMap[fd];
+				string idStr = oss.str();
+				size_t pos = report.find("report");
+				if (pos != string::npos)
 				{
-					string report(buf);
-					reports.push_back(report); // add report to list
-
-					// Insert ID into report so we can log it
-					ostringstream oss;
-					oss << " " << m_idMap[i];
-					string idStr = oss.str();
-					int pos = report.find("report") + 6;
-					report.insert(pos, idStr);
-
-					// Log "Received report..." message
-					LogMessage("Received " + report);
+					report.insert(pos + 6, idStr);
 				}
+
+				// Log "Received report..." message
+				LogMessage("Received " + report);
+
+				sock.fd = event.fd = -1;
 				reportsToRecv--;
 			}
+			else if (colocated && !m_rings[fd]->PrepareToWait())
+			{
+				timeout = 0; // (written to since it was read, read it again without sleeping)
+			}
+		}
+
+		if (reportsToRecv == 0)
+		{
+			break;
+		}
+
+		if (poll(watchdogs.data(), watchdogs.size(), timeout) == -1 && errno != EINTR) // Get fds that are ready to be read from
+		{
+			cout << "Error calling poll()\n";
+			return false;
 		}
 	}
 
-	
+	return true;
+}
+
+
+/** Should be called once the reports returned by ReceiveWDReports() have been processed. Sends the
+	watchdog that sent each report "ack <n>", n being the report's number, so a client (such as the
+	loadgen tool) can measure how long the desman took to process it. A watchdog that has gone away is
+	skipped.
+
+	@param reports The reports last returned by ReceiveWDReports()
+	*/
+void ConnectionManager::AcknowledgeReports(const vector<string>& reports) const
+{
+	for (size_t i = 0; i < reports.size() && i < m_reportFds.size(); i++)
+	{
+		int reportId = 0;
+		size_t pos = reports[i].find("report");
+		if (pos != string::npos)
+		{
+			istringstream(reports[i].substr(pos + 6)) >> reportId;
+		}
+
+		ostringstream ossAck;
+		ossAck << "ack " << reportId;
+		SendMessage(m_reportFds[i], ossAck.str());
+	}
+}
+
+
+/** Called internally to read the upstream desman's messages. Reads a byte at a time so nothing after
+	the line is consumed (like a watchdog does).
+
+	@param[out] msg The message received, without the '\n'
+
+	@return TRUE if a message was received, FALSE if the connection was lost
+	*/
+bool ConnectionManager::RecvUpstream(string& msg) const
+{
+	msg = "";
+
+	char c;
+	while (msg.length() < MAXBUFLEN)
+	{
+		if (recv(m_upstream, &c, 1, 0) <= 0)
+		{
+			return false;
+		}
+
+		if (c == '\n')
+		{
+			return true;
+		}
+		msg += c;
+	}
 
 	return true;
-}
\ No newline at end of file
+}
+
+
+/** Connects to the upstream desman (at DESMAN_PORT) the way a watchdog does and receives the ID it
+	assigns to this desman. Should be called before EstablishWDConnections(), so the upstream desman
+	can count this desman among its watchdogs while this desman waits for its own.
+
+	@param upstreamIP IP address of the upstream desman in dot-quad notation
+
+	@return The ID assigned by the upstream desman, or -1 if any errors occured
+	*/
+int ConnectionManager::ConnectToUpstream(const string& upstreamIP)
+{
+	sockaddr_in sa;
+	memset((char *)&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(DESMAN_PORT);
+	if (inet_aton(upstreamIP.c_str(), &sa.sin_addr) == 0)
+	{
+		cout << "Error setting upstream desman IP address\n";
+		return -1;
+	}
+
+	if ((m_upstream = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+	{
+		cout << "Error creating socket\n";
+		return -1;
+	}
+
+	if (connect(m_upstream, (sockaddr *)&sa, sizeof(sa)) == -1)
+	{
+		cout << "Error connecting to upstream desman\n";
+		close(m_upstream);
+		m_upstream = -1;
+		return -1;
+	}
+
+	// receive "UID <id>"
+	string msg;
+	if (!RecvUpstream(msg) || msg.compare(0, 4, "UID ") != 0)
+	{
+		cout << "Error receiving ID from upstream desman\n";
+		close(m_upstream);
+		m_upstream = -1;
+		return -1;
+	}
+
+	int id = atoi(msg.c_str() + 4);
+
+	ostringstream oss;
+	oss << "Connected to upstream desman at IP " << upstreamIP << " as watchdog " << id;
+	LogMessage(oss.str());
+
+	return id;
+}
+
+
+/** Should be called after EstablishWDConnections() returns TRUE and before SendStartSignal(), so this
+	desman's watchdogs start monitoring together with the rest of the upstream desman's.
+
+	@return TRUE once the start signal is received, FALSE if any errors occured
+	*/
+bool ConnectionManager::WaitForUpstreamStart() const
+{
+	string msg;
+	if (!RecvUpstream(msg) || msg != "start")
+	{
+		cout << "Error receiving start signal from upstream desman\n";
+		return false;
+	}
+
+	LogMessage("Upstream desman started...");
+	return true;
+}
+
+
+/** Sends a report to the upstream desman. Anything the upstream desman sent since the last report (its
+	acknowledgements, if it was started with -a) is read and discarded first, so its sends never block.
+	If the connection is lost it is closed, and later calls do nothing.
+
+	@param report The report to forward (a '\n' is appended)
+
+	@return TRUE if the report was sent, or FALSE if not relaying or the connection was lost
+	*/
+bool ConnectionManager::SendUpstream(const string& report)
+{
+	if (m_upstream == -1)
+	{
+		return false;
+	}
+
+	char buf[MAXBUFLEN];
+	ssize_t bytes;
+	while ((bytes = recv(m_upstream, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+	{
+	}
+
+	if (bytes == 0 || !SendMessage(m_upstream, report))
+	{
+		close(m_upstream);
+		m_upstream = -1;
+		return false;
+	}
+
+	LogMessage("Forwarded " + report);
+	return true;
+}
@@ -4,6 +4,10 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <deque>
+#include <memory>
+
+#include "shm_ring.h"
 
 using namespace std;
 
@@ -17,6 +21,18 @@ using namespace std;
 
 	In the event that the connection to a watchdog is lost, the connection mananger will notify the 
 	user of the loss and continue to function, receiving future reports from the other watchdogs.
+
+	Every message is a line ending in '\n'. Data received from each watchdog is buffered until a whole
+	line has arrived, so a report is neither cut short nor merged with the next however TCP splits
+	the stream. Watchdogs are monitored with poll(), so their number isn't limited by FD_SETSIZE.
+
+	Watchdogs on the same host can connect to a local (unix) socket instead, over which the handshake
+	is the same, but the UID comes with a ShmRing that the watchdog then writes its reports into. The
+	desman polls the ring's eventfd alongside the TCP sockets, so both transports are served by the
+	same loop.
+
+	A relay desman also connects to an upstream desman, to which it is one more watchdog: it receives
+	a UID and the start signal like any watchdog, then forwards one report per window.
 	*/
 class ConnectionManager
 {
@@ -32,6 +48,21 @@ private:
 	/** Stores a mapping of watchdog sockfd to watchdog ID */
 	map<int, int> m_idMap; 	
 
+	/** Data received from each watchdog (by sockfd) that doesn't yet make a whole line */
+	map<int, string> m_partial;
+
+	/** Whole reports received from each watchdog (by sockfd) that are still to be returned */
+	map<int, deque<string> > m_queued;
+
+	/** Sockfd of the watchdog that sent each report last returned by ReceiveWDReports() */
+	vector<int> m_reportFds;
+
+	/** Report ring of each colocated watchdog (by sockfd of its local socket) */
+	map<int, unique_ptr<ShmRing> > m_rings;
+
+	/** Sockfd of the upstream desman (-1 if not relaying) */
+	int m_upstream;
+
 	/** @brief Appends a message to m_logfile and console */
 	void LogMessage(const string& msg) const;
 
@@ -44,6 +75,27 @@ private:
 	/** @brief Initializes TCP socket returning sockfd */
 	int InitializeSocket() const;
 
+	/** @brief Initializes the local socket colocated watchdogs connect to, returning sockfd (-1 on error) */
+	int InitializeLocalSocket() const;
+
+	/** @brief Accepts a watchdog on a listening socket and assigns it an ID, returning FALSE on error */
+	bool AcceptWatchdog(int listener, bool local, int id);
+
+	/** @brief Sends a message (a '\n' is appended) to a watchdog, returning FALSE on error */
+	bool SendMessage(int fd, const string& msg) const;
+
+	/** @brief Receives what a watchdog has sent, queuing any whole reports, returning FALSE if the connection was lost */
+	bool ReadWatchdog(int fd);
+
+	/** @brief Reads a colocated watchdog's ring, queuing any whole reports, returning FALSE if the connection was lost */
+	bool ReadRing(int fd, bool sockReadable, bool woken);
+
+	/** @brief Queues every whole line received from a watchdog as a report */
+	void QueueReports(int fd);
+
+	/** @brief Receives a message (a line, without the '\n') from the upstream desman, returning FALSE on error */
+	bool RecvUpstream(string& msg) const;
+
 
 public:
 
@@ -56,8 +108,20 @@ public:
 	/** @brief Sends start signal to all watchdogs */
 	bool SendStartSignal() const;
 
-	/** @brief Waits to receive reports from all watchdogs returning them to caller as a vector of strings **/
-	bool ReceiveWDReports(vector<string>& reports); 
+	/** @brief Waits to receive reports from all watchdogs returning them to caller as a vector of strings (and the ID of the watchdog sending each) **/
+	bool ReceiveWDReports(vector<string>& reports, vector<int>& ids); 
+
+	/** @brief Acknowledges the reports last received (once processed), sending each watchdog "ack <report>" **/
+	void AcknowledgeReports(const vector<string>& reports) const;
+
+	/** @brief Connects to an upstream desman as one of its watchdogs, returning the ID it assigned (-1 on error) */
+	int ConnectToUpstream(const string& upstreamIP);
+
+	/** @brief Waits for the upstream desman's start signal, returning FALSE on error */
+	bool WaitForUpstreamStart() const;
+
+	/** @brief Forwards a report to the upstream desman, returning FALSE (and no longer relaying) if the connection was lost */
+	bool SendUpstream(const string& report);
 
 };
 
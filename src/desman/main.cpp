@@ -1,13 +1,27 @@
 #include "connection_manager.h"
+#include "report_store.h"
+#include "report_aggregator.h"
+#include "topk_summary.h"
+#include "../watchdog/cpu_affinity.h"
 
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <unistd.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/resource.h>	// setrlimit()
 
 using namespace std;
 
 
+#define DEFAULT_PARTITION_SECS 3600	// length of a report store partition
+#define DEFAULT_GLOBAL_FACTOR 3.0	// a key alerts globally when its packets are more than this many times its previous window's
+#define GLOBAL_MIN_PACKETS 1000		// min packets of a key across all watchdogs in a window for a global alert
+#define FDS_PER_WATCHDOG 3			// descriptors held per watchdog (its socket, plus the ring's memfd and eventfd if local)
+#define RESERVED_FDS 64				// descriptors left for the listeners, log, report store and upstream desman
+
+
 string g_logfile;
 
 
@@ -22,28 +36,84 @@ void LogMessage(const string& msg)
 	cout << msg << endl;
 }
 
+/** Raises the soft limit on open descriptors to the hard limit (the default soft limit of 1024 runs out
+	at about 340 local watchdogs), then checks that NUMWATCHDOGS fit under it.
+
+	@param numWatchdogs The number of watchdogs that will connect
+
+	@return TRUE if every watchdog fits, FALSE (having printed why) if not
+	*/
+bool RaiseFileLimit(int numWatchdogs)
+{
+	rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+	{
+		cout << "Error reading the open file limit" << endl;
+		return false;
+	}
+
+	if (rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1 && getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		{
+			cout << "Error raising the open file limit" << endl;
+			return false;
+		}
+	}
+
+	rlim_t needed = (rlim_t)numWatchdogs * FDS_PER_WATCHDOG + RESERVED_FDS;
+	if (needed > rl.rlim_cur)
+	{
+		cout << "Error: " << numWatchdogs << " watchdogs need up to " << needed << " descriptors but the open file limit is "
+			<< rl.rlim_cur << " (raise the hard limit, e.g. ulimit -Hn)" << endl;
+		return false;
+	}
+
+	return true;
+}
+
 /** Prints usage instructions to console **/
 void PrintUsgInstr()
 {
 	cout << "\nDesman Usage Instructions:\n\n";
-	cout << "> desman [-w filename] [-n number]\n";
+	cout << "> desman [-w filename] [-n number] [-d directory] [-p seconds] [-a] [-u upstreamIP] [-g factor] [-P cpus] [-L cpus]\n";
 	cout << "where\n";
 	cout << "-w, --write\t\tWrite the output in the specified log file\n";
 	cout << "-n, --number\t\tThe number of watchdogs in the NIDS\n";
+	cout << "-d, --directory\t\tAlso store the reports and window totals in the specified directory, for reportquery\n";
+	cout << "-p, --partition\t\tNumber of seconds of reports in each segment of the store (default = 3600,\n";
+	cout << "\t\t\tmust divide a day). Closed days are compacted into one segment in the background\n";
+	cout << "-a, --ack\t\tAcknowledge every report once processed (for the loadgen tool to measure latency)\n";
+	cout << "-u, --upstream\t\tRelay to the desman at the specified IP address: connect to it as one of its watchdogs\n";
+	cout << "\t\t\tand forward one report per window merging the reports of this desman's watchdogs\n";
+	cout << "-g, --global\t\tLog a global alert when a key's packets across all watchdogs are more than the specified\n";
+	cout << "\t\t\tfactor times its packets in the previous window (default = 3)\n";
+	cout << "-P, --report-cpus\tPin the main loop (which receives, merges and logs the reports) to the specified CPUs\n";
+	cout << "\t\t\t(e.g. 0-1), so the report rings of local watchdogs are also allocated on their NUMA node\n";
+	cout << "-L, --log-cpus\t\tWith -d, pin the store's compactor thread to the specified CPUs\n";
 }
 
 /** Parses cmd line arguments and saves options into fn args.
 	Returns TRUE if all opts are valid 
 	Returns FALSE if anything goes wrong or if any opts are invalid **/
-bool ParseCmdLineArgs(int argc, char** argv, string& logfile, int& numWatchdogs)
+bool ParseCmdLineArgs(int argc, char** argv, string& logfile, int& numWatchdogs, string& storeDir, long long& partitionSecs, bool& ack, string& upstreamIP, double& globalFactor,
+						vector<int>& reportCpus, vector<int>& logCpus)
 {
 	
 	numWatchdogs = 0;
 	logfile = "";
+	storeDir = "";
+	partitionSecs = DEFAULT_PARTITION_SECS;
+	ack = false;
+	upstreamIP = "";
+	globalFactor = DEFAULT_GLOBAL_FACTOR;
+	reportCpus.clear();
+	logCpus.clear();
 
 	int c;
 
-	while ((c = getopt(argc, argv, "w:n:")) != -1)
+	while ((c = getopt(argc, argv, "w:n:d:p:au:g:P:L:")) != -1)
 	{
 		switch (c)
 		{
@@ -53,6 +123,29 @@ bool ParseCmdLineArgs(int argc, char** argv, string& logfile, int& numWatchdogs)
 			case 'n':
 				numWatchdogs = atoi(optarg);
 				break;
+			case 'd':
+				storeDir = optarg;
+				break;
+			case 'p':
+				partitionSecs = atoll(optarg);
+				break;
+			case 'a':
+				ack = true;
+				break;
+			case 'u':
+				upstreamIP = optarg;
+				break;
+			case 'g':
+				globalFactor = atof(optarg);
+				break;
+			case 'P':
+			case 'L':
+				if (!ParseCpuList(optarg, (c == 'P') ? reportCpus : logCpus))
+				{
+					cout << "Error: invalid CPU list '" << optarg << "' (e.g. 0-3,8)" << endl;
+					return false;
+				}
+				break;
 			default:
 				return false;
 		}
@@ -71,14 +164,37 @@ bool ParseCmdLineArgs(int argc, char** argv, string& logfile, int& numWatchdogs)
 		return false;
 	}
 
+	if (partitionSecs < 1 || COMPACT_SPAN_SECS % partitionSecs != 0)
+	{
+		cout << "Error: Partition must be a number of seconds that divides " << COMPACT_SPAN_SECS << endl;
+		return false;
+	}
+
+	if (globalFactor <= 0)
+	{
+		cout << "Error: Global alert factor must be greater than 0" << endl;
+		return false;
+	}
+
 	return true;
 }
 
 
-/** Extracts data from list of reports, sums it, then logs the results **/
-void ProcessReports(vector<string> reports)
+/** Extracts data from list of reports (sent by the watchdogs with IDS), sums it, then logs the results. The
+	heaviest keys listed by the reports are merged into TOP. If PSTORE is given, each report and the totals
+	(as watchdog 0, numbered ROUND) are appended to it **/
+void ProcessReports(vector<string> reports, const vector<int>& ids, ReportStore* pStore, int round, TopKSummary& top)
 {
-	int totalPackets=0, totalBytes=0, totalFlows=0;
+	top.Clear();
+
+	unsigned long long totalPackets=0, totalBytes=0, totalFlows=0;
+
+	timeval now;
+	gettimeofday(&now, NULL);
+	long long time = (long long)now.tv_sec * 1000000 + now.tv_usec;
+
+	vector<ReportRow> rows;
+	bool anyAlert = false;
 
 	for (unsigned int i = 0; i < reports.size(); i++)
 	{
@@ -93,18 +209,53 @@ void ProcessReports(vector<string> reports)
 		}
 
 		// convert data to integers
-		int packets=0, bytes=0, flows=0;
-		if (reportData[0] == "alert")
+		bool alert = (reportData[0] == "alert");
+		size_t first = alert ? 1 : 0; // position of "report"
+		unsigned long long packets = strtoull(reportData[first + 2].c_str(), NULL, 10);
+		unsigned long long bytes = strtoull(reportData[first + 3].c_str(), NULL, 10);
+		unsigned long long flows = strtoull(reportData[first + 4].c_str(), NULL, 10);
+
+		if (pStore != NULL)
 		{
-			istringstream(reportData[3]) >> packets;
-			istringstream(reportData[4]) >> bytes;
-			istringstream(reportData[5]) >> flows;
+			ReportRow row;
+			row.time = time;
+			row.watchdog = ids[i];
+			row.report = 0;
+			istringstream(reportData[first + 1]) >> row.report;
+			row.alert = alert;
+			row.packets = packets;
+			row.bytes = bytes;
+			row.flows = flows;
+
+			// an alert's key (if any) follows the totals, the details after it are all name=value
+			row.key = "";
+			if (alert && reportData.size() > first + 5 && reportData[first + 5].find('=') == string::npos)
+			{
+				row.key = reportData[first + 5];
+			}
+
+			rows.push_back(row);
+			anyAlert = anyAlert || alert;
 		}
-		else 
+
+		// merge the report's heaviest keys (if listed) into the window's
+		string reportTop, reportTopFloor;
+		for (size_t t = first + 5; t < reportData.size(); t++)
+		{
+			if (reportData[t].compare(0, 4, "top=") == 0)
+			{
+				reportTop = reportData[t].substr(4);
+			}
+			else if (reportData[t].compare(0, 9, "topfloor=") == 0)
+			{
+				reportTopFloor = reportData[t].substr(9);
+			}
+		}
+
+		TopKSummary summary;
+		if (reportTop != "" && summary.Parse(reportTop, reportTopFloor))
 		{
-			istringstream(reportData[2]) >> packets;
-			istringstream(reportData[3]) >> bytes;
-			istringstream(reportData[4]) >> flows;
+			top.Merge(summary);
 		}
 
 		// increment totals
@@ -118,6 +269,47 @@ void ProcessReports(vector<string> reports)
 	oss << "Total traffic " << totalPackets << " " << totalBytes << " " << totalFlows;
 	LogMessage(oss.str());
 
+	if (pStore != NULL)
+	{
+		ReportRow total;
+		total.time = time;
+		total.watchdog = 0;
+		total.report = round;
+		total.alert = anyAlert;
+		total.packets = totalPackets;
+		total.bytes = totalBytes;
+		total.flows = totalFlows;
+		total.key = "";
+		rows.push_back(total);
+
+		pStore->Append(rows);
+	}
+
+}
+
+/** Global detection over the heaviest keys of all watchdogs (TOP, merged by ProcessReports()). Logs a
+	global alert for every key with at least GLOBAL_MIN_PACKETS packets that has more than FACTOR times
+	the packets it had in the previous window (PREVTOP). The fewest packets the key can have had now is
+	compared against the most it can have had then, so the summaries' errors never raise an alert **/
+void CheckGlobalAlerts(const TopKSummary& top, const TopKSummary& prevTop, double factor)
+{
+	for (size_t i = 0; i < top.NumKeys(); i++)
+	{
+		unsigned long long least = top.Count(i) - top.Error(i);
+		unsigned long long prevMost = prevTop.UpperBound(top.Key(i));
+
+		if (least >= GLOBAL_MIN_PACKETS && least > prevMost * factor)
+		{
+			ostringstream oss;
+			oss << "Global alert " << top.Key(i) << " packets " << least;
+			if (top.Error(i) > 0)
+			{
+				oss << "-" << top.Count(i);
+			}
+			oss << " (previous window at most " << prevMost << ")";
+			LogMessage(oss.str());
+		}
+	}
 }
 
 int main(int argc, char** argv)
@@ -126,7 +318,14 @@ int main(int argc, char** argv)
 	/** Parse cmd line arguments **/
 	string logfile;
 	int numWatchdogs;
-	if (!ParseCmdLineArgs(argc, argv, logfile, numWatchdogs))
+	string storeDir;
+	long long partitionSecs;
+	bool ack;
+	string upstreamIP;
+	double globalFactor;
+	vector<int> reportCpus;
+	vector<int> logCpus;
+	if (!ParseCmdLineArgs(argc, argv, logfile, numWatchdogs, storeDir, partitionSecs, ack, upstreamIP, globalFactor, reportCpus, logCpus))
 	{
 		// if any invalid arguments, print usage instructions and exit
 		PrintUsgInstr();
@@ -134,14 +333,49 @@ int main(int argc, char** argv)
 	}
 	g_logfile = logfile; // save logfile as global variable
 
+	// make room for a descriptor (or three with a report ring) per watchdog before any connect
+	if (!RaiseFileLimit(numWatchdogs))
+	{
+		return 0;
+	}
+
 	// Clear out our logfile (so any old data is overwritten)
 	fstream fs; 
 	fs.open(g_logfile, fstream::out);
 	fs.close();
 
+	// pin the main loop first, so the report rings it creates are allocated on its node (first touch)
+	if (!reportCpus.empty() && !SetThreadAffinity(pthread_self(), reportCpus))
+	{
+		cout << "Error: unable to run the main loop on the specified CPUs" << endl;
+		return 0;
+	}
+
+	// open the report store (if any), appending to what earlier runs stored
+	ReportStore store;
+	if (storeDir != "" && !store.Open(storeDir, partitionSecs))
+	{
+		return 0;
+	}
+
+	if (storeDir != "" && !logCpus.empty() && !store.SetCompactorAffinity(logCpus))
+	{
+		cout << "Error: unable to run the compactor on the specified CPUs" << endl;
+		return 0;
+	}
+	ReportStore* pStore = (storeDir != "") ? &store : NULL;
+
 	// instantiate our conmgr which will handle all communications with the WDs
 	ConnectionManager conMgr(numWatchdogs, g_logfile); 
 
+	/** Relaying: connect to the upstream desman first, so it can count us while we wait for our WDs **/
+	bool relay = (upstreamIP != "");
+	if (relay && conMgr.ConnectToUpstream(upstreamIP) == -1)
+	{
+		cout << "Unable to connect to upstream desman" << endl;
+		return 0;
+	}
+
 	/** Establish connection to all WDs **/
 	if (!conMgr.EstablishWDConnections()) // establish connection to all WDs
 	{
@@ -149,6 +383,12 @@ int main(int argc, char** argv)
 		return 0;
 	}
 
+	/** Relaying: our WDs start along with the rest of the upstream desman's **/
+	if (relay && !conMgr.WaitForUpstreamStart())
+	{
+		return 0;
+	}
+
 	/** Send start signal to all watchdogs **/
 	if (!conMgr.SendStartSignal())
 	{
@@ -157,15 +397,45 @@ int main(int argc, char** argv)
 	}
 
 	/** MAIN APPLICATION LOOP - Receive reports for all WDs then process them **/
+	int round = 0;
+	ReportAggregator aggregator;
+	TopKSummary top, prevTop; // heaviest keys across all WDs, this window and the previous
 	while (1)
 	{
 		vector<string> reports;
-		if (!conMgr.ReceiveWDReports(reports)) // ReceiveWDReports returns FALSE when all watchdogs have finished/dc'ed		
+		vector<int> ids;
+		if (!conMgr.ReceiveWDReports(reports, ids)) // ReceiveWDReports returns FALSE when all watchdogs have finished/dc'ed		
 		{
 			cout << "Exiting..." << endl;
 			return 0;
 		}
-		ProcessReports(reports);
+		ProcessReports(reports, ids, pStore, ++round, top);
+		if (round > 1) // (the first window has no previous window to compare against)
+		{
+			CheckGlobalAlerts(top, prevTop, globalFactor);
+		}
+		prevTop = top;
+
+		// forward one report for the window upstream, merging our WDs' reports
+		if (relay)
+		{
+			aggregator.Clear();
+			for (size_t i = 0; i < reports.size(); i++)
+			{
+				aggregator.Add(reports[i]);
+			}
+
+			if (!conMgr.SendUpstream(aggregator.Report(round)))
+			{
+				LogMessage("Lost connection with upstream desman, no longer relaying");
+				relay = false;
+			}
+		}
+
+		if (ack)
+		{
+			conMgr.AcknowledgeReports(reports);
+		}
 	}
 
 	return 0; // Shouldn't ever get here
@@ -0,0 +1,335 @@
+#include "report_aggregator.h"
+
+#include <sstream>
+#include <algorithm>
+#include <stdlib.h>
+
+
+/** @return TRUE if S is a (non-empty) string of digits
+	*/
+static bool IsCount(const string& s)
+{
+	return !s.empty() && s.find_first_not_of("0123456789") == string::npos;
+}
+
+
+/** Splits S at each DELIM
+
+	@param s The string to split
+	@param delim The character separating the parts
+	@param[out] parts The parts (an empty string gives a single empty part)
+	*/
+static void Split(const string& s, char delim, vector<string>& parts)
+{
+	parts.clear();
+
+	size_t start = 0;
+	size_t end;
+	while ((end = s.find(delim, start)) != string::npos)
+	{
+		parts.push_back(s.substr(start, end - start));
+		start = end + 1;
+	}
+	parts.push_back(s.substr(start));
+}
+
+
+ReportAggregator::ReportAggregator()
+{
+	Clear();
+}
+
+
+void ReportAggregator::Clear()
+{
+	m_numReports = 0;
+	m_totals[0] = m_totals[1] = m_totals[2] = 0;
+	m_alert = false;
+	m_alertKey = "";
+	m_sensors = 0;
+	m_details.clear();
+	m_names.clear();
+	m_top.Clear();
+	m_hasTop = false;
+}
+
+
+/** Parses a report the way ProcessReports() in the desman does: "report" (preceded by "alert" for
+	an alert), the report number, the packet, byte and flow totals, then for an alert the key it
+	alerted on if the next token isn't a detail. Every name=value token after that is merged via
+	AddDetail(), except sensors= which gives the number of watchdogs behind a relay (a report
+	without it is from a single watchdog), top= and topfloor= which are merged into m_top, and
+	entropy= which is dropped (also when prefixed with an interface, e.g. eth0:entropy=).
+
+	@param report The report, as received from a watchdog or relay
+	*/
+void ReportAggregator::Add(const string& report)
+{
+	vector<string> tokens;
+	istringstream iss(report);
+	string tok;
+	while (iss >> tok)
+	{
+		tokens.push_back(tok);
+	}
+
+	bool alert = (!tokens.empty() && tokens[0] == "alert");
+	size_t first = alert ? 1 : 0; // position of "report"
+	if (tokens.size() < first + 5 || tokens[first] != "report")
+	{
+		return; // (not a report)
+	}
+
+	m_numReports++;
+
+	for (int i = 0; i < 3; i++)
+	{
+		m_totals[i] += strtoull(tokens[first + 2 + i].c_str(), NULL, 10);
+	}
+
+	size_t details = first + 5;
+	if (alert && tokens.size() > details && tokens[details].find('=') == string::npos)
+	{
+		if (m_alertKey == "")
+		{
+			m_alertKey = tokens[details];
+		}
+		details++;
+	}
+	m_alert = m_alert || alert;
+
+	unsigned long long sensors = 1;
+	string top, topFloor;
+	for (size_t i = details; i < tokens.size(); i++)
+	{
+		size_t eq = tokens[i].find('=');
+		if (eq == string::npos || eq == 0)
+		{
+			continue;
+		}
+
+		string name = tokens[i].substr(0, eq);
+		string value = tokens[i].substr(eq + 1);
+		if (name == "sensors")
+		{
+			sensors = strtoull(value.c_str(), NULL, 10);
+			continue;
+		}
+		if (name == "top")
+		{
+			top = value;
+			continue;
+		}
+		if (name == "topfloor")
+		{
+			topFloor = value;
+			continue;
+		}
+		if (name == "entropy" || (name.size() > 8 && name.compare(name.size() - 8, 8, ":entropy") == 0))
+		{
+			continue;
+		}
+
+		AddDetail(name, value);
+	}
+	m_sensors += sensors;
+
+	TopKSummary summary;
+	if (top != "" && summary.Parse(top, topFloor))
+	{
+		m_top.Merge(summary);
+		m_hasTop = true;
+	}
+}
+
+
+/** Determines the form of VALUE and merges it into the detail named NAME, or starts that detail if
+	it's the first with the name. A value whose form differs from the first value with its name is
+	ignored.
+
+	@param name The token's name (e.g. "sig", or "eth0:sig" from a watchdog with several interfaces)
+	@param value The token's value (e.g. "http-get:10,passwd-read:3")
+	*/
+void ReportAggregator::AddDetail(const string& name, const string& value)
+{
+	// determine the form of the value
+	DetailForm form;
+	vector<string> parts;
+
+	if (IsCount(value))
+	{
+		form = DETAIL_COUNT;
+		parts.push_back(value);
+	}
+	else if (value.find('/') != string::npos)
+	{
+		form = DETAIL_COUNTS;
+		Split(value, '/', parts);
+		for (size_t i = 0; i < parts.size(); i++)
+		{
+			if (!IsCount(parts[i]))
+			{
+				form = DETAIL_ITEMS;
+				parts.assign(1, value);
+				break;
+			}
+		}
+	}
+	else
+	{
+		form = DETAIL_COUNTED_ITEMS;
+		Split(value, ',', parts);
+		for (size_t i = 0; i < parts.size(); i++)
+		{
+			size_t colon = parts[i].rfind(':');
+			if (colon == string::npos || colon == 0 || !IsCount(parts[i].substr(colon + 1)))
+			{
+				form = DETAIL_ITEMS;
+				break;
+			}
+		}
+	}
+
+	auto it = m_details.find(name);
+	if (it == m_details.end())
+	{
+		it = m_details.emplace(name, Detail()).first;
+		it->second.form = form;
+		m_names.push_back(name);
+	}
+
+	Detail& detail = it->second;
+	if (detail.form != form)
+	{
+		return;
+	}
+
+	switch (form)
+	{
+		case DETAIL_COUNT:
+		case DETAIL_COUNTS:
+		{
+			if (detail.counts.size() < parts.size())
+			{
+				detail.counts.resize(parts.size(), 0);
+			}
+
+			bool largest = (name == "sample" || name == "degraded");
+			for (size_t i = 0; i < parts.size(); i++)
+			{
+				unsigned long long count = strtoull(parts[i].c_str(), NULL, 10);
+				detail.counts[i] = largest ? max(detail.counts[i], count) : detail.counts[i] + count;
+			}
+			break;
+		}
+		case DETAIL_COUNTED_ITEMS:
+		{
+			for (size_t i = 0; i < parts.size(); i++)
+			{
+				size_t colon = parts[i].rfind(':');
+				string item = parts[i].substr(0, colon);
+				unsigned long long count = strtoull(parts[i].c_str() + colon + 1, NULL, 10);
+
+				auto found = detail.itemCounts.find(item);
+				if (found == detail.itemCounts.end())
+				{
+					detail.items.push_back(item);
+					detail.itemCounts[item] = count;
+				}
+				else
+				{
+					found->second += count;
+				}
+			}
+			break;
+		}
+		case DETAIL_ITEMS:
+		{
+			for (size_t i = 0; i < parts.size() && detail.items.size() < MAX_MERGED_ITEMS; i++)
+			{
+				if (detail.itemCounts.emplace(parts[i], 0).second)
+				{
+					detail.items.push_back(parts[i]);
+				}
+			}
+			break;
+		}
+	}
+}
+
+
+/** @param reportId Number of the merged report (the relay's window)
+
+	@return The merged report (e.g. "alert report 7 3000 123690 2998 10.0.0.3 newflows=2997 ... top=10.0.0.3:2997 topfloor=0 sensors=3")
+	*/
+string ReportAggregator::Report(int reportId) const
+{
+	ostringstream ossReport;
+	if (m_alert)
+	{
+		ossReport << "alert ";
+	}
+
+	ossReport << "report " << reportId << " " << m_totals[0] << " " << m_totals[1] << " " << m_totals[2];
+	if (m_alertKey != "")
+	{
+		ossReport << " " << m_alertKey;
+	}
+
+	for (size_t n = 0; n < m_names.size(); n++)
+	{
+		const Detail& detail = m_details.at(m_names[n]);
+		ossReport << " " << m_names[n] << "=";
+
+		switch (detail.form)
+		{
+			case DETAIL_COUNT:
+			case DETAIL_COUNTS:
+			{
+				for (size_t i = 0; i < detail.counts.size(); i++)
+				{
+					ossReport << (i ? "/" : "") << detail.counts[i];
+				}
+				break;
+			}
+			case DETAIL_COUNTED_ITEMS:
+			{
+				// the items with the highest summed counts (ties in the order first seen)
+				vector<pair<unsigned long long, size_t> > top;
+				for (size_t i = 0; i < detail.items.size(); i++)
+				{
+					top.push_back(make_pair(detail.itemCounts.at(detail.items[i]), i));
+				}
+
+				size_t numTop = min(top.size(), (size_t)MAX_MERGED_ITEMS);
+				partial_sort(top.begin(), top.begin() + numTop, top.end(),
+					[](const pair<unsigned long long, size_t>& a, const pair<unsigned long long, size_t>& b)
+					{
+						return a.first > b.first || (a.first == b.first && a.second < b.second);
+					});
+
+				for (size_t i = 0; i < numTop; i++)
+				{
+					ossReport << (i ? "," : "") << detail.items[top[i].second] << ":" << top[i].first;
+				}
+				break;
+			}
+			case DETAIL_ITEMS:
+			{
+				for (size_t i = 0; i < detail.items.size(); i++)
+				{
+					ossReport << (i ? "," : "") << detail.items[i];
+				}
+				break;
+			}
+		}
+	}
+
+	if (m_hasTop)
+	{
+		ossReport << " top=" << m_top.Format() << " topfloor=" << m_top.Floor();
+	}
+
+	ossReport << " sensors=" << m_sensors;
+	return ossReport.str();
+}
@@ -0,0 +1,108 @@
+#ifndef REPORT_AGGREGATOR_H
+#define REPORT_AGGREGATOR_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "topk_summary.h"
+
+using namespace std;
+
+
+#define MAX_MERGED_ITEMS 8		// max items kept in a merged list (e.g. the top signatures of sig=)
+
+
+/** @brief Merges the reports a desman received in one window into a single report
+
+	Used by a relay desman, which forwards one report per window to its upstream desman instead of
+	one per watchdog. The merged report has the same form as a watchdog's: the totals are summed, it
+	is an alert if any report was (with the key of the first alerting report that has one), and the
+	detail tokens (name=value) with the same name are merged by the form of their value:
+
+	- a count (e.g. newflows=12) is summed, except sample= and degraded= which keep the largest
+	- counts separated by '/' (e.g. prefix:dmz=120/9800/14) are summed element-wise
+	- counted items (e.g. sig=http-get:10,passwd-read:3) have the counts of each item summed and the
+	  MAX_MERGED_ITEMS items with the highest counts are kept
+	- any other list (e.g. portscan=10.0.0.1,10.0.0.2) becomes the union of the lists, keeping the
+	  first MAX_MERGED_ITEMS items
+	- the heaviest keys (top= and topfloor=) are merged as TopKSummary's, so the upstream desman can
+	  keep merging them without losing their bounds
+	- the entropies of a slice's distributions (entropy=) are dropped, as no combination of the
+	  watchdogs' entropies gives the entropy of their combined traffic (entropyalert= is kept)
+
+	Tokens are listed in the order their names first appear and followed by the merged heaviest keys
+	(if any report listed them) and sensors=<n>, the number
+	of watchdogs the report covers (including those behind any relay further down).
+	*/
+class ReportAggregator
+{
+
+private:
+
+	/** @brief Form of a detail token's value */
+	enum DetailForm
+	{
+		DETAIL_COUNT,			// 12
+		DETAIL_COUNTS,			// 120/9800/14
+		DETAIL_COUNTED_ITEMS,	// http-get:10,passwd-read:3
+		DETAIL_ITEMS			// 10.0.0.1,10.0.0.2
+	};
+
+	/** @brief The merged value of the detail tokens with one name */
+	struct Detail
+	{
+		DetailForm form;
+
+		/** The count(s) (for DETAIL_COUNT and DETAIL_COUNTS) */
+		vector<unsigned long long> counts;
+
+		/** The items in the order first seen, and the summed count of each (for DETAIL_COUNTED_ITEMS) */
+		vector<string> items;
+		unordered_map<string, unsigned long long> itemCounts;
+	};
+
+	/** Number of reports added */
+	int m_numReports;
+
+	/** Summed totals (packets, bytes, flows) */
+	unsigned long long m_totals[3];
+
+	bool m_alert;
+	string m_alertKey;
+
+	/** Number of watchdogs the reports cover */
+	unsigned long long m_sensors;
+
+	/** Detail tokens by name, and their names in the order first seen */
+	unordered_map<string, Detail> m_details;
+	vector<string> m_names;
+
+	/** Merged heaviest keys, and whether any report listed them */
+	TopKSummary m_top;
+	bool m_hasTop;
+
+	/** @brief Merges a detail token's value into the detail with its name */
+	void AddDetail(const string& name, const string& value);
+
+
+public:
+
+	/** @brief Constructor (no reports added) */
+	ReportAggregator();
+
+	/** @brief Forgets the reports added, to start the next window */
+	void Clear();
+
+	/** @brief Adds a report ("[alert ]report <n> <packets> <bytes> <flows> [key] details...") */
+	void Add(const string& report);
+
+	/** @brief Returns the number of reports added since the last Clear() */
+	int NumReports() const { return m_numReports; }
+
+	/** @brief Returns the merged report, numbered REPORTID */
+	string Report(int reportId) const;
+
+};
+
+#endif
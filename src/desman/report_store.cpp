@@ -0,0 +1,790 @@
+#include "report_store.h"
+#include "../watchdog/cpu_affinity.h"
+
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+static const char* g_columnNames[NUM_COLUMNS] = { "time", "watchdog", "report", "alert", "packets", "bytes", "flows", "key" };
+static const size_t g_columnSizes[NUM_COLUMNS] = { 8, 4, 4, 1, 8, 8, 8, 4 };
+
+
+
+const char* ColumnName(ReportColumn col)
+{
+	return g_columnNames[col];
+}
+
+
+ReportColumn ColumnByName(const string& name)
+{
+	for (int i = 0; i < NUM_COLUMNS; i++)
+	{
+		if (name == g_columnNames[i])
+		{
+			return (ReportColumn)i;
+		}
+	}
+	return NUM_COLUMNS;
+}
+
+
+/** Returns the name of a column's file in the segment at PATH **/
+static string ColumnFile(const string& path, int col)
+{
+	return path + "/" + g_columnNames[col] + ".col";
+}
+
+
+/** Maps a file read only. An empty file maps to NULL. Returns FALSE if the file can't be mapped **/
+static bool MapFile(const string& filename, const void*& map, size_t& size)
+{
+	map = NULL;
+	size = 0;
+
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+	{
+		close(fd);
+		return false;
+	}
+
+	if (st.st_size > 0)
+	{
+		void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED)
+		{
+			close(fd);
+			return false;
+		}
+		map = p;
+		size = st.st_size;
+	}
+
+	close(fd);
+	return true;
+}
+
+
+/** Removes a segment directory and the files in it **/
+static void RemoveDirectory(const string& path)
+{
+	DIR* pDir = opendir(path.c_str());
+	if (pDir == NULL)
+	{
+		return;
+	}
+
+	struct dirent* pEntry;
+	while ((pEntry = readdir(pDir)) != NULL)
+	{
+		if (pEntry->d_name[0] != '.')
+		{
+			unlink((path + "/" + pEntry->d_name).c_str());
+		}
+	}
+	closedir(pDir);
+
+	rmdir(path.c_str());
+}
+
+
+SegmentWriter::SegmentWriter()
+{
+	for (int i = 0; i < NUM_COLUMNS; i++)
+	{
+		m_columns[i] = NULL;
+	}
+	m_dict = NULL;
+	m_index = NULL;
+	m_rows = 0;
+}
+
+
+SegmentWriter::~SegmentWriter()
+{
+	Close();
+}
+
+
+/** Creates the segment directory if needed. If the segment already has rows, the columns are truncated
+	to the rows complete in all of them (a crash may have left some columns a row ahead), the key
+	dictionary is reloaded and the time index rebuilt, and new rows are appended after them.
+
+	@param path The segment directory
+
+	@return TRUE if the segment is open, FALSE otherwise (error printed to console)
+	*/
+bool SegmentWriter::Open(const string& path)
+{
+	Close();
+
+	if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST)
+	{
+		cout << "Error creating segment " << path << endl;
+		return false;
+	}
+
+	// rows complete in every column
+	uint64_t rows = UINT64_MAX;
+	for (int i = 0; i < NUM_COLUMNS; i++)
+	{
+		struct stat st;
+		uint64_t colRows = (stat(ColumnFile(path, i).c_str(), &st) == 0) ? st.st_size / g_columnSizes[i] : 0;
+		rows = min(rows, colRows);
+	}
+
+	for (int i = 0; i < NUM_COLUMNS; i++)
+	{
+		truncate(ColumnFile(path, i).c_str(), rows * g_columnSizes[i]); // (fails harmlessly if missing)
+	}
+
+	// reload the dictionary, dropping a key left half written
+	m_keyIds.clear();
+	string dictFile = path + "/keys.dict";
+	ifstream ifsDict(dictFile);
+	string key;
+	size_t dictSize = 0;
+	while (getline(ifsDict, key) && !ifsDict.eof())
+	{
+		uint32_t id = m_keyIds.size() + 1;
+		m_keyIds[key] = id;
+		dictSize += key.length() + 1;
+	}
+	ifsDict.close();
+	truncate(dictFile.c_str(), dictSize);
+
+	// rebuild the time index from the time column
+	vector<int64_t> times(rows);
+	FILE* pTimes = fopen(ColumnFile(path, COL_TIME).c_str(), "rb");
+	if (pTimes != NULL)
+	{
+		if (fread(times.data(), sizeof(int64_t), rows, pTimes) != rows)
+		{
+			rows = 0;
+		}
+		fclose(pTimes);
+	}
+
+	m_index = fopen((path + "/time.idx").c_str(), "wb");
+	m_dict = fopen(dictFile.c_str(), "ab");
+	bool ok = (m_index != NULL && m_dict != NULL);
+	for (int i = 0; i < NUM_COLUMNS; i++)
+	{
+		m_columns[i] = fopen(ColumnFile(path, i).c_str(), "ab");
+		ok = ok && (m_columns[i] != NULL);
+	}
+
+	for (uint64_t row = 0; ok && row < rows; row += STORE_INDEX_ROWS)
+	{
+		int64_t entry[2] = { times[row], (int64_t)row };
+		ok = (fwrite(entry, sizeof(entry), 1, m_index) == 1);
+	}
+
+	m_path = path;
+	m_rows = rows;
+
+	if (!ok)
+	{
+		cout << "Error opening segment " << path << endl;
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+
+/** A new key is added to the dictionary (and flushed) before any row refers to it.
+
+	@param row The row to append
+
+	@return TRUE if the row was appended, FALSE otherwise
+	*/
+bool SegmentWriter::Append(const ReportRow& row)
+{
+	if (!IsOpen())
+	{
+		return false;
+	}
+
+	uint32_t keyId = 0;
+	if (!row.key.empty())
+	{
+		auto it = m_keyIds.find(row.key);
+		if (it == m_keyIds.end())
+		{
+			keyId = m_keyIds.size() + 1;
+			m_keyIds[row.key] = keyId;
+			if (fprintf(m_dict, "%s\n", row.key.c_str()) < 0 || fflush(m_dict) != 0)
+			{
+				return false;
+			}
+		}
+		else
+		{
+			keyId = it->second;
+		}
+	}
+
+	int64_t time = row.time;
+	int32_t watchdog = row.watchdog;
+	int32_t report = row.report;
+	uint8_t alert = row.alert ? 1 : 0;
+	uint64_t packets = row.packets;
+	uint64_t bytes = row.bytes;
+	uint64_t flows = row.flows;
+
+	const void* values[NUM_COLUMNS] = { &time, &watchdog, &report, &alert, &packets, &bytes, &flows, &keyId };
+
+	if (m_rows % STORE_INDEX_ROWS == 0)
+	{
+		int64_t entry[2] = { time, (int64_t)m_rows };
+		if (fwrite(entry, sizeof(entry), 1, m_index) != 1)
+		{
+			return false;
+		}
+	}
+
+	for (int i = 0; i < NUM_COLUMNS; i++)
+	{
+		if (fwrite(values[i], g_columnSizes[i], 1, m_columns[i]) != 1)
+		{
+			return false;
+		}
+	}
+
+	m_rows++;
+	return true;
+}
+
+
+bool SegmentWriter::Flush()
+{
+	if (!IsOpen())
+	{
+		return false;
+	}
+
+	bool ok = (fflush(m_index) == 0);
+	for (int i = 0; i < NUM_COLUMNS; i++)
+	{
+		ok = (fflush(m_columns[i]) == 0) && ok;
+	}
+	return ok;
+}
+
+
+bool SegmentWriter::Close()
+{
+	FILE* files[NUM_COLUMNS + 2];
+	for (int i = 0; i < NUM_COLUMNS; i++)
+	{
+		files[i] = m_columns[i];
+		m_columns[i] = NULL;
+	}
+	files[NUM_COLUMNS] = m_dict;
+	files[NUM_COLUMNS + 1] = m_index;
+	m_dict = NULL;
+	m_index = NULL;
+
+	bool ok = true;
+	for (int i = 0; i < NUM_COLUMNS + 2; i++)
+	{
+		if (files[i] != NULL)
+		{
+			ok = (fflush(files[i]) == 0) && ok;
+			ok = (fsync(fileno(files[i])) == 0) && ok;
+			ok = (fclose(files[i]) == 0) && ok;
+		}
+	}
+
+	m_path = "";
+	m_keyIds.clear();
+	m_rows = 0;
+	return ok;
+}
+
+
+SegmentReader::SegmentReader()
+{
+	for (int i = 0; i < NUM_COLUMNS; i++)
+	{
+		m_maps[i] = NULL;
+		m_sizes[i] = 0;
+	}
+	m_index = NULL;
+	m_indexSize = 0;
+	m_keysLoaded = false;
+	m_rows = 0;
+}
+
+
+SegmentReader::~SegmentReader()
+{
+	for (int i = 0; i < NUM_COLUMNS; i++)
+	{
+		if (m_maps[i] != NULL)
+		{
+			munmap((void*)m_maps[i], m_sizes[i]);
+		}
+	}
+
+	if (m_index != NULL)
+	{
+		munmap((void*)m_index, m_indexSize);
+	}
+}
+
+
+/** @param path The segment directory
+
+	@return TRUE if the segment was opened, FALSE otherwise (error printed to console)
+	*/
+bool SegmentReader::Open(const string& path)
+{
+	m_path = path;
+
+	const void* index;
+	if (!MapFile(ColumnFile(path, COL_TIME), m_maps[COL_TIME], m_sizes[COL_TIME]) ||
+		!MapFile(path + "/time.idx", index, m_indexSize))
+	{
+		cout << "Error opening segment " << path << endl;
+		return false;
+	}
+
+	m_index = (const int64_t*)index;
+	m_rows = m_sizes[COL_TIME] / g_columnSizes[COL_TIME];
+	return true;
+}
+
+
+/** Rows() is reduced if the column has fewer complete rows than those mapped before (it is being
+	appended to).
+
+	@param col The column to map
+
+	@return TRUE if the column is mapped, FALSE otherwise (error printed to console)
+	*/
+bool SegmentReader::MapColumn(ReportColumn col)
+{
+	if (m_maps[col] != NULL || m_sizes[col] != 0)
+	{
+		return true;
+	}
+
+	if (!MapFile(ColumnFile(m_path, col), m_maps[col], m_sizes[col]))
+	{
+		cout << "Error opening column " << ColumnFile(m_path, col) << endl;
+		return false;
+	}
+
+	m_rows = min(m_rows, (uint64_t)(m_sizes[col] / g_columnSizes[col]));
+	return true;
+}
+
+
+/** The time index narrows each bound down to STORE_INDEX_ROWS rows, which are then binary searched,
+	so only a page or two of the time column is read for each bound.
+
+	@param from Start of the time range (usecs since the epoch)
+	@param until End of the time range (excluded)
+	@param[out] first First row in the range
+	@param[out] last Row after the last row in the range
+	*/
+void SegmentReader::TimeRange(long long from, long long until, uint64_t& first, uint64_t& last) const
+{
+	const int64_t* times = Column<int64_t>(COL_TIME);
+	size_t entries = m_indexSize / (2 * sizeof(int64_t));
+
+	auto lowerBound = [&](long long t) -> uint64_t
+	{
+		// first index entry at or after t, the row sought lies between it and the entry before
+		size_t lo = 0, hi = entries;
+		while (lo < hi)
+		{
+			size_t mid = (lo + hi) / 2;
+			if (m_index[2 * mid] < t) lo = mid + 1;
+			else hi = mid;
+		}
+
+		uint64_t begin = (lo > 0) ? min((uint64_t)m_index[2 * (lo - 1) + 1], m_rows) : 0;
+		uint64_t end = (lo < entries) ? min((uint64_t)m_index[2 * lo + 1], m_rows) : m_rows;
+		return lower_bound(times + begin, times + end, (int64_t)t) - times;
+	};
+
+	first = lowerBound(from);
+	last = max(first, lowerBound(until));
+}
+
+
+void SegmentReader::LoadKeys()
+{
+	if (m_keysLoaded)
+	{
+		return;
+	}
+
+	m_keys.assign(1, "");
+	ifstream ifs(m_path + "/keys.dict");
+	string key;
+	while (getline(ifs, key))
+	{
+		m_keys.push_back(key);
+	}
+	m_keysLoaded = true;
+}
+
+
+/** @param key The key to look up
+	@param[out] id Index of the key in the dictionary
+
+	@return TRUE if the key was found, FALSE if no row of the segment has it
+	*/
+bool SegmentReader::FindKey(const string& key, uint32_t& id)
+{
+	LoadKeys();
+	for (size_t i = 1; i < m_keys.size(); i++)
+	{
+		if (m_keys[i] == key)
+		{
+			id = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+string SegmentReader::Key(uint32_t id)
+{
+	LoadKeys();
+	return (id < m_keys.size()) ? m_keys[id] : "?";
+}
+
+
+/** The merged segment is written as <name>.tmp (replacing any left by an earlier attempt) and renamed
+	once it is complete and synced, so it appears atomically.
+
+	@param segments The segments to merge, in time order
+	@param start Start of the merged segment's time range (seconds)
+	@param end End of the merged segment's time range (seconds)
+
+	@return TRUE if the merged segment was written, FALSE otherwise (error printed to console)
+	*/
+bool ReportStore::Merge(const vector<SegmentInfo>& segments, long long start, long long end)
+{
+	ostringstream ossName;
+	ossName << m_dir << "/seg-" << start << "-" << end;
+	string path = ossName.str();
+	string tmpPath = path + ".tmp";
+
+	RemoveDirectory(tmpPath);
+
+	SegmentWriter writer;
+	if (!writer.Open(tmpPath))
+	{
+		return false;
+	}
+
+	bool ok = true;
+	for (size_t s = 0; ok && s < segments.size(); s++)
+	{
+		SegmentReader reader;
+		ok = reader.Open(segments[s].path);
+		for (int c = 0; ok && c < NUM_COLUMNS; c++)
+		{
+			ok = reader.MapColumn((ReportColumn)c);
+		}
+
+		if (!ok)
+		{
+			break;
+		}
+
+		const int64_t* times = reader.Column<int64_t>(COL_TIME);
+		const int32_t* watchdogs = reader.Column<int32_t>(COL_WATCHDOG);
+		const int32_t* reports = reader.Column<int32_t>(COL_REPORT);
+		const uint8_t* alerts = reader.Column<uint8_t>(COL_ALERT);
+		const uint64_t* packets = reader.Column<uint64_t>(COL_PACKETS);
+		const uint64_t* bytes = reader.Column<uint64_t>(COL_BYTES);
+		const uint64_t* flows = reader.Column<uint64_t>(COL_FLOWS);
+		const uint32_t* keys = reader.Column<uint32_t>(COL_KEY);
+
+		for (uint64_t i = 0; ok && i < reader.Rows(); i++)
+		{
+			ReportRow row;
+			row.time = times[i];
+			row.watchdog = watchdogs[i];
+			row.report = reports[i];
+			row.alert = alerts[i] != 0;
+			row.packets = packets[i];
+			row.bytes = bytes[i];
+			row.flows = flows[i];
+			row.key = reader.Key(keys[i]);
+			ok = writer.Append(row);
+		}
+	}
+
+	ok = writer.Close() && ok;
+	if (!ok || rename(tmpPath.c_str(), path.c_str()) == -1)
+	{
+		cout << "Error compacting segments into " << path << endl;
+		RemoveDirectory(tmpPath);
+		return false;
+	}
+
+	return true;
+}
+
+
+/** A day is closed once the partition being written starts at or after its end. Its segments are
+	merged and removed; if the day already has a merged segment (a previous compaction was interrupted
+	before removing them), the remaining segments are just removed.
+	*/
+void ReportStore::Compact()
+{
+	m_mtx.lock();
+	long long partitionStart = m_partitionStart;
+	m_mtx.unlock();
+
+	vector<SegmentInfo> segments;
+	if (partitionStart < 0 || !ListSegments(m_dir, segments, true))
+	{
+		return;
+	}
+
+	size_t i = 0;
+	while (i < segments.size())
+	{
+		long long day = segments[i].start - segments[i].start % COMPACT_SPAN_SECS;
+		long long dayEnd = day + COMPACT_SPAN_SECS;
+
+		vector<SegmentInfo> daySegments;
+		bool merged = false;
+		for (; i < segments.size() && segments[i].start < dayEnd; i++)
+		{
+			if (segments[i].start == day && segments[i].end == dayEnd)
+			{
+				merged = true;
+			}
+			else
+			{
+				daySegments.push_back(segments[i]);
+			}
+		}
+
+		if (dayEnd > partitionStart || daySegments.empty() || (!merged && daySegments.size() == 1))
+		{
+			continue;
+		}
+
+		if (!merged && !Merge(daySegments, day, dayEnd))
+		{
+			continue;
+		}
+
+		for (size_t s = 0; s < daySegments.size(); s++)
+		{
+			RemoveDirectory(daySegments[s].path);
+		}
+
+		if (!merged)
+		{
+			cout << "Compacted " << daySegments.size() << " segments of " << m_dir << " into seg-" << day << "-" << dayEnd << endl;
+		}
+	}
+}
+
+
+void ReportStore::CompactLoop()
+{
+	unique_lock<mutex> lock(m_mtx);
+
+	while (!m_stop)
+	{
+		m_cv.wait_for(lock, chrono::seconds(COMPACT_CHECK_SECS), [this] { return m_stop; });
+		if (m_stop)
+		{
+			break;
+		}
+
+		lock.unlock();
+		Compact();
+		lock.lock();
+	}
+}
+
+
+ReportStore::ReportStore()
+{
+	m_partitionSecs = 0;
+	m_stop = false;
+	m_partitionStart = -1;
+}
+
+
+ReportStore::~ReportStore()
+{
+	m_mtx.lock();
+	m_stop = true;
+	m_mtx.unlock();
+	m_cv.notify_one();
+
+	if (m_compactor.joinable())
+	{
+		m_compactor.join();
+	}
+
+	m_writer.Close();
+}
+
+
+/** @param dir The store's directory (created if it doesn't exist)
+	@param partitionSecs Length of a partition in seconds (must divide COMPACT_SPAN_SECS)
+
+	@return TRUE if the store is open, FALSE otherwise (error printed to console)
+	*/
+bool ReportStore::Open(const string& dir, long long partitionSecs)
+{
+	if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST)
+	{
+		cout << "Error creating report store " << dir << endl;
+		return false;
+	}
+
+	m_dir = dir;
+	m_partitionSecs = partitionSecs;
+
+	m_compactor = thread(&ReportStore::CompactLoop, this);
+	return true;
+}
+
+
+/** @param cpus The CPUs the compactor may run on
+
+	@return TRUE if the affinity was set
+	*/
+bool ReportStore::SetCompactorAffinity(const vector<int>& cpus)
+{
+	return SetThreadAffinity(m_compactor, cpus);
+}
+
+
+/** Rows are appended to the segment of their partition, switching segment whenever a row falls in a
+	later partition than the one open.
+
+	@param rows The rows to append
+
+	@return TRUE if every row was appended, FALSE otherwise (error printed to console)
+	*/
+bool ReportStore::Append(const vector<ReportRow>& rows)
+{
+	bool ok = true;
+
+	for (size_t i = 0; i < rows.size(); i++)
+	{
+		long long secs = rows[i].time / 1000000;
+		long long start = secs - secs % m_partitionSecs;
+
+		if (start != m_partitionStart || !m_writer.IsOpen())
+		{
+			m_writer.Close();
+
+			ostringstream ossPath;
+			ossPath << m_dir << "/seg-" << start << "-" << start + m_partitionSecs;
+			if (!m_writer.Open(ossPath.str()))
+			{
+				return false;
+			}
+
+			m_mtx.lock();
+			m_partitionStart = start;
+			m_mtx.unlock();
+		}
+
+		ok = m_writer.Append(rows[i]) && ok;
+	}
+
+	ok = m_writer.Flush() && ok;
+	if (!ok)
+	{
+		cout << "Error appending reports to " << m_dir << endl;
+	}
+	return ok;
+}
+
+
+/** Segments are listed by start time. Unless ALL is set, a segment that lies within another (one of
+	the partitions a compacted segment replaces, not yet removed) is left out, as are .tmp segments.
+
+	@param dir The store's directory
+	@param[out] segments The segments found
+	@param all TRUE to list segments lying within another too
+
+	@return TRUE if the directory was read, FALSE otherwise (error printed to console)
+	*/
+bool ReportStore::ListSegments(const string& dir, vector<SegmentInfo>& segments, bool all)
+{
+	segments.clear();
+
+	DIR* pDir = opendir(dir.c_str());
+	if (pDir == NULL)
+	{
+		cout << "Error reading report store " << dir << endl;
+		return false;
+	}
+
+	struct dirent* pEntry;
+	while ((pEntry = readdir(pDir)) != NULL)
+	{
+		SegmentInfo segment;
+		int len = 0;
+		if (sscanf(pEntry->d_name, "seg-%lld-%lld%n", &segment.start, &segment.end, &len) == 2 &&
+			pEntry->d_name[len] == '\0')
+		{
+			segment.path = dir + "/" + pEntry->d_name;
+			segments.push_back(segment);
+		}
+	}
+	closedir(pDir);
+
+	// by start, longest first, so a segment lying within another comes after it
+	sort(segments.begin(), segments.end(), [](const SegmentInfo& a, const SegmentInfo& b)
+	{
+		return (a.start != b.start) ? a.start < b.start : a.end > b.end;
+	});
+
+	if (!all)
+	{
+		vector<SegmentInfo> outer;
+		long long maxEnd = -1;
+		for (size_t i = 0; i < segments.size(); i++)
+		{
+			if (segments[i].end > maxEnd)
+			{
+				outer.push_back(segments[i]);
+				maxEnd = segments[i].end;
+			}
+		}
+		segments.swap(outer);
+	}
+
+	return true;
+}
@@ -0,0 +1,266 @@
+#ifndef REPORT_STORE_H
+#define REPORT_STORE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdio.h>
+#include <stdint.h>
+
+using namespace std;
+
+
+#define STORE_INDEX_ROWS 256		// rows per entry of a segment's time index
+#define COMPACT_SPAN_SECS 86400		// closed partitions are compacted into one segment per (UTC) day
+#define COMPACT_CHECK_SECS 60		// how often the compactor looks for closed days
+
+
+/** @brief A report (or window total) as stored by the ReportStore */
+struct ReportRow
+{
+	/** When the desman received it, in usecs since the epoch */
+	long long time;
+
+	/** ID of the watchdog that sent it (0 for the desman's window totals) */
+	int watchdog;
+
+	/** The watchdog's report number (the desman's round number for window totals) */
+	int report;
+
+	bool alert;
+
+	unsigned long long packets;
+	unsigned long long bytes;
+	unsigned long long flows;
+
+	/** Key the report alerted on (e.g. a dst ip address), "" if none */
+	string key;
+};
+
+
+/** @brief Columns of a segment, each stored in its own file (see ReportStore) */
+enum ReportColumn
+{
+	COL_TIME,		// int64_t
+	COL_WATCHDOG,	// int32_t
+	COL_REPORT,		// int32_t
+	COL_ALERT,		// uint8_t
+	COL_PACKETS,	// uint64_t
+	COL_BYTES,		// uint64_t
+	COL_FLOWS,		// uint64_t
+	COL_KEY,		// uint32_t (index into the segment's key dictionary, 0 for none)
+	NUM_COLUMNS
+};
+
+
+/** @brief Returns the name of a column (also the name of its file, without the .col extension) */
+const char* ColumnName(ReportColumn col);
+
+/** @brief Returns the column with the given name, or NUM_COLUMNS if there is none */
+ReportColumn ColumnByName(const string& name);
+
+
+/** @brief A segment directory of a report store */
+struct SegmentInfo
+{
+	string path;
+
+	/** Time range the segment covers, in seconds since the epoch ([start, end)) */
+	long long start;
+	long long end;
+};
+
+
+/** @brief Appends rows to a segment
+
+	Each column is appended to its own file, keys are replaced by their index in the segment's
+	dictionary (keys.dict, one key per line) and every STORE_INDEX_ROWS rows the time of the row is
+	added to the time index (time.idx, pairs of int64 time and uint64 row). Opening an existing
+	segment truncates the columns to the last complete row, so a crash mid-append is repaired.
+	*/
+class SegmentWriter
+{
+
+private:
+
+	string m_path;
+
+	FILE* m_columns[NUM_COLUMNS];
+	FILE* m_dict;
+	FILE* m_index;
+
+	/** Index of each key in the dictionary (from 1) */
+	unordered_map<string, uint32_t> m_keyIds;
+
+	uint64_t m_rows;
+
+
+	SegmentWriter(const SegmentWriter&);
+	SegmentWriter& operator=(const SegmentWriter&);
+
+
+public:
+
+	/** @brief Constructor (no segment open) */
+	SegmentWriter();
+
+	/** @brief Destructor, closes the segment */
+	~SegmentWriter();
+
+	/** @brief Creates a segment or reopens one to append to, returning FALSE on error */
+	bool Open(const string& path);
+
+	/** @brief Appends a row, returning FALSE on error */
+	bool Append(const ReportRow& row);
+
+	/** @brief Writes the rows appended so far to the files, returning FALSE on error */
+	bool Flush();
+
+	/** @brief Flushes and syncs the segment to disk and closes it, returning FALSE on error */
+	bool Close();
+
+	/** @brief Returns TRUE if a segment is open */
+	bool IsOpen() const { return !m_path.empty(); }
+
+};
+
+
+/** @brief Memory maps the columns of a segment for queries
+
+	Only the time column and the time index are mapped when the segment is opened; other columns are
+	mapped on demand, so a query only touches the files (and, through the index, the pages) it needs.
+	*/
+class SegmentReader
+{
+
+private:
+
+	string m_path;
+
+	const void* m_maps[NUM_COLUMNS];
+	size_t m_sizes[NUM_COLUMNS];
+
+	/** The time index (pairs of time and row) */
+	const int64_t* m_index;
+	size_t m_indexSize;
+
+	/** The key dictionary (loaded by the first key lookup) */
+	vector<string> m_keys;
+	bool m_keysLoaded;
+
+	/** Complete rows in every column mapped */
+	uint64_t m_rows;
+
+
+	SegmentReader(const SegmentReader&);
+	SegmentReader& operator=(const SegmentReader&);
+
+	/** @brief Loads the key dictionary if it isn't yet */
+	void LoadKeys();
+
+
+public:
+
+	/** @brief Constructor (no segment open) */
+	SegmentReader();
+
+	/** @brief Destructor, unmaps the segment */
+	~SegmentReader();
+
+	/** @brief Maps a segment's time column and index, returning FALSE on error */
+	bool Open(const string& path);
+
+	/** @brief Maps another column, returning FALSE on error */
+	bool MapColumn(ReportColumn col);
+
+	/** @brief Returns a mapped column as an array of Rows() values of its type */
+	template <class T>
+	const T* Column(ReportColumn col) const { return (const T*)m_maps[col]; }
+
+	/** @brief Returns the number of rows present in every column mapped */
+	uint64_t Rows() const { return m_rows; }
+
+	/** @brief Finds the rows [first, last) received in [from, until) (times in usecs) */
+	void TimeRange(long long from, long long until, uint64_t& first, uint64_t& last) const;
+
+	/** @brief Looks up a key's index in the dictionary, returning FALSE if the segment doesn't contain it */
+	bool FindKey(const string& key, uint32_t& id);
+
+	/** @brief Returns the key with the given index ("" for 0) */
+	string Key(uint32_t id);
+
+};
+
+
+/** @brief Append-only, time-partitioned columnar store of the reports received by the desman
+
+	Rows are appended to the segment of the current partition (a directory named seg-<start>-<end>,
+	times in seconds), starting a new segment every partition. Queries (see reportquery) map only the
+	columns and, through each segment's time index, only the rows they need instead of reparsing the
+	log.
+
+	A background thread compacts closed partitions: once every partition of a day is closed, the day's
+	segments are merged into one (written as a .tmp directory and renamed into place) and the old
+	segments removed. Readers ignore any segment that lies within another, so a query during
+	compaction never counts rows twice.
+	*/
+class ReportStore
+{
+
+private:
+
+	string m_dir;
+
+	/** Length of a partition in seconds */
+	long long m_partitionSecs;
+
+	/** Segment of the current partition */
+	SegmentWriter m_writer;
+
+	/** Compactor thread state */
+	thread m_compactor;
+	mutex m_mtx;
+	condition_variable m_cv;
+	bool m_stop;
+	long long m_partitionStart;		// start of the partition being written (-1 if none), nothing from it on is compacted
+
+
+	ReportStore(const ReportStore&);
+	ReportStore& operator=(const ReportStore&);
+
+	/** @brief Merges segments (in time order) into a new segment, returning FALSE on error */
+	bool Merge(const vector<SegmentInfo>& segments, long long start, long long end);
+
+	/** @brief Compacts the segments of every closed day */
+	void Compact();
+
+	/** @brief Compactor thread, compacts every COMPACT_CHECK_SECS until stopped */
+	void CompactLoop();
+
+
+public:
+
+	/** @brief Constructor (not open) */
+	ReportStore();
+
+	/** @brief Destructor, stops the compactor and closes the current segment */
+	~ReportStore();
+
+	/** @brief Opens (creating if needed) a store, returning FALSE on error */
+	bool Open(const string& dir, long long partitionSecs);
+
+	/** @brief Restricts the compactor thread (once open) to the given CPUs, returning FALSE on error */
+	bool SetCompactorAffinity(const vector<int>& cpus);
+
+	/** @brief Appends rows (in time order) and flushes them, returning FALSE on error */
+	bool Append(const vector<ReportRow>& rows);
+
+	/** @brief Lists the segments of a store in time order, returning FALSE on error */
+	static bool ListSegments(const string& dir, vector<SegmentInfo>& segments, bool all = false);
+
+};
+
+#endif
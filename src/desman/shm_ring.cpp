@@ -0,0 +1,302 @@
+#include "shm_ring.h"
+
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>		// memfd_create(), mmap()
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>		// sendmsg()/recvmsg() with SCM_RIGHTS
+
+
+#define SHM_HEADER_BYTES 4096	// the data starts on the page after the header
+
+
+ShmRing::ShmRing()
+{
+	m_header = NULL;
+	m_data = NULL;
+	m_capacity = 0;
+	m_memfd = -1;
+	m_eventfd = -1;
+}
+
+
+ShmRing::~ShmRing()
+{
+	if (m_header != NULL)
+	{
+		munmap(m_header, SHM_HEADER_BYTES + m_capacity);
+	}
+
+	if (m_memfd != -1)
+	{
+		close(m_memfd);
+	}
+
+	if (m_eventfd != -1)
+	{
+		close(m_eventfd);
+	}
+}
+
+
+/** Called internally by ReceiveDescriptors() once m_memfd is set. The size of the mapping is taken
+	from the memfd, and must match the capacity the desman put in the header, which is only read here:
+	from then on the desman could change it under the watchdog.
+
+	@return TRUE if the ring was mapped, FALSE if any errors occured
+	*/
+bool ShmRing::Map()
+{
+	struct stat st;
+	if (fstat(m_memfd, &st) == -1 || st.st_size <= SHM_HEADER_BYTES)
+	{
+		cout << "Error sizing report ring\n";
+		return false;
+	}
+
+	void* p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_memfd, 0);
+	if (p == MAP_FAILED)
+	{
+		cout << "Error mapping report ring\n";
+		return false;
+	}
+
+	m_header = (ShmRingHeader*)p;
+	m_data = (char*)p + SHM_HEADER_BYTES;
+
+	uint32_t capacity = m_header->capacity;
+	if (capacity == 0 || (capacity & (capacity - 1)) != 0 || st.st_size != SHM_HEADER_BYTES + capacity)
+	{
+		cout << "Error: invalid report ring\n";
+		munmap(p, st.st_size);
+		m_header = NULL;
+		m_data = NULL;
+		return false;
+	}
+
+	m_capacity = capacity;
+	return true;
+}
+
+
+/** Creates the ring's memory (SHM_RING_BYTES of data after the header, zero filled so the ring
+	starts empty) and its eventfd. The pages are populated up front, so they are allocated on the NUMA
+	node of the desman's main loop rather than wherever the watchdog first writes a report.
+
+	@return TRUE if the ring was created, FALSE if any errors occured
+	*/
+bool ShmRing::Create()
+{
+	if ((m_memfd = memfd_create("nids-report-ring", MFD_CLOEXEC)) == -1 ||
+		ftruncate(m_memfd, SHM_HEADER_BYTES + SHM_RING_BYTES) == -1)
+	{
+		cout << "Error creating report ring\n";
+		return false;
+	}
+
+	void* p = mmap(NULL, SHM_HEADER_BYTES + SHM_RING_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_memfd, 0);
+	if (p == MAP_FAILED)
+	{
+		cout << "Error mapping report ring\n";
+		return false;
+	}
+
+	m_header = (ShmRingHeader*)p;
+	m_data = (char*)p + SHM_HEADER_BYTES;
+	m_capacity = SHM_RING_BYTES;
+	m_header->capacity = m_capacity;
+	m_header->head.store(0);
+	m_header->tail.store(0);
+	m_header->waiting.store(0);
+
+	if ((m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+	{
+		cout << "Error creating report ring eventfd\n";
+		return false;
+	}
+
+	return true;
+}
+
+
+/** The descriptors (the memfd then the eventfd) travel as SCM_RIGHTS ancillary data with the first
+	byte of the message, which has to be received with ReceiveDescriptors().
+
+	@param sockfd The watchdog's unix socket
+	@param msg The message (e.g. "UID 3"), without the terminating '\n'
+
+	@return TRUE if the message was sent, FALSE if an error occured
+	*/
+bool ShmRing::SendDescriptors(int sockfd, const string& msg) const
+{
+	string line = msg + "\n";
+
+	iovec iov;
+	iov.iov_base = (void*)line.c_str();
+	iov.iov_len = line.length();
+
+	int fds[2] = { m_memfd, m_eventfd };
+	char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+
+	msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+
+	cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	// (a unix stream socket takes the whole of a message this short at once)
+	return sendmsg(sockfd, &mh, MSG_NOSIGNAL) == (ssize_t)line.length();
+}
+
+
+/** Receives the first byte of a message sent with SendDescriptors(), along with the ring's descriptors,
+	then maps the ring. The rest of the message is left on the socket.
+
+	@param sockfd The unix socket connected to the desman
+	@param[out] first The first byte of the message
+
+	@return TRUE if the ring was received and mapped, FALSE if any errors occured
+	*/
+bool ShmRing::ReceiveDescriptors(int sockfd, char& first)
+{
+	iovec iov;
+	iov.iov_base = &first;
+	iov.iov_len = 1;
+
+	int fds[2];
+	char control[CMSG_SPACE(sizeof(fds))];
+
+	msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+
+	if (recvmsg(sockfd, &mh, MSG_CMSG_CLOEXEC) != 1)
+	{
+		return false;
+	}
+
+	cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+		cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+	{
+		cout << "Error: desman sent no report ring\n";
+		return false;
+	}
+
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	m_memfd = fds[0];
+	m_eventfd = fds[1];
+
+	return Map();
+}
+
+
+/** Copies the data in after the last byte written (wrapping around the end of the ring) and only
+	then publishes it by advancing the tail. If the desman set the waiting flag it is cleared and the
+	eventfd written, which is the only syscall made, and only made when the desman is asleep. The tail
+	is stored and the flag loaded sequentially consistently, so either the desman's PrepareToWait()
+	sees the new tail or this sees the flag (never neither).
+
+	@param data The bytes to write
+	@param len Number of bytes to write
+
+	@return Number of bytes written, less than LEN if the ring is full
+	*/
+size_t ShmRing::Write(const char* data, size_t len)
+{
+	uint32_t capacity = m_capacity;
+	uint64_t head = m_header->head.load(memory_order_acquire);
+	uint64_t tail = m_header->tail.load(memory_order_relaxed);
+
+	size_t n = min(len, (size_t)(capacity - (tail - head)));
+	if (n == 0)
+	{
+		return 0;
+	}
+
+	size_t pos = tail & (capacity - 1);
+	size_t part = min(n, capacity - pos);
+	memcpy(m_data + pos, data, part);
+	memcpy(m_data, data + part, n - part);
+
+	m_header->tail.store(tail + n, memory_order_seq_cst);
+
+	if (m_header->waiting.load(memory_order_seq_cst) && m_header->waiting.exchange(0))
+	{
+		uint64_t one = 1;
+		if (write(m_eventfd, &one, sizeof(one)) != sizeof(one))
+		{
+			cout << "Error waking desman\n";
+		}
+	}
+
+	return n;
+}
+
+
+/** @param[out] out String every byte written since the last call is appended to
+	*/
+void ShmRing::Read(string& out)
+{
+	uint32_t capacity = m_capacity;	// (never the header's, which the watchdog can overwrite)
+	uint64_t tail = m_header->tail.load(memory_order_acquire);
+	uint64_t head = m_header->head.load(memory_order_relaxed);
+
+	size_t n = min(tail - head, (uint64_t)capacity); // (only a misbehaving watchdog writes more than fits)
+	if (n == 0)
+	{
+		return;
+	}
+
+	size_t pos = head & (capacity - 1);
+	size_t part = min(n, capacity - pos);
+	out.append(m_data + pos, part);
+	out.append(m_data, n - part);
+
+	m_header->head.store(head + n, memory_order_release);
+}
+
+
+/** Should be called before polling the eventfd. Sets the waiting flag so the watchdog's next Write()
+	wakes the desman, then checks the ring once more, since a report written before the flag was seen
+	would otherwise not be noticed until the next one.
+
+	@return TRUE if the desman can sleep, FALSE if the ring has data to read
+	*/
+bool ShmRing::PrepareToWait()
+{
+	m_header->waiting.store(1, memory_order_seq_cst);
+
+	if (m_header->tail.load(memory_order_seq_cst) != m_header->head.load(memory_order_relaxed))
+	{
+		m_header->waiting.store(0);
+		return false;
+	}
+
+	return true;
+}
+
+
+void ShmRing::ClearWakeup()
+{
+	uint64_t count;
+	if (read(m_eventfd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+	{
+		cout << "Error reading report ring eventfd\n";
+	}
+}
@@ -0,0 +1,100 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <string>
+#include <atomic>
+#include <stdint.h>
+
+using namespace std;
+
+
+#define DESMAN_LOCAL_SOCKET "nids-desman"	// abstract unix socket colocated watchdogs connect to
+#define SHM_RING_BYTES (1 << 20)			// size of the report ring of each colocated watchdog
+
+
+/** @brief Shared header of a ShmRing (at the start of the shared memory, followed by the data) */
+struct ShmRingHeader
+{
+	/** Bytes read by the desman so far (only written by the desman) */
+	atomic<uint64_t> head;
+	char pad1[64 - sizeof(atomic<uint64_t>)];
+
+	/** Bytes written by the watchdog so far (only written by the watchdog) */
+	atomic<uint64_t> tail;
+	char pad2[64 - sizeof(atomic<uint64_t>)];
+
+	/** Set by the desman before it sleeps in poll(), cleared by whoever sees it set */
+	atomic<uint32_t> waiting;
+
+	/** Size of the data area in bytes (a power of 2), only read when the ring is mapped */
+	uint32_t capacity;
+};
+
+
+/** @brief Single producer, single consumer byte ring in shared memory, carrying a colocated watchdog's
+	reports to the desman
+
+	The desman creates the ring (an anonymous memfd) and an eventfd for each colocated watchdog and
+	passes both with the watchdog's UID over the local socket the watchdog connected to. From then
+	on the watchdog writes its reports, still as lines ending in '\n', into the ring and the desman
+	reads them out without either making a syscall. The eventfd is only written when the desman has
+	announced (via the waiting flag) that it is about to sleep in poll(), so a busy desman is never
+	woken. The handshake (UID and start), acknowledgements and disconnects stay on the local socket.
+	*/
+class ShmRing
+{
+
+private:
+
+	ShmRingHeader* m_header;
+	char* m_data;
+
+	/** Size of the data area, kept privately since the other side can overwrite the header's copy */
+	uint32_t m_capacity;
+
+	int m_memfd;
+	int m_eventfd;
+
+
+	ShmRing(const ShmRing&);
+	ShmRing& operator=(const ShmRing&);
+
+	/** @brief Maps a received ring's memory, returning FALSE on error */
+	bool Map();
+
+
+public:
+
+	/** @brief Constructor (no ring) */
+	ShmRing();
+
+	/** @brief Destructor, unmaps the ring and closes its descriptors */
+	~ShmRing();
+
+	/** @brief Creates a ring of SHM_RING_BYTES (desman), returning FALSE on error */
+	bool Create();
+
+	/** @brief Sends a message (a '\n' is appended) over a unix socket with the ring's descriptors attached (desman) */
+	bool SendDescriptors(int sockfd, const string& msg) const;
+
+	/** @brief Receives the ring's descriptors over a unix socket and maps it (watchdog), returning FALSE on error */
+	bool ReceiveDescriptors(int sockfd, char& first);
+
+	/** @brief Writes as much of LEN bytes of DATA as fits, waking the desman if it sleeps. Returns the bytes written (watchdog) */
+	size_t Write(const char* data, size_t len);
+
+	/** @brief Appends everything in the ring to OUT (desman) */
+	void Read(string& out);
+
+	/** @brief Announces that the desman will sleep, returning FALSE (and not sleeping) if the ring isn't empty (desman) */
+	bool PrepareToWait();
+
+	/** @brief Resets the eventfd once poll() has returned (desman) */
+	void ClearWakeup();
+
+	/** @brief Returns the eventfd the desman polls (-1 if none) */
+	int EventFd() const { return m_eventfd; }
+
+};
+
+#endif
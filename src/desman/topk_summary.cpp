@@ -0,0 +1,188 @@
+#include "topk_summary.h"
+
+#include <sstream>
+#include <algorithm>
+#include <unordered_map>
+#include <stdlib.h>
+
+
+/** @return TRUE if S is a (non-empty) string of digits
+	*/
+static bool IsCount(const string& s)
+{
+	return !s.empty() && s.find_first_not_of("0123456789") == string::npos;
+}
+
+
+/** @param capacity Max number of keys listed
+	*/
+TopKSummary::TopKSummary(size_t capacity)
+{
+	m_capacity = capacity;
+	m_floor = 0;
+}
+
+
+void TopKSummary::Clear()
+{
+	m_entries.clear();
+	m_floor = 0;
+}
+
+
+/** Called by Parse() and Merge(). Orders the entries by count (ties keep their order) and drops all but
+	the m_capacity heaviest, raising the floor to the count of the heaviest one dropped.
+	*/
+void TopKSummary::Truncate()
+{
+	stable_sort(m_entries.begin(), m_entries.end(),
+		[](const Entry& a, const Entry& b) { return a.count > b.count; });
+
+	if (m_entries.size() > m_capacity)
+	{
+		m_floor = max(m_floor, m_entries[m_capacity].count);
+		m_entries.resize(m_capacity);
+	}
+}
+
+
+/** Each item of TOP is a key, its count after the last ':' and optionally the count's error after a
+	'~' (a key may itself contain ':', e.g. "10.0.0.5:80:1200").
+
+	@param top The report's top= value (e.g. "10.0.0.5:2400~35,10.0.0.7:800")
+	@param floor The report's topfloor= value (e.g. "35")
+
+	@return TRUE if the summary was parsed, FALSE if either value is malformed (the summary is then empty)
+	*/
+bool TopKSummary::Parse(const string& top, const string& floor)
+{
+	Clear();
+
+	if (!IsCount(floor))
+	{
+		return false;
+	}
+	m_floor = strtoull(floor.c_str(), NULL, 10);
+
+	istringstream iss(top);
+	string item;
+	while (getline(iss, item, ','))
+	{
+		size_t colon = item.rfind(':');
+		if (colon == string::npos || colon == 0)
+		{
+			Clear();
+			return false;
+		}
+
+		string count = item.substr(colon + 1);
+		string error = "0";
+		size_t tilde = count.find('~');
+		if (tilde != string::npos)
+		{
+			error = count.substr(tilde + 1);
+			count = count.substr(0, tilde);
+		}
+
+		if (!IsCount(count) || !IsCount(error))
+		{
+			Clear();
+			return false;
+		}
+
+		Entry entry;
+		entry.key = item.substr(0, colon);
+		entry.count = strtoull(count.c_str(), NULL, 10);
+		entry.error = strtoull(error.c_str(), NULL, 10);
+		m_entries.push_back(entry);
+	}
+
+	Truncate();
+	return true;
+}
+
+
+/** A key listed in only one of the summaries has the other's floor added to its count and error, as it
+	may have had that many in the other (see the class description).
+
+	@param other The summary to merge in
+	*/
+void TopKSummary::Merge(const TopKSummary& other)
+{
+	unordered_map<string, size_t> index;
+	for (size_t i = 0; i < m_entries.size(); i++)
+	{
+		index[m_entries[i].key] = i;
+	}
+
+	size_t numOwn = m_entries.size();
+	vector<bool> inOther(numOwn, false);
+
+	for (size_t i = 0; i < other.m_entries.size(); i++)
+	{
+		const Entry& theirs = other.m_entries[i];
+
+		auto it = index.find(theirs.key);
+		if (it != index.end())
+		{
+			m_entries[it->second].count += theirs.count;
+			m_entries[it->second].error += theirs.error;
+			inOther[it->second] = true;
+		}
+		else
+		{
+			Entry entry;
+			entry.key = theirs.key;
+			entry.count = theirs.count + m_floor;
+			entry.error = theirs.error + m_floor;
+			m_entries.push_back(entry);
+		}
+	}
+
+	for (size_t i = 0; i < numOwn; i++)
+	{
+		if (!inOther[i])
+		{
+			m_entries[i].count += other.m_floor;
+			m_entries[i].error += other.m_floor;
+		}
+	}
+
+	m_floor += other.m_floor;
+	Truncate();
+}
+
+
+/** @param key The key
+
+	@return Its count if listed, else Floor()
+	*/
+unsigned long long TopKSummary::UpperBound(const string& key) const
+{
+	for (size_t i = 0; i < m_entries.size(); i++)
+	{
+		if (m_entries[i].key == key)
+		{
+			return m_entries[i].count;
+		}
+	}
+
+	return m_floor;
+}
+
+
+/** @return The listed keys, heaviest first, as "key:count" or "key:count~error" separated by ','
+	*/
+string TopKSummary::Format() const
+{
+	ostringstream oss;
+	for (size_t i = 0; i < m_entries.size(); i++)
+	{
+		oss << (i ? "," : "") << m_entries[i].key << ":" << m_entries[i].count;
+		if (m_entries[i].error > 0)
+		{
+			oss << "~" << m_entries[i].error;
+		}
+	}
+	return oss.str();
+}
@@ -0,0 +1,97 @@
+#ifndef TOPK_SUMMARY_H
+#define TOPK_SUMMARY_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+#define TOPK_SUMMARY_KEYS 32		// max keys kept in a merged summary (global view and relayed reports)
+
+
+/** @brief Mergeable summary of the heaviest keys (by packets) of one or more watchdogs
+
+	A Space-Saving summary: a bounded list of keys, each with an upper bound on its count and the most
+	that bound can overestimate it by, plus a floor that bounds the count of any key not listed. A
+	watchdog's report gives the summary of its slice (" top=10.0.0.5:1200,10.0.0.7:800 topfloor=35"),
+	exact for the keys listed.
+
+	Two summaries are merged by summing the counts of the keys listed in both. A key listed in only one
+	may have had up to the other's floor in the other, so that floor is added to its count and to its
+	error, and the floors are summed. The merged list is then cut back to its capacity, the largest count
+	cut off raising the floor if it is higher. Throughout, a listed key's true count is between
+	Count() - Error() and Count(), and an unlisted key's is at most Floor(), however many watchdogs (and
+	relays in between) were merged. A key hit moderately by every watchdog is thus listed with a small
+	error even if no single watchdog alerted on it.
+
+	Merged summaries are carried in the same form, errors following a '~' (e.g. "10.0.0.5:2400~35").
+	*/
+class TopKSummary
+{
+
+private:
+
+	/** @brief A listed key */
+	struct Entry
+	{
+		string key;
+
+		/** Upper bound on the key's count */
+		unsigned long long count;
+
+		/** Max overestimate of count */
+		unsigned long long error;
+	};
+
+	/** Max number of keys listed */
+	size_t m_capacity;
+
+	/** Listed keys, heaviest first */
+	vector<Entry> m_entries;
+
+	/** Upper bound on the count of any key not listed */
+	unsigned long long m_floor;
+
+	/** @brief Sorts the entries, then cuts them back to m_capacity */
+	void Truncate();
+
+
+public:
+
+	/** @brief Constructor (an empty summary, the identity of Merge()) */
+	TopKSummary(size_t capacity = TOPK_SUMMARY_KEYS);
+
+	/** @brief Empties the summary */
+	void Clear();
+
+	/** @brief Replaces the summary with the one in a report's top= and topfloor= values, returning FALSE if malformed */
+	bool Parse(const string& top, const string& floor);
+
+	/** @brief Merges another summary into this one */
+	void Merge(const TopKSummary& other);
+
+	/** @brief Returns the number of keys listed */
+	size_t NumKeys() const { return m_entries.size(); }
+
+	/** @brief Returns the Nth heaviest key listed */
+	const string& Key(size_t n) const { return m_entries[n].key; }
+
+	/** @brief Returns the upper bound on the count of the Nth heaviest key listed */
+	unsigned long long Count(size_t n) const { return m_entries[n].count; }
+
+	/** @brief Returns the max overestimate of Count(N) */
+	unsigned long long Error(size_t n) const { return m_entries[n].error; }
+
+	/** @brief Returns the upper bound on the count of any key not listed */
+	unsigned long long Floor() const { return m_floor; }
+
+	/** @brief Returns the upper bound on the count of KEY, listed or not */
+	unsigned long long UpperBound(const string& key) const;
+
+	/** @brief Returns the list of keys as a report's top= value (e.g. "10.0.0.5:2400~35,10.0.0.7:800") */
+	string Format() const;
+
+};
+
+#endif
@@ -0,0 +1,762 @@
+#include "../desman/shm_ring.h"
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <memory>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/resource.h>	// setrlimit()
+
+using namespace std;
+
+
+#define MAXBUFLEN 4096			// bytes read from the desman at a time
+#define DESMAN_PORT 11353
+#define DRAIN_USECS 2000000		// time allowed at the end for the reports in flight to be acknowledged
+#define MIN_POLL_USECS 1000		// shortest wait between checks of the send schedule
+#define RESERVED_FDS 16			// descriptors left for stdio and the threads besides the connections
+
+
+/** Returns the monotonic time in usecs **/
+long long NowUsecs()
+{
+	return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/** Load options **/
+struct LoadOptions
+{
+	string desmanIP;
+	int connections;
+	double rate;			// reports per second per connection (0 = send the next report once the last is acknowledged)
+	int reportSize;			// bytes per report (padded)
+	double jitter;			// each interval between reports varies by up to +/- this fraction
+	double alertFraction;	// fraction of reports that are alerts
+	double duration;		// seconds of load
+	bool ack;				// the desman acknowledges reports (desman -a), so latency is measured
+	bool local;				// connect to the desman on this host, sending reports through shared memory
+	int threads;
+	vector<pair<double, double> > disconnects;	// (fraction of connections, seconds into the load) to drop
+};
+
+
+/** @brief A thread's share of the simulated watchdog connections
+
+	Each connection follows the watchdog's handshake (connect, receive "UID <id>", then "start") and
+	then sends reports as lines on its schedule. With acknowledgements, the time from queuing a report
+	to receiving its "ack <n>" is the desman's end-to-end latency for it.
+	*/
+class WatchdogSimulator
+{
+
+private:
+
+	/** @brief A simulated watchdog */
+	struct Connection
+	{
+		int fd;					// -1 once closed
+		int id;					// UID assigned by the desman
+		int reportsSent;
+		long long nextSend;		// when the next report is due (usecs, monotonic)
+		long long disconnectAt;	// when to drop the connection (usecs, monotonic, -1 for never)
+		string inbuf;			// received, not yet a whole line
+		string outbuf;			// queued, not yet sent
+		unique_ptr<ShmRing> ring;	// the report ring (connected to the local desman), NULL over TCP
+		deque<pair<int, long long> > inFlight;	// (report number, time queued) of reports not yet acknowledged
+	};
+
+	const LoadOptions& m_options;
+	vector<Connection> m_conns;
+	mt19937 m_rng;
+
+	/** Latency of every acknowledged report in usecs */
+	vector<uint32_t> m_latencies;
+
+
+	/** @brief Receives what the desman sent on a connection, returning FALSE if it was closed */
+	bool Receive(Connection& conn)
+	{
+		char buf[MAXBUFLEN];
+		ssize_t bytes = recv(conn.fd, buf, sizeof(buf), 0);
+		if (bytes == 0 || (bytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+		{
+			return false;
+		}
+
+		if (bytes > 0)
+		{
+			conn.inbuf.append(buf, bytes);
+		}
+		return true;
+	}
+
+	/** @brief Takes the next whole line received on a connection, returning FALSE if there is none */
+	bool NextLine(Connection& conn, string& line)
+	{
+		size_t end = conn.inbuf.find('\n');
+		if (end == string::npos)
+		{
+			return false;
+		}
+
+		line = conn.inbuf.substr(0, end);
+		conn.inbuf.erase(0, end + 1);
+		return true;
+	}
+
+	/** @brief Waits (blocking) for the next line on a connection, returning FALSE if it was closed */
+	bool WaitLine(Connection& conn, string& line)
+	{
+		while (!NextLine(conn, line))
+		{
+			if (!Receive(conn))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/** @brief Sends as much of a connection's queued output as the socket (or ring) takes, returning FALSE on error */
+	bool Flush(Connection& conn)
+	{
+		if (conn.ring)
+		{
+			conn.outbuf.erase(0, conn.ring->Write(conn.outbuf.data(), conn.outbuf.length()));
+			return true;
+		}
+
+		while (!conn.outbuf.empty())
+		{
+			ssize_t bytes = send(conn.fd, conn.outbuf.data(), conn.outbuf.length(), MSG_NOSIGNAL);
+			if (bytes == -1)
+			{
+				return errno == EAGAIN || errno == EWOULDBLOCK;
+			}
+			conn.outbuf.erase(0, bytes);
+		}
+		return true;
+	}
+
+	/** @brief Queues a connection's next report (like a watchdog's: "[alert ]report <n> <packets> <bytes> <flows> ...") */
+	void QueueReport(Connection& conn, long long now)
+	{
+		int reportId = ++conn.reportsSent;
+		bool alert = uniform_real_distribution<double>(0, 1)(m_rng) < m_options.alertFraction;
+
+		ostringstream oss;
+		if (alert)
+		{
+			oss << "alert ";
+		}
+		oss << "report " << reportId << " " << 1000 + reportId % 100 << " " << 60000 + reportId % 1000 << " " << 100;
+		if (alert)
+		{
+			oss << " 10.0." << conn.id / 256 % 256 << "." << conn.id % 256;
+		}
+		oss << " newflows=100 halfopen=0 portscans=0 hostsweeps=0";
+
+		string report = oss.str();
+		if ((int)report.length() + 5 < m_options.reportSize)
+		{
+			report += " pad=" + string(m_options.reportSize - report.length() - 5, 'x');
+		}
+
+		conn.outbuf += report + "\n";
+		if (m_options.ack)
+		{
+			conn.inFlight.push_back(make_pair(reportId, now));
+		}
+		sent++;
+	}
+
+	/** @brief Closes a connection (the desman sees the watchdog disconnect) */
+	void Close(Connection& conn)
+	{
+		close(conn.fd);
+		conn.fd = -1;
+		disconnected++;
+	}
+
+
+public:
+
+	/** Progress counters (read by the main thread while the load runs) */
+	atomic<unsigned long long> sent;
+	atomic<unsigned long long> acked;
+	atomic<unsigned long long> disconnected;
+
+
+	WatchdogSimulator(const LoadOptions& options, int numConns, unsigned int seed)
+		: m_options(options), m_rng(seed), sent(0), acked(0), disconnected(0)
+	{
+		m_conns.resize(numConns);
+		for (size_t i = 0; i < m_conns.size(); i++)
+		{
+			m_conns[i].fd = -1;
+			m_conns[i].id = 0;
+			m_conns[i].reportsSent = 0;
+			m_conns[i].nextSend = 0;
+			m_conns[i].disconnectAt = -1;
+		}
+	}
+
+	~WatchdogSimulator()
+	{
+		for (size_t i = 0; i < m_conns.size(); i++)
+		{
+			if (m_conns[i].fd != -1)
+			{
+				close(m_conns[i].fd);
+			}
+		}
+	}
+
+	/** @brief Connects every connection (to SA, or with -l to the local socket) and waits for its UID (returning FALSE on error) */
+	bool Connect(const sockaddr* sa, socklen_t len)
+	{
+		for (size_t i = 0; i < m_conns.size(); i++)
+		{
+			Connection& conn = m_conns[i];
+			if ((conn.fd = socket(sa->sa_family, SOCK_STREAM, 0)) == -1 || connect(conn.fd, sa, len) == -1)
+			{
+				cout << "Error connecting to desman: " << strerror(errno) << "\n";
+				return false;
+			}
+
+			// "UID <id>" (the desman answers each connection as it accepts it, locally with the ring attached)
+			char first = 0;
+			if (m_options.local)
+			{
+				conn.ring.reset(new ShmRing());
+				if (!conn.ring->ReceiveDescriptors(conn.fd, first))
+				{
+					cout << "Error receiving report ring from desman\n";
+					return false;
+				}
+			}
+
+			string line;
+			if (!WaitLine(conn, line))
+			{
+				cout << "Error receiving ID from desman\n";
+				return false;
+			}
+
+			if (first != 0)
+			{
+				line = first + line;
+			}
+
+			if (line.compare(0, 4, "UID ") != 0)
+			{
+				cout << "Error receiving ID from desman\n";
+				return false;
+			}
+			conn.id = atoi(line.c_str() + 4);
+		}
+		return true;
+	}
+
+	/** @brief Waits for the start signal on every connection (returning FALSE on error) */
+	bool WaitForStart()
+	{
+		for (size_t i = 0; i < m_conns.size(); i++)
+		{
+			Connection& conn = m_conns[i];
+			string line;
+			if (!WaitLine(conn, line))
+			{
+				cout << "Error receiving start signal from desman\n";
+				return false;
+			}
+
+			if (line != "start")
+			{
+				cout << "Error: expected start signal from desman, received '" << line << "'\n";
+				return false;
+			}
+
+			fcntl(conn.fd, F_SETFL, fcntl(conn.fd, F_GETFL) | O_NONBLOCK);
+		}
+		return true;
+	}
+
+	/** @brief Schedules the first reports (spread over one interval) and the disconnects */
+	void Schedule(long long start)
+	{
+		long long interval = (m_options.rate > 0) ? (long long)(1000000 / m_options.rate) : 0;
+		for (size_t i = 0; i < m_conns.size(); i++)
+		{
+			m_conns[i].nextSend = start + (interval ? (long long)(m_rng() % interval) : 0);
+		}
+
+		// each disconnect drops its fraction of the connections not already dropped by an earlier one
+		size_t next = 0;
+		for (size_t d = 0; d < m_options.disconnects.size(); d++)
+		{
+			size_t count = (size_t)(m_options.disconnects[d].first * m_conns.size() + 0.5);
+			for (size_t i = 0; i < count && next < m_conns.size(); i++, next++)
+			{
+				m_conns[next].disconnectAt = start + (long long)(m_options.disconnects[d].second * 1000000);
+			}
+		}
+	}
+
+	/** @brief Sends reports on schedule and receives acknowledgements until end, then drains until drainEnd */
+	void Run(long long end, long long drainEnd)
+	{
+		long long interval = (m_options.rate > 0) ? (long long)(1000000 / m_options.rate) : 0;
+		uniform_real_distribution<double> jitter(-m_options.jitter, m_options.jitter);
+		vector<pollfd> fds(m_conns.size());
+
+		while (1)
+		{
+			long long now = NowUsecs();
+			bool sending = (now < end);
+			long long wake = sending ? end : drainEnd;
+			size_t open = 0, waiting = 0;
+
+			for (size_t i = 0; i < m_conns.size(); i++)
+			{
+				Connection& conn = m_conns[i];
+				fds[i].fd = conn.fd;
+				fds[i].events = 0;
+				fds[i].revents = 0;
+				if (conn.fd == -1)
+				{
+					continue;
+				}
+
+				if (conn.disconnectAt >= 0 && now >= conn.disconnectAt)
+				{
+					Close(conn);
+					fds[i].fd = -1;
+					continue;
+				}
+
+				if (sending)
+				{
+					if (interval > 0)
+					{
+						// open loop: on schedule, whatever the desman's progress
+						while (now >= conn.nextSend)
+						{
+							QueueReport(conn, conn.nextSend);
+							conn.nextSend += max(1LL, (long long)(interval * (1 + jitter(m_rng))));
+						}
+						wake = min(wake, conn.nextSend);
+					}
+					else if (conn.inFlight.empty())
+					{
+						// closed loop: the next report once the last is acknowledged
+						QueueReport(conn, now);
+					}
+
+					if (conn.disconnectAt >= 0)
+					{
+						wake = min(wake, conn.disconnectAt);
+					}
+				}
+
+				if (!Flush(conn))
+				{
+					Close(conn);
+					fds[i].fd = -1;
+					continue;
+				}
+
+				fds[i].events = POLLIN | ((conn.outbuf.empty() || conn.ring) ? 0 : POLLOUT);
+				if (conn.ring && !conn.outbuf.empty())
+				{
+					wake = now; // (ring full, retry after the shortest wait)
+				}
+				open++;
+				waiting += conn.inFlight.size();
+			}
+
+			if (open == 0 || (!sending && (now >= drainEnd || !m_options.ack || waiting == 0)))
+			{
+				return;
+			}
+
+			int timeout = (int)max((long long)MIN_POLL_USECS, wake - now) / 1000;
+			if (poll(fds.data(), fds.size(), timeout) == -1 && errno != EINTR)
+			{
+				cout << "Error calling poll()\n";
+				return;
+			}
+
+			now = NowUsecs();
+			for (size_t i = 0; i < m_conns.size(); i++)
+			{
+				Connection& conn = m_conns[i];
+				if (conn.fd == -1 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				{
+					continue;
+				}
+
+				if (!Receive(conn))
+				{
+					Close(conn);
+					continue;
+				}
+
+				// "ack <n>": reports are acknowledged in the order they were sent
+				string line;
+				while (NextLine(conn, line))
+				{
+					int reportId = (line.compare(0, 4, "ack ") == 0) ? atoi(line.c_str() + 4) : 0;
+					while (!conn.inFlight.empty() && conn.inFlight.front().first <= reportId)
+					{
+						if (conn.inFlight.front().first == reportId)
+						{
+							m_latencies.push_back((uint32_t)min(now - conn.inFlight.front().second, (long long)UINT32_MAX));
+							acked++;
+						}
+						conn.inFlight.pop_front();
+					}
+				}
+			}
+		}
+	}
+
+	/** @brief Returns the latency of every acknowledged report (usecs) */
+	const vector<uint32_t>& Latencies() const { return m_latencies; }
+
+};
+
+
+/** Raises the soft limit on open descriptors to the hard limit (the default soft limit of 1024 runs out
+	at about 1000 TCP or 340 local connections), then checks that the connections fit under it.
+	Each connection holds its socket, plus with -l its ring's memfd and eventfd.
+
+	@param options The load options (the connections and whether they are local)
+
+	@return TRUE if every connection fits, FALSE (having printed why) if not
+	*/
+bool RaiseFileLimit(const LoadOptions& options)
+{
+	rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+	{
+		cout << "Error reading the open file limit\n";
+		return false;
+	}
+
+	if (rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1 && getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		{
+			cout << "Error raising the open file limit\n";
+			return false;
+		}
+	}
+
+	rlim_t needed = (rlim_t)options.connections * (options.local ? 3 : 1) + RESERVED_FDS;
+	if (needed > rl.rlim_cur)
+	{
+		cout << "Error: " << options.connections << " connections need " << needed << " descriptors but the open file limit is "
+			<< rl.rlim_cur << " (raise the hard limit, e.g. ulimit -Hn)\n";
+		return false;
+	}
+
+	return true;
+}
+
+
+/** Prints usage instructions to console **/
+void PrintUsgInstr()
+{
+	cout << "\nLoadgen Usage Instructions:\n\n";
+	cout << "> loadgen [-c desmanIP | -l] [-n connections] [-r rate] [-z bytes] [-j jitter] [-e fraction] [-d seconds] [-a] [-x fraction@seconds ...] [-t threads]\n";
+	cout << "where\n";
+	cout << "-c, --connect\t\tConnect to the specified IP address for the desman (started with -n <connections>)\n";
+	cout << "-l, --local\t\tConnect to the desman on this host instead, sending reports through shared memory\n";
+	cout << "-n, --number\t\tNumber of simulated watchdogs (default = 100)\n";
+	cout << "-r, --rate\t\tReports per second sent by each watchdog (default = 1). With -a, 0 sends each watchdog's\n";
+	cout << "\t\t\tnext report as soon as its last is acknowledged, to find the desman's saturation throughput\n";
+	cout << "-z, --size\t\tSize of each report in bytes (default = 128)\n";
+	cout << "-j, --jitter\t\tVary each interval between reports by up to +/- this fraction (default = 0)\n";
+	cout << "-e, --alerts\t\tFraction of reports that are alerts (default = 0)\n";
+	cout << "-d, --duration\t\tSeconds of load (default = 10)\n";
+	cout << "-a, --ack\t\tThe desman acknowledges reports (desman -a): measure end-to-end latency\n";
+	cout << "-x, --disconnect\tDrop the specified fraction of the watchdogs the specified number of seconds into\n";
+	cout << "\t\t\tthe load (e.g. -x 0.1@5, repeat for several)\n";
+	cout << "-t, --threads\t\tNumber of threads driving the watchdogs (default = number of CPUs)\n";
+}
+
+
+/** Parses cmd line arguments and saves options into fn args.
+	Returns TRUE if all opts are valid
+	Returns FALSE if anything goes wrong or if any opts are invalid **/
+bool ParseCmdLineArgs(int argc, char** argv, LoadOptions& options)
+{
+	options.desmanIP = "";
+	options.connections = 100;
+	options.rate = 1;
+	options.reportSize = 128;
+	options.jitter = 0;
+	options.alertFraction = 0;
+	options.duration = 10;
+	options.ack = false;
+	options.local = false;
+	options.threads = max(1, (int)thread::hardware_concurrency());
+	options.disconnects.clear();
+
+	int c;
+
+	while ((c = getopt(argc, argv, "c:ln:r:z:j:e:d:ax:t:")) != -1)
+	{
+		switch (c)
+		{
+			case 'c':
+				options.desmanIP = optarg;
+				break;
+			case 'n':
+				options.connections = atoi(optarg);
+				break;
+			case 'r':
+				options.rate = atof(optarg);
+				break;
+			case 'z':
+				options.reportSize = atoi(optarg);
+				break;
+			case 'j':
+				options.jitter = atof(optarg);
+				break;
+			case 'e':
+				options.alertFraction = atof(optarg);
+				break;
+			case 'd':
+				options.duration = atof(optarg);
+				break;
+			case 'a':
+				options.ack = true;
+				break;
+			case 'l':
+				options.local = true;
+				break;
+			case 'x':
+			{
+				double fraction, secs;
+				char at;
+				if (!(istringstream(optarg) >> fraction >> at >> secs) || at != '@' || fraction < 0 || fraction > 1 || secs < 0)
+				{
+					cout << "Error: disconnects are given as fraction@seconds (e.g. 0.1@5)\n";
+					return false;
+				}
+				options.disconnects.push_back(make_pair(fraction, secs));
+				break;
+			}
+			case 't':
+				options.threads = atoi(optarg);
+				break;
+			default:
+				return false;
+		}
+	}
+
+	if (options.desmanIP == "" && !options.local)
+	{
+		cout << "Error: must provide desman IP\n";
+		return false;
+	}
+
+	if (options.connections < 1 || options.threads < 1 || options.duration <= 0)
+	{
+		cout << "Error: connections, threads and duration must be positive\n";
+		return false;
+	}
+
+	if (options.rate < 0 || (options.rate == 0 && !options.ack))
+	{
+		cout << "Error: rate must be positive (or 0 with -a)\n";
+		return false;
+	}
+
+	if (options.jitter < 0 || options.jitter >= 1)
+	{
+		cout << "Error: jitter must be at least 0 and less than 1\n";
+		return false;
+	}
+
+	return true;
+}
+
+
+int main(int argc, char** argv)
+{
+	LoadOptions options;
+	if (!ParseCmdLineArgs(argc, argv, options))
+	{
+		PrintUsgInstr();
+		return 0;
+	}
+
+	if (!RaiseFileLimit(options))
+	{
+		return 1;
+	}
+
+	sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(DESMAN_PORT);
+	if (!options.local && inet_aton(options.desmanIP.c_str(), &sa.sin_addr) == 0)
+	{
+		cout << "Error: invalid desman IP " << options.desmanIP << "\n";
+		return 1;
+	}
+
+	sockaddr_un su;
+	memset(&su, 0, sizeof(su));
+	su.sun_family = AF_UNIX;
+	strncpy(su.sun_path + 1, DESMAN_LOCAL_SOCKET, sizeof(su.sun_path) - 2); // (abstract name)
+
+	const sockaddr* pAddr = options.local ? (const sockaddr*)&su : (const sockaddr*)&sa;
+	socklen_t addrLen = options.local ? offsetof(sockaddr_un, sun_path) + 1 + strlen(DESMAN_LOCAL_SOCKET) : sizeof(sa);
+
+	/** Split the connections between the threads **/
+	int numThreads = min(options.threads, options.connections);
+	vector<unique_ptr<WatchdogSimulator> > simulators;
+	for (int t = 0; t < numThreads; t++)
+	{
+		int numConns = options.connections / numThreads + (t < options.connections % numThreads ? 1 : 0);
+		simulators.push_back(unique_ptr<WatchdogSimulator>(new WatchdogSimulator(options, numConns, 12345 + t)));
+	}
+
+	/** Connect every watchdog, wait for the start signal, then run the load **/
+	cout << "Connecting " << options.connections << " watchdogs to " << (options.local ? "the desman on this host" : options.desmanIP) << "...\n";
+
+	atomic<int> failed(0);
+	atomic<int> started(0);
+	atomic<long long> start(0);
+	vector<thread> threads;
+	for (int t = 0; t < numThreads; t++)
+	{
+		threads.push_back(thread([&, t]
+		{
+			WatchdogSimulator& sim = *simulators[t];
+			if (!sim.Connect(pAddr, addrLen) || !sim.WaitForStart())
+			{
+				failed++;
+				started++;
+				return;
+			}
+
+			// every thread starts the load together, once all have the start signal
+			started++;
+			while (start == 0)
+			{
+				this_thread::sleep_for(chrono::milliseconds(1));
+			}
+
+			long long end = start + (long long)(options.duration * 1000000);
+			sim.Schedule(start);
+			sim.Run(end, end + DRAIN_USECS);
+		}));
+	}
+
+	while (started < numThreads)
+	{
+		this_thread::sleep_for(chrono::milliseconds(1));
+	}
+
+	if (failed > 0)
+	{
+		start = 1; // (lets the threads that did start finish straight away)
+		for (size_t t = 0; t < threads.size(); t++)
+		{
+			threads[t].join();
+		}
+		return 1;
+	}
+
+	start = NowUsecs();
+	cout << "Started, sending reports for " << options.duration << " seconds...\n";
+
+	/** Print the throughput every second while the load runs **/
+	unsigned long long prevSent = 0, prevAcked = 0;
+	for (int s = 1; s <= (int)options.duration; s++)
+	{
+		this_thread::sleep_until(chrono::steady_clock::time_point(chrono::microseconds(start + s * 1000000LL)));
+
+		unsigned long long totalSent = 0, totalAcked = 0, totalDropped = 0;
+		for (size_t t = 0; t < simulators.size(); t++)
+		{
+			totalSent += simulators[t]->sent;
+			totalAcked += simulators[t]->acked;
+			totalDropped += simulators[t]->disconnected;
+		}
+
+		cout << "t=" << s << "s sent/s=" << totalSent - prevSent;
+		if (options.ack)
+		{
+			cout << " acked/s=" << totalAcked - prevAcked << " in flight=" << totalSent - totalAcked;
+		}
+		cout << " disconnected=" << totalDropped << "\n";
+
+		prevSent = totalSent;
+		prevAcked = totalAcked;
+	}
+
+	for (size_t t = 0; t < threads.size(); t++)
+	{
+		threads[t].join();
+	}
+
+	/** Summary **/
+	unsigned long long totalSent = 0, totalAcked = 0, totalDropped = 0;
+	vector<uint32_t> latencies;
+	for (size_t t = 0; t < simulators.size(); t++)
+	{
+		totalSent += simulators[t]->sent;
+		totalAcked += simulators[t]->acked;
+		totalDropped += simulators[t]->disconnected;
+		latencies.insert(latencies.end(), simulators[t]->Latencies().begin(), simulators[t]->Latencies().end());
+	}
+
+	cout << "\nWatchdogs: " << options.connections << " (" << totalDropped << " disconnected)\n";
+	cout << fixed << setprecision(1);
+	cout << "Reports sent: " << totalSent << " (" << totalSent / options.duration << "/s)\n";
+
+	if (options.ack)
+	{
+		cout << "Reports acknowledged: " << totalAcked << " (" << totalAcked / options.duration << "/s)\n";
+
+		if (!latencies.empty())
+		{
+			sort(latencies.begin(), latencies.end());
+			const double percentiles[] = { 50, 90, 99, 99.9 };
+			cout << "Latency (ms): min=" << latencies.front() / 1000.0;
+			for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++)
+			{
+				size_t i = min(latencies.size() - 1, (size_t)(latencies.size() * percentiles[p] / 100));
+				cout << " p" << setprecision(percentiles[p] < 99.5 ? 0 : 1) << percentiles[p] << setprecision(1)
+					<< "=" << latencies[i] / 1000.0;
+			}
+			cout << " max=" << latencies.back() / 1000.0 << "\n";
+		}
+	}
+
+	return 0;
+}
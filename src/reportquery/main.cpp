@@ -0,0 +1,282 @@
+#include "../desman/report_store.h"
+
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/time.h>
+
+using namespace std;
+
+
+/** Query options **/
+struct Query
+{
+	long long from;				// time range, in usecs ([from, until))
+	long long until;
+	int watchdog;				// only reports from this watchdog (-1 for any watchdog, 0 for window totals)
+	string key;					// only reports that alerted on this key ("" for any)
+	bool alertsOnly;
+	bool sum;					// print the number of rows and sums instead of the rows
+	vector<ReportColumn> columns;	// columns to print (or sum)
+};
+
+
+/** Prints usage instructions to console **/
+void PrintUsgInstr()
+{
+	cout << "\nReportquery Usage Instructions:\n\n";
+	cout << "> reportquery [-d directory] [-f seconds] [-u seconds] [-l seconds] [-w id] [-k key] [-a] [-c columns] [-s]\n";
+	cout << "where\n";
+	cout << "-d, --directory\t\tThe report store written by desman -d\n";
+	cout << "-f, --from\t\tOnly reports received at or after this time (seconds since the epoch)\n";
+	cout << "-u, --until\t\tOnly reports received before this time (seconds since the epoch)\n";
+	cout << "-l, --last\t\tOnly reports received in the last number of seconds\n";
+	cout << "-w, --watchdog\t\tOnly reports from the watchdog with this ID (0 for the desman's window totals,\n";
+	cout << "\t\t\tby default reports from every watchdog)\n";
+	cout << "-k, --key\t\tOnly reports that alerted on this key (e.g. 10.0.0.5)\n";
+	cout << "-a, --alerts\t\tOnly reports that are alerts\n";
+	cout << "-c, --columns\t\tComma separated columns to print: time,watchdog,report,alert,packets,bytes,flows,key\n";
+	cout << "\t\t\t(default = all, or packets,bytes,flows with -s)\n";
+	cout << "-s, --sum\t\tPrint the number of matching reports and the sum of each column instead\n";
+}
+
+
+/** Parses cmd line arguments and saves options into fn args.
+	Returns TRUE if all opts are valid
+	Returns FALSE if anything goes wrong or if any opts are invalid **/
+bool ParseCmdLineArgs(int argc, char** argv, string& dir, Query& query)
+{
+	dir = "";
+	query.from = 0;
+	query.until = LLONG_MAX;
+	query.watchdog = -1;
+	query.key = "";
+	query.alertsOnly = false;
+	query.sum = false;
+	query.columns.clear();
+
+	string columns = "";
+	timeval now;
+	gettimeofday(&now, NULL);
+
+	int c;
+
+	while ((c = getopt(argc, argv, "d:f:u:l:w:k:ac:s")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				dir = optarg;
+				break;
+			case 'f':
+				query.from = (long long)(atof(optarg) * 1000000);
+				break;
+			case 'u':
+				query.until = (long long)(atof(optarg) * 1000000);
+				break;
+			case 'l':
+				query.from = (long long)now.tv_sec * 1000000 + now.tv_usec - (long long)(atof(optarg) * 1000000);
+				break;
+			case 'w':
+				query.watchdog = atoi(optarg);
+				break;
+			case 'k':
+				query.key = optarg;
+				break;
+			case 'a':
+				query.alertsOnly = true;
+				break;
+			case 'c':
+				columns = optarg;
+				break;
+			case 's':
+				query.sum = true;
+				break;
+			default:
+				return false;
+		}
+	}
+
+	if (dir == "")
+	{
+		cout << "Error: must provide report store directory" << endl;
+		return false;
+	}
+
+	if (columns == "")
+	{
+		columns = query.sum ? "packets,bytes,flows" : "time,watchdog,report,alert,packets,bytes,flows,key";
+	}
+
+	istringstream issColumns(columns);
+	string name;
+	while (getline(issColumns, name, ','))
+	{
+		ReportColumn col = ColumnByName(name);
+		if (col == NUM_COLUMNS)
+		{
+			cout << "Error: unknown column " << name << endl;
+			return false;
+		}
+
+		if (query.sum && col != COL_PACKETS && col != COL_BYTES && col != COL_FLOWS)
+		{
+			cout << "Error: can only sum packets, bytes and flows" << endl;
+			return false;
+		}
+
+		query.columns.push_back(col);
+	}
+
+	return true;
+}
+
+
+/** Runs QUERY over the segments of the store in DIR, printing the matching rows (or their sums).
+	Segments outside the time range are skipped without being opened, and only the columns the
+	query filters on or prints are mapped. Returns FALSE on error **/
+bool RunQuery(const string& dir, const Query& query)
+{
+	vector<SegmentInfo> segments;
+	if (!ReportStore::ListSegments(dir, segments))
+	{
+		return false;
+	}
+
+	uint64_t matches = 0;
+	vector<unsigned long long> sums(query.columns.size(), 0);
+
+	for (size_t s = 0; s < segments.size(); s++)
+	{
+		if (segments[s].end * 1000000 <= query.from || segments[s].start * 1000000 >= query.until)
+		{
+			continue;
+		}
+
+		SegmentReader reader;
+		if (!reader.Open(segments[s].path))
+		{
+			return false;
+		}
+
+		uint32_t keyId = 0;
+		if (query.key != "" && !reader.FindKey(query.key, keyId))
+		{
+			continue; // (no report in this segment alerted on the key)
+		}
+
+		bool ok = reader.MapColumn(COL_WATCHDOG);
+		ok = ok && (query.key == "" || reader.MapColumn(COL_KEY));
+		ok = ok && (!query.alertsOnly || reader.MapColumn(COL_ALERT));
+		for (size_t c = 0; ok && c < query.columns.size(); c++)
+		{
+			ok = reader.MapColumn(query.columns[c]);
+		}
+
+		if (!ok)
+		{
+			return false;
+		}
+
+		const int64_t* times = reader.Column<int64_t>(COL_TIME);
+		const int32_t* watchdogs = reader.Column<int32_t>(COL_WATCHDOG);
+		const int32_t* reports = reader.Column<int32_t>(COL_REPORT);
+		const uint8_t* alerts = reader.Column<uint8_t>(COL_ALERT);
+		const uint32_t* keys = reader.Column<uint32_t>(COL_KEY);
+		const uint64_t* counts[NUM_COLUMNS] = { NULL };
+		counts[COL_PACKETS] = reader.Column<uint64_t>(COL_PACKETS);
+		counts[COL_BYTES] = reader.Column<uint64_t>(COL_BYTES);
+		counts[COL_FLOWS] = reader.Column<uint64_t>(COL_FLOWS);
+
+		uint64_t first, last;
+		reader.TimeRange(query.from, query.until, first, last);
+
+		for (uint64_t i = first; i < last; i++)
+		{
+			// by default only watchdog reports, not the window totals
+			if ((query.watchdog == -1) ? watchdogs[i] == 0 : watchdogs[i] != query.watchdog)
+			{
+				continue;
+			}
+
+			if ((query.key != "" && keys[i] != keyId) || (query.alertsOnly && !alerts[i]))
+			{
+				continue;
+			}
+
+			matches++;
+
+			if (query.sum)
+			{
+				for (size_t c = 0; c < query.columns.size(); c++)
+				{
+					sums[c] += counts[query.columns[c]][i];
+				}
+				continue;
+			}
+
+			ostringstream oss;
+			for (size_t c = 0; c < query.columns.size(); c++)
+			{
+				oss << (c ? " " : "");
+				switch (query.columns[c])
+				{
+					case COL_TIME:
+					{
+						char buf[32];
+						snprintf(buf, sizeof(buf), "%lld.%06lld", (long long)times[i] / 1000000, (long long)times[i] % 1000000);
+						oss << buf;
+						break;
+					}
+					case COL_WATCHDOG:
+						oss << watchdogs[i];
+						break;
+					case COL_REPORT:
+						oss << reports[i];
+						break;
+					case COL_ALERT:
+						oss << (int)alerts[i];
+						break;
+					case COL_KEY:
+					{
+						string key = reader.Key(keys[i]);
+						oss << (key == "" ? "-" : key);
+						break;
+					}
+					default:
+						oss << counts[query.columns[c]][i];
+						break;
+				}
+			}
+			cout << oss.str() << "\n";
+		}
+	}
+
+	if (query.sum)
+	{
+		cout << "reports " << matches;
+		for (size_t c = 0; c < query.columns.size(); c++)
+		{
+			cout << " " << ColumnName(query.columns[c]) << " " << sums[c];
+		}
+		cout << endl;
+	}
+
+	return true;
+}
+
+
+int main(int argc, char** argv)
+{
+	string dir;
+	Query query;
+
+	if (!ParseCmdLineArgs(argc, argv, dir, query))
+	{
+		PrintUsgInstr();
+		return 0;
+	}
+
+	return RunQuery(dir, query) ? 0 : 1;
+}
@@ -0,0 +1,400 @@
+#include "../watchdog/packet_parser.h"
+#include "../watchdog/capture_shard.h"	// HEADER_SNAPLEN
+
+#include <iostream>
+#include <vector>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+using namespace std;
+
+
+/** Checks a condition, printing it (with the frame length being parsed) if it fails **/
+#define CHECK(cond) Check((cond), #cond, __LINE__)
+
+static int g_failures = 0;
+static u_int g_caplen = 0;		// caplen of the frame being checked (printed on failure)
+
+static void Check(bool ok, const char* cond, int line)
+{
+	if (!ok)
+	{
+		cout << "FAILED line " << line << " (caplen " << g_caplen << "): " << cond << "\n";
+		g_failures++;
+	}
+}
+
+
+
+/** @brief A captured frame placed right before an unreadable page, so any read past its caplen crashes
+
+	The parsers must never read past caplen; without a sanitizer an overread would go unnoticed, so
+	every truncation of a frame is parsed from memory that ends exactly at caplen.
+	*/
+class GuardedFrame
+{
+
+private:
+
+	u_char* m_map;
+	size_t m_pageSize;
+
+
+public:
+
+	GuardedFrame()
+	{
+		m_pageSize = sysconf(_SC_PAGESIZE);
+		m_map = (u_char*)mmap(NULL, 2 * m_pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		mprotect(m_map + m_pageSize, m_pageSize, PROT_NONE);
+	}
+
+	~GuardedFrame()
+	{
+		munmap(m_map, 2 * m_pageSize);
+	}
+
+	/** @brief Returns the first caplen bytes of frame, ending at the unreadable page */
+	const u_char* Capture(const vector<u_char>& frame, u_int caplen)
+	{
+		u_char* data = m_map + m_pageSize - caplen;
+		memcpy(data, frame.data(), caplen);
+		return data;
+	}
+
+};
+
+
+
+/** Frame builders (all fields big endian, checksums left at 0) **/
+
+static void Put8(vector<u_char>& f, u_int value)
+{
+	f.push_back(value & 0xff);
+}
+
+static void Put16(vector<u_char>& f, u_int value)
+{
+	Put8(f, value >> 8);
+	Put8(f, value);
+}
+
+static void Put32(vector<u_char>& f, uint32_t value)
+{
+	Put16(f, value >> 16);
+	Put16(f, value);
+}
+
+static void PutZeros(vector<u_char>& f, size_t count)
+{
+	f.insert(f.end(), count, 0);
+}
+
+/** Ethernet header followed by the given tag ethertypes (outermost first), each with a VLAN id */
+static void PutEthernet(vector<u_char>& f, const vector<u_short>& tags, u_short ethertype)
+{
+	PutZeros(f, 2 * ETHER_ADDR_LEN);
+	for (size_t i = 0; i < tags.size(); i++)
+	{
+		Put16(f, tags[i]);
+		Put16(f, 100 + i);	// (TCI)
+	}
+	Put16(f, ethertype);
+}
+
+/** IPv4 header without options, 10.0.0.1 -> 10.0.0.2 */
+static void PutIpv4(vector<u_char>& f, u_char protocol, u_int payloadLen)
+{
+	Put8(f, 0x45);
+	Put8(f, 0);
+	Put16(f, 20 + payloadLen);
+	Put32(f, 0);	// (id, flags and fragment offset)
+	Put8(f, 64);
+	Put8(f, protocol);
+	Put16(f, 0);
+	Put32(f, 0x0a000001);
+	Put32(f, 0x0a000002);
+}
+
+/** IPv6 header, 2001:db8::1 -> 2001:db8::2 */
+static void PutIpv6(vector<u_char>& f, u_char nextHeader, u_int payloadLen)
+{
+	Put32(f, 0x60000000);
+	Put16(f, payloadLen);
+	Put8(f, nextHeader);
+	Put8(f, 64);
+	for (int i = 1; i <= 2; i++)
+	{
+		Put32(f, 0x20010db8);
+		PutZeros(f, 11);
+		Put8(f, i);
+	}
+}
+
+/** IPv6 extension header of (len + 1) * 8 bytes (fragment headers take the fragment offset instead) */
+static void PutIpv6Ext(vector<u_char>& f, u_char nextHeader, u_char len, u_short fragOffset = 0)
+{
+	Put8(f, nextHeader);
+	Put8(f, len);
+	Put16(f, fragOffset << 3);
+	PutZeros(f, (len + 1) * 8 - 4);
+}
+
+/** TCP header with optionsLen bytes of options (a multiple of 4) */
+static void PutTcp(vector<u_char>& f, u_short srcPort, u_short dstPort, u_char flags, u_int optionsLen)
+{
+	Put16(f, srcPort);
+	Put16(f, dstPort);
+	Put32(f, 1000);
+	Put32(f, 0);
+	Put8(f, ((20 + optionsLen) / 4) << 4);
+	Put8(f, flags);
+	Put16(f, 65535);
+	Put32(f, 0);	// (checksum and urgent pointer)
+	f.insert(f.end(), optionsLen, 1);	// (NOPs)
+}
+
+/** UDP header */
+static void PutUdp(vector<u_char>& f, u_short srcPort, u_short dstPort, u_int payloadLen)
+{
+	Put16(f, srcPort);
+	Put16(f, dstPort);
+	Put16(f, 8 + payloadLen);
+	Put16(f, 0);
+}
+
+
+
+/** Parses every truncation of an Ethernet frame tagged 802.1Q carrying IPv4/TCP: it must be rejected until
+	the IPv4 header is complete, counted without ports until the TCP header is, and fully parsed from then on **/
+static void TestVlanTruncated(GuardedFrame& guard)
+{
+	vector<u_char> f;
+	PutEthernet(f, vector<u_short>(1, ETHER_VLAN), ETHER_IPV4);
+	PutIpv4(f, IPPROTO_TCP, 20 + 12 + 100);
+	PutTcp(f, 1234, 80, TH_SYN, 12);
+	PutZeros(f, 100);
+
+	const u_int IP = SIZE_ETHERNET + SIZE_VLAN_TAG;
+	const u_int TCP = IP + 20;
+
+	for (g_caplen = 0; g_caplen <= f.size(); g_caplen++)
+	{
+		PacketInfo p;
+		bool parsed = ParsePacket<DLT_EN10MB>(guard.Capture(f, g_caplen), g_caplen, p);
+
+		CHECK(parsed == (g_caplen >= TCP));
+		if (!parsed)
+		{
+			continue;
+		}
+
+		CHECK(p.protocol == IPPROTO_TCP && !p.ipv6 && p.src_ip == 0x0a000001 && p.dst_ip == 0x0a000002);
+		CHECK(p.size == 20 + 32 + 100);
+
+		bool ports = (g_caplen >= TCP + 20);
+		CHECK(p.src_port == (ports ? 1234 : 0) && p.dst_port == (ports ? 80 : 0));
+		CHECK(p.tcp_flags == (ports ? TH_SYN : 0));
+		CHECK(p.payload_len == (g_caplen > TCP + 32 ? (int)(g_caplen - TCP - 32) : 0));
+	}
+}
+
+
+/** Every truncation of a QinQ frame inside its tags is rejected, and a third tag is never skipped **/
+static void TestQinqTags(GuardedFrame& guard)
+{
+	vector<u_short> tags;
+	tags.push_back(ETHER_QINQ);
+	tags.push_back(ETHER_VLAN);
+
+	vector<u_char> f;
+	PutEthernet(f, tags, ETHER_IPV4);
+	PutIpv4(f, IPPROTO_UDP, 8);
+	PutUdp(f, 5353, 53, 0);
+
+	for (g_caplen = 0; g_caplen <= f.size(); g_caplen++)
+	{
+		PacketInfo p;
+		bool parsed = ParsePacket<DLT_EN10MB>(guard.Capture(f, g_caplen), g_caplen, p);
+		CHECK(parsed == (g_caplen >= SIZE_ETHERNET + 2 * SIZE_VLAN_TAG + 20));
+		CHECK(!parsed || p.dst_port == (g_caplen == f.size() ? 53 : 0));
+	}
+
+	tags.push_back(ETHER_VLAN);
+	f.clear();
+	PutEthernet(f, tags, ETHER_IPV4);
+	PutIpv4(f, IPPROTO_UDP, 8);
+	PutUdp(f, 5353, 53, 0);
+
+	PacketInfo p;
+	g_caplen = f.size();
+	CHECK(!ParsePacket<DLT_EN10MB>(guard.Capture(f, g_caplen), g_caplen, p));
+}
+
+
+/** Parses every truncation of a QinQ frame carrying IPv6 with a hop-by-hop, routing, fragment and
+	destination options header before TCP (with the maximum 40 bytes of options). The frame must be
+	rejected until the last extension header's next header field is captured, and is fully parsed at
+	HEADER_SNAPLEN, the default capture length for headers only **/
+static void TestIpv6ExtTruncated(GuardedFrame& guard)
+{
+	vector<u_short> tags;
+	tags.push_back(ETHER_QINQ);
+	tags.push_back(ETHER_VLAN);
+
+	const u_int PAYLOAD = 200;
+	const u_int EXT = 8 + 24 + 8 + 8;
+
+	vector<u_char> f;
+	PutEthernet(f, tags, ETHER_IPV6);
+	PutIpv6(f, IPPROTO_HOPOPTS, EXT + 60 + PAYLOAD);
+	PutIpv6Ext(f, IPPROTO_ROUTING, 0);
+	PutIpv6Ext(f, IPPROTO_FRAGMENT, 2);
+	PutIpv6Ext(f, IPPROTO_DSTOPTS, 0);
+	PutIpv6Ext(f, IPPROTO_TCP, 0);
+	PutTcp(f, 40000, 443, TH_SYN | TH_ACK, 40);
+	PutZeros(f, PAYLOAD);
+
+	const u_int IP = SIZE_ETHERNET + 2 * SIZE_VLAN_TAG;
+	const u_int LAST_EXT = IP + SIZE_IPV6 + EXT - 8;
+	const u_int TCP = IP + SIZE_IPV6 + EXT;
+
+	CHECK(TCP + 60 <= HEADER_SNAPLEN);
+
+	for (g_caplen = 0; g_caplen <= f.size(); g_caplen++)
+	{
+		PacketInfo p;
+		bool parsed = ParsePacket<DLT_EN10MB>(guard.Capture(f, g_caplen), g_caplen, p);
+
+		CHECK(parsed == (g_caplen >= LAST_EXT + sizeof(sniff_ip6_ext)));
+		if (!parsed)
+		{
+			continue;
+		}
+
+		CHECK(p.protocol == IPPROTO_TCP && p.ipv6);
+		CHECK(p.size == (int)(SIZE_IPV6 + EXT + 60 + PAYLOAD));
+
+		bool ports = (g_caplen >= TCP + 20);
+		CHECK(p.src_port == (ports ? 40000 : 0) && p.dst_port == (ports ? 443 : 0));
+		CHECK(p.tcp_flags == (ports ? (TH_SYN | TH_ACK) : 0));
+		CHECK(p.tcp_len == (ports ? (int)PAYLOAD : 0));
+		CHECK(p.payload_len == (g_caplen > TCP + 60 ? (int)(g_caplen - TCP - 60) : 0));
+	}
+
+	PacketInfo p;
+	g_caplen = HEADER_SNAPLEN;
+	CHECK(ParsePacket<DLT_EN10MB>(guard.Capture(f, g_caplen), g_caplen, p) && p.dst_port == 443);
+}
+
+
+/** A non-first IPv6 fragment is counted without ports, and a chain longer than the parser follows is rejected **/
+static void TestIpv6ExtLimits(GuardedFrame& guard)
+{
+	vector<u_char> f;
+	PutEthernet(f, vector<u_short>(), ETHER_IPV6);
+	PutIpv6(f, IPPROTO_FRAGMENT, 8 + 8);
+	PutIpv6Ext(f, IPPROTO_UDP, 0, 185);
+	PutUdp(f, 5353, 53, 0);
+
+	PacketInfo p;
+	g_caplen = f.size();
+	CHECK(ParsePacket<DLT_EN10MB>(guard.Capture(f, g_caplen), g_caplen, p) && p.protocol == IPPROTO_UDP);
+	CHECK(p.src_port == 0 && p.dst_port == 0);
+
+	f.clear();
+	PutEthernet(f, vector<u_short>(), ETHER_IPV6);
+	PutIpv6(f, IPPROTO_DSTOPTS, 9 * 8 + 8);
+	for (int i = 0; i < 8; i++)
+	{
+		PutIpv6Ext(f, IPPROTO_DSTOPTS, 0);
+	}
+	PutIpv6Ext(f, IPPROTO_UDP, 0);
+	PutUdp(f, 5353, 53, 0);
+
+	g_caplen = f.size();
+	CHECK(!ParsePacket<DLT_EN10MB>(guard.Capture(f, g_caplen), g_caplen, p));
+}
+
+
+/** The ICMP type is parsed (ICMPv6 counting as ICMP) once its first byte is captured, and left 0 before **/
+static void TestIcmpType(GuardedFrame& guard)
+{
+	vector<u_char> f;
+	PutEthernet(f, vector<u_short>(), ETHER_IPV4);
+	PutIpv4(f, IPPROTO_ICMP, 8);
+	Put8(f, ICMP_ECHO_REQUEST);
+	PutZeros(f, 7);
+
+	for (g_caplen = SIZE_ETHERNET + 20; g_caplen <= f.size(); g_caplen++)
+	{
+		PacketInfo p;
+		CHECK(ParsePacket<DLT_EN10MB>(guard.Capture(f, g_caplen), g_caplen, p) && p.protocol == IPPROTO_ICMP);
+		CHECK(p.icmp_type == (g_caplen > SIZE_ETHERNET + 20 ? ICMP_ECHO_REQUEST : 0));
+		CHECK(p.src_port == 0 && p.dst_port == 0);
+	}
+
+	f.clear();
+	PutEthernet(f, vector<u_short>(), ETHER_IPV6);
+	PutIpv6(f, IPPROTO_ICMPV6, 8);
+	Put8(f, ICMPV6_ECHO_REQUEST);
+	PutZeros(f, 7);
+
+	PacketInfo p;
+	g_caplen = f.size();
+	CHECK(ParsePacket<DLT_EN10MB>(guard.Capture(f, g_caplen), g_caplen, p) && p.protocol == IPPROTO_ICMP && p.ipv6);
+	CHECK(p.icmp_type == ICMPV6_ECHO_REQUEST);
+}
+
+
+/** Parses every truncation of IPv4/UDP behind the link layer header LINK **/
+template <int DLT>
+static void TestLinkTruncated(GuardedFrame& guard, const vector<u_char>& link)
+{
+	vector<u_char> f = link;
+	PutIpv4(f, IPPROTO_UDP, 8 + 4);
+	PutUdp(f, 5353, 53, 4);
+	PutZeros(f, 4);
+
+	for (g_caplen = 0; g_caplen <= f.size(); g_caplen++)
+	{
+		PacketInfo p;
+		bool parsed = ParsePacket<DLT>(guard.Capture(f, g_caplen), g_caplen, p);
+
+		CHECK(parsed == (g_caplen >= link.size() + 20));
+		CHECK(!parsed || p.dst_port == (g_caplen >= link.size() + 28 ? 53 : 0));
+	}
+}
+
+
+int main()
+{
+	GuardedFrame guard;
+
+	TestVlanTruncated(guard);
+	TestQinqTags(guard);
+	TestIpv6ExtTruncated(guard);
+	TestIpv6ExtLimits(guard);
+	TestIcmpType(guard);
+
+	vector<u_char> sll(SIZE_LINUX_SLL - 2, 0);
+	Put16(sll, ETHER_IPV4);
+	TestLinkTruncated<DLT_LINUX_SLL>(guard, sll);
+
+	TestLinkTruncated<DLT_RAW>(guard, vector<u_char>());
+
+	vector<u_char> null(SIZE_NULL, 0);
+	null[0] = AF_INET;	// (host byte order, little endian)
+	TestLinkTruncated<DLT_NULL>(guard, null);
+
+	if (g_failures > 0)
+	{
+		cout << g_failures << " packet parser checks FAILED\n";
+		return 1;
+	}
+
+	cout << "All packet parser checks passed\n";
+	return 0;
+}
@@ -0,0 +1,119 @@
+#include "arena.h"
+#include "large_pages.h"
+
+#include <stdlib.h>
+#include <new>
+
+
+#define MIN_OVERDRAFT_CHUNK 4096	// size of the chunks allocated past the budget (for the few fixed size allocations allowed there)
+
+
+/** Chunks come from AllocateLarge(), so once the arena has grown to huge pages they back it (if enabled).
+
+	@param size Size in bytes of the chunk to request
+	*/
+void Arena::AddChunk(size_t size)
+{
+	Chunk chunk;
+	chunk.base = (char*)AllocateLarge(size);
+	chunk.size = size;
+
+	m_chunks.push_back(chunk);
+	m_capacity += size;
+	m_mallocCalls++;
+}
+
+
+/** Called by Allocate() when the current chunk does not have room for the request. Moves on to
+	the next chunk kept from a previous timeslice if there is one, otherwise allocates a new chunk
+	at least twice the size of the last one so the number of chunks grows logarithmically. With a
+	budget set, the new chunk is shrunk so the arena's capacity does not exceed the budget.
+
+	@param size Size in bytes of the allocation that did not fit
+	@param align Required alignment of that allocation
+	*/
+void Arena::Grow(size_t size, size_t align)
+{
+	size_t needed = size + align;
+
+	// skip over any spare chunks that are too small for this request
+	while (m_chunkIdx + 1 < m_chunks.size())
+	{
+		m_chunkIdx++;
+		if (m_chunks[m_chunkIdx].size >= needed)
+		{
+			m_cur = m_chunks[m_chunkIdx].base;
+			m_end = m_cur + m_chunks[m_chunkIdx].size;
+			return;
+		}
+	}
+
+	size_t chunkSize = m_chunks.empty() ? needed : m_chunks.back().size * 2;
+	if (m_budget != 0 && m_capacity + chunkSize > m_budget)
+	{
+		chunkSize = (m_capacity < m_budget) ? m_budget - m_capacity : MIN_OVERDRAFT_CHUNK;
+	}
+	if (chunkSize < needed)
+	{
+		chunkSize = needed;
+	}
+
+	AddChunk(chunkSize);
+	m_chunkIdx = m_chunks.size() - 1;
+	m_cur = m_chunks[m_chunkIdx].base;
+	m_end = m_cur + m_chunks[m_chunkIdx].size;
+}
+
+
+/** Initializes the arena with a single chunk.
+
+	@param initialSize Size in bytes of the first chunk
+	*/
+Arena::Arena(size_t initialSize)
+{
+	m_capacity = 0;
+	m_mallocCalls = 0;
+	m_bytesUsed = 0;
+	m_budget = 0;
+
+	AddChunk(initialSize);
+	m_chunkIdx = 0;
+	m_cur = m_chunks[0].base;
+	m_end = m_cur + m_chunks[0].size;
+}
+
+
+Arena::~Arena()
+{
+	for (unsigned int i = 0; i < m_chunks.size(); i++)
+	{
+		FreeLarge(m_chunks[i].base, m_chunks[i].size);
+	}
+}
+
+
+/** Releases everything allocated since the last call to Reset(). If the timeslice needed more
+	than one chunk, all chunks are replaced by a single chunk as large as their combined size, so
+	the next slice of similar volume fits in one chunk without touching malloc again.
+	*/
+void Arena::Reset()
+{
+	if (m_chunks.size() > 1)
+	{
+		size_t total = m_capacity;
+
+		for (unsigned int i = 0; i < m_chunks.size(); i++)
+		{
+			FreeLarge(m_chunks[i].base, m_chunks[i].size);
+		}
+		m_chunks.clear();
+		m_capacity = 0;
+
+		AddChunk(total);
+	}
+
+	m_chunkIdx = 0;
+	m_cur = m_chunks[0].base;
+	m_end = m_cur + m_chunks[0].size;
+	m_bytesUsed = 0;
+}
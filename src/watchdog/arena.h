@@ -0,0 +1,160 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+
+/** @brief Bump-pointer allocator backing all per-timeslice analyzer state
+
+	Memory is handed out by advancing a pointer through a list of large chunks, and individual
+	deallocations are ignored. Everything allocated during a timeslice is released at once by
+	calling Reset() at the end of the slice. Reset() keeps the chunks for the next slice (coalescing
+	them into one chunk if the slice outgrew the first), so once the arena has grown to fit the
+	busiest slice no further calls to malloc are made.
+
+	An optional budget (SetBudget()) caps how large the arena grows: chunks are sized so that the
+	total stays within the budget, and OverBudget() tells users when to stop allocating and fall back
+	to fixed size state instead.
+	*/
+class Arena
+{
+
+private:
+
+	/** @brief A single block of memory obtained from malloc (or huge pages, see AllocateLarge()) */
+	struct Chunk
+	{
+		/** Start of the chunk */
+		char* base;
+
+		/** Size of the chunk in bytes */
+		size_t size;
+	};
+
+	/** All chunks owned by the arena, in the order they are used */
+	vector<Chunk> m_chunks;
+
+	/** Index of the chunk currently being allocated from */
+	size_t m_chunkIdx;
+
+	/** Next free byte within the current chunk */
+	char* m_cur;
+
+	/** One past the last byte of the current chunk */
+	char* m_end;
+
+	/** Number of bytes handed out since the last call to Reset() */
+	size_t m_bytesUsed;
+
+	/** Total size of all chunks in bytes */
+	size_t m_capacity;
+
+	/** Number of chunks requested from malloc over the lifetime of the arena */
+	unsigned long long m_mallocCalls;
+
+	/** Memory budget in bytes (0 = unlimited), see SetBudget() */
+	size_t m_budget;
+
+	/** @brief Moves to the next chunk (allocating one if needed) with room for size bytes */
+	void Grow(size_t size, size_t align);
+
+	/** @brief Allocates a new chunk of at least size bytes and appends it to m_chunks */
+	void AddChunk(size_t size);
+
+	Arena(const Arena&);
+	Arena& operator=(const Arena&);
+
+
+public:
+
+	/** @brief Constructor */
+	explicit Arena(size_t initialSize = 64 * 1024);
+
+	/** @brief Destructor, frees all chunks */
+	~Arena();
+
+	/** @brief Returns size bytes of memory aligned to align */
+	void* Allocate(size_t size, size_t align)
+	{
+		char* p = (char*)(((uintptr_t)m_cur + (align - 1)) & ~(uintptr_t)(align - 1));
+		if (p + size > m_end)
+		{
+			Grow(size, align);
+			p = (char*)(((uintptr_t)m_cur + (align - 1)) & ~(uintptr_t)(align - 1));
+		}
+		m_cur = p + size;
+		m_bytesUsed += size;
+		return p;
+	}
+
+	/** @brief Releases everything allocated since the last Reset() */
+	void Reset();
+
+	/** @brief Returns the number of bytes handed out since the last Reset() */
+	size_t BytesUsed() const { return m_bytesUsed; }
+
+	/** @brief Returns the total size of all chunks owned by the arena */
+	size_t Capacity() const { return m_capacity; }
+
+	/** @brief Returns the number of chunks requested from malloc so far */
+	unsigned long long MallocCalls() const { return m_mallocCalls; }
+
+	/** @brief Sets the memory budget in bytes (0 = unlimited) */
+	void SetBudget(size_t budget) { m_budget = budget; }
+
+	/** @brief Returns TRUE once the bytes handed out since the last Reset() have reached the budget */
+	bool OverBudget() const { return m_budget != 0 && m_bytesUsed >= m_budget; }
+
+};
+
+
+/** @brief STL allocator adapter so standard containers can allocate from an Arena
+
+	deallocate() is a no-op: memory is only reclaimed when the underlying arena is Reset(), so
+	containers using this allocator must be cleared before the arena is.
+	*/
+template <class T>
+class ArenaAllocator
+{
+
+public:
+
+	typedef T value_type;
+
+	/** The arena that memory is taken from */
+	Arena* m_arena;
+
+	/** @brief Constructor */
+	explicit ArenaAllocator(Arena& arena) : m_arena(&arena) {}
+
+	/** @brief Rebinding constructor (required by node based containers) */
+	template <class U>
+	ArenaAllocator(const ArenaAllocator<U>& other) : m_arena(other.m_arena) {}
+
+	/** @brief Allocates room for n objects of type T */
+	T* allocate(size_t n)
+	{
+		return (T*)m_arena->Allocate(n * sizeof(T), alignof(T));
+	}
+
+	/** @brief No-op, memory is released by Arena::Reset() */
+	void deallocate(T*, size_t) {}
+};
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs)
+{
+	return lhs.m_arena == rhs.m_arena;
+}
+
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs)
+{
+	return lhs.m_arena != rhs.m_arena;
+}
+
+#endif
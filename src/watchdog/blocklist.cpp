@@ -0,0 +1,355 @@
+#include "blocklist.h"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+
+#define BLOCKLIST_VERSION 1
+#define BLOOM_BITS_PER_KEY 10		// bloom filter size (4 bits set per key, ~1% false positives)
+#define RANGE_INDEX_SIZE 65537		// one entry per /16, plus one
+
+
+
+/** @param offset A file offset
+
+	@return offset rounded up to the next multiple of 64 (the start of the next section)
+	*/
+static size_t Align(size_t offset)
+{
+	return (offset + 63) & ~(size_t)63;
+}
+
+
+/** @param[in] text An IPv4 address with an optional prefix length (e.g. "10.0.0.0/8")
+	@param[out] addr The network address (host byte order, host bits cleared)
+	@param[out] len The prefix length (32 if none was given)
+
+	@return TRUE if text is valid and FALSE otherwise
+	*/
+bool ParseCidr(const string& text, uint32_t& addr, int& len)
+{
+	size_t slash = text.find('/');
+	in_addr in;
+
+	if (inet_pton(AF_INET, text.substr(0, slash).c_str(), &in) != 1)
+	{
+		return false;
+	}
+
+	len = 32;
+	if (slash != string::npos)
+	{
+		string lenText = text.substr(slash + 1);
+		if (lenText.empty() || lenText.find_first_not_of("0123456789") != string::npos || lenText.length() > 2)
+		{
+			return false;
+		}
+		len = atoi(lenText.c_str());
+		if (len > 32)
+		{
+			return false;
+		}
+	}
+
+	uint32_t mask = (len == 0) ? 0 : 0xffffffff << (32 - len);
+	addr = ntohl(in.s_addr) & mask;
+	return true;
+}
+
+
+/** @param block A bloom filter block
+	@param hash The key's hash (4 bit positions of 9 bits each)
+	*/
+static void BloomSet(uint64_t* block, uint64_t hash)
+{
+	for (int i = 0; i < 4; i++, hash >>= 9)
+	{
+		block[(hash >> 6) & 7] |= (uint64_t)1 << (hash & 63);
+	}
+}
+
+
+/** @param addr Address to look up (host byte order)
+
+	@return TRUE if addr is one of the exact addresses or within one of the ranges
+	*/
+bool Blocklist::Lookup(uint32_t addr) const
+{
+	if (binary_search(m_ips, m_ips + m_header->numIps, addr))
+	{
+		return true;
+	}
+
+	// the only ranges that can hold addr are those ending in its /16 and the first one ending after it
+	uint32_t h = addr >> 16;
+	uint32_t lo = m_rangeIndex[h];
+	uint32_t hi = min(m_rangeIndex[h + 1] + 1, m_header->numRanges);
+
+	// find the first range ending at or after addr
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (m_ranges[mid * 2 + 1] < addr)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	return lo < m_header->numRanges && m_ranges[lo * 2] <= addr && addr <= m_ranges[lo * 2 + 1];
+}
+
+
+Blocklist::Blocklist()
+{
+	m_map = NULL;
+	m_mapSize = 0;
+	m_header = NULL;
+	m_bloom = NULL;
+	m_ips = NULL;
+	m_rangeIndex = NULL;
+	m_ranges = NULL;
+	m_bloomMask = 0;
+}
+
+
+Blocklist::~Blocklist()
+{
+	if (m_map != NULL)
+	{
+		munmap(m_map, m_mapSize);
+	}
+}
+
+
+/** Maps the index file read only. The file is only checked for consistency (not read), so loading
+	takes the same time no matter how large the list is; pages are faulted in as lookups touch them.
+
+	@param filename Name of an index file created by Build()
+
+	@return TRUE if the index was mapped and FALSE otherwise (error printed to console)
+	*/
+bool Blocklist::Load(const string& filename)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1)
+	{
+		cout << "Error: couldn't open blocklist " << filename << endl;
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(BlocklistHeader))
+	{
+		cout << "Error: invalid blocklist " << filename << endl;
+		close(fd);
+		return false;
+	}
+
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		cout << "Error: couldn't map blocklist " << filename << endl;
+		return false;
+	}
+
+	// locate the sections and make sure the file is large enough to hold them
+	const BlocklistHeader* header = (const BlocklistHeader*)map;
+	size_t bloomOffset = Align(sizeof(BlocklistHeader));
+	size_t ipsOffset = Align(bloomOffset + (size_t)header->numBloomBlocks * 64);
+	size_t indexOffset = Align(ipsOffset + (size_t)header->numIps * 4);
+	size_t rangesOffset = Align(indexOffset + RANGE_INDEX_SIZE * 4);
+	size_t end = rangesOffset + (size_t)header->numRanges * 8;
+
+	if (memcmp(header->magic, "IPBL", 4) != 0 || header->version != BLOCKLIST_VERSION ||
+		header->numBloomBlocks == 0 || (header->numBloomBlocks & (header->numBloomBlocks - 1)) != 0 ||
+		end != (size_t)st.st_size)
+	{
+		cout << "Error: invalid blocklist " << filename << endl;
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	if (m_map != NULL)
+	{
+		munmap(m_map, m_mapSize);
+	}
+
+	m_map = map;
+	m_mapSize = st.st_size;
+	m_header = header;
+	m_bloom = (const uint64_t*)((const char*)map + bloomOffset);
+	m_ips = (const uint32_t*)((const char*)map + ipsOffset);
+	m_rangeIndex = (const uint32_t*)((const char*)map + indexOffset);
+	m_ranges = (const uint32_t*)((const char*)map + rangesOffset);
+	m_bloomMask = header->numBloomBlocks - 1;
+
+	return true;
+}
+
+
+/** Builds an index from a text list with one IPv4 address or CIDR prefix per line (e.g. "192.0.2.1"
+	or "198.51.100.0/24"). Blank lines and lines starting with '#' are ignored. Overlapping and adjacent
+	prefixes are merged. The index is written to a temporary file that is then renamed to indexfile,
+	so a watchdog reloading it never sees a partially written index.
+
+	@param listfile Name of the text list
+	@param indexfile Name of the index file to write
+
+	@return TRUE if the index was written and FALSE otherwise (error printed to console)
+	*/
+bool Blocklist::Build(const string& listfile, const string& indexfile)
+{
+	ifstream in(listfile.c_str());
+	if (!in)
+	{
+		cout << "Error: couldn't open " << listfile << endl;
+		return false;
+	}
+
+	vector<uint32_t> ips;
+	vector<pair<uint32_t, uint32_t> > ranges;
+
+	string line;
+	int lineNum = 0;
+	while (getline(in, line))
+	{
+		lineNum++;
+
+		size_t start = line.find_first_not_of(" \t\r");
+		if (start == string::npos || line[start] == '#')
+		{
+			continue;
+		}
+		size_t end = line.find_last_not_of(" \t\r");
+
+		uint32_t addr;
+		int len;
+		if (!ParseCidr(line.substr(start, end - start + 1), addr, len))
+		{
+			cout << "Error: invalid address on line " << lineNum << " of " << listfile << endl;
+			return false;
+		}
+
+		if (len == 32)
+		{
+			ips.push_back(addr);
+		}
+		else
+		{
+			ranges.push_back(make_pair(addr, addr | (0xffffffff >> len)));
+		}
+	}
+
+	sort(ips.begin(), ips.end());
+	ips.erase(unique(ips.begin(), ips.end()), ips.end());
+
+	// merge overlapping and adjacent ranges
+	sort(ranges.begin(), ranges.end());
+	vector<uint32_t> merged; // start, end pairs
+	for (size_t i = 0; i < ranges.size(); i++)
+	{
+		size_t n = merged.size();
+		if (n > 0 && (merged[n - 1] == 0xffffffff || ranges[i].first <= merged[n - 1] + 1))
+		{
+			merged[n - 1] = max(merged[n - 1], ranges[i].second);
+		}
+		else
+		{
+			merged.push_back(ranges[i].first);
+			merged.push_back(ranges[i].second);
+		}
+	}
+	uint32_t numRanges = merged.size() / 2;
+
+	// rangeIndex[h] = first range ending at or after the start of /16 h
+	vector<uint32_t> rangeIndex(RANGE_INDEX_SIZE);
+	uint32_t r = 0;
+	for (uint32_t h = 0; h < RANGE_INDEX_SIZE; h++)
+	{
+		while (h < 65536 && r < numRanges && merged[r * 2 + 1] < (h << 16))
+		{
+			r++;
+		}
+		rangeIndex[h] = (h < 65536) ? r : numRanges;
+	}
+
+	// bloom filter over the exact addresses and the /16s touched by every range
+	size_t numKeys = ips.size();
+	for (uint32_t i = 0; i < numRanges; i++)
+	{
+		numKeys += (merged[i * 2 + 1] >> 16) - (merged[i * 2] >> 16) + 1;
+	}
+
+	uint32_t numBlocks = 1;
+	while ((size_t)numBlocks * 512 < numKeys * BLOOM_BITS_PER_KEY)
+	{
+		numBlocks <<= 1;
+	}
+	vector<uint64_t> bloom((size_t)numBlocks * 8, 0);
+
+	for (size_t i = 0; i < ips.size(); i++)
+	{
+		BloomSet(&bloom[(Hash(ips[i] >> 16) & (numBlocks - 1)) * 8], Hash(ips[i]) >> 16);
+	}
+	for (uint32_t i = 0; i < numRanges; i++)
+	{
+		for (uint32_t h = merged[i * 2] >> 16; h <= merged[i * 2 + 1] >> 16; h++)
+		{
+			BloomSet(&bloom[(Hash(h) & (numBlocks - 1)) * 8], Hash((uint64_t)1 << 32 | h) >> 16);
+		}
+	}
+
+	// write the index
+	BlocklistHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "IPBL", 4);
+	header.version = BLOCKLIST_VERSION;
+	header.numIps = ips.size();
+	header.numRanges = numRanges;
+	header.numBloomBlocks = numBlocks;
+
+	string tmpfile = indexfile + ".tmp";
+	ofstream out(tmpfile.c_str(), ios::binary | ios::trunc);
+
+	const char padding[64] = {0};
+	size_t offset = 0;
+	struct Section { const void* data; size_t size; } sections[] = {
+		{ &header, sizeof(header) },
+		{ bloom.data(), bloom.size() * 8 },
+		{ ips.data(), ips.size() * 4 },
+		{ rangeIndex.data(), rangeIndex.size() * 4 },
+		{ merged.data(), merged.size() * 4 } };
+
+	for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]); i++)
+	{
+		out.write(padding, Align(offset) - offset);
+		out.write((const char*)sections[i].data, sections[i].size);
+		offset = Align(offset) + sections[i].size;
+	}
+	out.close();
+
+	if (!out || rename(tmpfile.c_str(), indexfile.c_str()) == -1)
+	{
+		cout << "Error: couldn't write " << indexfile << endl;
+		unlink(tmpfile.c_str());
+		return false;
+	}
+
+	cout << "Wrote " << indexfile << ": " << ips.size() << " addresses, " << numRanges << " ranges\n";
+	return true;
+}
@@ -0,0 +1,147 @@
+#ifndef BLOCKLIST_H
+#define BLOCKLIST_H
+
+#include <string>
+#include <stdint.h>
+
+using namespace std;
+
+
+/** @brief Parses an IPv4 address with an optional prefix length (e.g. "10.0.0.0/8") */
+bool ParseCidr(const string& text, uint32_t& addr, int& len);
+
+
+/** @brief Header of a binary blocklist index file (see Blocklist::Build())
+
+	The header is followed by (in native byte order, each section 64-byte aligned):
+	- bloom: numBloomBlocks blocks of 512 bits (one cache line each)
+	- ips: numIps exact addresses, sorted
+	- rangeIndex: 65537 entries, rangeIndex[h] is the first range whose end is in /16 h or later
+	- ranges: numRanges disjoint [start, end] address ranges (the merged CIDRs), sorted
+	*/
+struct BlocklistHeader
+{
+	/** "IPBL" */
+	char magic[4];
+
+	/** BLOCKLIST_VERSION */
+	uint32_t version;
+
+	/** Number of exact addresses */
+	uint32_t numIps;
+
+	/** Number of address ranges */
+	uint32_t numRanges;
+
+	/** Number of 512-bit bloom filter blocks (a power of two) */
+	uint32_t numBloomBlocks;
+
+	/** Unused (0) */
+	uint32_t reserved;
+};
+
+
+/** @brief Set of known-bad IPv4 addresses and CIDR prefixes, memory mapped from a prebuilt index
+
+	The index is built offline from a text list (see Build()) so that Load() only has to map the file:
+	a list of hundreds of thousands of entries is usable immediately and its pages are shared with any
+	other watchdog using the same file.
+
+	Exact addresses are kept in a sorted array (binary search) and CIDR prefixes are merged into
+	disjoint ranges, found through a /16 index. Most addresses are in neither, so Contains() first checks
+	a blocked bloom filter: the block (one cache line) is chosen by the address's /16, and holds both
+	the address itself and the /16s of all prefixes. A miss therefore costs a single cache line.
+	*/
+class Blocklist
+{
+
+private:
+
+	/** The mapped index file (NULL if none loaded) */
+	void* m_map;
+
+	/** Size of the mapping in bytes */
+	size_t m_mapSize;
+
+	/** Pointers to the sections of the mapped file */
+	const BlocklistHeader* m_header;
+	const uint64_t* m_bloom;
+	const uint32_t* m_ips;
+	const uint32_t* m_rangeIndex;
+	const uint32_t* m_ranges;
+
+	/** numBloomBlocks - 1 */
+	uint32_t m_bloomMask;
+
+
+	Blocklist(const Blocklist&);
+	Blocklist& operator=(const Blocklist&);
+
+	/** @brief Returns TRUE if addr is in the exact set or in a prefix (no bloom check) */
+	bool Lookup(uint32_t addr) const;
+
+
+public:
+
+	/** @brief Mixes a 64-bit key (used for bloom filter block and bit selection) */
+	static uint64_t Hash(uint64_t key)
+	{
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33;
+		key *= 0xc4ceb9fe1a85ec53ULL;
+		key ^= key >> 33;
+		return key;
+	}
+
+	/** @brief Returns TRUE if all bits of a key are set in a bloom block (4 bits, 9 bits of hash each) */
+	static bool BloomTest(const uint64_t* block, uint64_t hash)
+	{
+		for (int i = 0; i < 4; i++, hash >>= 9)
+		{
+			if (!((block[(hash >> 6) & 7] >> (hash & 63)) & 1))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/** @brief Constructor (empty blocklist) */
+	Blocklist();
+
+	/** @brief Destructor, unmaps the index */
+	~Blocklist();
+
+	/** @brief Maps a prebuilt index file, returning FALSE on error */
+	bool Load(const string& filename);
+
+	/** @brief Builds an index file from a text list of addresses and CIDR prefixes, returning FALSE on error */
+	static bool Build(const string& listfile, const string& indexfile);
+
+	/** @brief Returns TRUE if addr (host byte order) is blocklisted */
+	bool Contains(uint32_t addr) const
+	{
+		if (m_map == NULL)
+		{
+			return false;
+		}
+
+		const uint64_t* block = m_bloom + (Hash(addr >> 16) & m_bloomMask) * 8;
+		if (!BloomTest(block, Hash(addr) >> 16) && !BloomTest(block, Hash((uint64_t)1 << 32 | addr >> 16) >> 16))
+		{
+			return false;
+		}
+
+		return Lookup(addr);
+	}
+
+	/** @brief Returns the number of exact addresses */
+	uint32_t NumIps() const { return m_map ? m_header->numIps : 0; }
+
+	/** @brief Returns the number of (merged) prefix ranges */
+	uint32_t NumRanges() const { return m_map ? m_header->numRanges : 0; }
+
+};
+
+#endif
@@ -0,0 +1,655 @@
+#include "capture_shard.h"
+#include "packet_parser.h"
+#include "cpu_affinity.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <string.h>
+#include <math.h>
+
+
+#define IP_FILTER "((ip and (tcp or udp or icmp)) or ip6)"	// default BPF filter (the traffic ParseIp() can analyze)
+#define ETHERNET_FILTER IP_FILTER " or (vlan and (" IP_FILTER " or (vlan and " IP_FILTER ")))"	// ...on ethernet, also with VLAN tags
+#define MAX_IDLE_REPORTS 60		// max empty reports generated for a gap between packets in a pcap file
+#define MAX_SAMPLE_RATE 1024	// max N when shedding load by analyzing only 1 in N flows
+#define BACKLOG_HIGH 50000		// packets waiting in the capture buffer at a slice boundary that trigger sampling
+#define BACKLOG_LOW 5000		// backlog below which (with no drops) a slice counts as calm
+#define CALM_SLICES 10			// consecutive calm slices before the sample rate is halved again
+
+
+
+/** @param msg The message to be written to m_logfile and console
+	*/
+void CaptureShard::LogMessage(const string& msg) const
+{
+	fstream fs;
+	fs.open(m_logfile, fstream::out | fstream::app);
+	fs << msg << endl;
+	fs.close();
+
+	cout << msg << endl;
+}
+
+
+/** Frames are parsed by link type (VLAN tagged ethernet, Linux cooked, raw IP or loopback). The capture
+	is closed by the destructor, whether or not this succeeds.
+
+	@param pHandle The opened capture
+	@param name Name of the interface or pcap file (for error messages)
+	@param filter BPF filter ("" for all TCP/UDP/ICMP traffic over IPv4/IPv6). On a live interface the
+		   filter runs in the kernel, so frames it rejects are never copied to user space.
+
+	@return TRUE if the link type is supported and the filter was installed, FALSE otherwise (error printed to console)
+	*/
+bool CaptureShard::Prepare(pcap_t* pHandle, const string& name, const string& filter)
+{
+	m_handles.push_back(pHandle);
+	int datalink = pcap_datalink(pHandle);
+
+	pcap_handler parser = SelectParser(datalink);
+	if (parser == NULL)
+	{
+		cout << "Error: unsupported link type " << datalink << " on " << name << endl;
+		return false;
+	}
+	m_parsers.push_back(parser);
+
+	string program = filter;
+	if (program == "")
+	{
+		program = (datalink == DLT_EN10MB) ? ETHERNET_FILTER : IP_FILTER;
+	}
+
+	bpf_program bpf;
+	if (pcap_compile(pHandle, &bpf, program.c_str(), 1, PCAP_NETMASK_UNKNOWN) == -1)
+	{
+		cout << "Couldn't parse filter '" << program << "': " << pcap_geterr(pHandle) << endl;
+		return false;
+	}
+
+	int result = pcap_setfilter(pHandle, &bpf);
+	pcap_freecode(&bpf);
+
+	if (result == -1)
+	{
+		cout << "Couldn't install filter '" << program << "': " << pcap_geterr(pHandle) << endl;
+		return false;
+	}
+
+	return true;
+}
+
+
+/** Only builds the snapshot (copying the analyzer's state); the Checkpointer writes it to disk.
+
+	@param slice The slice just reported
+	*/
+void CaptureShard::Checkpoint(long long slice)
+{
+	SnapshotWriter snapshot(m_sliceClock.SliceUsecs(), slice);
+	m_analyzer.SaveState(snapshot);
+	m_pCheckpointer->Save(snapshot);
+
+	m_lastCheckpoint = slice;
+}
+
+
+/** Also queues a flight recorder dump of the slices leading up to slice if the report is an alert, and
+	a snapshot of the analyzer's state if one is due.
+
+	@param slice The slice being reported
+	*/
+void CaptureShard::ReportSlice(long long slice)
+{
+	ShardReport report;
+	report.text = m_analyzer.GenerateReport();
+	report.alert = m_analyzer.LastReportAlerted();
+	report.alertKey = m_analyzer.LastAlertKey();
+	report.details = m_analyzer.LastReportDetails();
+	m_analyzer.GetLastTotals(report.totals);
+	m_reports.push(report);
+
+	if (m_pRecorder && report.alert)
+	{
+		m_pRecorder->RequestDump(slice - m_recordSlices + 1, slice,
+									m_recordKeyOnly ? m_analyzer.AlertKeyFilter() : nullptr);
+	}
+
+	if (m_pCheckpointer && slice >= m_lastCheckpoint + m_checkpointSlices)
+	{
+		Checkpoint(slice);
+	}
+}
+
+
+/** Generates reports for every timeslice before slice that hasn't been reported yet, then makes slice
+	the current timeslice. Idle slices in between get an (empty) report each so that every report
+	describes exactly one timeslice.
+
+	@param slice The slice that has started
+	*/
+void CaptureShard::CloseSlicesLocked(long long slice)
+{
+	if (m_currentSlice >= 0 && slice > m_currentSlice)
+	{
+		long long numReports = min(slice - m_currentSlice, (long long)MAX_IDLE_REPORTS);
+
+		for (long long i = 0; i < numReports; i++)
+		{
+			ReportSlice(m_currentSlice + i);
+		}
+	}
+
+	if (slice > m_currentSlice)
+	{
+		m_currentSlice = slice;
+	}
+}
+
+
+/** Packets are assigned to timeslices by their capture timestamp (not by when they are processed).
+	A packet belonging to a later slice means all earlier slices are complete, so they are reported first.
+
+	@param batch The parsed packets
+	*/
+void CaptureShard::AddBatch(const PacketBatch& batch)
+{
+	if (batch.count == 0)
+	{
+		return;
+	}
+
+	m_mtx.lock();
+	for (int i = 0; i < batch.count; i++)
+	{
+		CloseSlicesLocked(batch.slices[i]);
+		m_analyzer.AddPacket(batch.packets[i]);
+	}
+	m_mtx.unlock();
+}
+
+
+/** Parses a frame (pcap_dispatch() callback) into the next slot of the PacketBatch in args. Frames
+	are only valid until the callback returns, so the payload is copied into the batch if the batch
+	keeps payloads, and dropped otherwise. The frame is also recorded by the flight recorder (if any).
+	*/
+template <int DLT>
+void CaptureShard::ParseIntoBatch(u_char* args, const pcap_pkthdr* header, const u_char* packet)
+{
+	PacketBatch* pBatch = (PacketBatch*)args;
+	CaptureShard* pShard = pBatch->pShard;
+	pShard->m_packetsSeen.fetch_add(1, memory_order_relaxed);
+
+	PacketInfo& pktInfo = pBatch->packets[pBatch->count]; // We'll store all data we need about the packet in here
+	if (!ParsePacket<DLT>(packet, header->caplen, pktInfo))
+	{
+		return;
+	}
+
+	pktInfo.ts_usecs = (long long)header->ts.tv_sec * 1000000 + header->ts.tv_usec;
+	long long slice = pShard->m_sliceClock.SliceOf(header->ts);
+
+	if (pShard->m_pRecorder)
+	{
+		pShard->m_pRecorder->Record(header, packet, pktInfo, slice);
+	}
+
+	if (pktInfo.payload_len > 0)
+	{
+		if (pBatch->payloads.empty())
+		{
+			pktInfo.payload = NULL;
+			pktInfo.payload_len = 0;
+		}
+		else
+		{
+			u_char* slot = &pBatch->payloads[(size_t)pBatch->count * pBatch->slotSize];
+			pktInfo.payload_len = min((u_int)pktInfo.payload_len, pBatch->slotSize);
+			memcpy(slot, pktInfo.payload, pktInfo.payload_len);
+			pktInfo.payload = slot;
+		}
+	}
+
+	pBatch->slices[pBatch->count++] = slice;
+}
+
+
+/** @param datalink A link type (DLT_ value)
+
+	@return The pcap_dispatch() callback parsing frames of that link type, or NULL if it isn't supported
+	*/
+pcap_handler CaptureShard::SelectParser(int datalink)
+{
+	switch (datalink)
+	{
+		case DLT_EN10MB:
+			return ParseIntoBatch<DLT_EN10MB>;
+		case DLT_LINUX_SLL:
+			return ParseIntoBatch<DLT_LINUX_SLL>;
+		case DLT_RAW:
+			return ParseIntoBatch<DLT_RAW>;
+		case DLT_NULL:
+			return ParseIntoBatch<DLT_NULL>;
+		default:
+			return NULL;
+	}
+}
+
+
+/** Reads packets in batches of up to BATCH_SIZE, via pcap_dispatch() from a live interface or from the
+	merged pcap files, and adds each batch to the analyzer under a single lock. When the pcap files end,
+	their final (partial) timeslice is reported too. When a live capture ends (see Stop()) its partial
+	timeslice is dropped instead, so the final snapshot holds the baselines of the last complete slice
+	rather than of a fraction of one.
+	*/
+void CaptureShard::Capture()
+{
+	unique_ptr<PacketBatch> pBatch(new PacketBatch());
+	pBatch->pShard = this;
+	pBatch->slotSize = 0;
+	for (size_t i = 0; i < m_handles.size(); i++)
+	{
+		pBatch->slotSize = max(pBatch->slotSize, (u_int)min(pcap_snapshot(m_handles[i]), FULL_SNAPLEN));
+	}
+	if (m_needPayloads)
+	{
+		pBatch->payloads.resize((size_t)BATCH_SIZE * pBatch->slotSize);
+	}
+
+	if (m_live)
+	{
+		int result;
+		do
+		{
+			// returns 0 when the read timeout expires
+			pBatch->count = 0;
+			result = pcap_dispatch(m_handles[0], BATCH_SIZE, m_parsers[0], (u_char*)pBatch.get());
+			AddBatch(*pBatch);
+		}
+		while (result >= 0);
+
+		if (result == -1)
+		{
+			cout << "Error reading packets from " << m_name << ": " << pcap_geterr(m_handles[0]) << endl;
+		}
+	}
+	else
+	{
+		const pcap_pkthdr* header;
+		const u_char* frame;
+		size_t source;
+		bool more = true;
+
+		while (more)
+		{
+			pBatch->count = 0;
+			for (int i = 0; i < BATCH_SIZE; i++)
+			{
+				more = m_pMerger->Next(header, frame, source);
+				if (!more)
+				{
+					break;
+				}
+				m_parsers[source]((u_char*)pBatch.get(), header, frame);
+			}
+			AddBatch(*pBatch);
+		}
+	}
+
+	// report the final (partial) timeslice of a pcap file, and save the state at its end
+	m_mtx.lock();
+	if (m_currentSlice >= 0)
+	{
+		long long lastSlice = m_currentSlice;
+		if (m_live)
+		{
+			lastSlice--;
+		}
+		else
+		{
+			ReportSlice(m_currentSlice);
+		}
+
+		if (m_pCheckpointer && m_lastCheckpoint != lastSlice)
+		{
+			Checkpoint(lastSlice);
+		}
+	}
+	m_captureDone = true;
+	m_mtx.unlock();
+}
+
+
+/** @param name Name of the interface or pcap file to capture from
+	@param logfile Name of the file the shard's analyzer logs to
+	@param sliceClock Maps packet timestamps to timeslices
+	*/
+CaptureShard::CaptureShard(const string& name, const string& logfile, const SliceClock& sliceClock)
+	: m_sliceClock(sliceClock),
+	  m_analyzer(logfile),
+	  m_packetsSeen(0)
+{
+	m_name = name;
+	m_logfile = logfile;
+	m_live = false;
+	m_needPayloads = false;
+	m_recordSlices = 0;
+	m_recordKeyOnly = false;
+	m_checkpointSlices = 0;
+	m_lastCheckpoint = -1;
+	m_currentSlice = -1;
+	m_captureDone = false;
+	m_prevDrops = 0;
+	m_sampleRate = 1;
+	m_calmSlices = 0;
+}
+
+
+CaptureShard::~CaptureShard()
+{
+	if (m_thread.joinable())
+	{
+		m_thread.join();
+	}
+
+	// (the merger's readers must stop before the files are closed)
+	m_pMerger.reset();
+
+	for (size_t i = 0; i < m_handles.size(); i++)
+	{
+		pcap_close(m_handles[i]);
+	}
+}
+
+
+/** Opens the interface for live capture of the first snaplen bytes of each frame. In immediate mode
+	packets are delivered as soon as they arrive rather than when the buffer fills or the read timeout
+	expires.
+
+	@param snaplen Bytes to capture per frame
+	@param bufferMB Kernel capture buffer size in MB
+	@param immediate TRUE for immediate mode
+	@param filter BPF filter ("" for the default)
+
+	@return TRUE if the capture was opened and FALSE otherwise (error printed to console)
+	*/
+bool CaptureShard::OpenLive(int snaplen, int bufferMB, bool immediate, const string& filter)
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+
+	pcap_t* pHandle = pcap_create(m_name.c_str(), errbuf);
+	if (pHandle == NULL)
+	{
+		cout << "Couldn't open device " << errbuf << endl;
+		return false;
+	}
+
+	pcap_set_snaplen(pHandle, snaplen);
+	pcap_set_promisc(pHandle, 1);
+	pcap_set_timeout(pHandle, 1000);
+	pcap_set_buffer_size(pHandle, bufferMB * 1024 * 1024);
+	pcap_set_immediate_mode(pHandle, immediate ? 1 : 0);
+
+	int status = pcap_activate(pHandle);
+	if (status < 0)
+	{
+		cout << "Couldn't activate device " << m_name << ": " << pcap_statustostr(status) << " " << pcap_geterr(pHandle) << endl;
+		pcap_close(pHandle);
+		return false;
+	}
+
+	m_live = true;
+	return Prepare(pHandle, m_name, filter);
+}
+
+
+/** The files may have different link types. Each is read ahead by its own thread from here on.
+
+	@param files Names of the pcap files
+	@param filter BPF filter ("" for the default)
+
+	@return TRUE if every file was opened and FALSE otherwise (error printed to console)
+	*/
+bool CaptureShard::OpenOffline(const vector<string>& files, const string& filter)
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		pcap_t* pHandle = pcap_open_offline(files[i].c_str(), errbuf);
+		if (pHandle == NULL)
+		{
+			cout << "Couldn't open pcap file " << errbuf << endl;
+			return false;
+		}
+
+		if (!Prepare(pHandle, files[i], filter))
+		{
+			return false;
+		}
+	}
+
+	m_live = false;
+	m_pMerger.reset(new PcapMerger(m_handles, files));
+	return true;
+}
+
+
+/** The recorder's ring is allocated up front, so recording never allocates. Must be called after the
+	capture is opened and before Start().
+
+	@param memoryBytes Memory for the recorder's ring
+	@param seconds Time before (and including) an alert's slice to dump
+	@param full TRUE to record full packets rather than headers
+	@param keyOnly TRUE to only dump the packets of the key that triggered the alert
+	@param prefix Dump files are named <prefix>.<slice>.pcap
+
+	@return TRUE if recording, FALSE if the captures have different link types (error printed to console)
+	*/
+bool CaptureShard::EnableRecorder(size_t memoryBytes, double seconds, bool full, bool keyOnly, const string& prefix)
+{
+	// a pcap file holds frames of one link type only
+	int snaplen = 0;
+	for (size_t i = 0; i < m_handles.size(); i++)
+	{
+		if (pcap_datalink(m_handles[i]) != pcap_datalink(m_handles[0]))
+		{
+			cout << "Error: can't record packets of different link types into one pcap file\n";
+			return false;
+		}
+		snaplen = max(snaplen, min(pcap_snapshot(m_handles[i]), full ? FULL_SNAPLEN : HEADER_SNAPLEN));
+	}
+
+	m_pRecorder.reset(new FlightRecorder(memoryBytes, snaplen, pcap_datalink(m_handles[0]), prefix, m_logfile));
+
+	m_recordSlices = max(1LL, (long long)ceil(seconds * 1000000 / m_sliceClock.SliceUsecs()));
+	m_recordKeyOnly = keyOnly;
+	return true;
+}
+
+
+/** The snapshot is only used if it was taken with the same timeslice (totals of different slice lengths
+	can't be compared). Must be called after the analyzer is configured and before Start().
+
+	@param filename Name of the snapshot file (written to <filename>.tmp first, then renamed)
+	@param seconds Capture time between snapshots
+	*/
+void CaptureShard::EnableSnapshots(const string& filename, double seconds)
+{
+	SnapshotReader snapshot;
+	if (snapshot.Open(filename))
+	{
+		ostringstream oss;
+		if (snapshot.Header().sliceUsecs != m_sliceClock.SliceUsecs())
+		{
+			oss << "Ignoring snapshot " << filename << " (taken with a different timeslice)";
+		}
+		else if (m_analyzer.LoadState(snapshot))
+		{
+			oss << "Resumed from snapshot " << filename << " (slice " << snapshot.Header().slice << ")";
+		}
+		else
+		{
+			oss << "Ignoring snapshot " << filename;
+		}
+		LogMessage(oss.str());
+	}
+
+	m_pCheckpointer.reset(new Checkpointer(filename));
+	m_checkpointSlices = max(1LL, (long long)ceil(seconds * 1000000 / m_sliceClock.SliceUsecs()));
+}
+
+
+/** The capture thread keeps running during the swap; it only waits for the pointer swap.
+
+	@param[in,out] blocklist The new blocklist, replaced by the previous one (to be released outside the lock)
+	*/
+void CaptureShard::SwapBlocklist(shared_ptr<const Blocklist>& blocklist)
+{
+	m_mtx.lock();
+	m_analyzer.SwapBlocklist(blocklist);
+	m_mtx.unlock();
+}
+
+
+/** @param cpu CPU to pin the capture thread to (-1 = not pinned)
+	@param needPayloads TRUE if payloads must be passed to the analyzer (signature matching)
+	*/
+void CaptureShard::Start(int cpu, bool needPayloads)
+{
+	m_needPayloads = needPayloads;
+	m_thread = thread(&CaptureShard::Capture, this);
+
+	if (cpu >= 0)
+	{
+		SetThreadAffinity(m_thread, vector<int>(1, cpu));
+	}
+}
+
+
+/** Breaks out of pcap_dispatch(), after which the capture thread saves a snapshot of the last complete
+	slice (see Capture()). Safe to call from another thread; pcap files are always replayed to their end.
+	*/
+void CaptureShard::Stop()
+{
+	if (m_live)
+	{
+		pcap_breakloop(m_handles[0]);
+	}
+}
+
+
+/** These threads only write files (dumps and snapshots), so they can be kept off the capture CPUs.
+
+	@param cpus The CPUs they may run on
+
+	@return TRUE if the affinity was set
+	*/
+bool CaptureShard::SetLoggingAffinity(const vector<int>& cpus)
+{
+	if (m_pRecorder && !m_pRecorder->SetAffinity(cpus))
+	{
+		return false;
+	}
+
+	if (m_pCheckpointer && !m_pCheckpointer->SetAffinity(cpus))
+	{
+		return false;
+	}
+
+	return true;
+}
+
+
+/** To be called at each slice boundary, so slices are reported even if no packet of a later slice arrives.
+	Once the capture has ended (e.g. the interface went down) no further slices are reported, as their
+	empty reports would pass for an interface without traffic.
+
+	@param slice The slice that has started
+	*/
+void CaptureShard::CloseSlices(long long slice)
+{
+	m_mtx.lock();
+	if (!m_captureDone)
+	{
+		CloseSlicesLocked(slice);
+	}
+	m_mtx.unlock();
+}
+
+
+/** @param[out] reports Queue the reports are appended to (oldest first)
+
+	@return TRUE if the capture has ended (all reports have then been taken)
+	*/
+bool CaptureShard::TakeReports(queue<ShardReport>& reports)
+{
+	m_mtx.lock();
+	while (!m_reports.empty())
+	{
+		reports.push(m_reports.front());
+		m_reports.pop();
+	}
+	bool done = m_captureDone;
+	m_mtx.unlock();
+
+	return done;
+}
+
+
+/** The load is judged by the packets the kernel dropped since the last call and by the backlog (packets
+	received by the kernel that haven't been parsed yet). Drops or a large backlog double the sample rate;
+	after CALM_SLICES quiet slices in a row it is halved again, so the rate only steps back down once the
+	capture thread is clearly keeping up. The new rate applies from the next slice on.
+	*/
+void CaptureShard::AdaptSampleRate()
+{
+	pcap_stat stats;
+	if (!m_live || pcap_stats(m_handles[0], &stats) == -1)
+	{
+		return;
+	}
+
+	u_int drops = stats.ps_drop - m_prevDrops;
+	m_prevDrops = stats.ps_drop;
+
+	u_int backlog = stats.ps_recv - m_packetsSeen.load(memory_order_relaxed);
+	if (backlog > 0x80000000) // (packets seen but not yet counted in ps_recv)
+	{
+		backlog = 0;
+	}
+
+	uint32_t rate = m_sampleRate;
+	if (drops > 0 || backlog > BACKLOG_HIGH)
+	{
+		rate = min(rate * 2, (uint32_t)MAX_SAMPLE_RATE);
+		m_calmSlices = 0;
+	}
+	else if (backlog < BACKLOG_LOW && rate > 1)
+	{
+		if (++m_calmSlices >= CALM_SLICES)
+		{
+			rate /= 2;
+			m_calmSlices = 0;
+		}
+	}
+	else
+	{
+		m_calmSlices = 0;
+	}
+
+	if (rate != m_sampleRate)
+	{
+		m_sampleRate = rate;
+
+		m_mtx.lock();
+		m_analyzer.SetSampleRate(rate);
+		m_mtx.unlock();
+
+		ostringstream oss;
+		oss << "Sampling 1 in " << rate << " flows on " << m_name << " (" << drops << " dropped, " << backlog << " queued)";
+		LogMessage(oss.str());
+	}
+}
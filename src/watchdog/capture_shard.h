@@ -0,0 +1,238 @@
+#ifndef CAPTURE_SHARD_H
+#define CAPTURE_SHARD_H
+
+#include "traffic_analyzer.h"
+#include "slice_clock.h"
+#include "flight_recorder.h"
+#include "pcap_merger.h"
+#include "snapshot.h"
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <pcap.h>
+
+using namespace std;
+
+
+#define HEADER_SNAPLEN 256		// default bytes captured per frame (QinQ, IPv6 with up to 134 bytes of extension headers, TCP with options)
+#define FULL_SNAPLEN 65535		// bytes captured per frame when matching signatures against payloads
+#define BATCH_SIZE 64			// max packets read per pcap_dispatch() call and added to the analyzer under one lock
+
+
+/** @brief A report generated by a CaptureShard, with the figures needed to combine it with other shards' */
+struct ShardReport
+{
+	/** The report as generated by the shard's analyzer */
+	string text;
+
+	/** TRUE if the report is an alert */
+	bool alert;
+
+	/** Metric totals */
+	vector<unsigned long long> totals;
+
+	/** Key that triggered the alert ("" if none) */
+	string alertKey;
+
+	/** Report tokens following the totals and key */
+	string details;
+};
+
+
+/** @brief Captures packets from one source (a live interface or a set of pcap files) into its own TrafficAnalyzer
+
+	Each shard has its own capture thread, analyzer, report queue and lock, so shards capturing from
+	different interfaces never contend with each other. The capture thread reads packets in batches (see
+	Capture()), assigns them to timeslices by their capture timestamp and closes a slice as soon as a
+	packet of a later slice arrives. The main thread closes slices without traffic (CloseSlices()) and
+	collects the reports (TakeReports()). Several pcap files are replayed as one stream in timestamp
+	order (see PcapMerger).
+
+	Analyzer configuration (GetAnalyzer()) must be done before Start().
+	*/
+class CaptureShard
+{
+
+private:
+
+	/** Packets parsed by one pcap_dispatch() call */
+	struct PacketBatch
+	{
+		/** The shard the packets are for */
+		CaptureShard* pShard;
+
+		/** Number of packets parsed so far */
+		int count;
+
+		PacketInfo packets[BATCH_SIZE];
+
+		/** Timeslice of each packet */
+		long long slices[BATCH_SIZE];
+
+		/** Max payload bytes kept per packet */
+		u_int slotSize;
+
+		/** Payload copies, slotSize bytes per packet (empty if payloads aren't needed) */
+		vector<u_char> payloads;
+	};
+
+	/** Name of the interface or pcap files */
+	string m_name;
+
+	/** The file this shard logs to */
+	string m_logfile;
+
+	/** The capture: the live interface, or each pcap file (empty until opened) */
+	vector<pcap_t*> m_handles;
+
+	/** TRUE if capturing from a live interface */
+	bool m_live;
+
+	/** Callback parsing the frames of each capture, for its link type */
+	vector<pcap_handler> m_parsers;
+
+	/** Merges the pcap files by timestamp (NULL for a live interface) */
+	unique_ptr<PcapMerger> m_pMerger;
+
+	/** Maps packet timestamps to timeslices */
+	SliceClock m_sliceClock;
+
+	/** The shard's analyzer */
+	WatchdogAnalyzer m_analyzer;
+
+	/** TRUE if payloads are passed to the analyzer (signature matching) */
+	bool m_needPayloads;
+
+	/** Keeps recent packets for dumping on alerts (NULL if not enabled) */
+	unique_ptr<FlightRecorder> m_pRecorder;
+
+	/** Number of slices dumped per alert (up to and including the alert's) */
+	long long m_recordSlices;
+
+	/** TRUE to dump only the packets of the key that triggered the alert */
+	bool m_recordKeyOnly;
+
+	/** Writes snapshots of the analyzer's state (NULL if not enabled) */
+	unique_ptr<Checkpointer> m_pCheckpointer;
+
+	/** Number of slices between snapshots */
+	long long m_checkpointSlices;
+
+	/** Slice of the last snapshot taken (-1 if none) */
+	long long m_lastCheckpoint;
+
+	/** Guards m_analyzer, m_currentSlice, m_reports and m_captureDone once started */
+	mutex m_mtx;
+
+	/** Index of the slice currently being accumulated (-1 before first packet) */
+	long long m_currentSlice;
+
+	/** Reports generated but not yet taken */
+	queue<ShardReport> m_reports;
+
+	/** TRUE once the capture has ended */
+	bool m_captureDone;
+
+	/** Packets handed to the parser so far (wraps like pcap_stat counters) */
+	atomic<u_int> m_packetsSeen;
+
+	/** pcap_stat drop count at the previous slice boundary */
+	u_int m_prevDrops;
+
+	/** Current load shedding sample rate (1 = every flow analyzed) */
+	uint32_t m_sampleRate;
+
+	/** Consecutive slices without drops or backlog */
+	int m_calmSlices;
+
+	/** The capture thread */
+	thread m_thread;
+
+
+	CaptureShard(const CaptureShard&);
+	CaptureShard& operator=(const CaptureShard&);
+
+	/** @brief Appends a message to m_logfile and console */
+	void LogMessage(const string& msg) const;
+
+	/** @brief Adds a capture with its parser and installs the filter, returning FALSE on error */
+	bool Prepare(pcap_t* pHandle, const string& name, const string& filter);
+
+	/** @brief Generates the report of a slice and queues it (m_mtx held) */
+	void ReportSlice(long long slice);
+
+	/** @brief Queues a snapshot of the analyzer's state as of the end of slice (m_mtx held) */
+	void Checkpoint(long long slice);
+
+	/** @brief Reports every slice before slice not yet reported (m_mtx held) */
+	void CloseSlicesLocked(long long slice);
+
+	/** @brief Adds a batch of parsed packets to the analyzer under one lock */
+	void AddBatch(const PacketBatch& batch);
+
+	/** @brief Capture thread, reads packets in batches until the capture ends */
+	void Capture();
+
+	/** @brief pcap_dispatch() callback parsing frames of link type DLT into a PacketBatch */
+	template <int DLT>
+	static void ParseIntoBatch(u_char* args, const pcap_pkthdr* header, const u_char* packet);
+
+	/** @brief Returns the callback parsing frames of a link type, or NULL if it isn't supported */
+	static pcap_handler SelectParser(int datalink);
+
+
+public:
+
+	/** @brief Constructor (nothing is opened yet) */
+	CaptureShard(const string& name, const string& logfile, const SliceClock& sliceClock);
+
+	/** @brief Destructor, waits for the capture thread and closes the capture */
+	~CaptureShard();
+
+	/** @brief Opens a live interface, returning FALSE on error */
+	bool OpenLive(int snaplen, int bufferMB, bool immediate, const string& filter);
+
+	/** @brief Opens pcap files to be replayed as one stream in timestamp order, returning FALSE on error */
+	bool OpenOffline(const vector<string>& files, const string& filter);
+
+	/** @brief Keeps recent packets in a flight recorder, dumped to <prefix>.<slice>.pcap on alerts (FALSE on error) */
+	bool EnableRecorder(size_t memoryBytes, double seconds, bool full, bool keyOnly, const string& prefix);
+
+	/** @brief Resumes from the snapshot in a file (if any) and saves a snapshot to it every seconds of capture time */
+	void EnableSnapshots(const string& filename, double seconds);
+
+	/** @brief Returns the shard's analyzer, for configuration before Start() */
+	WatchdogAnalyzer& GetAnalyzer() { return m_analyzer; }
+
+	/** @brief Replaces the analyzer's blocklist (safe while capturing) */
+	void SwapBlocklist(shared_ptr<const Blocklist>& blocklist);
+
+	/** @brief Starts the capture thread, pinned to a CPU (-1 = not pinned) */
+	void Start(int cpu, bool needPayloads);
+
+	/** @brief Ends a live capture, saving a final snapshot if enabled (the capture thread is joined on destruction) */
+	void Stop();
+
+	/** @brief Restricts the flight recorder's and snapshot writer's threads (if enabled) to the given CPUs, returning FALSE on error */
+	bool SetLoggingAffinity(const vector<int>& cpus);
+
+	/** @brief Reports every slice before slice that hasn't been reported yet */
+	void CloseSlices(long long slice);
+
+	/** @brief Moves all queued reports to reports, returning TRUE once the capture has ended */
+	bool TakeReports(queue<ShardReport>& reports);
+
+	/** @brief Adapts the sample rate to the capture's drops and backlog (live captures, once per slice) */
+	void AdaptSampleRate();
+
+	/** @brief Returns the name of the interface or pcap files */
+	const string& Name() const { return m_name; }
+
+};
+
+#endif
@@ -0,0 +1,153 @@
+#include "cpu_affinity.h"
+
+#include <sstream>
+#include <fstream>
+#include <dirent.h>
+#include <stdlib.h>
+#include <sched.h>
+
+
+/** @param list The CPU list, ranges and single CPUs separated by ','
+	@param[out] cpus The CPUs listed, in order
+
+	@return TRUE if the list was parsed, FALSE if it is empty or malformed (or a CPU is past CPU_SETSIZE)
+	*/
+bool ParseCpuList(const string& list, vector<int>& cpus)
+{
+	cpus.clear();
+
+	istringstream iss(list);
+	string item;
+	while (getline(iss, item, ','))
+	{
+		size_t dash = item.find('-');
+		string first = item.substr(0, dash);
+		string last = (dash == string::npos) ? first : item.substr(dash + 1);
+
+		if (first.empty() || last.empty() ||
+			first.find_first_not_of("0123456789") != string::npos || last.find_first_not_of("0123456789") != string::npos)
+		{
+			return false;
+		}
+
+		int from = atoi(first.c_str());
+		int to = atoi(last.c_str());
+		if (from > to || to >= CPU_SETSIZE)
+		{
+			return false;
+		}
+
+		for (int cpu = from; cpu <= to; cpu++)
+		{
+			cpus.push_back(cpu);
+		}
+	}
+
+	return !cpus.empty();
+}
+
+
+/** @param thread The thread
+	@param cpus The CPUs it may run on
+
+	@return TRUE if the affinity was set
+	*/
+bool SetThreadAffinity(pthread_t thread, const vector<int>& cpus)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (size_t i = 0; i < cpus.size(); i++)
+	{
+		CPU_SET(cpus[i], &set);
+	}
+
+	return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+
+/** @param thread The thread
+	@param[out] cpus The CPUs it may run on
+
+	@return TRUE if the affinity was read
+	*/
+bool GetThreadAffinity(pthread_t thread, vector<int>& cpus)
+{
+	cpus.clear();
+
+	cpu_set_t set;
+	if (pthread_getaffinity_np(thread, sizeof(set), &set) != 0)
+	{
+		return false;
+	}
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (CPU_ISSET(cpu, &set))
+		{
+			cpus.push_back(cpu);
+		}
+	}
+	return true;
+}
+
+
+/** The node is the one linked from the CPU's sysfs directory (/sys/devices/system/cpu/cpu<N>/node<M>).
+
+	@param cpu The CPU
+
+	@return Its NUMA node, 0 if the kernel doesn't say (no NUMA support), or -1 if there is no such CPU
+	*/
+int CpuNode(int cpu)
+{
+	ostringstream oss;
+	oss << "/sys/devices/system/cpu/cpu" << cpu;
+
+	DIR* dir = opendir(oss.str().c_str());
+	if (dir == NULL)
+	{
+		return -1;
+	}
+
+	int node = 0;
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		string name = entry->d_name;
+		if (name.size() > 4 && name.compare(0, 4, "node") == 0 && name.find_first_not_of("0123456789", 4) == string::npos)
+		{
+			node = atoi(name.c_str() + 4);
+			break;
+		}
+	}
+	closedir(dir);
+
+	return node;
+}
+
+
+/** @param cpu The CPU
+
+	@return The CPUs of its NUMA node (/sys/devices/system/node/node<M>/cpulist), or just CPU if they can't be read
+	*/
+vector<int> NodeCpus(int cpu)
+{
+	vector<int> cpus;
+	int node = CpuNode(cpu);
+	if (node == -1)
+	{
+		cpus.assign(1, cpu);
+		return cpus;
+	}
+
+	ostringstream oss;
+	oss << "/sys/devices/system/node/node" << node << "/cpulist";
+
+	ifstream file(oss.str().c_str());
+	string list;
+	if (!getline(file, list) || !ParseCpuList(list, cpus))
+	{
+		cpus.assign(1, cpu);
+	}
+
+	return cpus;
+}
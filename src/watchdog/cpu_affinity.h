@@ -0,0 +1,40 @@
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <pthread.h>
+
+using namespace std;
+
+
+/** @brief Helpers for placing threads on CPUs and finding the NUMA node of a CPU
+
+	CPU lists are given as on the kernel's command line and in sysfs, e.g. "0-3,8,10-11". NUMA nodes are
+	read from sysfs; on a host without NUMA information every CPU is taken to be on node 0.
+
+	Memory is placed by the kernel's default (first touch) policy: a page is allocated on the node of
+	the CPU that first writes to it. A thread that allocates and fills a table while running on a node's
+	CPUs (see SetThreadAffinity()) therefore gets the table on that node, without libnuma.
+	*/
+
+/** @brief Parses a CPU list (e.g. "0-3,8") into CPU numbers, returning FALSE if malformed */
+bool ParseCpuList(const string& list, vector<int>& cpus);
+
+/** @brief Restricts a thread to the given CPUs, returning FALSE on error */
+bool SetThreadAffinity(pthread_t thread, const vector<int>& cpus);
+
+/** @brief Restricts a thread to the given CPUs, returning FALSE on error */
+inline bool SetThreadAffinity(thread& t, const vector<int>& cpus) { return SetThreadAffinity(t.native_handle(), cpus); }
+
+/** @brief Gets the CPUs a thread may run on, returning FALSE on error */
+bool GetThreadAffinity(pthread_t thread, vector<int>& cpus);
+
+/** @brief Returns the NUMA node of a CPU (0 without NUMA information, -1 if there is no such CPU) */
+int CpuNode(int cpu);
+
+/** @brief Returns the CPUs of a CPU's NUMA node (just the CPU itself if they can't be read) */
+vector<int> NodeCpus(int cpu);
+
+#endif
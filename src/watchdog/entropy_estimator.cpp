@@ -0,0 +1,165 @@
+#include "entropy_estimator.h"
+
+#include <math.h>
+#include <string.h>
+
+
+
+/** @param minPackets Min packets in a slice for its estimates to be checked and baselined
+	@param warmupSlices Number of slices baselined before a feature can alert
+	@param minShift Min difference (bits) between a slice's entropy and its baseline for an alert
+	@param rebaselineSlices Number of consecutive alerting slices after which a feature's baseline is restarted
+	*/
+EntropyEstimator::EntropyEstimator(unsigned long long minPackets, uint32_t warmupSlices, double minShift, uint32_t rebaselineSlices)
+	: m_counts(NUM_ENTROPY_FEATURES * BUCKETS, 0)
+{
+	m_packets = 0;
+	m_minPackets = minPackets;
+	m_warmupSlices = warmupSlices;
+	m_minShift = minShift;
+	m_rebaselineSlices = rebaselineSlices;
+
+	for (int f = 0; f < NUM_ENTROPY_FEATURES; f++)
+	{
+		m_entropy[f] = 0;
+		m_baselines[f].mean = 0;
+		m_baselines[f].dev = 0;
+		m_baselines[f].slices = 0;
+		m_baselines[f].alerts = 0;
+	}
+}
+
+
+/** Estimates the entropy of each feature's histogram, H = log2(S) - (1/S) * sum(c * log2(c)) over the
+	bucket counts c (S being the number of packets), which costs BUCKETS logarithms per feature whatever
+	the traffic.
+
+	If the slice had at least m_minPackets packets, each estimate is compared against its baseline (once
+	m_warmupSlices slices were baselined) and then folded into it. A feature alerts when its entropy
+	differs from the baseline by at least m_minShift bits and by more than alertFactor times the
+	baseline's usual deviation. An alerting slice is not folded into the baseline, so a sustained attack
+	keeps alerting instead of becoming the norm, until the feature has alerted for m_rebaselineSlices
+	slices in a row: the change is then taken as the new norm and the baseline restarts from this slice.
+
+	@param alertFactor Factor of the usual deviation a shift has to exceed
+	@param[out] shifts For each feature, +1 if its entropy rose enough to alert, -1 if it fell enough, else 0
+
+	@return TRUE if any feature alerted
+	*/
+bool EntropyEstimator::EndSlice(double alertFactor, int shifts[])
+{
+	bool alert = false;
+	bool checked = (m_packets >= m_minPackets);
+
+	for (int f = 0; f < NUM_ENTROPY_FEATURES; f++)
+	{
+		shifts[f] = 0;
+
+		double entropy = 0;
+		if (m_packets > 0)
+		{
+			const uint32_t* counts = &m_counts[f * BUCKETS];
+			double sum = 0;
+			for (int b = 0; b < BUCKETS; b++)
+			{
+				if (counts[b] > 1)
+				{
+					sum += counts[b] * log2((double)counts[b]);
+				}
+			}
+
+			double total = (double)m_packets;
+			entropy = log2(total) - sum / total;
+			if (entropy < 0)
+			{
+				entropy = 0; // (rounding)
+			}
+		}
+		m_entropy[f] = entropy;
+
+		if (!checked)
+		{
+			continue;
+		}
+
+		Baseline& baseline = m_baselines[f];
+		double diff = entropy - baseline.mean;
+
+		if (baseline.slices >= m_warmupSlices && fabs(diff) >= m_minShift && fabs(diff) > baseline.dev * alertFactor)
+		{
+			shifts[f] = (diff > 0) ? 1 : -1;
+			alert = true;
+
+			if (++baseline.alerts < m_rebaselineSlices)
+			{
+				continue;
+			}
+			baseline.slices = 0;
+			baseline.dev = 0;
+		}
+		baseline.alerts = 0;
+
+		if (baseline.slices == 0)
+		{
+			baseline.mean = entropy;
+		}
+		else
+		{
+			baseline.mean += diff / BASELINE_SLICES;
+			baseline.dev += (fabs(diff) - baseline.dev) / BASELINE_SLICES;
+		}
+		baseline.slices++;
+	}
+
+	memset(&m_counts[0], 0, m_counts.size() * sizeof(uint32_t));
+	m_packets = 0;
+
+	return alert;
+}
+
+
+/** @param feature The feature
+
+	@return 'srcip', 'dstip', 'srcport' or 'dstport'
+	*/
+const char* EntropyEstimator::FeatureName(EntropyFeature feature)
+{
+	static const char* names[NUM_ENTROPY_FEATURES] = { "srcip", "dstip", "srcport", "dstport" };
+	return names[feature];
+}
+
+
+/** The histograms of the current slice aren't saved, a restarted watchdog starts a new slice anyway.
+
+	@param[out] snapshot Snapshot the baselines are appended to
+	*/
+void EntropyEstimator::Save(SnapshotWriter& snapshot) const
+{
+	for (int f = 0; f < NUM_ENTROPY_FEATURES; f++)
+	{
+		snapshot.Put(m_baselines[f].mean);
+		snapshot.Put(m_baselines[f].dev);
+		snapshot.Put(m_baselines[f].slices);
+	}
+}
+
+
+/** @param snapshot Snapshot positioned at the baselines (see Save())
+
+	@return TRUE if the baselines were restored and FALSE if the snapshot ended first
+	*/
+bool EntropyEstimator::Load(SnapshotReader& snapshot)
+{
+	Baseline baselines[NUM_ENTROPY_FEATURES];
+	for (int f = 0; f < NUM_ENTROPY_FEATURES; f++)
+	{
+		if (!snapshot.Get(baselines[f].mean) || !snapshot.Get(baselines[f].dev) || !snapshot.Get(baselines[f].slices))
+		{
+			return false;
+		}
+		baselines[f].alerts = 0;
+	}
+
+	memcpy(m_baselines, baselines, sizeof(m_baselines));
+	return true;
+}
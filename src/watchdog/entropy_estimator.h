@@ -0,0 +1,135 @@
+#ifndef ENTROPY_ESTIMATOR_H
+#define ENTROPY_ESTIMATOR_H
+
+#include "packet_info.h"
+#include "snapshot.h"
+
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+
+/** @brief Packet fields whose distribution's entropy is estimated */
+enum EntropyFeature { ENTROPY_SRC_IP, ENTROPY_DST_IP, ENTROPY_SRC_PORT, ENTROPY_DST_PORT, NUM_ENTROPY_FEATURES };
+
+
+/** @brief Detects changes in the traffic mix from the entropy of the src/dst address and port distributions
+
+	An attack can change the mix of traffic without changing its volume: a DDoS from many sources spreads
+	the source addresses out (their entropy rises) while concentrating the destinations (theirs falls), a
+	scan across ports spreads the destination ports out. The Shannon entropy of each distribution is
+	estimated per timeslice and compared against a baseline of previous slices.
+
+	Each feature is hashed into a fixed histogram of BUCKETS packet counters, so the memory cost is fixed
+	(BUCKETS * 4 bytes per feature) and adding a packet costs exactly one hash and one increment per
+	feature. The entropy of the histogram is computed once at the end of the slice. Values that collide in
+	a bucket are counted as one, so the estimate never exceeds the true entropy and saturates towards
+	log2(BUCKETS) bits once a distribution spreads over many more values than there are buckets, but a
+	shift of the mix still shows as a shift of the estimate.
+
+	The baseline of each feature is an exponentially weighted moving average of its entropy and of the
+	entropy's absolute deviation from that average (over about BASELINE_SLICES slices). Once warmed up, a
+	slice whose entropy is further from the average than both a minimum shift and a factor times the usual
+	deviation raises an alert. Slices with too few packets for a meaningful estimate are neither checked
+	nor baselined.
+
+	An alerting slice isn't folded into the baseline, so an attack keeps alerting instead of becoming the
+	norm. A lasting legitimate change of the mix (a new service, a NAT change) would then alert forever,
+	so once a feature has alerted for a number of slices in a row its baseline is restarted from the
+	current slice (warming up again).
+	*/
+class EntropyEstimator
+{
+
+private:
+
+	/** Number of histogram buckets per feature (a power of two) */
+	static const int BUCKET_BITS = 12;
+	static const int BUCKETS = 1 << BUCKET_BITS;
+
+	/** The baseline averages over about this many slices */
+	static const int BASELINE_SLICES = 8;
+
+	/** @brief Baseline of one feature */
+	struct Baseline
+	{
+		/** Moving average of the entropy (bits) */
+		double mean;
+
+		/** Moving average of the entropy's absolute deviation from mean (bits) */
+		double dev;
+
+		/** Number of slices baselined */
+		uint32_t slices;
+
+		/** Number of consecutive alerting slices (not saved in snapshots) */
+		uint32_t alerts;
+	};
+
+	/** Packets per bucket of each feature this slice (NUM_ENTROPY_FEATURES * BUCKETS) */
+	vector<uint32_t> m_counts;
+
+	/** Packets added this slice */
+	unsigned long long m_packets;
+
+	/** Entropy estimates of the last slice ended (bits) */
+	double m_entropy[NUM_ENTROPY_FEATURES];
+
+	Baseline m_baselines[NUM_ENTROPY_FEATURES];
+
+	/** Min packets in a slice for its estimates to be checked and baselined */
+	unsigned long long m_minPackets;
+
+	/** Number of slices baselined before a feature can alert */
+	uint32_t m_warmupSlices;
+
+	/** Min difference (bits) from the baseline for an alert */
+	double m_minShift;
+
+	/** Number of consecutive alerting slices after which a feature's baseline is restarted */
+	uint32_t m_rebaselineSlices;
+
+
+	/** @brief Returns the bucket of a feature's value */
+	static uint32_t Bucket(uint32_t value)
+	{
+		// Fibonacci hashing: the top bits of the product mix every bit of the value
+		return (uint32_t)(((uint64_t)value * 0x9E3779B97F4A7C15ULL) >> (64 - BUCKET_BITS));
+	}
+
+
+public:
+
+	/** @brief Constructor */
+	EntropyEstimator(unsigned long long minPackets, uint32_t warmupSlices, double minShift, uint32_t rebaselineSlices);
+
+	/** @brief Adds a packet to the histogram of every feature */
+	void AddPacket(const PacketInfo& p)
+	{
+		uint32_t* counts = &m_counts[0];
+		counts[Bucket(p.src_ip)]++;
+		counts[BUCKETS + Bucket(p.dst_ip)]++;
+		counts[2 * BUCKETS + Bucket(p.src_port)]++;
+		counts[3 * BUCKETS + Bucket(p.dst_port)]++;
+		m_packets++;
+	}
+
+	/** @brief Estimates the entropies of the slice, checks them against the baselines then starts a new slice */
+	bool EndSlice(double alertFactor, int shifts[]);
+
+	/** @brief Returns the estimated entropy (bits) of a feature in the last slice ended */
+	double Entropy(EntropyFeature feature) const { return m_entropy[feature]; }
+
+	/** @brief Returns the name of a feature as used in reports (e.g. "srcip") */
+	static const char* FeatureName(EntropyFeature feature);
+
+	/** @brief Appends the baselines to a snapshot */
+	void Save(SnapshotWriter& snapshot) const;
+
+	/** @brief Restores the baselines from a snapshot, returning FALSE if it ended first */
+	bool Load(SnapshotReader& snapshot);
+
+};
+
+#endif
@@ -0,0 +1,206 @@
+#include "flight_recorder.h"
+#include "cpu_affinity.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+
+#define RECORD_SHARE 4		// 1 in RECORD_SHARE bytes of the recorder's memory holds records, the rest packet data
+
+
+
+/** @param pos Position in the byte ring (counted from the first byte ever recorded)
+	@param dest Buffer to copy to
+	@param len Number of bytes to copy
+	*/
+void FlightRecorder::CopyOut(uint64_t pos, u_char* dest, uint32_t len) const
+{
+	size_t offset = pos % m_data.size();
+	size_t first = min((size_t)len, m_data.size() - offset);
+	memcpy(dest, &m_data[offset], first);
+	memcpy(dest + first, &m_data[0], len - first);
+}
+
+
+/** Walks the records still in the ring, oldest first. Each record (and its data) is copied before use and
+	only written if the writer hasn't lapped it in the meantime, so capture never has to wait for a dump.
+
+	@param request The slices and filter to dump
+	@param filename Name of the pcap file to write
+
+	@return Number of packets written, or -1 if the file couldn't be written
+	*/
+int FlightRecorder::Dump(const DumpRequest& request, const string& filename)
+{
+	pcap_t* pDead = pcap_open_dead(m_linktype, m_snaplen);
+	pcap_dumper_t* pDumper = (pDead != NULL) ? pcap_dump_open(pDead, filename.c_str()) : NULL;
+	if (pDumper == NULL)
+	{
+		if (pDead != NULL)
+		{
+			pcap_close(pDead);
+		}
+		return -1;
+	}
+
+	vector<u_char> frame(m_snaplen);
+	uint64_t end = m_recordsWritten.load(memory_order_acquire);
+	uint64_t start = (end > m_records.size()) ? end - m_records.size() : 0;
+	int count = 0;
+
+	for (uint64_t i = start; i < end; i++)
+	{
+		PacketRecord r = m_records[i % m_records.size()];
+		if (r.slice < request.firstSlice || r.slice > request.lastSlice)
+		{
+			continue;
+		}
+
+		PacketInfo p = {};
+		p.size = r.len;
+		p.src_ip = r.src_ip;
+		p.dst_ip = r.dst_ip;
+		p.src_port = r.src_port;
+		p.dst_port = r.dst_port;
+		p.protocol = r.protocol;
+		p.ipv6 = r.ipv6;
+		p.ts_usecs = r.ts_usecs;
+		if (request.filter && !request.filter(p))
+		{
+			continue;
+		}
+
+		CopyOut(r.dataPos, &frame[0], r.caplen);
+
+		// the record is intact if the writer (which may be midway through the next packet) hasn't reached it
+		atomic_thread_fence(memory_order_acquire);
+		uint64_t written = m_recordsWritten.load(memory_order_relaxed);
+		uint64_t bytesWritten = m_bytesWritten.load(memory_order_relaxed);
+		if (written >= i + m_records.size() || bytesWritten + m_snaplen > r.dataPos + m_data.size())
+		{
+			continue;
+		}
+
+		pcap_pkthdr header;
+		header.ts.tv_sec = r.ts_usecs / 1000000;
+		header.ts.tv_usec = r.ts_usecs % 1000000;
+		header.caplen = r.caplen;
+		header.len = r.len;
+		pcap_dump((u_char*)pDumper, &header, &frame[0]);
+		count++;
+	}
+
+	pcap_dump_close(pDumper);
+	pcap_close(pDead);
+	return count;
+}
+
+
+void FlightRecorder::DumpLoop()
+{
+	unique_lock<mutex> lock(m_mtx);
+
+	while (1)
+	{
+		m_cv.wait(lock, [this] { return m_stop || !m_requests.empty(); });
+		if (m_requests.empty())
+		{
+			return; // (stopped)
+		}
+
+		DumpRequest request = m_requests.front();
+		m_requests.pop_front();
+		lock.unlock();
+
+		ostringstream ossFile;
+		ossFile << m_prefix << "." << request.lastSlice << ".pcap";
+		int count = Dump(request, ossFile.str());
+
+		ostringstream ossMsg;
+		if (count < 0)
+		{
+			ossMsg << "Error: couldn't write " << ossFile.str();
+		}
+		else
+		{
+			ossMsg << "Dumped " << count << " packets to " << ossFile.str();
+		}
+
+		fstream fs;
+		fs.open(m_logfile, fstream::out | fstream::app);
+		fs << ossMsg.str() << endl;
+		fs.close();
+		cout << ossMsg.str() << endl;
+
+		lock.lock();
+	}
+}
+
+
+/** A quarter of the memory holds records and the rest packet data, enough for a few hundred thousand
+	packet headers (or full packets of several hundred bytes each). All of it is touched up front, so
+	recording never page faults.
+
+	@param memoryBytes Memory for the rings
+	@param snaplen Bytes recorded per packet (at most)
+	@param linktype Link type (DLT_ value) of the frames to be recorded
+	@param prefix Dump files are named <prefix>.<slice>.pcap
+	@param logfile Name of the logfile dumps are logged to
+	*/
+FlightRecorder::FlightRecorder(size_t memoryBytes, uint32_t snaplen, int linktype, const string& prefix, const string& logfile)
+	: m_records(max(memoryBytes / RECORD_SHARE / sizeof(PacketRecord), (size_t)1)),
+	  m_data(max(memoryBytes - memoryBytes / RECORD_SHARE, (size_t)snaplen * 2), 0),
+	  m_recordsWritten(0),
+	  m_bytesWritten(0)
+{
+	m_snaplen = snaplen;
+	m_linktype = linktype;
+	m_prefix = prefix;
+	m_logfile = logfile;
+	m_stop = false;
+
+	m_thread = thread(&FlightRecorder::DumpLoop, this);
+}
+
+
+FlightRecorder::~FlightRecorder()
+{
+	m_mtx.lock();
+	m_stop = true;
+	m_mtx.unlock();
+	m_cv.notify_one();
+
+	m_thread.join();
+}
+
+
+/** @param cpus The CPUs the dump thread may run on
+
+	@return TRUE if the affinity was set
+	*/
+bool FlightRecorder::SetAffinity(const vector<int>& cpus)
+{
+	return SetThreadAffinity(m_thread, cpus);
+}
+
+
+/** Only queues the dump (it is written by the dump thread), so it is safe to call with locks held.
+
+	@param firstSlice First slice to dump
+	@param lastSlice Last slice to dump (also names the file)
+	@param filter Only packets for which filter returns TRUE are dumped (all if empty)
+	*/
+void FlightRecorder::RequestDump(long long firstSlice, long long lastSlice, function<bool(const PacketInfo&)> filter)
+{
+	DumpRequest request;
+	request.firstSlice = firstSlice;
+	request.lastSlice = lastSlice;
+	request.filter = filter;
+
+	m_mtx.lock();
+	m_requests.push_back(request);
+	m_mtx.unlock();
+	m_cv.notify_one();
+}
@@ -0,0 +1,158 @@
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include "packet_info.h"
+#include "large_pages.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <string.h>
+#include <stdint.h>
+#include <pcap.h>
+
+using namespace std;
+
+
+/** @brief Keeps the most recent packets in memory so the traffic behind an alert can be dumped to a pcap file
+
+	Record() copies each packet (its first snaplen bytes) into a preallocated ring: a ring of fixed size
+	records (capture info plus the parsed 5-tuple) and a byte ring holding the packet data. Nothing is
+	allocated and no lock is taken, so recording costs two memcpy()s per packet and the oldest packets
+	are simply overwritten.
+
+	When an alert fires, RequestDump() queues the slices to save. A background thread then copies the
+	matching packets out of the ring (while capture carries on) and writes them with pcap_dump(). A
+	packet overwritten while it was being copied is detected by comparing the ring positions before and
+	after, and left out of the dump.
+	*/
+class FlightRecorder
+{
+
+private:
+
+	/** @brief A recorded packet */
+	struct PacketRecord
+	{
+		/** Capture timestamp in microseconds since the epoch */
+		long long ts_usecs;
+
+		/** Timeslice of the packet */
+		long long slice;
+
+		/** Position of the packet's data in the byte ring (counted from the first byte ever recorded) */
+		uint64_t dataPos;
+
+		/** Bytes recorded and the packet's length on the wire */
+		uint32_t caplen, len;
+
+		/** Parsed 5-tuple (to filter dumps by key) */
+		uint32_t src_ip, dst_ip;
+		u_short src_port, dst_port;
+		u_char protocol;
+		bool ipv6;
+	};
+
+	/** @brief A queued dump */
+	struct DumpRequest
+	{
+		/** Slices to dump */
+		long long firstSlice, lastSlice;
+
+		/** Only packets passing the filter are dumped (all if empty) */
+		function<bool(const PacketInfo&)> filter;
+	};
+
+	/** Bytes recorded per packet */
+	uint32_t m_snaplen;
+
+	/** Link type of the recorded frames */
+	int m_linktype;
+
+	/** Dump files are named <m_prefix>.<last slice>.pcap */
+	string m_prefix;
+
+	/** Name of the logfile dumps are logged to */
+	string m_logfile;
+
+	/** Ring of records */
+	vector<PacketRecord, LargePageAllocator<PacketRecord> > m_records;
+
+	/** Ring of packet data */
+	vector<u_char, LargePageAllocator<u_char> > m_data;
+
+	/** Number of records and data bytes ever recorded (published after each packet is written) */
+	atomic<uint64_t> m_recordsWritten;
+	atomic<uint64_t> m_bytesWritten;
+
+	/** Dump thread state */
+	thread m_thread;
+	mutex m_mtx;
+	condition_variable m_cv;
+	deque<DumpRequest> m_requests;
+	bool m_stop;
+
+
+	FlightRecorder(const FlightRecorder&);
+	FlightRecorder& operator=(const FlightRecorder&);
+
+	/** @brief Copies len bytes from the byte ring at pos (wrapping around) */
+	void CopyOut(uint64_t pos, u_char* dest, uint32_t len) const;
+
+	/** @brief Writes a requested dump, returning the number of packets written */
+	int Dump(const DumpRequest& request, const string& filename);
+
+	/** @brief Dump thread, writes queued dumps until stopped */
+	void DumpLoop();
+
+
+public:
+
+	/** @brief Constructor, preallocates memoryBytes for the rings and starts the dump thread */
+	FlightRecorder(size_t memoryBytes, uint32_t snaplen, int linktype, const string& prefix, const string& logfile);
+
+	/** @brief Destructor, writes any queued dumps and stops the dump thread */
+	~FlightRecorder();
+
+	/** @brief Restricts the dump thread to the given CPUs, returning FALSE on error */
+	bool SetAffinity(const vector<int>& cpus);
+
+	/** @brief Records a packet (to be called by the capture thread only) */
+	void Record(const pcap_pkthdr* header, const u_char* frame, const PacketInfo& p, long long slice)
+	{
+		uint64_t i = m_recordsWritten.load(memory_order_relaxed);
+		uint64_t pos = m_bytesWritten.load(memory_order_relaxed);
+
+		PacketRecord& r = m_records[i % m_records.size()];
+		r.ts_usecs = p.ts_usecs;
+		r.slice = slice;
+		r.dataPos = pos;
+		r.caplen = min(header->caplen, m_snaplen);
+		r.len = header->len;
+		r.src_ip = p.src_ip;
+		r.dst_ip = p.dst_ip;
+		r.src_port = p.src_port;
+		r.dst_port = p.dst_port;
+		r.protocol = p.protocol;
+		r.ipv6 = p.ipv6;
+
+		size_t offset = pos % m_data.size();
+		size_t first = min((size_t)r.caplen, m_data.size() - offset);
+		memcpy(&m_data[offset], frame, first);
+		memcpy(&m_data[0], frame + first, r.caplen - first);
+
+		m_bytesWritten.store(pos + r.caplen, memory_order_release);
+		m_recordsWritten.store(i + 1, memory_order_release);
+	}
+
+	/** @brief Queues a dump of the recorded packets of slices firstSlice to lastSlice that pass filter */
+	void RequestDump(long long firstSlice, long long lastSlice, function<bool(const PacketInfo&)> filter);
+
+};
+
+#endif
@@ -0,0 +1,385 @@
+#include "flow_table.h"
+
+#include <netinet/in.h>
+
+#include "network_protocols.h"
+
+
+#define USECS_PER_TICK 1000000		// the expiry wheel ticks once per second of capture time
+
+#define TIMEOUT_HALF_OPEN 30		// secs before an incomplete TCP handshake is forgotten
+#define TIMEOUT_ESTABLISHED 300		// secs before an idle TCP connection is forgotten
+#define TIMEOUT_CLOSED 10			// secs before a closed/reset TCP connection is forgotten
+#define TIMEOUT_OTHER 60			// secs before an idle UDP/ICMP/other flow is forgotten
+
+
+const uint32_t FlowTable::EMPTY;
+
+
+/** @param key The flow's canonical 5-tuple
+
+	@return 32-bit hash of key
+	*/
+uint32_t FlowTable::Hash(const FlowKey& key)
+{
+	return FlowHash(make_tuple(key.ip[0], key.ip[1], key.port[0], key.port[1], key.protocol));
+}
+
+
+/** Probes m_index (linear probing) starting at the key's hash.
+
+	@param key The flow's canonical 5-tuple
+
+	@return Index into m_index of the slot holding key's flow id, or of the EMPTY slot it would be inserted into
+	*/
+uint32_t FlowTable::FindSlot(const FlowKey& key) const
+{
+	uint32_t i = Hash(key) & m_indexMask;
+
+	while (m_index[i] != EMPTY && !(m_flows[m_index[i]].key == key))
+	{
+		i = (i + 1) & m_indexMask;
+	}
+
+	return i;
+}
+
+
+/** Removes the flow from m_index using backward shift deletion (so the hash table never needs
+	tombstones), cancels its timer and returns its id to m_free.
+
+	@param id The flow to remove
+	*/
+void FlowTable::Remove(uint32_t id)
+{
+	FlowEntry& flow = m_flows[id];
+
+	SetState(flow, TCP_NONE);
+	m_wheel.Cancel(id);
+
+	// remove from the hash table, shifting back any entries that probed past this slot
+	uint32_t i = FindSlot(flow.key);
+	uint32_t j = i;
+	while (1)
+	{
+		j = (j + 1) & m_indexMask;
+		if (m_index[j] == EMPTY)
+		{
+			break;
+		}
+
+		uint32_t home = Hash(m_flows[m_index[j]].key) & m_indexMask;
+
+		// entry at j can fill the hole at i only if its home slot is not within (i, j]
+		if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j)))
+		{
+			m_index[i] = m_index[j];
+			i = j;
+		}
+	}
+	m_index[i] = EMPTY;
+
+	m_free.push_back(id);
+	m_activeFlows--;
+}
+
+
+/** @param flow The flow to update
+	@param state The flow's new TcpState
+	*/
+void FlowTable::SetState(FlowEntry& flow, TcpState state)
+{
+	bool wasHalfOpen = (flow.state == TCP_SYN_SENT || flow.state == TCP_SYN_RCVD);
+	bool isHalfOpen = (state == TCP_SYN_SENT || state == TCP_SYN_RCVD);
+
+	if (wasHalfOpen && !isHalfOpen) m_halfOpen -= flow.weight;
+	if (!wasHalfOpen && isHalfOpen) m_halfOpen += flow.weight;
+
+	flow.state = state;
+}
+
+
+/** Tracks the three-way handshake and connection teardown. Flows first seen mid-connection (no SYN)
+	are treated as established.
+
+	@param flow The flow the packet belongs to
+	@param sender Endpoint (0 or 1) that sent the packet
+	@param flags The packet's TCP flags
+	*/
+void FlowTable::UpdateTcpState(FlowEntry& flow, int sender, u_char flags)
+{
+	bool fromInitiator = (sender == flow.initiator);
+
+	if (flags & TH_RST)
+	{
+		SetState(flow, TCP_CLOSED);
+		return;
+	}
+
+	switch (flow.state)
+	{
+		case TCP_NONE: // first packet of the flow
+			if ((flags & TH_SYN) && !(flags & TH_ACK))
+			{
+				SetState(flow, TCP_SYN_SENT);
+			}
+			else
+			{
+				SetState(flow, (flags & TH_FIN) ? TCP_CLOSING : TCP_ESTABLISHED);
+			}
+			break;
+		case TCP_SYN_SENT:
+			if (!fromInitiator && (flags & TH_SYN) && (flags & TH_ACK))
+			{
+				SetState(flow, TCP_SYN_RCVD);
+			}
+			break;
+		case TCP_SYN_RCVD:
+			if (fromInitiator && (flags & TH_ACK) && !(flags & TH_SYN))
+			{
+				SetState(flow, TCP_ESTABLISHED);
+			}
+			break;
+		case TCP_ESTABLISHED:
+			if (flags & TH_FIN)
+			{
+				SetState(flow, TCP_CLOSING);
+			}
+			break;
+		case TCP_CLOSING:
+			if ((flow.flags[0] & TH_FIN) && (flow.flags[1] & TH_FIN))
+			{
+				SetState(flow, TCP_CLOSED);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+
+/** @param flow The flow
+
+	@return Number of seconds the flow may be idle before it is expired
+	*/
+uint32_t FlowTable::IdleTimeout(const FlowEntry& flow) const
+{
+	switch (flow.state)
+	{
+		case TCP_SYN_SENT:
+		case TCP_SYN_RCVD:
+			return TIMEOUT_HALF_OPEN;
+		case TCP_ESTABLISHED:
+		case TCP_CLOSING:
+			return TIMEOUT_ESTABLISHED;
+		case TCP_CLOSED:
+			return TIMEOUT_CLOSED;
+		default:
+			return TIMEOUT_OTHER;
+	}
+}
+
+
+/** Called by m_wheel when a flow's timer fires. Timers are not moved on every packet, so the flow
+	may have been active since its timer was set; in that case the timer is set again from the time
+	of the flow's last packet, otherwise the flow is removed.
+
+	@param id The flow whose timer fired
+	@param now The current tick
+	*/
+void FlowTable::OnExpire(uint32_t id, uint64_t now)
+{
+	FlowEntry& flow = m_flows[id];
+	uint64_t expiry = flow.lastSeen / USECS_PER_TICK + IdleTimeout(flow);
+
+	if (expiry > now)
+	{
+		m_wheel.Schedule(id, expiry);
+	}
+	else
+	{
+		Remove(id);
+		m_expiredFlows++;
+	}
+}
+
+
+/** Initializes an empty table. All memory for capacity flows is allocated up front.
+
+	@param capacity Maximum number of flows tracked at once
+	*/
+FlowTable::FlowTable(uint32_t capacity)
+	: m_flows(capacity), m_wheel(capacity, 0)
+{
+	uint32_t indexSize = 1;
+	while (indexSize < capacity * 2)
+	{
+		indexSize <<= 1;
+	}
+	m_index.assign(indexSize, EMPTY);
+	m_indexMask = indexSize - 1;
+
+	m_free.reserve(capacity);
+	for (uint32_t i = capacity; i > 0; i--)
+	{
+		m_free.push_back(i - 1);
+	}
+
+	m_activeFlows = 0;
+	m_halfOpen = 0;
+	ResetSliceCounters();
+}
+
+
+/** Expires flows that have been idle past their timeout (as of the packet's capture time), then
+	finds or creates the packet's flow and updates its counters and TCP state. If the table is full
+	the packet is counted in m_droppedFlows instead (and in m_droppedSyns if it is a connection attempt).
+
+	@param p PacketInfo struct storing all relevent metadata from a packet
+	@param weight Number of flows a new flow stands for (the sample rate) in the half-open and new flow counts
+	*/
+void FlowTable::AddPacket(const PacketInfo& p, uint32_t weight)
+{
+	uint64_t now = p.ts_usecs / USECS_PER_TICK;
+	m_wheel.Advance(now, [this, now](uint32_t id) { OnExpire(id, now); });
+
+	// order the endpoints so both directions of a connection map to the same key
+	FlowKey key;
+	int sender = (p.src_ip < p.dst_ip || (p.src_ip == p.dst_ip && p.src_port <= p.dst_port)) ? 0 : 1;
+	key.ip[sender] = p.src_ip;
+	key.ip[1 - sender] = p.dst_ip;
+	key.port[sender] = p.src_port;
+	key.port[1 - sender] = p.dst_port;
+	key.protocol = p.protocol;
+
+	uint32_t slot = FindSlot(key);
+	uint32_t id = m_index[slot];
+
+	if (id == EMPTY)
+	{
+		if (m_free.empty())
+		{
+			m_droppedFlows++;
+			if (p.protocol == IPPROTO_TCP && (p.tcp_flags & TH_SYN) && !(p.tcp_flags & TH_ACK))
+			{
+				m_droppedSyns += weight;
+			}
+			return;
+		}
+
+		id = m_free.back();
+		m_free.pop_back();
+		m_index[slot] = id;
+
+		FlowEntry& flow = m_flows[id];
+		flow.key = key;
+		flow.initiator = sender;
+		flow.state = TCP_NONE;
+		flow.flags[0] = flow.flags[1] = 0;
+		flow.weight = weight;
+		flow.packets[0] = flow.packets[1] = 0;
+		flow.bytes[0] = flow.bytes[1] = 0;
+		flow.firstSeen = p.ts_usecs;
+
+		m_activeFlows++;
+		m_newFlows += weight;
+	}
+
+	FlowEntry& flow = m_flows[id];
+	u_char prevState = flow.state;
+
+	flow.packets[sender]++;
+	flow.bytes[sender] += p.size;
+	flow.lastSeen = p.ts_usecs;
+
+	if (p.protocol == IPPROTO_TCP)
+	{
+		flow.flags[sender] |= p.tcp_flags;
+		UpdateTcpState(flow, sender, p.tcp_flags);
+	}
+
+	// (re)arm the expiry timer when the flow is new or its timeout changed with its state
+	if (!m_wheel.IsScheduled(id) || flow.state != prevState)
+	{
+		m_wheel.Schedule(id, now + IdleTimeout(flow));
+	}
+}
+
+
+/** The flows are written in pool order, preceded by the expiry wheel's current tick.
+
+	@param[out] snapshot Snapshot the flows are appended to
+	*/
+void FlowTable::Save(SnapshotWriter& snapshot) const
+{
+	vector<FlowEntry> flows;
+	flows.reserve(m_activeFlows);
+
+	for (size_t i = 0; i < m_index.size(); i++)
+	{
+		if (m_index[i] != EMPTY)
+		{
+			flows.push_back(m_flows[m_index[i]]);
+		}
+	}
+
+	snapshot.Put(m_wheel.Now());
+	snapshot.PutArray(flows.data(), flows.size());
+}
+
+
+/** The flows are not copied, so the snapshot must stay open until they are loaded.
+
+	@param snapshot Snapshot positioned at the flows (see Save())
+	@param[out] saved The flows saved in the snapshot
+
+	@return TRUE if the flows were read and FALSE if the snapshot ended first
+	*/
+bool FlowTable::Read(SnapshotReader& snapshot, SavedFlows& saved)
+{
+	return snapshot.Get(saved.now) && (saved.flows = snapshot.GetArray<FlowEntry>(saved.count)) != NULL;
+}
+
+
+/** Moves the expiry wheel to the snapshot's tick and inserts each saved flow with a timer set from its
+	last packet, so flows that stay idle after the restart expire on schedule. Flows beyond the table's
+	capacity are dropped. Must be called before any packet is added.
+
+	@param saved Flows read from a snapshot (see Read())
+	*/
+void FlowTable::Load(const SavedFlows& saved)
+{
+	const FlowEntry* flows = saved.flows;
+
+	m_wheel.Advance(saved.now - 1, [](uint32_t) {}); // (no timers scheduled yet, so this only moves the wheel)
+
+	for (size_t i = 0; i < saved.count && !m_free.empty(); i++)
+	{
+		uint32_t slot = FindSlot(flows[i].key);
+		if (m_index[slot] != EMPTY || flows[i].state > TCP_CLOSED)
+		{
+			continue;
+		}
+
+		uint32_t id = m_free.back();
+		m_free.pop_back();
+		m_index[slot] = id;
+
+		FlowEntry& flow = m_flows[id];
+		flow = flows[i];
+		flow.state = TCP_NONE;
+		SetState(flow, (TcpState)flows[i].state);
+		m_activeFlows++;
+
+		m_wheel.Schedule(id, flow.lastSeen / USECS_PER_TICK + IdleTimeout(flow));
+	}
+}
+
+
+void FlowTable::ResetSliceCounters()
+{
+	m_newFlows = 0;
+	m_expiredFlows = 0;
+	m_droppedFlows = 0;
+	m_droppedSyns = 0;
+}
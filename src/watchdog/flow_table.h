@@ -0,0 +1,202 @@
+#ifndef FLOW_TABLE_H
+#define FLOW_TABLE_H
+
+#include "packet_info.h"
+#include "timer_wheel.h"
+#include "snapshot.h"
+#include "large_pages.h"
+
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+
+/** @brief TCP connection state of a flow (TCP_NONE for non-TCP flows) */
+enum TcpState { TCP_NONE, TCP_SYN_SENT, TCP_SYN_RCVD, TCP_ESTABLISHED, TCP_CLOSING, TCP_CLOSED };
+
+
+/** @brief Persistent table of bidirectional flows that outlives individual timeslices
+
+	Each flow is keyed by its 5-tuple with the endpoints in canonical order, so both directions of a
+	connection share one entry holding per-direction packet/byte counters, the TCP flags seen from
+	each side and the TCP connection state. Entries live in a fixed size pool indexed by an open
+	addressing hash table, so the packet path never allocates.
+
+	Idle flows are expired by a TimerWheel ticking once per second of capture time. Timers are not
+	moved on every packet: when a flow's timer fires and the flow has been active since, it is simply
+	rescheduled, which keeps expiry amortized O(1) per flow without rescanning the table.
+
+	The table maintains a running count of half-open TCP connections (SYN seen but the handshake never
+	completed) and per-slice counts of new flows, which TrafficAnalyzer uses to detect SYN floods and
+	spikes in the new flow rate.
+
+	When only a sample of flows is added, each flow carries a weight: the number of flows it stands for
+	(the sample rate when it was created). The counts are sums of these weights, so they estimate all
+	traffic and a flow still counts for the rate it was sampled at after the rate changes.
+
+	The tracked flows can be saved to a snapshot and loaded into a new table (Save(), Read() then Load()),
+	so a restarted watchdog doesn't count every ongoing connection as new.
+	*/
+class FlowTable
+{
+
+private:
+
+	/** @brief Direction independent 5-tuple (endpoint 0 is the lower of the two (ip, port) pairs) */
+	struct FlowKey
+	{
+		uint32_t ip[2];
+		u_short port[2];
+		u_char protocol;
+
+		bool operator==(const FlowKey& rhs) const
+		{
+			return ip[0] == rhs.ip[0] && ip[1] == rhs.ip[1] && port[0] == rhs.port[0] &&
+					port[1] == rhs.port[1] && protocol == rhs.protocol;
+		}
+	};
+
+	/** @brief A single tracked flow */
+	struct FlowEntry
+	{
+		/** The flow's canonical 5-tuple */
+		FlowKey key;
+
+		/** Endpoint (0 or 1) that sent the first packet seen */
+		u_char initiator;
+
+		/** Current TcpState */
+		u_char state;
+
+		/** OR of all TCP flags sent by each endpoint */
+		u_char flags[2];
+
+		/** Number of flows this one stands for (the sample rate when it was created) */
+		uint32_t weight;
+
+		/** Packets sent by each endpoint */
+		unsigned long long packets[2];
+
+		/** Bytes sent by each endpoint */
+		unsigned long long bytes[2];
+
+		/** Capture time (usecs since the epoch) of the first packet */
+		long long firstSeen;
+
+		/** Capture time (usecs since the epoch) of the most recent packet */
+		long long lastSeen;
+	};
+
+	/** Marks an empty hash table slot */
+	static const uint32_t EMPTY = 0xffffffff;
+
+	/** Pool of flow entries (indexed by flow id) */
+	vector<FlowEntry, LargePageAllocator<FlowEntry> > m_flows;
+
+	/** Open addressing hash table of flow ids (linear probing) */
+	vector<uint32_t, LargePageAllocator<uint32_t> > m_index;
+
+	/** m_index.size() - 1 (the size is a power of two) */
+	uint32_t m_indexMask;
+
+	/** Stack of unused flow ids */
+	vector<uint32_t> m_free;
+
+	/** Expiry timers (one per flow id, one tick per second) */
+	TimerWheel m_wheel;
+
+	/** Number of flows currently in the table */
+	uint32_t m_activeFlows;
+
+	/** Weighted number of TCP flows currently in the SYN_SENT or SYN_RCVD state */
+	unsigned long long m_halfOpen;
+
+	/** Weighted number of flows created this slice */
+	unsigned long long m_newFlows;
+
+	/** Number of flows expired this slice */
+	unsigned long long m_expiredFlows;
+
+	/** Number of packets of new flows that could not be tracked this slice because the table was full */
+	unsigned long long m_droppedFlows;
+
+	/** Weighted number of those packets that were connection attempts (SYN without ACK) */
+	unsigned long long m_droppedSyns;
+
+
+	/** @brief Returns the slot in m_index holding the flow with this key (or the empty slot where it belongs) */
+	uint32_t FindSlot(const FlowKey& key) const;
+
+	/** @brief Removes a flow from the table and returns its id to the free list */
+	void Remove(uint32_t id);
+
+	/** @brief Changes a flow's TCP state, keeping m_halfOpen up to date */
+	void SetState(FlowEntry& flow, TcpState state);
+
+	/** @brief Updates a flow's TCP state given a packet's flags and sender */
+	void UpdateTcpState(FlowEntry& flow, int sender, u_char flags);
+
+	/** @brief Returns the idle timeout (in seconds) for a flow in its current state */
+	uint32_t IdleTimeout(const FlowEntry& flow) const;
+
+	/** @brief Called by m_wheel when a flow's timer fires */
+	void OnExpire(uint32_t id, uint64_t now);
+
+	static uint32_t Hash(const FlowKey& key);
+
+
+public:
+
+	/** @brief Constructor */
+	explicit FlowTable(uint32_t capacity);
+
+	/** @brief Adds a packet to its flow (creating the flow if needed, standing for WEIGHT flows) and expires idle flows */
+	void AddPacket(const PacketInfo& p, uint32_t weight = 1);
+
+	/** @brief Flows read from a snapshot by Read(), not yet added to a table (they point into the snapshot's mapping) */
+	struct SavedFlows
+	{
+		/** Tick of the expiry wheel when the snapshot was taken */
+		uint64_t now;
+
+		/** The saved flows */
+		const FlowEntry* flows;
+
+		/** Number of saved flows */
+		size_t count;
+	};
+
+	/** @brief Appends the tracked flows to a snapshot */
+	void Save(SnapshotWriter& snapshot) const;
+
+	/** @brief Reads the flows saved in a snapshot without changing the table, returning FALSE if the snapshot is invalid */
+	static bool Read(SnapshotReader& snapshot, SavedFlows& saved);
+
+	/** @brief Adds flows read by Read() to the (empty) table */
+	void Load(const SavedFlows& saved);
+
+	/** @brief Resets the per-slice counters (new/expired/dropped flows, dropped SYNs) */
+	void ResetSliceCounters();
+
+	/** @brief Returns the number of flows currently tracked */
+	uint32_t GetActiveFlows() const { return m_activeFlows; }
+
+	/** @brief Returns the (weighted) number of half-open TCP connections currently tracked */
+	unsigned long long GetHalfOpen() const { return m_halfOpen; }
+
+	/** @brief Returns the (weighted) number of flows created this slice */
+	unsigned long long GetNewFlows() const { return m_newFlows; }
+
+	/** @brief Returns the number of flows expired this slice */
+	unsigned long long GetExpiredFlows() const { return m_expiredFlows; }
+
+	/** @brief Returns the number of packets of new flows not tracked this slice because the table was full */
+	unsigned long long GetDroppedFlows() const { return m_droppedFlows; }
+
+	/** @brief Returns the (weighted) number of connection attempts (SYN without ACK) not tracked this slice because the table was full */
+	unsigned long long GetDroppedSyns() const { return m_droppedSyns; }
+
+};
+
+#endif
@@ -0,0 +1,113 @@
+#include "large_pages.h"
+
+#include <atomic>
+#include <new>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+
+/** Set by EnableLargePages() */
+static bool s_enabled = false;
+
+/** Bytes mapped from the reserved pool and for transparent huge pages (tables may be allocated by several capture threads) */
+static atomic<size_t> s_reservedBytes(0);
+static atomic<size_t> s_transparentBytes(0);
+
+
+/** @return BYTES rounded up to a multiple of HUGE_PAGE_BYTES
+	*/
+static size_t RoundToHugePages(size_t bytes)
+{
+	return (bytes + HUGE_PAGE_BYTES - 1) & ~(size_t)(HUGE_PAGE_BYTES - 1);
+}
+
+
+void EnableLargePages()
+{
+	s_enabled = true;
+}
+
+
+bool LargePagesEnabled()
+{
+	return s_enabled;
+}
+
+
+/** Maps the block from the reserved huge page pool (MAP_HUGETLB), which fails if the pool is too small.
+	It is then mapped in ordinary pages instead, aligned to HUGE_PAGE_BYTES (by mapping an extra huge
+	page and unmapping the ends) so that madvise(MADV_HUGEPAGE) can have the kernel back it with
+	transparent huge pages. Either way the pages are only allocated when first written to, on the node of
+	the writing thread (see cpu_affinity.h).
+
+	@param bytes Size of the block
+
+	@return The block
+	*/
+void* AllocateLarge(size_t bytes)
+{
+	if (!s_enabled || bytes < HUGE_PAGE_BYTES)
+	{
+		void* p = malloc(bytes);
+		if (p == NULL)
+		{
+			throw bad_alloc();
+		}
+		return p;
+	}
+
+	size_t size = RoundToHugePages(bytes);
+
+	void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+	{
+		s_reservedBytes += size;
+		return p;
+	}
+
+	char* raw = (char*)mmap(NULL, size + HUGE_PAGE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED)
+	{
+		throw bad_alloc();
+	}
+
+	char* aligned = (char*)(((uintptr_t)raw + HUGE_PAGE_BYTES - 1) & ~(uintptr_t)(HUGE_PAGE_BYTES - 1));
+	if (aligned > raw)
+	{
+		munmap(raw, aligned - raw);
+	}
+	munmap(aligned + size, HUGE_PAGE_BYTES - (aligned - raw));
+
+	madvise(aligned, size, MADV_HUGEPAGE);
+	s_transparentBytes += size;
+	return aligned;
+}
+
+
+/** @param p The block
+	@param bytes The size it was allocated with
+	*/
+void FreeLarge(void* p, size_t bytes)
+{
+	if (!s_enabled || bytes < HUGE_PAGE_BYTES)
+	{
+		free(p);
+	}
+	else
+	{
+		munmap(p, RoundToHugePages(bytes));
+	}
+}
+
+
+size_t ReservedHugePageBytes()
+{
+	return s_reservedBytes.load();
+}
+
+
+size_t TransparentHugePageBytes()
+{
+	return s_transparentBytes.load();
+}
@@ -0,0 +1,78 @@
+#ifndef LARGE_PAGES_H
+#define LARGE_PAGES_H
+
+#include <cstddef>
+
+using namespace std;
+
+
+#define HUGE_PAGE_BYTES (2 * 1024 * 1024)	// size of an x86-64 huge page, the granularity of huge page backed tables
+
+
+/** @brief Optional huge page backing for large tables
+
+	Once EnableLargePages() is called, allocations of at least HUGE_PAGE_BYTES made through
+	AllocateLarge() (or LargePageAllocator) are mapped in huge pages: from the reserved pool
+	(vm.nr_hugepages) if it has room, otherwise as 2MB aligned mappings the kernel is asked to back with
+	transparent huge pages. A table spanning a few huge pages instead of thousands of 4KB pages costs the
+	packet path far fewer TLB misses. Smaller allocations, and all allocations until then, use malloc.
+
+	EnableLargePages() must be called before any table is allocated, as FreeLarge() tells how a block
+	was allocated from its size and the current setting.
+	*/
+
+/** @brief Backs allocations of at least HUGE_PAGE_BYTES with huge pages from now on */
+void EnableLargePages();
+
+/** @brief Returns TRUE if EnableLargePages() was called */
+bool LargePagesEnabled();
+
+/** @brief Allocates BYTES (in huge pages if enabled and large enough), throwing bad_alloc on failure */
+void* AllocateLarge(size_t bytes);
+
+/** @brief Frees a block returned by AllocateLarge() for the same number of bytes */
+void FreeLarge(void* p, size_t bytes);
+
+/** @brief Returns the bytes mapped so far from the reserved huge page pool */
+size_t ReservedHugePageBytes();
+
+/** @brief Returns the bytes mapped so far for transparent huge pages */
+size_t TransparentHugePageBytes();
+
+
+/** @brief STL allocator adapter so large standard containers can be backed by huge pages (see AllocateLarge()) */
+template <class T>
+class LargePageAllocator
+{
+
+public:
+
+	typedef T value_type;
+
+	/** @brief Constructor */
+	LargePageAllocator() {}
+
+	/** @brief Rebinding constructor */
+	template <class U>
+	LargePageAllocator(const LargePageAllocator<U>&) {}
+
+	/** @brief Allocates room for n objects of type T */
+	T* allocate(size_t n) { return (T*)AllocateLarge(n * sizeof(T)); }
+
+	/** @brief Frees room for n objects of type T */
+	void deallocate(T* p, size_t n) { FreeLarge(p, n * sizeof(T)); }
+};
+
+template <class T, class U>
+bool operator==(const LargePageAllocator<T>&, const LargePageAllocator<U>&)
+{
+	return true;
+}
+
+template <class T, class U>
+bool operator!=(const LargePageAllocator<T>&, const LargePageAllocator<U>&)
+{
+	return false;
+}
+
+#endif
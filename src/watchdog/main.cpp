@@ -1,38 +1,51 @@
-#include "traffic_analyzer.h"
-#include "network_protocols.h"
+#include "capture_shard.h"
+#include "slice_clock.h"
+#include "cpu_affinity.h"
+#include "large_pages.h"
+#include "../desman/shm_ring.h"
+#include "../desman/topk_summary.h"
 
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <queue>
+#include <vector>
+#include <algorithm>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <chrono>	// for timing
 #include <thread>	// threading library
-#include <mutex>	// thread mutex
+#include <memory>
 
 #include <sys/socket.h>	// socket library
 #include <netinet/in.h> // socket structs (i.e. sockaddr_in, etc.)
 #include <arpa/inet.h>	// inet_aton() etc.
-
-#include <pcap.h>	// pcap library
+#include <sys/un.h>		// sockaddr_un
 
 
 
 using namespace std;
 
-#define MAXBUFLEN 512
+#define MAXBUFLEN 512			// max length of a message from the desman
 #define DESMAN_PORT 11353
+#define MAX_GRACE_USECS 250000	// max time to wait past a slice boundary for late packets
+#define DEFAULT_MEMORY_MB 256	// default memory budget for per-timeslice analyzer state
+#define DEFAULT_BUFFER_MB 32	// default kernel capture buffer size
+#define FLIGHT_RECORDER_MB 64	// memory preallocated for the flight recorder's packet ring
+#define CHECKPOINT_SECS 60		// default capture time between snapshots of the analyzer's state
+#define STOP_POLL_MSECS 100		// how often the live loop checks for SIGINT/SIGTERM while waiting for a slice to end
 
 
-mutex g_mtx;			// so we can synchronize access to TrafficAnalyzer instance between threads
 string g_logfile;
 
-bool g_liveMode;		// TRUE if we're reading packets from a live interface
+bool g_liveMode;		// TRUE if we're reading packets from live interfaces
 
-queue<string> g_reports;
-long long int g_maxts_usecs = 0; // max timestamp value for this timeslice
-double g_timeslice = 1.0;			 // our timeslice length in seconds (default = 1.0)
+SliceClock g_sliceClock;		// maps packet timestamps to epoch aligned timeslices (default = 1.0 secs)
+volatile sig_atomic_t g_reloadBlocklist = 0;	// set by SIGHUP to reload the blocklist index
+volatile sig_atomic_t g_stop = 0;				// set by SIGINT/SIGTERM to stop a live capture (with -S)
 
 
 /** Appends MSG to m_logfile and to console **/
@@ -48,46 +61,201 @@ void LogMessage(const string& msg)
 }
 
 
+/** SIGHUP handler, asks the main loop to reload the blocklist **/
+void OnSighup(int)
+{
+	g_reloadBlocklist = 1;
+}
+
+
+/** SIGINT/SIGTERM handler, asks the live loop to stop the captures so they save a final snapshot **/
+void OnStop(int)
+{
+	g_stop = 1;
+}
+
+
+/** Sleeps until DEADLINE, waking early (within STOP_POLL_MSECS) if g_stop is set **/
+void SleepUntil(chrono::steady_clock::time_point deadline)
+{
+	chrono::steady_clock::time_point now;
+	while (!g_stop && (now = chrono::steady_clock::now()) < deadline)
+	{
+		this_thread::sleep_until(min(deadline, now + chrono::milliseconds(STOP_POLL_MSECS)));
+	}
+}
+
+
+/** Maps the blocklist index in BLOCKFILE and swaps it into every shard's analyzer. The capture threads
+	keep running while the index is mapped; they only wait for the pointer swap. The previous index
+	is unmapped once the last shard has released it. Returns FALSE (keeping the previous index) if the
+	index can't be loaded **/
+bool LoadBlocklist(const vector<unique_ptr<CaptureShard> >& shards, const string& blockfile)
+{
+	shared_ptr<Blocklist> pBlocklist = make_shared<Blocklist>();
+	if (!pBlocklist->Load(blockfile))
+	{
+		return false;
+	}
+
+	ostringstream oss;
+	oss << "Loaded blocklist " << blockfile << " (" << pBlocklist->NumIps() << " addresses, " 
+		<< pBlocklist->NumRanges() << " ranges)";
+
+	for (size_t i = 0; i < shards.size(); i++)
+	{
+		shared_ptr<const Blocklist> pNew = pBlocklist;
+		shards[i]->SwapBlocklist(pNew);
+	}
+
+	LogMessage(oss.str());
+	return true;
+}
+
+
+/** Adds PATH to FILES, or if PATH is a directory, every (non hidden) file in it in name order, so rotated
+	captures are listed oldest first. Returns FALSE (error printed to console) if PATH can't be read or
+	holds no files **/
+bool ListPcapFiles(const string& path, vector<string>& files)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) == -1 || !S_ISDIR(st.st_mode))
+	{
+		files.push_back(path); // (opening it reports any error)
+		return true;
+	}
+
+	DIR* pDir = opendir(path.c_str());
+	if (pDir == NULL)
+	{
+		cout << "Error: can't read directory " << path << endl;
+		return false;
+	}
+
+	vector<string> names;
+	dirent* pEntry;
+	while ((pEntry = readdir(pDir)) != NULL)
+	{
+		string name = pEntry->d_name;
+		if (name[0] == '.' || stat((path + "/" + name).c_str(), &st) == -1 || !S_ISREG(st.st_mode))
+		{
+			continue;
+		}
+		names.push_back(path + "/" + name);
+	}
+	closedir(pDir);
+
+	if (names.empty())
+	{
+		cout << "Error: no files in directory " << path << endl;
+		return false;
+	}
+
+	sort(names.begin(), names.end());
+	files.insert(files.end(), names.begin(), names.end());
+	return true;
+}
+
+
 /** Prints usage instructions **/
 void PrintUsgInstr()
 {
 	cout << "\nWatchdog Usage Instructions:\n\n";
-	cout << "> watchdog [-r filename] [-i interface] [-w filename] [-c desmanIP] [-t timeslice]\n";
+	cout << "> watchdog [-r filename ...] [-i interface ...] [-w filename] [-c desmanIP | -l] [-t timeslice] [-a factor] [-s rulefile] [-b blocklist] [-p prefixfile] [-m megabytes] [-f filter] [-z snaplen] [-B megabytes] [-I] [-R seconds [-F] [-O]] [-S snapshot [-K seconds]] [-C cpus] [-P cpus] [-L cpus] [-H]\n";
 	cout << "where\n";
-	cout << "-r, --read\t\tRead the specified file\n";
-	cout << "-i, --interface\t\tListen on the specified interface\n";
+	cout << "-r, --read\t\tRead the specified file, or every file in the specified directory (repeat to read several,\n";
+	cout << "\t\t\te.g. from different taps, replayed together as one stream in timestamp order)\n";
+	cout << "-i, --interface\t\tListen on the specified interface (repeat to listen on several, each on its own thread,\n";
+	cout << "\t\t\twith one combined report giving the totals of each interface as if:<name>=packets/bytes/flows)\n";
 	cout << "-w, --write\t\tWrite the output in the specified log file\n";
 	cout << "-c, --connect\t\tConnect to the specified IP address for the desman\n";
+	cout << "-l, --local\t\tConnect to the desman on this host instead, sending reports through shared memory\n";
 	cout << "OPTIONAL:\n";
 	cout << "-t, --timeslice\t\tNumber of seconds to monitor traffic before sending report to desman (default = 1.0)\n";
+	cout << "\t\t\tSlices are aligned to multiples of the timeslice since the epoch\n";
+	cout << "-a, --alert\t\tAlert when a metric or detector is more than the specified number of times its value\n";
+	cout << "\t\t\tin the previous timeslice (default = 3, see the backtest tool to choose one)\n";
+	cout << "-s, --signatures\tMatch TCP/UDP payloads against the signatures in the specified rule file\n";
+	cout << "\t\t\t(one 'name pattern' per line, with |hex| for binary bytes, e.g. 'nop-sled |90 90 90 90|')\n";
+	cout << "-b, --blocklist\t\tAlert on traffic to/from the addresses in the specified blocklist index\n";
+	cout << "\t\t\t(built with the blocklist tool, reloaded on SIGHUP)\n";
+	cout << "-p, --prefixes\t\tAlso total and alert on traffic per destination CIDR group in the specified file\n";
+	cout << "\t\t\t(one 'group prefix' per line, e.g. 'customers 198.51.100.0/24')\n";
+	cout << "-m, --memory\t\tMemory budget in MB for per-timeslice traffic data (default = " << DEFAULT_MEMORY_MB << ", 0 = unlimited)\n";
+	cout << "\t\t\tOnce reached, new destinations are only counted in the totals (reported as degraded)\n";
+	cout << "-f, --filter\t\tOnly capture traffic matching the specified BPF filter (default = all TCP/UDP/ICMP over IPv4/IPv6)\n";
+	cout << "-z, --snaplen\t\tBytes to capture per frame on a live interface (default = " << HEADER_SNAPLEN << ", or " << FULL_SNAPLEN << " with -s)\n";
+	cout << "-B, --buffer\t\tKernel capture buffer size in MB on a live interface (default = " << DEFAULT_BUFFER_MB << ")\n";
+	cout << "-I, --immediate\t\tDeliver packets from a live interface as soon as they arrive (no buffering)\n";
+	cout << "-R, --record\t\tKeep the packet headers of the specified number of seconds in memory and dump them to\n";
+	cout << "\t\t\t<logfile>.<slice>.pcap whenever a report is an alert\n";
+	cout << "-F, --full\t\tWith -R, keep full packets rather than headers\n";
+	cout << "-O, --offender\t\tWith -R, only dump the packets of the destination that triggered the alert\n";
+	cout << "-S, --snapshot\t\tResume from the baselines saved in the specified snapshot file (if it exists) and keep\n";
+	cout << "\t\t\tsaving them to it, so a restarted watchdog doesn't alert against an empty baseline\n";
+	cout << "\t\t\t(with several interfaces, one <snapshot>.<interface> file each); a live capture stopped\n";
+	cout << "\t\t\twith SIGINT/SIGTERM saves them once more as of the last complete timeslice\n";
+	cout << "-K, --checkpoint\tWith -S, number of seconds between snapshots (default = " << CHECKPOINT_SECS << ")\n";
+	cout << "-C, --capture-cpus\tPin the capture threads (which also analyze the packets) to the specified CPUs, one\n";
+	cout << "\t\t\teach in turn (e.g. 2-5,8; default = one CPU per interface with several, else not pinned)\n";
+	cout << "\t\t\tEach interface's tables and capture buffer are allocated on its CPU's NUMA node\n";
+	cout << "-P, --report-cpus\tPin the main thread (which closes the slices and sends the reports) to the specified CPUs\n";
+	cout << "-L, --log-cpus\t\tPin the flight recorder's and snapshot writer's threads to the specified CPUs\n";
+	cout << "-H, --hugepages\t\tBack the large tables (flows, streams, flight recorder, traffic data) with huge pages,\n";
+	cout << "\t\t\tfrom the reserved pool (vm.nr_hugepages) if it has room, else transparent huge pages\n";
 }
 
 
 /** Parses cmd line arguments and saves options into fn args.
 	Returns TRUE if all opts are valid 
 	Returns FALSE if anything goes wrong or if any opts are invalid **/
-bool ParseCmdLineArgs(int argc, char** argv, string& pcapfile, string& interface, 
-							string& logfile, string& desmanIP, double& timeslice)
+bool ParseCmdLineArgs(int argc, char** argv, vector<string>& pcapfiles, vector<string>& interfaces, 
+							string& logfile, string& desmanIP, bool& local, double& timeslice, double& alertFactor, string& rulefile, string& blockfile, string& prefixfile, int& memoryMB,
+							string& filter, int& snaplen, int& bufferMB, bool& immediate,
+							double& recordSecs, bool& recordFull, bool& recordKeyOnly, string& snapshotfile, double& checkpointSecs,
+							vector<int>& captureCpus, vector<int>& reportCpus, vector<int>& logCpus, bool& hugePages)
 {
 	
-	pcapfile = "";
-	interface = "";
+	pcapfiles.clear();
+	interfaces.clear();
 	logfile = "";
 	desmanIP = "";
+	local = false;
 	timeslice = 1.0;
+	alertFactor = 3.0;
+	rulefile = "";
+	blockfile = "";
+	prefixfile = "";
+	memoryMB = DEFAULT_MEMORY_MB;
+	filter = ""; // (chosen by link type once the capture is open)
+	snaplen = 0; // (chosen below)
+	bufferMB = DEFAULT_BUFFER_MB;
+	immediate = false;
+	recordSecs = 0;
+	recordFull = false;
+	recordKeyOnly = false;
+	snapshotfile = "";
+	checkpointSecs = CHECKPOINT_SECS;
+	captureCpus.clear();
+	reportCpus.clear();
+	logCpus.clear();
+	hugePages = false;
 
 	int c;
 
-	while ((c = getopt(argc, argv, "r:i:w:c:t:")) != -1)
+	while ((c = getopt(argc, argv, "r:i:w:c:lt:a:s:b:p:m:f:z:B:IR:FOS:K:C:P:L:H")) != -1)
 	{
 		switch (c)
 		{
 			case 'r':
-				pcapfile = optarg;
+				if (!ListPcapFiles(optarg, pcapfiles))
+				{
+					return false;
+				}
 				g_liveMode = false;
 				break;
 			case 'i':
-				interface = optarg;
+				interfaces.push_back(optarg);
 				g_liveMode = true;
 				break;
 			case 'w':
@@ -96,45 +264,219 @@ bool ParseCmdLineArgs(int argc, char** argv, string& pcapfile, string& interface
 			case 'c':
 				desmanIP = optarg;
 				break;
+			case 'l':
+				local = true;
+				break;
 			case 't':
 				istringstream(string(optarg)) >> timeslice;
 				break;
+			case 'a':
+				istringstream(string(optarg)) >> alertFactor;
+				if (alertFactor <= 0)
+				{
+					cout << "Error: alert factor must be positive\n";
+					return false;
+				}
+				break;
+			case 's':
+				rulefile = optarg;
+				break;
+			case 'b':
+				blockfile = optarg;
+				break;
+			case 'p':
+				prefixfile = optarg;
+				break;
+			case 'm':
+				istringstream(string(optarg)) >> memoryMB;
+				break;
+			case 'f':
+				filter = optarg;
+				break;
+			case 'z':
+				istringstream(string(optarg)) >> snaplen;
+				if (snaplen <= 0)
+				{
+					cout << "Error: snaplen must be positive\n";
+					return false;
+				}
+				break;
+			case 'B':
+				istringstream(string(optarg)) >> bufferMB;
+				break;
+			case 'I':
+				immediate = true;
+				break;
+			case 'R':
+				istringstream(string(optarg)) >> recordSecs;
+				if (recordSecs <= 0)
+				{
+					cout << "Error: recording time must be positive\n";
+					return false;
+				}
+				break;
+			case 'F':
+				recordFull = true;
+				break;
+			case 'O':
+				recordKeyOnly = true;
+				break;
+			case 'S':
+				snapshotfile = optarg;
+				break;
+			case 'K':
+				istringstream(string(optarg)) >> checkpointSecs;
+				if (checkpointSecs <= 0)
+				{
+					cout << "Error: checkpoint interval must be positive\n";
+					return false;
+				}
+				break;
+			case 'C':
+			case 'P':
+			case 'L':
+				if (!ParseCpuList(optarg, (c == 'C') ? captureCpus : (c == 'P') ? reportCpus : logCpus))
+				{
+					cout << "Error: invalid CPU list '" << optarg << "' (e.g. 0-3,8)\n";
+					return false;
+				}
+				break;
+			case 'H':
+				hugePages = true;
+				break;
 			default:
 				return false;
 		}
 	}
 
 	// verify user options are valid
-	if (desmanIP == "")
+	if (desmanIP == "" && !local)
 	{
 		cout << "Error: must provide desman IP\n";
 		return false;
 	}
 
+	if (desmanIP != "" && local)
+	{
+		cout << "Error: Please provide only one of either desman IP or -l (not both)\n";
+		return false;
+	}
+
 	if (logfile == "")
 	{
 		cout << "Error: must provide logfile name\n";
 		return false;
 	}
 
-	if (interface == "" && pcapfile == "")
+	if (interfaces.empty() && pcapfiles.empty())
 	{
 		cout << "Error: must provide live interface name or pcapfile\n";
 		return false;
 	}
 
-	if (interface != "" && pcapfile != "")
+	if (!interfaces.empty() && !pcapfiles.empty())
 	{
 		cout << "Error: Please provide only one of either live interface name or pcapfile (not both)\n";
 		return false;
 	}
 
+	for (size_t i = 0; i < interfaces.size(); i++)
+	{
+		if (find(interfaces.begin(), interfaces.begin() + i, interfaces[i]) != interfaces.begin() + i)
+		{
+			cout << "Error: interface " << interfaces[i] << " given more than once\n";
+			return false;
+		}
+	}
+
 	if (timeslice < 0.1)
 	{
 		cout << "Error: timeslice must be at least 0.1 seconds\n";
 		return false;
 	}
 
+	if (memoryMB < 0)
+	{
+		cout << "Error: memory budget can't be negative\n";
+		return false;
+	}
+
+	if (bufferMB < 1)
+	{
+		cout << "Error: capture buffer must be at least 1 MB\n";
+		return false;
+	}
+
+	// headers are all we need, unless payloads are matched against signatures
+	if (snaplen == 0)
+	{
+		snaplen = (rulefile != "") ? FULL_SNAPLEN : HEADER_SNAPLEN;
+	}
+
+	return true;
+}
+
+
+/** Receives a message (a line ending in '\n') from the desman into MSG, without the '\n'. Reads a byte
+	at a time so nothing after the line is consumed. Returns FALSE if the connection was lost **/
+bool RecvLine(int sockfd, string& msg)
+{
+	msg = "";
+
+	char c;
+	while (msg.length() < MAXBUFLEN)
+	{
+		if (recv(sockfd, &c, 1, 0) <= 0)
+		{
+			return false;
+		}
+
+		if (c == '\n')
+		{
+			return true;
+		}
+		msg += c;
+	}
+
+	return true;
+}
+
+
+/** Sends a message to the desman as a line (a '\n' is appended), however many send() calls it takes.
+	With PRING (connected to a desman on this host) the line is written into the report ring instead,
+	waiting for the desman to make room if it's full. Returns FALSE if an error occured **/
+bool SendToDesman(int sockfd, ShmRing* pRing, const string& msg)
+{
+	string line = msg + "\n";
+	size_t sent = 0;
+
+	while (sent < line.length())
+	{
+		if (pRing != NULL)
+		{
+			size_t bytes = pRing->Write(line.c_str() + sent, line.length() - sent);
+			if (bytes == 0)
+			{
+				// ring full: make sure the desman is still there (it closes the socket on exit), then wait for it
+				char c;
+				if (recv(sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+				{
+					return false;
+				}
+				this_thread::sleep_for(chrono::milliseconds(1));
+			}
+			sent += bytes;
+			continue;
+		}
+
+		ssize_t bytes = send(sockfd, line.c_str() + sent, line.length() - sent, MSG_NOSIGNAL);
+		if (bytes == -1)
+		{
+			return false;
+		}
+		sent += bytes;
+	}
+
 	return true;
 }
 
@@ -160,13 +502,56 @@ int ConnectToDesman(int& sockfd, sockaddr_in* pSA)
 	cout << "Connected to desman\n";
 
 	/** Receive "UID <id>" msg from desman **/
-	char buf[MAXBUFLEN] = {0};
-	if (recv(sockfd, buf, MAXBUFLEN, 0) == -1)
+	string msg;
+	if (!RecvLine(sockfd, msg))
 	{
 		cout << "Error receiving ID from desman\n";
 		return -1;
 	}
-	string msg(buf);
+
+	/** parse msg to get ID as an integer and return **/
+	msg.erase(0, 4); // strip "UID " from msg so only the actual id value remains
+	int id;
+	istringstream(msg) >> id; // convert id to integer
+
+	return id;
+}
+
+
+/** Connects to the desman on this host through its local socket, returning the assigned WD ID upon success.
+	The ID arrives with the report ring (see ShmRing) that reports are then written into, which is mapped
+	into RING. Returns -1 if any errors occured **/
+int ConnectToLocalDesman(int& sockfd, ShmRing& ring)
+{
+	sockaddr_un sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path + 1, DESMAN_LOCAL_SOCKET, sizeof(sa.sun_path) - 2); // (abstract name)
+	socklen_t len = offsetof(sockaddr_un, sun_path) + 1 + strlen(DESMAN_LOCAL_SOCKET);
+
+	if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+	{
+		cout << "Error creating socket\n";
+		return -1;
+	}
+
+	if (connect(sockfd, (sockaddr *)&sa, len) == -1)
+	{
+		cout << "Error connecting to local desman\n";
+		return -1;
+	}
+
+	cout << "Connected to desman\n";
+
+	/** Receive "UID <id>" msg (with the ring) from desman **/
+	char first;
+	string msg;
+	if (!ring.ReceiveDescriptors(sockfd, first) || !RecvLine(sockfd, msg))
+	{
+		cout << "Error receiving ID from desman\n";
+		return -1;
+	}
+	msg = first + msg;
 
 	/** parse msg to get ID as an integer and return **/
 	msg.erase(0, 4); // strip "UID " from msg so only the actual id value remains
@@ -182,14 +567,14 @@ int ConnectToDesman(int& sockfd, sockaddr_in* pSA)
 	Returns FALSE if any errors occured **/
 bool StandbyToStart(int sockfd)
 {
-	char buf[MAXBUFLEN] = {0};
+	string msg;
 
-	if (recv(sockfd, buf, MAXBUFLEN, 0) == -1)
+	if (!RecvLine(sockfd, msg))
 	{
 		return false;
 	}
 
-	if (string(buf) != "start")
+	if (msg != "start")
 	{
 		return false;
 	}
@@ -198,100 +583,114 @@ bool StandbyToStart(int sockfd)
 }
 
 
-void GetPacket(u_char* args, const pcap_pkthdr* header, const u_char* packet)
+/** Combines the reports the shards generated for one timeslice (REPORTS, in shard order) into a single
+	report numbered REPORTID: the summed totals and the key of the first shard alerting on one, then
+	the totals of each interface as if:<name>=packets/bytes/flows, the interfaces that alerted as
+	ifalert=<name>,... and finally each shard's remaining tokens prefixed with <name>:. The desman only
+	reads the leading totals, so it sees the sensor as a whole. The heaviest keys (top= and topfloor=)
+	are instead merged into one unprefixed list (see TopKSummary), which the desman merges across
+	watchdogs. A single shard's report is passed on unchanged **/
+string CombineReports(const vector<unique_ptr<CaptureShard> >& shards, const vector<ShardReport>& reports, int reportId)
 {
-	TrafficAnalyzer* pTrafficAnalyzer = (TrafficAnalyzer*)args; // ptr to our TrafficAnalyzer instance
+	if (reports.size() == 1)
+	{
+		return reports[0].text;
+	}
+
+	vector<unsigned long long> totals(reports[0].totals.size(), 0);
+	bool alert = false;
+	string alertKey = "";
+	ostringstream ossAlerting; // (e.g. "eth0,eth2")
 
-	// If we're reading from a pcapfile, need to use timestamps to monitor time
-	if (!g_liveMode)
+	for (size_t i = 0; i < reports.size(); i++)
 	{
-		time_t secs = header->ts.tv_sec;
-		long int usecOffset = header->ts.tv_usec;
-		long long int ts_usecs = (secs * 1000000) + usecOffset;
+		for (size_t m = 0; m < totals.size(); m++)
+		{
+			totals[m] += reports[i].totals[m];
+		}
 
-		if (ts_usecs > g_maxts_usecs)
+		if (reports[i].alert)
 		{
-			
-			if (g_maxts_usecs > 0) // don't want to generate report if this is the first packet
-			{			
-				// If all packets for this timeslice have been added, generate report and add it to the queue
-				g_mtx.lock();
-				string report = pTrafficAnalyzer->GenerateReport();	
-				g_reports.push(report);
-				g_mtx.unlock();
+			ossAlerting << (alert ? "," : "") << shards[i]->Name();
+			alert = true;
+
+			if (alertKey == "")
+			{
+				alertKey = reports[i].alertKey;
 			}
-			g_maxts_usecs = ts_usecs + (long long int)(g_timeslice * 1000000.0);
 		}
 	}
 
-	PacketInfo pktInfo; // We'll store all data we need about the packet in here
-
-	const sniff_ip* ip;		// the IP header
-	const sniff_tcp* tcp;  	// the TCP header
-	u_int size_ip;			// size of ip header
+	ostringstream ossReport;
+	if (alert)
+	{
+		ossReport << "alert ";
+		LogMessage("alert on " + ossAlerting.str()); // log alert
+	}
 
-	// Compute IP header offset
-	ip = (sniff_ip*)(packet + SIZE_ETHERNET);
-	size_ip = IP_HL(ip)*4;
-	if (size_ip < 20)
+	ossReport << "report " << reportId;
+	for (size_t m = 0; m < totals.size(); m++)
 	{
-		// invalid ip header length
-		return;
+		ossReport << " " << totals[m];
 	}
 
-	// Determine packet size
-	pktInfo.size = ntohs(ip->ip_len);
+	if (alertKey != "")
+	{
+		ossReport << " " << alertKey;
+	}
 
-	// Determine source and destination IP addresses
-	pktInfo.src_ip = inet_ntoa(ip->ip_src);
-	pktInfo.dst_ip = inet_ntoa(ip->ip_dst);
+	for (size_t i = 0; i < reports.size(); i++)
+	{
+		ossReport << " if:" << shards[i]->Name() << "=";
+		for (size_t m = 0; m < reports[i].totals.size(); m++)
+		{
+			ossReport << (m ? "/" : "") << reports[i].totals[m];
+		}
+	}
 
-	// Determine protocol (We only care about TCP/UDP)
-	switch(ip->ip_p)
+	if (alert)
 	{
-		case IPPROTO_TCP:
-			pktInfo.protocol = "TCP";
-			break;
-		case IPPROTO_UDP:
-			pktInfo.protocol = "UDP";
-			break;
-		case IPPROTO_ICMP:
-			pktInfo.protocol = "ICMP";
-			break;
-		case IPPROTO_IP:
-			pktInfo.protocol = "IP";
-			break;
-		default:
-			pktInfo.protocol = "unknown";
-			return;
+		ossReport << " ifalert=" << ossAlerting.str();
 	}
 
-	if (pktInfo.protocol == "TCP" || pktInfo.protocol == "UDP")
+	TopKSummary top;
+	bool hasTop = false;
+	for (size_t i = 0; i < reports.size(); i++)
 	{
-		// Compute TCP header offset (can use this for UDP also since we just need src/dst ports)
-		tcp = (sniff_tcp*)(packet + SIZE_ETHERNET + size_ip);
+		istringstream issDetails(reports[i].details);
+		string tok;
+		string shardTop, shardTopFloor;
+		while (issDetails >> tok)
+		{
+			if (tok.compare(0, 4, "top=") == 0)
+			{
+				shardTop = tok.substr(4);
+			}
+			else if (tok.compare(0, 9, "topfloor=") == 0)
+			{
+				shardTopFloor = tok.substr(9);
+			}
+			else
+			{
+				ossReport << " " << shards[i]->Name() << ":" << tok;
+			}
+		}
 
-		// Determine source and destination ports
-		pktInfo.src_port = ntohs(tcp->th_sport);
-		pktInfo.dst_port = ntohs(tcp->th_dport);
+		TopKSummary summary;
+		if (shardTop != "" && summary.Parse(shardTop, shardTopFloor))
+		{
+			top.Merge(summary);
+			hasTop = true;
+		}
 	}
-	else
+
+	if (hasTop)
 	{
-		pktInfo.src_port = 0;
-		pktInfo.dst_port = 0;
+		ossReport << " top=" << top.Format() << " topfloor=" << top.Floor();
 	}
 
-
-	// Add packet to traffic analyzer for processing
-	g_mtx.lock();
-	pTrafficAnalyzer->AddPacket(pktInfo);
-	g_mtx.unlock();
-}
-
-/** calls pcap_loop(). This code will be executed by child thread **/
-void MonitorTraffic(pcap_t* pHandle, TrafficAnalyzer* pTrafficAnalyzer)
-{
-	pcap_loop(pHandle, -1, GetPacket, (u_char*)pTrafficAnalyzer); // loop through packets
+	LogMessage(ossReport.str()); // log report
+	return ossReport.str();
 }
 
 
@@ -300,21 +699,42 @@ int main(int argc, char** argv)
 
 	/** Parse input args **/   // TODO
 	string desmanIP;
+	bool local;
 	string logfile;
-	string interface;
-	string pcapfile;
+	vector<string> interfaces;
+	vector<string> pcapfiles;
 	double timeslice;
-
-	if (!ParseCmdLineArgs(argc, argv, pcapfile, interface, logfile, desmanIP, timeslice))
+	double alertFactor;
+	string rulefile;
+	string blockfile;
+	string prefixfile;
+	int memoryMB;
+	string filter;
+	int snaplen;
+	int bufferMB;
+	bool immediate;
+	double recordSecs;
+	bool recordFull;
+	bool recordKeyOnly;
+	string snapshotfile;
+	double checkpointSecs;
+	vector<int> captureCpus;
+	vector<int> reportCpus;
+	vector<int> logCpus;
+	bool hugePages;
+
+	if (!ParseCmdLineArgs(argc, argv, pcapfiles, interfaces, logfile, desmanIP, local, timeslice, alertFactor, rulefile, blockfile, prefixfile, memoryMB,
+							filter, snaplen, bufferMB, immediate, recordSecs, recordFull, recordKeyOnly,
+							snapshotfile, checkpointSecs, captureCpus, reportCpus, logCpus, hugePages))
 	{
 		// if any invalid arguments, print usage instructions and exit
 		PrintUsgInstr();
 		return 0;
 	}
 
-	// save interface/timeslice value as global variables
+	// save logfile/timeslice value as global variables
 	g_logfile = logfile;
-	g_timeslice = timeslice;
+	g_sliceClock = SliceClock(timeslice);
 
 	// Clear out our logfile (so any old data is overwritten)
 	fstream fs; 
@@ -322,29 +742,131 @@ int main(int argc, char** argv)
 	fs.close();
 
 
-	/** Initialize our pcap session **/
+	/** Create a capture shard (capture thread + analyzer) per interface, or one for the pcap files **/
+
+	vector<string> sources = g_liveMode ? interfaces : vector<string>(1, pcapfiles[0]);
+	vector<unique_ptr<CaptureShard> > shards;
 
-	char errbuf[PCAP_ERRBUF_SIZE];
-	pcap_t* pHandle;
+	// (must precede the first table allocated)
+	if (hugePages)
+	{
+		EnableLargePages();
+	}
 
-	if (g_liveMode) // If we're reading from a live interface...
+	// CPU of each shard's capture thread (-1 = not pinned): taken in turn from -C, else with several
+	// interfaces each thread gets its own CPU (as far as there are CPUs)
+	unsigned int numCpus = max(thread::hardware_concurrency(), 1u);
+	vector<int> shardCpus(sources.size(), -1);
+	for (size_t i = 0; i < sources.size(); i++)
 	{
+		if (!captureCpus.empty())
+		{
+			shardCpus[i] = captureCpus[i % captureCpus.size()];
+		}
+		else if (sources.size() > 1)
+		{
+			shardCpus[i] = (int)(i % numCpus);
+		}
+	}
+
+	vector<int> mainCpus;
+	GetThreadAffinity(pthread_self(), mainCpus);
+
+	for (size_t i = 0; i < sources.size(); i++)
+	{
+		// set the shard up from its capture CPU's NUMA node, so the pages of its tables, flight recorder and
+		// kernel capture buffer are allocated there (first touch) and its pcap readers start there
+		if (shardCpus[i] >= 0)
+		{
+			if (!SetThreadAffinity(pthread_self(), NodeCpus(shardCpus[i])))
+			{
+				cout << "Error: unable to run on CPU " << shardCpus[i] << "\n";
+				return 0;
+			}
+
+			ostringstream oss;
+			oss << "Capturing " << sources[i] << " on CPU " << shardCpus[i] << " (NUMA node " << CpuNode(shardCpus[i]) << ")";
+			LogMessage(oss.str());
+		}
+
+		// with several interfaces each shard logs its own reports to <logfile>.<interface>
+		string shardLog = (sources.size() > 1) ? logfile + "." + sources[i] : logfile;
+		if (sources.size() > 1)
+		{
+			fs.open(shardLog, fstream::out);
+			fs.close();
+		}
+
+		shards.push_back(unique_ptr<CaptureShard>(new CaptureShard(sources[i], shardLog, g_sliceClock)));
+		CaptureShard* pShard = shards.back().get();
+
+		// the memory budgets are for the whole process, so they are split between the shards
+		WatchdogAnalyzer& analyzer = pShard->GetAnalyzer();
+		analyzer.SetMemoryBudget((size_t)memoryMB * 1024 * 1024 / sources.size());
+		analyzer.SetAlertFactor(alertFactor);
+
+		if (rulefile != "" && !analyzer.LoadSignatures(rulefile))
+		{
+			return 0;
+		}
+
+		if (prefixfile != "" && !analyzer.LoadPrefixes(prefixfile))
+		{
+			return 0;
+		}
+
+		bool opened = g_liveMode ? pShard->OpenLive(snaplen, bufferMB, immediate, filter) : pShard->OpenOffline(pcapfiles, filter);
+		if (!opened)
+		{
+			return 0;
+		}
+
+		if (recordSecs > 0 && !pShard->EnableRecorder((size_t)FLIGHT_RECORDER_MB * 1024 * 1024 / sources.size(),
+															recordSecs, recordFull, recordKeyOnly, shardLog))
+		{
+			return 0;
+		}
+
+		if (snapshotfile != "")
+		{
+			pShard->EnableSnapshots((sources.size() > 1) ? snapshotfile + "." + sources[i] : snapshotfile, checkpointSecs);
+		}
 
-		pHandle = pcap_open_live(interface.c_str(), BUFSIZ, 1, 1000, errbuf);
-		if (pHandle == NULL)
+		if (!logCpus.empty() && !pShard->SetLoggingAffinity(logCpus))
 		{
-			cout << "Couldn't open device " << errbuf << endl;
+			cout << "Error: unable to run the logging threads on the specified CPUs\n";
 			return 0;
 		}
 	}
-	else // If we're reading from a pcap file...
+
+	if (!SetThreadAffinity(pthread_self(), reportCpus.empty() ? mainCpus : reportCpus))
+	{
+		cout << "Error: unable to run the main thread on the specified CPUs\n";
+		return 0;
+	}
+
+	if (hugePages)
 	{
-		pHandle = pcap_open_offline(pcapfile.c_str(), errbuf);
-		if (pHandle == NULL)
+		ostringstream oss;
+		oss << "Huge pages: " << ReservedHugePageBytes() / (1024 * 1024) << " MB reserved, "
+			<< TransparentHugePageBytes() / (1024 * 1024) << " MB transparent";
+		LogMessage(oss.str());
+	}
+
+	if (blockfile != "")
+	{
+		if (!LoadBlocklist(shards, blockfile))
 		{
-			cout << "Couldn't open pcap file " << errbuf << endl;
 			return 0;
 		}
+		signal(SIGHUP, OnSighup);
+	}
+
+	if (g_liveMode && snapshotfile != "")
+	{
+		// (stop cleanly so the baselines of the last complete slice are saved)
+		signal(SIGINT, OnStop);
+		signal(SIGTERM, OnStop);
 	}
 
 
@@ -352,26 +874,43 @@ int main(int argc, char** argv)
 	/** Establish connection to desman and receive ID **/
 
 	int sockfd;
-	sockaddr_in sockaddr;
+	int id = 0;
+	ShmRing ring;
+	ShmRing* pRing = NULL; // (reports are sent over TCP unless the desman is on this host)
 
-	// Setup our sockaddr_in struct
-	memset(&sockaddr, 0, sizeof(sockaddr));
-	sockaddr.sin_family = AF_INET;
-	sockaddr.sin_port = htons(DESMAN_PORT);
-	if (inet_aton(desmanIP.c_str(), &sockaddr.sin_addr) == 0)
+	if (local)
 	{
-		cout << "Error setting IP address\n";
-		return 0;
+		LogMessage("Connecting to desman on this host...");
+
+		if ((id = ConnectToLocalDesman(sockfd, ring)) == -1)
+		{
+			cout << "Unable to establish connection to Desman\n";
+			return 0;
+		}
+		pRing = &ring;
 	}
+	else
+	{
+		sockaddr_in sockaddr;
+
+		// Setup our sockaddr_in struct
+		memset(&sockaddr, 0, sizeof(sockaddr));
+		sockaddr.sin_family = AF_INET;
+		sockaddr.sin_port = htons(DESMAN_PORT);
+		if (inet_aton(desmanIP.c_str(), &sockaddr.sin_addr) == 0)
+		{
+			cout << "Error setting IP address\n";
+			return 0;
+		}
 
-	// Log "Connecting to desman..." msg
-	LogMessage("Connecting to desman at " + desmanIP + "...");
+		// Log "Connecting to desman..." msg
+		LogMessage("Connecting to desman at " + desmanIP + "...");
 
-	int id = 0;
-	if ((id = ConnectToDesman(sockfd, &sockaddr)) == -1)
-	{
-		cout << "Unable to establish connection to Desman\n";
-		return 0;
+		if ((id = ConnectToDesman(sockfd, &sockaddr)) == -1)
+		{
+			cout << "Unable to establish connection to Desman\n";
+			return 0;
+		}
 	}
 
 	// Log "Received <UID>" msg
@@ -392,62 +931,134 @@ int main(int argc, char** argv)
 
 	LogMessage("Received start...");
 
-
-	TrafficAnalyzer trafficAnalyzer(logfile);	// Create our TrafficAnalyzer instance
-
-	// Create child thread to loop through packets, storing packet data in trafficAnalyzer
-	thread trafficMonitor_th(MonitorTraffic, pHandle, &trafficAnalyzer);
+	// Start a capture thread per shard, storing packet data in the shard's analyzer
+	for (size_t i = 0; i < shards.size(); i++)
+	{
+		shards[i]->Start(shardCpus[i], rulefile != "");
+	}
 
 	
 	if (g_liveMode) /** MAIN APPLICATION LOOP - LIVE INTERFACE **/
 	{
-		// Main thread generates reports every TIMESLICE (wallclock) and sends them to desman
+		// Main thread closes each timeslice at its (wallclock, epoch aligned) boundary and sends the reports 
+		// to desman. Deadlines are absolute so time spent reporting doesn't shift later slices.
+		long long slice = g_sliceClock.CurrentSlice();
+		chrono::microseconds grace(min(g_sliceClock.SliceUsecs() / 4, (long long)MAX_GRACE_USECS));
+
+		for (size_t i = 0; i < shards.size(); i++)
+		{
+			shards[i]->CloseSlices(slice);
+		}
+
+		vector<queue<ShardReport> > pending(shards.size());	// reports taken from each shard, not yet combined
+		int reportsSent = 0;
+		bool captureEnded = false;	// TRUE once a shard's capture has ended on its own (e.g. interface down)
+
 		do
 		{
-			// sleep for TIMESLICE secs...
-			this_thread::sleep_for(chrono::milliseconds( (int)(g_timeslice * 1000) )); 
+			// sleep until the current slice has ended (plus a grace period for packets still in the capture buffer)
+			SleepUntil(g_sliceClock.Deadline(slice) + grace);
+			if (g_stop)
+			{
+				break;
+			}
+			slice++;
+
+			if (g_reloadBlocklist)
+			{
+				g_reloadBlocklist = 0;
+				LoadBlocklist(shards, blockfile);
+			}
 
-			// process data and generate report
-			g_mtx.lock();
-			string report = trafficAnalyzer.GenerateReport();
-			g_mtx.unlock();
+			for (size_t i = 0; i < shards.size(); i++)
+			{
+				// shed load if the capture thread is falling behind (takes effect from the next slice)
+				shards[i]->AdaptSampleRate();
+
+				// close the slice (if a packet from a later slice hasn't already) and grab all pending reports
+				shards[i]->CloseSlices(slice);
+				if (shards[i]->TakeReports(pending[i]) && !captureEnded)
+				{
+					LogMessage("Error: capture on " + shards[i]->Name() + " has ended, stopping");
+					captureEnded = true;
+				}
+			}
 
-			// send report to desman
-			if (send(sockfd, report.c_str(), report.length(), 0) == -1)	
+			// every shard reports every slice, so the reports at the front of the queues are for the same slice
+			while (1)
 			{
-				cout << "Error sending report to desman\n";
-				return 0;
+				vector<ShardReport> reports;
+				for (size_t i = 0; i < shards.size() && !pending[i].empty(); i++)
+				{
+					reports.push_back(pending[i].front());
+				}
+
+				if (reports.size() < shards.size())
+				{
+					break;
+				}
+
+				for (size_t i = 0; i < shards.size(); i++)
+				{
+					pending[i].pop();
+				}
+
+				// send report to desman
+				string report = CombineReports(shards, reports, ++reportsSent);
+				if (!SendToDesman(sockfd, pRing, report))
+				{
+					cout << "Error sending report to desman\n";
+					return 0;
+				}
 			}
 		}
-		while (1); // Run until user terminates (via ctrl+C)
+		while (!captureEnded); // Run until user terminates (via ctrl+C) or a capture fails
+
+		// stopped by SIGINT/SIGTERM (with -S) or a failed capture: each capture thread saves a final snapshot as it ends
+		// (a sensor that can no longer see one of its interfaces stops rather than report it as silent)
+		LogMessage("Stopping...");
+		for (size_t i = 0; i < shards.size(); i++)
+		{
+			shards[i]->Stop();
+		}
 	}
 	else /** MAIN APPLICATION LOOP - PCAP FILE **/
 	{
-		do
+		// Reports are sent one per TIMESLICE, paced against absolute deadlines
+		chrono::steady_clock::time_point deadline = chrono::steady_clock::now();
+		queue<ShardReport> reports;
+
+		while (1)
 		{
-			// sleep for TIMESLICE secs...
-			this_thread::sleep_for(chrono::milliseconds( (int)(g_timeslice * 1000) ));
+			deadline += chrono::microseconds(g_sliceClock.SliceUsecs());
+			this_thread::sleep_until(deadline);
+
+			if (g_reloadBlocklist)
+			{
+				g_reloadBlocklist = 0;
+				LoadBlocklist(shards, blockfile);
+			}
 
 			// grab next report from queue (processing done ahead of time)
-			g_mtx.lock();
-			string report = g_reports.front();
-			g_reports.pop();
-			g_mtx.unlock();
+			bool done = shards[0]->TakeReports(reports);
+			if (reports.empty())
+			{
+				if (done) break; // Once all reports are sent we can terminate
+				continue;
+			}
+			string report = reports.front().text;
+			reports.pop();
 
 			// send report to desman
-			if (send(sockfd, report.c_str(), report.length(), 0) == -1)	
+			if (!SendToDesman(sockfd, pRing, report))
 			{
 				cout << "Error sending report to desman\n";
 				return 0;
 			}
 		}
-		while (!g_reports.empty()); // Once all reports are sent we can terminate
 	}
 	
 
 
-	trafficMonitor_th.join();
-	pcap_close(pHandle);
 	return 0;
 }
-
@@ -0,0 +1,356 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "packet_info.h"
+#include "arena.h"
+
+#include <string>
+#include <sstream>
+#include <new>
+#include <math.h>
+#include <string.h>
+
+using namespace std;
+
+
+/**************************************************************************************************/
+/***  Aggregation keys: select which packet field TrafficAnalyzer groups its traffic data by.    ***/
+/***  Each key provides key_type, Extract() (packet -> key) and Format() (key -> report text).   ***/
+/**************************************************************************************************/
+
+/** @brief Aggregates traffic per destination IP address */
+struct DstKey
+{
+	typedef uint32_t key_type;
+
+	static key_type Extract(const PacketInfo& p) { return p.dst_ip; }
+
+	static string Format(key_type key) { return IpToString(key); }
+};
+
+/** @brief Aggregates traffic per source IP address */
+struct SrcKey
+{
+	typedef uint32_t key_type;
+
+	static key_type Extract(const PacketInfo& p) { return p.src_ip; }
+
+	static string Format(key_type key) { return IpToString(key); }
+};
+
+/** @brief Aggregates traffic per destination IP address and port (e.g. '10.0.0.5:80') */
+struct DstPortKey
+{
+	typedef uint64_t key_type;
+
+	static key_type Extract(const PacketInfo& p) { return ((uint64_t)p.dst_ip << 16) | (u_short)p.dst_port; }
+
+	static string Format(key_type key)
+	{
+		ostringstream oss;
+		oss << IpToString((uint32_t)(key >> 16)) << ":" << (key & 0xffff);
+		return oss.str();
+	}
+};
+
+/** @brief Aggregates traffic per IP protocol */
+struct ProtocolKey
+{
+	typedef u_char key_type;
+
+	static key_type Extract(const PacketInfo& p) { return p.protocol; }
+
+	static string Format(key_type key) { return ProtocolToString(key); }
+};
+
+
+
+/** @brief Set of unique flows stored in an open addressing hash table allocated from an Arena
+
+	Starts out empty and grows by doubling (the old table is abandoned to the arena), so
+	a set holding a handful of flows costs no more than a short list while large sets stay O(1).
+
+	If the table needs to grow while the arena is over its budget, the set is converted in place into
+	a HyperLogLog sketch stored in the table's own memory (at least MIN_REGISTERS registers), after
+	which Size() is an estimate (a few percent error) and the set uses no further memory.
+	*/
+class FlowSet
+{
+
+private:
+
+	/** @brief A single hash table entry */
+	struct Slot
+	{
+		flow_t flow;
+		bool used;
+	};
+
+	/** The arena new tables are allocated from */
+	Arena* m_arena;
+
+	/** Hash table (m_capacity entries, always a power of two) */
+	Slot* m_slots;
+
+	/** Number of entries in m_slots */
+	uint32_t m_capacity;
+
+	/** Number of unique flows stored */
+	uint32_t m_size;
+
+	/** Number of HyperLogLog registers (0 while the set is exact) */
+	uint32_t m_numRegisters;
+
+	/** Smallest and largest number of registers used by a sketch (the smallest table holds MIN_REGISTERS bytes) */
+	static const uint32_t MIN_REGISTERS = 128;
+	static const uint32_t MAX_REGISTERS = 4096;
+
+	/** @brief Returns the sketch registers (stored in place of m_slots) */
+	uint8_t* Registers() const { return (uint8_t*)m_slots; }
+
+	/** @brief Adds a flow hash to the sketch (register = top bits, rank = leading zeros of the rest + 1) */
+	static void AddToRegisters(uint8_t* registers, uint32_t numRegisters, uint32_t hash)
+	{
+		int bits = __builtin_ctz(numRegisters);
+		uint32_t rest = hash << bits;
+		uint8_t rank = (rest == 0) ? (33 - bits) : (__builtin_clz(rest) + 1);
+
+		uint8_t& reg = registers[hash >> (32 - bits)];
+		if (rank > reg)
+		{
+			reg = rank;
+		}
+	}
+
+	/** @brief Converts the table into a sketch of all flows stored in it */
+	void ConvertToSketch()
+	{
+		uint32_t numRegisters = MIN_REGISTERS;
+		while (numRegisters * 2 <= m_capacity * sizeof(Slot) && numRegisters * 2 <= MAX_REGISTERS)
+		{
+			numRegisters *= 2;
+		}
+
+		uint8_t registers[MAX_REGISTERS] = {0};
+		for (uint32_t i = 0; i < m_capacity; i++)
+		{
+			if (m_slots[i].used)
+			{
+				AddToRegisters(registers, numRegisters, FlowHash(m_slots[i].flow));
+			}
+		}
+
+		memcpy(Registers(), registers, numRegisters);
+		m_numRegisters = numRegisters;
+	}
+
+	/** @brief Doubles the size of the hash table and re-inserts all flows */
+	void Grow()
+	{
+		if (m_capacity > 0 && m_arena->OverBudget())
+		{
+			ConvertToSketch();
+			return;
+		}
+
+		uint32_t newCapacity = (m_capacity == 0) ? 8 : m_capacity * 2;
+		Slot* newSlots = (Slot*)m_arena->Allocate(newCapacity * sizeof(Slot), alignof(Slot));
+		for (uint32_t i = 0; i < newCapacity; i++)
+		{
+			new (&newSlots[i]) Slot();
+		}
+
+		for (uint32_t i = 0; i < m_capacity; i++)
+		{
+			if (m_slots[i].used)
+			{
+				uint32_t j = FlowHash(m_slots[i].flow) & (newCapacity - 1);
+				while (newSlots[j].used)
+				{
+					j = (j + 1) & (newCapacity - 1);
+				}
+				newSlots[j] = m_slots[i];
+			}
+		}
+
+		m_slots = newSlots;
+		m_capacity = newCapacity;
+	}
+
+
+public:
+
+	/** @brief Constructor, no memory is allocated until the first Insert() */
+	explicit FlowSet(Arena& arena) : m_arena(&arena), m_slots(NULL), m_capacity(0), m_size(0), m_numRegisters(0) {}
+
+	/** @brief Adds flow to the set, returning TRUE if it was not already present (always FALSE once a sketch) */
+	bool Insert(const flow_t& flow)
+	{
+		if (m_numRegisters == 0 && (m_size + 1) * 4 > m_capacity * 3)
+		{
+			Grow();
+		}
+
+		if (m_numRegisters != 0)
+		{
+			AddToRegisters(Registers(), m_numRegisters, FlowHash(flow));
+			return false;
+		}
+
+		uint32_t i = FlowHash(flow) & (m_capacity - 1);
+		while (m_slots[i].used)
+		{
+			if (m_slots[i].flow == flow)
+			{
+				return false;
+			}
+			i = (i + 1) & (m_capacity - 1);
+		}
+
+		m_slots[i].flow = flow;
+		m_slots[i].used = true;
+		m_size++;
+		return true;
+	}
+
+	/** @brief Returns the number of unique flows in the set (estimated once it is a sketch) */
+	uint32_t Size() const
+	{
+		if (m_numRegisters == 0)
+		{
+			return m_size;
+		}
+
+		// HyperLogLog estimate, with linear counting for small cardinalities
+		double m = m_numRegisters;
+		double sum = 0;
+		uint32_t zeros = 0;
+		for (uint32_t i = 0; i < m_numRegisters; i++)
+		{
+			sum += ldexp(1.0, -Registers()[i]);
+			zeros += (Registers()[i] == 0);
+		}
+
+		double estimate = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+		if (estimate <= 2.5 * m && zeros > 0)
+		{
+			estimate = m * log(m / zeros);
+		}
+		return (uint32_t)(estimate + 0.5);
+	}
+
+	/** @brief Returns TRUE if the set has been converted to a sketch */
+	bool IsSketch() const { return m_numRegisters != 0; }
+};
+
+
+
+/**************************************************************************************************/
+/***  Metric policies: each metric keeps a State per aggregation key (allocated from the        ***/
+/***  per-timeslice arena) and provides Name(), Add() (fold a packet into the State) and        ***/
+/***  Value() (the number reported and checked for alerts). Values of a metric must be          ***/
+/***  additive across keys, since report totals are the sum over all keys.                     ***/
+/**************************************************************************************************/
+
+/** @brief Number of packets */
+struct PacketCount
+{
+	struct State
+	{
+		unsigned long long packets;
+		explicit State(Arena&) : packets(0) {}
+	};
+
+	static const char* Name() { return "packets"; }
+
+	static void Add(State& s, const PacketInfo&) { s.packets++; }
+
+	static unsigned long long Value(const State& s) { return s.packets; }
+};
+
+/** @brief Sum of the size of all packets (in bytes) */
+struct ByteCount
+{
+	struct State
+	{
+		unsigned long long bytes;
+		explicit State(Arena&) : bytes(0) {}
+	};
+
+	static const char* Name() { return "bytes"; }
+
+	static void Add(State& s, const PacketInfo& p) { s.bytes += p.size; }
+
+	static unsigned long long Value(const State& s) { return s.bytes; }
+};
+
+/** @brief Number of unique 5-tuple flows */
+struct FlowCount
+{
+	struct State
+	{
+		FlowSet flows;
+		explicit State(Arena& arena) : flows(arena) {}
+	};
+
+	static const char* Name() { return "flows"; }
+
+	static void Add(State& s, const PacketInfo& p) { s.flows.Insert(MakeFlow(p)); }
+
+	static unsigned long long Value(const State& s) { return s.flows.Size(); }
+};
+
+
+
+/** @brief Compile-time list of metric States
+
+	MetricSet<M1, M2, ...> holds one M::State per metric and forwards Add()/Values() to each
+	metric in order. The recursion is resolved at compile time so calls are fully inlined.
+	*/
+template <class... Metrics>
+struct MetricSet;
+
+template <>
+struct MetricSet<>
+{
+	explicit MetricSet(Arena&) {}
+
+	void Add(const PacketInfo&) {}
+
+	void Values(unsigned long long*) const {}
+
+	static void Names(const char**) {}
+};
+
+template <class Metric, class... Rest>
+struct MetricSet<Metric, Rest...> : MetricSet<Rest...>
+{
+	/** State of the first metric in the list */
+	typename Metric::State state;
+
+	/** @brief Constructor, all States allocate from arena */
+	explicit MetricSet(Arena& arena) : MetricSet<Rest...>(arena), state(arena) {}
+
+	/** @brief Adds a packet to every metric's State */
+	void Add(const PacketInfo& p)
+	{
+		Metric::Add(state, p);
+		MetricSet<Rest...>::Add(p);
+	}
+
+	/** @brief Writes the value of every metric to out (in metric order) */
+	void Values(unsigned long long* out) const
+	{
+		*out = Metric::Value(state);
+		MetricSet<Rest...>::Values(out + 1);
+	}
+
+	/** @brief Writes the name of every metric to out (in metric order) */
+	static void Names(const char** out)
+	{
+		*out = Metric::Name();
+		MetricSet<Rest...>::Names(out + 1);
+	}
+};
+
+#endif
@@ -4,8 +4,23 @@
 #include <arpa/inet.h>
 
 
-#define SIZE_ETHERNET 14 		// ethernet headers are always exactly 14 bytes
+#define SIZE_ETHERNET 14 		// ethernet headers are always exactly 14 bytes (without VLAN tags)
 #define ETHER_ADDR_LEN 6		// ethernet addresses are 6 bytes
+#define SIZE_VLAN_TAG 4			// 802.1Q/802.1ad tag (TCI followed by the inner ethertype)
+#define SIZE_LINUX_SLL 16		// Linux "cooked" capture header (protocol in the last 2 bytes)
+#define SIZE_NULL 4				// BSD loopback header (address family)
+#define SIZE_IPV6 40			// fixed IPv6 header
+
+#define ETHER_IPV4 0x0800		// ethertypes
+#define ETHER_IPV6 0x86dd
+#define ETHER_VLAN 0x8100		// 802.1Q
+#define ETHER_QINQ 0x88a8		// 802.1ad
+#define ETHER_QINQ_OLD 0x9100	// pre-standard QinQ
+
+#define ICMP_ECHO_REQUEST 8		// ICMP request types (the other types are replies and errors)
+#define ICMP_TIMESTAMP_REQUEST 13
+#define ICMP_MASK_REQUEST 17
+#define ICMPV6_ECHO_REQUEST 128
 
 
 /**************************************************************************************************/
@@ -68,4 +83,24 @@ struct sniff_tcp {
 
 /*************************************** END COPY-PASTED CODE ****************************************/
 
+
+/* IPv6 header */
+struct sniff_ip6
+{
+	u_int	ip6_flow;				/* version, traffic class, flow label */
+	u_short	ip6_plen;				/* payload length (excluding this header) */
+	u_char	ip6_nxt;				/* next header */
+	u_char	ip6_hlim;				/* hop limit */
+	u_char	ip6_src[16];			/* source address */
+	u_char	ip6_dst[16];			/* destination address */
+};
+
+/* Any IPv6 extension header starts with these (except that AH measures its length in 4 byte units) */
+struct sniff_ip6_ext
+{
+	u_char	ip6e_nxt;				/* next header */
+	u_char	ip6e_len;				/* length in 8 byte units, not counting the first 8 bytes */
+	u_short	ip6e_frag;				/* fragment offset and flags (fragment header only) */
+};
+
 #endif
\ No newline at end of file
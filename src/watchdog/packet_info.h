@@ -0,0 +1,92 @@
+#ifndef PACKET_INFO_H
+#define PACKET_INFO_H
+
+#include <string>
+#include <tuple>
+#include <stdint.h>
+#include <sys/types.h>
+
+using namespace std;
+
+
+/** @brief 5-tuple of src_ip, dst_ip, src_port, dst_port, and protocol */
+typedef tuple<uint32_t, uint32_t, u_short, u_short, u_char> flow_t;
+
+
+/** @brief Stores all relevant metadata for a single packet */
+struct PacketInfo
+{
+	/** Size of packet in bytes */
+	int size;
+
+	/** Source IPv4 address (host byte order), or a 32-bit fold of the IPv6 address (see ipv6) */
+	uint32_t src_ip;
+
+	/** Destination IPv4 address (host byte order), or a 32-bit fold of the IPv6 address (see ipv6) */
+	uint32_t dst_ip;
+
+	/** TRUE if an IPv6 packet. Its addresses are hashed down to 32 bits, so they key the per-address
+		metrics and detectors like IPv4 addresses but can't be looked up in the blocklist or prefix groups */
+	bool ipv6;
+
+	/** Source port number (0 if packet protocol is not TCP/UDP) */
+	int src_port;
+
+	/** Destination port number (0 if packet protocol is not TCP/UDP) */
+	int dst_port;
+
+	/** IP protocol number (IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP, IPPROTO_IP), ICMPv6 counts as IPPROTO_ICMP */
+	u_char protocol;
+
+	/** TCP flags (0 if packet protocol is not TCP) */
+	u_char tcp_flags;
+
+	/** ICMP or ICMPv6 message type (see ipv6), 0 if packet protocol is not ICMP or the type wasn't captured */
+	u_char icmp_type;
+
+	/** TCP sequence number (0 if packet protocol is not TCP) */
+	uint32_t tcp_seq;
+
+	/** Number of TCP payload bytes sent, per the IP and TCP headers (0 if packet protocol is not TCP) */
+	int tcp_len;
+
+	/** Capture timestamp in microseconds since the epoch */
+	long long ts_usecs;
+
+	/** TCP/UDP payload as captured (NULL if none). Only valid until the packet has been added. */
+	const u_char* payload;
+
+	/** Number of payload bytes captured (may be less than sent if the capture was truncated) */
+	int payload_len;
+};
+
+
+/** @brief Converts an IPv4 address in host byte order to dot-quad notation */
+string IpToString(uint32_t addr);
+
+/** @brief Converts an IP protocol number to its name ('TCP', 'UDP', 'ICMP', 'IP') */
+string ProtocolToString(u_char protocol);
+
+/** @brief Returns the 5-tuple flow of a packet */
+inline flow_t MakeFlow(const PacketInfo& p)
+{
+	return make_tuple(p.src_ip, p.dst_ip, (u_short)p.src_port, (u_short)p.dst_port, p.protocol);
+}
+
+/** @brief Hashes a flow's 5-tuple (the same flow always yields the same value) */
+inline uint32_t FlowHash(const flow_t& flow)
+{
+	uint64_t h = ((uint64_t)get<0>(flow) << 32) | get<1>(flow);
+	h ^= ((uint64_t)get<2>(flow) << 24) | ((uint64_t)get<3>(flow) << 8) | get<4>(flow);
+
+	// 64-bit finalizer from MurmurHash3
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return (uint32_t)h;
+}
+
+#endif
@@ -0,0 +1,232 @@
+#include "packet_parser.h"
+
+#include <algorithm>
+#include <string.h>
+#include <netinet/in.h>
+
+
+#define MAX_IPV6_EXT_HEADERS 8		// extension headers followed before giving up on finding the transport header
+
+
+
+/** IPv4-mapped addresses (::ffff:a.b.c.d) fold to the IPv4 address itself, so dual stack traffic from
+	the same host is counted together. Any other address is hashed down to 32 bits.
+
+	@param addr A 16 byte IPv6 address (network byte order)
+
+	@return The address folded to 32 bits
+	*/
+static uint32_t FoldIpv6(const u_char* addr)
+{
+	static const u_char V4_MAPPED[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+	uint32_t last;
+	memcpy(&last, addr + 12, 4);
+	if (memcmp(addr, V4_MAPPED, 12) == 0)
+	{
+		return ntohl(last);
+	}
+
+	uint64_t hi, lo;
+	memcpy(&hi, addr, 8);
+	memcpy(&lo, addr + 8, 8);
+
+	// 64-bit finalizer from MurmurHash3
+	uint64_t h = hi ^ (lo * 0x9e3779b97f4a7c15ULL);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return (uint32_t)h;
+}
+
+
+/** @param protocol An IPv6 next header value
+
+	@return TRUE if protocol is an extension header that ParseIp() can skip over
+	*/
+static bool IsIpv6ExtHeader(u_char protocol)
+{
+	switch (protocol)
+	{
+		case IPPROTO_HOPOPTS:
+		case IPPROTO_ROUTING:
+		case IPPROTO_FRAGMENT:
+		case IPPROTO_AH:
+		case IPPROTO_DSTOPTS:
+			return true;
+		default:
+			return false;
+	}
+}
+
+
+/** Fills in every field of p except ts_usecs. Every header is checked against caplen before it is
+	read. Packets whose transport header wasn't captured (or that are non-first fragments) are still
+	counted, with ports, flags and ICMP type of 0. The payload pointer refers into frame and excludes any link
+	layer padding after the IP packet.
+
+	@param frame The captured frame
+	@param caplen Number of bytes captured
+	@param offset Offset of the IP header in frame
+	@param ethertype ETHER_IPV4 or ETHER_IPV6
+	@param[out] p The parsed packet
+
+	@return TRUE if the frame holds a TCP/UDP/ICMP packet and FALSE otherwise (p is then undefined)
+	*/
+bool ParseIp(const u_char* frame, u_int caplen, u_int offset, u_short ethertype, PacketInfo& p)
+{
+	u_int l4;					// offset of the transport header
+	u_char protocol;
+	bool firstFragment;			// FALSE if a fragment other than the first (no transport header)
+
+	if (ethertype == ETHER_IPV4)
+	{
+		if (caplen < offset + sizeof(sniff_ip))
+		{
+			return false;
+		}
+
+		const sniff_ip* ip = (const sniff_ip*)(frame + offset);
+		u_int size_ip = IP_HL(ip)*4;
+		if (IP_V(ip) != 4 || size_ip < 20)
+		{
+			// invalid ip header
+			return false;
+		}
+
+		p.ipv6 = false;
+		p.size = ntohs(ip->ip_len);
+		p.src_ip = ntohl(ip->ip_src.s_addr);
+		p.dst_ip = ntohl(ip->ip_dst.s_addr);
+
+		protocol = ip->ip_p;
+		l4 = offset + size_ip;
+		firstFragment = (ntohs(ip->ip_off) & IP_OFFMASK) == 0;
+	}
+	else if (ethertype == ETHER_IPV6)
+	{
+		if (caplen < offset + SIZE_IPV6 || (frame[offset] >> 4) != 6)
+		{
+			return false;
+		}
+
+		const sniff_ip6* ip6 = (const sniff_ip6*)(frame + offset);
+
+		p.ipv6 = true;
+		p.size = SIZE_IPV6 + ntohs(ip6->ip6_plen);
+		p.src_ip = FoldIpv6(ip6->ip6_src);
+		p.dst_ip = FoldIpv6(ip6->ip6_dst);
+
+		protocol = ip6->ip6_nxt;
+		l4 = offset + SIZE_IPV6;
+		firstFragment = true;
+
+		// skip extension headers to reach the transport header
+		for (int i = 0; IsIpv6ExtHeader(protocol); i++)
+		{
+			if (i == MAX_IPV6_EXT_HEADERS || caplen < l4 + sizeof(sniff_ip6_ext))
+			{
+				return false;
+			}
+
+			const sniff_ip6_ext* ext = (const sniff_ip6_ext*)(frame + l4);
+			if (protocol == IPPROTO_FRAGMENT)
+			{
+				firstFragment = firstFragment && (ntohs(ext->ip6e_frag) & 0xfff8) == 0;
+				l4 += 8;
+			}
+			else if (protocol == IPPROTO_AH)
+			{
+				l4 += (ext->ip6e_len + 2) * 4;
+			}
+			else
+			{
+				l4 += (ext->ip6e_len + 1) * 8;
+			}
+			protocol = ext->ip6e_nxt;
+		}
+
+		if (protocol == IPPROTO_ICMPV6)
+		{
+			protocol = IPPROTO_ICMP;
+		}
+	}
+	else
+	{
+		return false;
+	}
+
+	// Determine protocol (We only care about TCP/UDP/ICMP)
+	switch (protocol)
+	{
+		case IPPROTO_TCP:
+		case IPPROTO_UDP:
+		case IPPROTO_ICMP:
+		case IPPROTO_IP:
+			p.protocol = protocol;
+			break;
+		default:
+			return false;
+	}
+
+	p.src_port = 0;
+	p.dst_port = 0;
+	p.tcp_flags = 0;
+	p.icmp_type = 0;
+	p.tcp_seq = 0;
+	p.tcp_len = 0;
+	p.payload = NULL;
+	p.payload_len = 0;
+
+	if ((protocol != IPPROTO_TCP && protocol != IPPROTO_UDP && protocol != IPPROTO_ICMP) || !firstFragment)
+	{
+		return true;
+	}
+
+	// the IP packet ends at its total length (anything after that is link layer padding) or where the capture does
+	u_int end = min(caplen, offset + (u_int)p.size);
+
+	if (protocol == IPPROTO_ICMP)
+	{
+		if (end > l4)
+		{
+			p.icmp_type = frame[l4];
+		}
+		return true;
+	}
+	u_int size_l4 = (protocol == IPPROTO_TCP) ? 20 : 8;
+	if (end < l4 + size_l4)
+	{
+		return true;
+	}
+
+	// (can use sniff_tcp for UDP also since we just need src/dst ports)
+	const sniff_tcp* tcp = (const sniff_tcp*)(frame + l4);
+	p.src_port = ntohs(tcp->th_sport);
+	p.dst_port = ntohs(tcp->th_dport);
+
+	if (protocol == IPPROTO_TCP)
+	{
+		p.tcp_flags = tcp->th_flags;
+		p.tcp_seq = ntohl(tcp->th_seq);
+		size_l4 = max(TH_OFF(tcp)*4, 20);
+
+		// (from the IP length, as the capture may have cut the payload short)
+		if (offset + (u_int)p.size > l4 + size_l4)
+		{
+			p.tcp_len = offset + p.size - (l4 + size_l4);
+		}
+	}
+
+	// Locate the payload (whatever of it was captured) for the signature engine
+	if (end > l4 + size_l4)
+	{
+		p.payload = frame + l4 + size_l4;
+		p.payload_len = end - (l4 + size_l4);
+	}
+
+	return true;
+}
@@ -0,0 +1,145 @@
+#ifndef PACKET_PARSER_H
+#define PACKET_PARSER_H
+
+#include "packet_info.h"
+#include "network_protocols.h"
+
+#include <sys/socket.h>	// AF_INET, AF_INET6
+#include <pcap.h>
+
+using namespace std;
+
+
+#define MAX_VLAN_TAGS 2		// VLAN tags skipped per frame (802.1Q, or 802.1ad QinQ)
+
+
+/** @brief Parses the IP packet at offset in a captured frame into p, returning FALSE if it isn't TCP/UDP/ICMP */
+bool ParseIp(const u_char* frame, u_int caplen, u_int offset, u_short ethertype, PacketInfo& p);
+
+
+/** @brief Link layer header of a pcap datalink type
+
+	Parse() locates the network layer of a captured frame: it sets offset to the start of the IP header
+	and ethertype to its type (ETHER_IPV4 or ETHER_IPV6), returning FALSE if the frame doesn't carry IP.
+	It never reads past caplen. There is one specialization per supported DLT_ value, so the parser
+	for a capture is chosen once (see ParsePacket()) rather than tested on every frame.
+	*/
+template <int DLT>
+struct LinkLayer;
+
+
+/** @brief Ethernet, with up to MAX_VLAN_TAGS 802.1Q/802.1ad tags */
+template <>
+struct LinkLayer<DLT_EN10MB>
+{
+	static bool Parse(const u_char* frame, u_int caplen, u_int& offset, u_short& ethertype)
+	{
+		if (caplen < SIZE_ETHERNET)
+		{
+			return false;
+		}
+
+		offset = SIZE_ETHERNET;
+		ethertype = ntohs(((const sniff_ethernet*)frame)->ether_type);
+
+		for (int tags = 0; ethertype == ETHER_VLAN || ethertype == ETHER_QINQ || ethertype == ETHER_QINQ_OLD; tags++)
+		{
+			if (tags == MAX_VLAN_TAGS || caplen < offset + SIZE_VLAN_TAG)
+			{
+				return false;
+			}
+			ethertype = ntohs(*(const u_short*)(frame + offset + 2));
+			offset += SIZE_VLAN_TAG;
+		}
+
+		return true;
+	}
+};
+
+
+/** @brief Linux "cooked" capture (e.g. capturing on the "any" interface) */
+template <>
+struct LinkLayer<DLT_LINUX_SLL>
+{
+	static bool Parse(const u_char* frame, u_int caplen, u_int& offset, u_short& ethertype)
+	{
+		if (caplen < SIZE_LINUX_SLL)
+		{
+			return false;
+		}
+
+		offset = SIZE_LINUX_SLL;
+		ethertype = ntohs(*(const u_short*)(frame + SIZE_LINUX_SLL - 2));
+		return true;
+	}
+};
+
+
+/** @brief Raw IP, no link layer header (the IP version tells IPv4 from IPv6) */
+template <>
+struct LinkLayer<DLT_RAW>
+{
+	static bool Parse(const u_char* frame, u_int caplen, u_int& offset, u_short& ethertype)
+	{
+		if (caplen < 1)
+		{
+			return false;
+		}
+
+		offset = 0;
+		ethertype = ((frame[0] >> 4) == 6) ? ETHER_IPV6 : ETHER_IPV4;
+		return true;
+	}
+};
+
+
+/** @brief BSD loopback: a 4 byte address family in the capturing host's byte order */
+template <>
+struct LinkLayer<DLT_NULL>
+{
+	static bool Parse(const u_char* frame, u_int caplen, u_int& offset, u_short& ethertype)
+	{
+		if (caplen < SIZE_NULL)
+		{
+			return false;
+		}
+
+		uint32_t family = *(const uint32_t*)frame;
+		if (family & 0xffff0000)
+		{
+			family = __builtin_bswap32(family); // (captured on a host of the other byte order)
+		}
+
+		offset = SIZE_NULL;
+		switch (family)
+		{
+			case AF_INET:
+				ethertype = ETHER_IPV4;
+				return true;
+			case 10: // AF_INET6 on Linux,
+			case 24: // NetBSD/OpenBSD,
+			case 28: // FreeBSD,
+			case 30: // and macOS
+				ethertype = ETHER_IPV6;
+				return true;
+			default:
+				return false;
+		}
+	}
+};
+
+
+/** @brief Parses a captured frame of datalink type DLT (DLT_ value) into p
+
+	@return TRUE if the frame holds a TCP/UDP/ICMP packet over IPv4 or IPv6, FALSE otherwise
+	*/
+template <int DLT>
+inline bool ParsePacket(const u_char* frame, u_int caplen, PacketInfo& p)
+{
+	u_int offset;
+	u_short ethertype;
+
+	return LinkLayer<DLT>::Parse(frame, caplen, offset, ethertype) && ParseIp(frame, caplen, offset, ethertype, p);
+}
+
+#endif
@@ -0,0 +1,205 @@
+#include "pcap_merger.h"
+
+#include <iostream>
+
+
+
+/** Packets are copied out of libpcap's buffer (which the next read overwrites) into a block. A full
+	block (or the last one) is queued once fewer than READ_AHEAD_BLOCKS blocks are waiting.
+
+	@param pSource The file to read
+	*/
+void PcapMerger::ReadAhead(Source* pSource)
+{
+	unique_ptr<Block> pBlock;
+
+	while (1)
+	{
+		if (!pBlock)
+		{
+			// reuse a merged block if there is one
+			pSource->mtx.lock();
+			if (!pSource->spare.empty())
+			{
+				pBlock = move(pSource->spare.front());
+				pSource->spare.pop_front();
+			}
+			pSource->mtx.unlock();
+
+			if (!pBlock)
+			{
+				pBlock.reset(new Block());
+				pBlock->headers.reserve(READ_AHEAD_PACKETS);
+				pBlock->offsets.reserve(READ_AHEAD_PACKETS);
+			}
+
+			pBlock->headers.clear();
+			pBlock->offsets.clear();
+			pBlock->data.clear();
+		}
+
+		pcap_pkthdr* header;
+		const u_char* frame;
+		int result = pcap_next_ex(pSource->pHandle, &header, &frame);
+
+		if (result == 1)
+		{
+			pBlock->headers.push_back(*header);
+			pBlock->offsets.push_back(pBlock->data.size());
+			pBlock->data.insert(pBlock->data.end(), frame, frame + header->caplen);
+
+			if (pBlock->headers.size() < READ_AHEAD_PACKETS)
+			{
+				continue;
+			}
+		}
+		else if (result == -1)
+		{
+			cout << "Error reading packets from " << pSource->name << ": " << pcap_geterr(pSource->pHandle) << endl;
+		}
+
+		bool end = (result != 1);
+
+		unique_lock<mutex> lock(pSource->mtx);
+		pSource->cv.wait(lock, [this, pSource] { return m_stop || pSource->blocks.size() < READ_AHEAD_BLOCKS; });
+		if (m_stop)
+		{
+			return;
+		}
+
+		if (!pBlock->headers.empty())
+		{
+			pSource->blocks.push_back(move(pBlock));
+		}
+		pSource->done = end;
+		lock.unlock();
+		pSource->cv.notify_all();
+
+		if (end)
+		{
+			return;
+		}
+	}
+}
+
+
+/** Waits for the reader if the source's current block is used up (handing that block back to the reader).
+
+	@param source Index of the source
+
+	@return TRUE if the source's next packet was added to the heap, FALSE if the source has ended
+	*/
+bool PcapMerger::Advance(size_t source)
+{
+	Source& s = *m_sources[source];
+
+	if (s.pCurrent && ++s.pos < s.pCurrent->headers.size())
+	{
+		const timeval& ts = s.pCurrent->headers[s.pos].ts;
+		m_heap.push(HeapEntry((long long)ts.tv_sec * 1000000 + ts.tv_usec, source));
+		return true;
+	}
+
+	unique_lock<mutex> lock(s.mtx);
+	if (s.pCurrent)
+	{
+		s.spare.push_back(move(s.pCurrent));
+	}
+
+	s.cv.wait(lock, [&s] { return s.done || !s.blocks.empty(); });
+	if (s.blocks.empty())
+	{
+		return false;
+	}
+
+	s.pCurrent = move(s.blocks.front());
+	s.blocks.pop_front();
+	s.pos = 0;
+	lock.unlock();
+	s.cv.notify_all();
+
+	const timeval& ts = s.pCurrent->headers[0].ts;
+	m_heap.push(HeapEntry((long long)ts.tv_sec * 1000000 + ts.tv_usec, source));
+	return true;
+}
+
+
+/** @param handles The opened pcap files, in order of precedence for equal timestamps
+	@param names Name of each file (for error messages)
+	*/
+PcapMerger::PcapMerger(const vector<pcap_t*>& handles, const vector<string>& names)
+	: m_stop(false)
+{
+	m_primed = false;
+	m_last = -1;
+
+	for (size_t i = 0; i < handles.size(); i++)
+	{
+		m_sources.push_back(unique_ptr<Source>(new Source()));
+		Source* pSource = m_sources.back().get();
+		pSource->name = names[i];
+		pSource->pHandle = handles[i];
+		pSource->done = false;
+		pSource->pos = 0;
+	}
+
+	for (size_t i = 0; i < m_sources.size(); i++)
+	{
+		m_sources[i]->reader = thread(&PcapMerger::ReadAhead, this, m_sources[i].get());
+	}
+}
+
+
+PcapMerger::~PcapMerger()
+{
+	m_stop = true;
+
+	for (size_t i = 0; i < m_sources.size(); i++)
+	{
+		// (taking the lock makes sure a reader about to wait sees m_stop)
+		m_sources[i]->mtx.lock();
+		m_sources[i]->mtx.unlock();
+		m_sources[i]->cv.notify_all();
+
+		m_sources[i]->reader.join();
+	}
+}
+
+
+/** @param[out] header Header of the next packet
+	@param[out] frame Data of the next packet
+	@param[out] source Index of the file the packet is from
+
+	@return TRUE if a packet was returned, FALSE once every file has ended
+	*/
+bool PcapMerger::Next(const pcap_pkthdr*& header, const u_char*& frame, size_t& source)
+{
+	// the previous packet's source only moves on now, as its block must stay valid until this call
+	if (!m_primed)
+	{
+		for (size_t i = 0; i < m_sources.size(); i++)
+		{
+			Advance(i);
+		}
+		m_primed = true;
+	}
+	else if (m_last >= 0)
+	{
+		Advance(m_last);
+	}
+
+	m_last = -1;
+	if (m_heap.empty())
+	{
+		return false;
+	}
+
+	source = m_heap.top().second;
+	m_heap.pop();
+	m_last = (int)source;
+
+	const Block& block = *m_sources[source]->pCurrent;
+	header = &block.headers[m_sources[source]->pos];
+	frame = block.data.data() + block.offsets[m_sources[source]->pos];
+	return true;
+}
@@ -0,0 +1,112 @@
+#ifndef PCAP_MERGER_H
+#define PCAP_MERGER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <pcap.h>
+
+using namespace std;
+
+
+#define READ_AHEAD_PACKETS 1024	// packets per read-ahead block
+#define READ_AHEAD_BLOCKS 4			// blocks read ahead per pcap file
+
+
+/** @brief Replays several pcap files as a single stream of packets in timestamp order
+
+	Each file is read by its own thread, which copies packets into blocks of up to READ_AHEAD_PACKETS
+	and keeps up to READ_AHEAD_BLOCKS of them queued, so the files are read in parallel and ahead of
+	the consumer. Next() merges the files with a min heap holding the next packet of each file
+	(a k-way merge), so each packet costs O(log k) comparisons for k files.
+
+	Every file is assumed to be in timestamp order itself (as captures are). Packets with equal
+	timestamps come from the file listed first. Merged blocks are handed back to their reader for
+	reuse, so a replay doesn't allocate once the blocks have grown to size.
+	*/
+class PcapMerger
+{
+
+private:
+
+	/** @brief Packets read ahead from a file */
+	struct Block
+	{
+		vector<pcap_pkthdr> headers;
+
+		/** Offset of each packet's data in data */
+		vector<size_t> offsets;
+
+		vector<u_char> data;
+	};
+
+	/** @brief A pcap file being merged */
+	struct Source
+	{
+		/** Name of the file (for error messages) */
+		string name;
+
+		pcap_t* pHandle;
+
+		/** Reader state (guarded by mtx) */
+		thread reader;
+		mutex mtx;
+		condition_variable cv;
+		deque<unique_ptr<Block> > blocks;	// read ahead, not yet merged
+		deque<unique_ptr<Block> > spare;	// merged, for the reader to reuse
+		bool done;							// TRUE once the reader has reached the end of the file
+
+		/** Block being merged and position of its next packet (consumer only) */
+		unique_ptr<Block> pCurrent;
+		size_t pos;
+	};
+
+	/** (timestamp in usecs, source index) of the next packet of each source with packets left */
+	typedef pair<long long, size_t> HeapEntry;
+
+	vector<unique_ptr<Source> > m_sources;
+
+	/** Min heap of the sources' next packets */
+	priority_queue<HeapEntry, vector<HeapEntry>, greater<HeapEntry> > m_heap;
+
+	/** TRUE once the heap holds every source's first packet */
+	bool m_primed;
+
+	/** Source of the packet returned by the last Next() (-1 if none) */
+	int m_last;
+
+	/** Set to stop the readers early */
+	atomic<bool> m_stop;
+
+
+	PcapMerger(const PcapMerger&);
+	PcapMerger& operator=(const PcapMerger&);
+
+	/** @brief Reader thread, reads a file ahead in blocks until its end (or until stopped) */
+	void ReadAhead(Source* pSource);
+
+	/** @brief Moves a source on to its next packet and adds it to the heap, returning FALSE at its end */
+	bool Advance(size_t source);
+
+
+public:
+
+	/** @brief Constructor, starts reading every file (the handles must stay open until destruction) */
+	PcapMerger(const vector<pcap_t*>& handles, const vector<string>& names);
+
+	/** @brief Destructor, stops the readers */
+	~PcapMerger();
+
+	/** @brief Returns the next packet of the merged stream (valid until the next call), or FALSE at the end */
+	bool Next(const pcap_pkthdr*& header, const u_char*& frame, size_t& source);
+
+};
+
+#endif
@@ -0,0 +1,140 @@
+#include "prefix_table.h"
+#include "blocklist.h"	// for ParseCidr()
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+
+const uint32_t PrefixTable::CHILD;
+
+
+/** @param entry The entry the new chunk replaces (its result is inherited by all 256 entries)
+
+	@return CHILD | the new chunk's number
+	*/
+uint32_t PrefixTable::NewChunk(uint32_t entry)
+{
+	uint32_t chunk = m_chunks.size() / 256;
+	m_chunks.resize(m_chunks.size() + 256, entry);
+	return CHILD | chunk;
+}
+
+
+/** Sets every entry covered by the prefix (prefix expansion). Since prefixes are added shortest
+	first, a longer prefix simply overwrites the entries of any shorter prefix containing it.
+
+	@param addr Network address of the prefix (host byte order)
+	@param len Prefix length
+	@param group Group id
+	*/
+void PrefixTable::Insert(uint32_t addr, int len, uint32_t group)
+{
+	uint32_t value = group + 1;
+
+	if (len <= 16)
+	{
+		uint32_t first = addr >> 16;
+		fill(m_level0.begin() + first, m_level0.begin() + first + (1 << (16 - len)), value);
+		return;
+	}
+
+	if (!(m_level0[addr >> 16] & CHILD))
+	{
+		m_level0[addr >> 16] = NewChunk(m_level0[addr >> 16]);
+	}
+	size_t chunk1 = (m_level0[addr >> 16] & ~CHILD) * 256;
+
+	if (len <= 24)
+	{
+		size_t first = chunk1 + ((addr >> 8) & 0xff);
+		fill(m_chunks.begin() + first, m_chunks.begin() + first + (1 << (24 - len)), value);
+		return;
+	}
+
+	size_t index1 = chunk1 + ((addr >> 8) & 0xff);
+	if (!(m_chunks[index1] & CHILD))
+	{
+		uint32_t child = NewChunk(m_chunks[index1]); // (may reallocate m_chunks)
+		m_chunks[index1] = child;
+	}
+	size_t first = (m_chunks[index1] & ~CHILD) * 256 + (addr & 0xff);
+	fill(m_chunks.begin() + first, m_chunks.begin() + first + (1 << (32 - len)), value);
+}
+
+
+PrefixTable::PrefixTable()
+	: m_level0(65536, 0)
+{
+}
+
+
+/** Prefix group files contain one prefix per line: a group name (no spaces) followed by a CIDR
+	prefix. A group may have any number of prefixes, e.g.
+
+		customers	198.51.100.0/24
+		customers	203.0.113.0/25
+		dns			192.0.2.53
+
+	Blank lines and lines starting with '#' are ignored. Where the prefixes of different groups
+	overlap, an address belongs to the group with the longest matching prefix.
+
+	@param filename Name of the prefix group file
+
+	@return TRUE if all groups were loaded and FALSE otherwise (error printed to console)
+	*/
+bool PrefixTable::Load(const string& filename)
+{
+	ifstream fs(filename.c_str());
+	if (!fs)
+	{
+		cout << "Error: couldn't open prefix file " << filename << endl;
+		return false;
+	}
+
+	struct Prefix { int len; uint32_t addr; uint32_t group; };
+	vector<Prefix> prefixes;
+	m_groups.clear();
+
+	string line;
+	int lineNum = 0;
+	while (getline(fs, line))
+	{
+		lineNum++;
+
+		string name, cidr, extra;
+		istringstream iss(line);
+		if (!(iss >> name) || name[0] == '#')
+		{
+			continue;
+		}
+
+		Prefix prefix;
+		if (!(iss >> cidr) || (iss >> extra) || !ParseCidr(cidr, prefix.addr, prefix.len))
+		{
+			cout << "Error: invalid prefix on line " << lineNum << " of " << filename << endl;
+			return false;
+		}
+
+		prefix.group = find(m_groups.begin(), m_groups.end(), name) - m_groups.begin();
+		if (prefix.group == m_groups.size())
+		{
+			m_groups.push_back(name);
+		}
+		prefixes.push_back(prefix);
+	}
+
+	// insert shortest prefixes first so longer ones take precedence
+	stable_sort(prefixes.begin(), prefixes.end(),
+				[](const Prefix& a, const Prefix& b) { return a.len < b.len; });
+
+	m_level0.assign(65536, 0);
+	m_chunks.clear();
+	for (size_t i = 0; i < prefixes.size(); i++)
+	{
+		Insert(prefixes[i].addr, prefixes[i].len, prefixes[i].group);
+	}
+
+	return true;
+}
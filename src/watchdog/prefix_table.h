@@ -0,0 +1,76 @@
+#ifndef PREFIX_TABLE_H
+#define PREFIX_TABLE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+
+/** @brief Longest prefix match from IPv4 addresses to named groups of CIDR prefixes
+
+	Groups (e.g. customer subnets or service ranges) are loaded from a file by Load(). Lookups use a
+	16-8-8 multibit trie with prefix expansion: a 65536 entry table indexed by the top 16 bits of the
+	address, whose entries either hold the result or point to a 256 entry chunk for the next 8 bits
+	(and likewise for the last 8). A lookup is therefore at most three dependent array reads, no matter
+	how many prefixes are configured. Chunks are only created under /16s holding prefixes longer than /16.
+	*/
+class PrefixTable
+{
+
+private:
+
+	/** Entry flag: the rest of the entry is a chunk number rather than a result */
+	static const uint32_t CHILD = 0x80000000;
+
+	/** Top level table, indexed by the top 16 bits of the address. Entries are 0 (no match),
+		group id + 1, or CHILD | chunk number */
+	vector<uint32_t> m_level0;
+
+	/** Chunks of 256 entries (same encoding as m_level0) */
+	vector<uint32_t> m_chunks;
+
+	/** Group names, indexed by group id */
+	vector<string> m_groups;
+
+
+	/** @brief Creates a chunk whose entries all hold entry, returning its CHILD entry */
+	uint32_t NewChunk(uint32_t entry);
+
+	/** @brief Adds a prefix (must be added in order of increasing length) */
+	void Insert(uint32_t addr, int len, uint32_t group);
+
+
+public:
+
+	/** @brief Constructor (no groups) */
+	PrefixTable();
+
+	/** @brief Loads the groups in filename, returning FALSE on error */
+	bool Load(const string& filename);
+
+	/** @brief Returns the id of the group with the longest prefix containing addr (host byte order), or -1 */
+	int Lookup(uint32_t addr) const
+	{
+		uint32_t entry = m_level0[addr >> 16];
+		if (entry & CHILD)
+		{
+			entry = m_chunks[(entry & ~CHILD) * 256 + ((addr >> 8) & 0xff)];
+			if (entry & CHILD)
+			{
+				entry = m_chunks[(entry & ~CHILD) * 256 + (addr & 0xff)];
+			}
+		}
+		return (int)entry - 1;
+	}
+
+	/** @brief Returns the number of groups */
+	size_t NumGroups() const { return m_groups.size(); }
+
+	/** @brief Returns the name of a group */
+	const string& GroupName(size_t group) const { return m_groups[group]; }
+
+};
+
+#endif
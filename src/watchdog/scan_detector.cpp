@@ -0,0 +1,256 @@
+#include "scan_detector.h"
+
+#include <math.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "network_protocols.h"
+
+
+
+/** @param x Value to hash
+
+	@return 32-bit hash of x
+	*/
+static uint32_t Hash32(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+
+/** Linear counting estimate of the number of distinct values added to a sketch: n = -m ln(zeros/m)
+
+	@param zeros Number of zero bits left in a SKETCH_BITS bit sketch
+	*/
+static uint32_t LinearCount(uint32_t zeros, uint32_t bits)
+{
+	if (zeros == 0)
+	{
+		zeros = 1; // saturated, the estimate is a lower bound
+	}
+	return (uint32_t)(-(double)bits * log((double)zeros / bits) + 0.5);
+}
+
+
+/** Inverse of LinearCount(): the number of zero bits left once threshold distinct values were added.
+	*/
+static uint16_t ZerosAt(uint32_t threshold, uint32_t bits)
+{
+	return (uint16_t)(bits * exp(-(double)threshold / bits));
+}
+
+
+/** @param sketch The sketch to update
+	@param zeros The sketch's zero bit count
+	@param value The value being added (already hashed)
+	*/
+void ScanDetector::SetBit(uint64_t* sketch, uint16_t& zeros, uint32_t value)
+{
+	uint32_t bit = value & (SKETCH_BITS - 1);
+	uint64_t mask = (uint64_t)1 << (bit & 63);
+
+	if (!(sketch[bit >> 6] & mask))
+	{
+		sketch[bit >> 6] |= mask;
+		zeros--;
+	}
+}
+
+
+/** Looks src_ip up in its set. If it is not there, an empty or stale entry of the set is claimed,
+	or failing that the entry with the fewest packets this slice is evicted. Entries last used in an
+	older slice are reset before being returned.
+
+	@param src_ip Source IP address (host byte order)
+
+	@return The source's entry
+	*/
+ScanDetector::SourceEntry& ScanDetector::Lookup(uint32_t src_ip)
+{
+	SourceEntry* set = &m_table[(Hash32(src_ip) & (m_numSets - 1)) * WAYS];
+	SourceEntry* victim = NULL;
+
+	for (int i = 0; i < WAYS; i++)
+	{
+		if (set[i].src_ip == src_ip && set[i].slice != 0)
+		{
+			victim = &set[i];
+			break;
+		}
+
+		if (set[i].slice != m_slice)
+		{
+			if (victim == NULL || victim->slice == m_slice)
+			{
+				victim = &set[i]; // free or stale entry, prefer it to evicting an active one
+			}
+		}
+		else if (victim == NULL || (victim->slice == m_slice && set[i].packets < victim->packets))
+		{
+			victim = &set[i];
+		}
+	}
+
+	if (victim->src_ip != src_ip || victim->slice == 0)
+	{
+		if (victim->slice == m_slice)
+		{
+			m_evictions++;
+		}
+		victim->src_ip = src_ip;
+		victim->slice = 0; // force a reset below
+	}
+
+	if (victim->slice != m_slice)
+	{
+		victim->slice = m_slice;
+		victim->packets = 0;
+		victim->portZeros = SKETCH_BITS;
+		victim->hostZeros = SKETCH_BITS;
+		victim->portAlerted = false;
+		victim->hostAlerted = false;
+		memset(victim->ports, 0, sizeof(victim->ports));
+		memset(victim->hosts, 0, sizeof(victim->hosts));
+	}
+
+	return *victim;
+}
+
+
+/** Initializes an empty table.
+
+	@param maxSources Number of sources tracked at once (rounded up to a multiple of WAYS that is a power of two)
+	@param portThreshold Number of distinct destination ports in a slice that indicates a port scan
+	@param hostThreshold Number of distinct destination hosts in a slice that indicates a host sweep
+	*/
+ScanDetector::ScanDetector(uint32_t maxSources, uint32_t portThreshold, uint32_t hostThreshold)
+{
+	m_numSets = 1;
+	while (m_numSets * WAYS < maxSources)
+	{
+		m_numSets <<= 1;
+	}
+
+	SourceEntry empty;
+	memset(&empty, 0, sizeof(empty));
+	m_table.assign(m_numSets * WAYS, empty);
+
+	m_slice = 1; // slice 0 marks entries that have never been used
+	m_evictions = 0;
+	m_portZerosLimit = ZerosAt(portThreshold, SKETCH_BITS);
+	m_hostZerosLimit = ZerosAt(hostThreshold, SKETCH_BITS);
+}
+
+
+/** Adds the packet's destination port (TCP/UDP only) and destination host to its source's sketches.
+	Only packets that look like probes are counted, so that a busy server replying to many clients is
+	not mistaken for a scanner: TCP packets without ACK (SYN, FIN, NULL and XMAS scans), UDP packets
+	sent to a port no higher than their source port, and ICMP requests (echo, timestamp and address mask,
+	or ICMPv6 echo). ICMP replies and errors (e.g. unreachable or TTL exceeded from a gateway) and ICMPv6
+	neighbour/router discovery are not probes.
+
+	@param p PacketInfo struct storing all relevent metadata from a packet
+
+	@return SCAN_PORTS or SCAN_HOSTS if this packet made its source cross the port scan or host sweep
+			threshold for the first time this slice, SCAN_NONE otherwise
+	*/
+ScanAlert ScanDetector::AddPacket(const PacketInfo& p)
+{
+	bool probe;
+	switch (p.protocol)
+	{
+		case IPPROTO_TCP:
+			probe = !(p.tcp_flags & TH_ACK);
+			break;
+		case IPPROTO_UDP:
+			probe = (p.dst_port <= p.src_port);
+			break;
+		case IPPROTO_ICMP:
+			probe = p.ipv6 ? (p.icmp_type == ICMPV6_ECHO_REQUEST) :
+					(p.icmp_type == ICMP_ECHO_REQUEST || p.icmp_type == ICMP_TIMESTAMP_REQUEST || p.icmp_type == ICMP_MASK_REQUEST);
+			break;
+		default:
+			probe = false;
+	}
+	if (!probe)
+	{
+		return SCAN_NONE;
+	}
+
+	SourceEntry& entry = Lookup(p.src_ip);
+	entry.packets++;
+
+	if (p.protocol != IPPROTO_ICMP)
+	{
+		SetBit(entry.ports, entry.portZeros, Hash32(p.dst_port));
+	}
+	SetBit(entry.hosts, entry.hostZeros, Hash32(p.dst_ip));
+
+	if (!entry.portAlerted && entry.portZeros <= m_portZerosLimit)
+	{
+		entry.portAlerted = true;
+		return SCAN_PORTS;
+	}
+
+	if (!entry.hostAlerted && entry.hostZeros <= m_hostZerosLimit)
+	{
+		entry.hostAlerted = true;
+		return SCAN_HOSTS;
+	}
+
+	return SCAN_NONE;
+}
+
+
+void ScanDetector::NewSlice()
+{
+	m_slice++;
+	if (m_slice == 0)
+	{
+		m_slice = 1;
+	}
+	m_evictions = 0;
+}
+
+
+/** @param src_ip Source IP address (host byte order)
+
+	@return Estimated number of distinct destination ports contacted by src_ip this slice (0 if not tracked)
+	*/
+uint32_t ScanDetector::EstimatePorts(uint32_t src_ip) const
+{
+	const SourceEntry* set = &m_table[(Hash32(src_ip) & (m_numSets - 1)) * WAYS];
+
+	for (int i = 0; i < WAYS; i++)
+	{
+		if (set[i].src_ip == src_ip && set[i].slice == m_slice)
+		{
+			return LinearCount(set[i].portZeros, SKETCH_BITS);
+		}
+	}
+	return 0;
+}
+
+
+/** @param src_ip Source IP address (host byte order)
+
+	@return Estimated number of distinct destination hosts contacted by src_ip this slice (0 if not tracked)
+	*/
+uint32_t ScanDetector::EstimateHosts(uint32_t src_ip) const
+{
+	const SourceEntry* set = &m_table[(Hash32(src_ip) & (m_numSets - 1)) * WAYS];
+
+	for (int i = 0; i < WAYS; i++)
+	{
+		if (set[i].src_ip == src_ip && set[i].slice == m_slice)
+		{
+			return LinearCount(set[i].hostZeros, SKETCH_BITS);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,113 @@
+#ifndef SCAN_DETECTOR_H
+#define SCAN_DETECTOR_H
+
+#include "packet_info.h"
+
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+
+/** @brief Category of scan alerts */
+enum ScanAlert { SCAN_NONE, SCAN_PORTS, SCAN_HOSTS };
+
+
+/** @brief Detects port scans and host sweeps by tracking distinct destinations per source
+
+	For each tracked source IP, two linear counting sketches (fixed size bitmaps) estimate the number
+	of distinct destination ports and distinct destination hosts it probed this timeslice. A
+	scanner touching thousands of ports or hosts with a few packets each stands out immediately here,
+	even though it barely changes the overall packets/bytes/flows totals.
+
+	Sources are kept in a fixed size, 4-way set associative table, so the memory cost is fixed (about
+	SKETCH_BITS/4 bytes per tracked source) no matter how many sources are seen. When a set is full the
+	least active source in it is evicted. Entries are tagged with the slice they were last reset in,
+	so starting a new slice (NewSlice()) costs O(1) instead of clearing the table.
+
+	Only probe-like packets are counted (see AddPacket()), so servers replying to many clients are not
+	mistaken for scanners. AddPacket() checks the estimates as each packet is added and reports a scan the moment a source
+	crosses a threshold (once per source and category per slice).
+	*/
+class ScanDetector
+{
+
+private:
+
+	/** Number of bits in each linear counting sketch */
+	static const int SKETCH_BITS = 1024;
+
+	/** Number of entries per set */
+	static const int WAYS = 4;
+
+	/** @brief Per source state */
+	struct SourceEntry
+	{
+		/** Source IP address (host byte order) */
+		uint32_t src_ip;
+
+		/** Slice the entry was last reset in (entries from older slices are treated as empty) */
+		uint32_t slice;
+
+		/** Packets seen from this source this slice (used to pick eviction victims) */
+		uint32_t packets;
+
+		/** Number of zero bits left in ports/hosts */
+		uint16_t portZeros, hostZeros;
+
+		/** Set once a scan alert has been raised for this source this slice */
+		bool portAlerted, hostAlerted;
+
+		/** Linear counting sketch of distinct destination ports */
+		uint64_t ports[SKETCH_BITS / 64];
+
+		/** Linear counting sketch of distinct destination hosts */
+		uint64_t hosts[SKETCH_BITS / 64];
+	};
+
+	/** The table of tracked sources (m_numSets * WAYS entries) */
+	vector<SourceEntry> m_table;
+
+	/** Number of sets in m_table (a power of two) */
+	uint32_t m_numSets;
+
+	/** Current slice number */
+	uint32_t m_slice;
+
+	/** Alert when a sketch has no more than this many zero bits left (i.e. its estimate crosses the threshold) */
+	uint16_t m_portZerosLimit, m_hostZerosLimit;
+
+	/** Number of sources evicted this slice to make room for another */
+	unsigned long long m_evictions;
+
+
+	/** @brief Returns the entry for src_ip, claiming (and resetting) one if it is not tracked */
+	SourceEntry& Lookup(uint32_t src_ip);
+
+	/** @brief Sets the bit for value in a sketch, decrementing zeros if it was not already set */
+	static void SetBit(uint64_t* sketch, uint16_t& zeros, uint32_t value);
+
+
+public:
+
+	/** @brief Constructor */
+	ScanDetector(uint32_t maxSources, uint32_t portThreshold, uint32_t hostThreshold);
+
+	/** @brief Adds a packet, returning SCAN_PORTS or SCAN_HOSTS if its source just crossed a threshold */
+	ScanAlert AddPacket(const PacketInfo& p);
+
+	/** @brief Starts a new slice, forgetting all per-slice state */
+	void NewSlice();
+
+	/** @brief Returns the estimated number of distinct destination ports contacted by src_ip this slice */
+	uint32_t EstimatePorts(uint32_t src_ip) const;
+
+	/** @brief Returns the estimated number of distinct destination hosts contacted by src_ip this slice */
+	uint32_t EstimateHosts(uint32_t src_ip) const;
+
+	/** @brief Returns the number of sources evicted this slice */
+	unsigned long long GetEvictions() const { return m_evictions; }
+
+};
+
+#endif
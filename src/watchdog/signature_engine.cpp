@@ -0,0 +1,402 @@
+#include "signature_engine.h"
+
+#include <iostream>
+#include <fstream>
+#include <queue>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+#define MAX_SIMD_FIRST_BYTES 8		// max distinct first bytes for the SSE2 prefilter (more than this uses the pair bitmap alone)
+
+static const uint32_t NO_STATE = 0xffffffff;
+
+
+
+/** @param c A hex digit
+
+	@return The digit's value, or -1 if c is not a hex digit
+	*/
+static int HexValue(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+
+/** Patterns are literal text, except that bytes between a pair of '|' are given as hex
+	(e.g. "GET |2f 2e 2e|/" is "GET /../"). A literal '|' is written |7c|.
+
+	@param[in] text The pattern as written in the rule file
+	@param[out] pattern The pattern's bytes
+
+	@return TRUE if text is a valid, non-empty pattern and FALSE otherwise
+	*/
+bool SignatureEngine::ParsePattern(const string& text, string& pattern)
+{
+	bool hex = false;
+	pattern = "";
+
+	for (size_t i = 0; i < text.length(); i++)
+	{
+		if (text[i] == '|')
+		{
+			hex = !hex;
+		}
+		else if (!hex)
+		{
+			pattern += text[i];
+		}
+		else if (text[i] != ' ')
+		{
+			if (i + 1 >= text.length() || HexValue(text[i]) < 0 || HexValue(text[i + 1]) < 0)
+			{
+				return false;
+			}
+			pattern += (char)(HexValue(text[i]) << 4 | HexValue(text[i + 1]));
+			i++;
+		}
+	}
+
+	return !hex && !pattern.empty();
+}
+
+
+/** Builds the Aho-Corasick automaton for m_patterns: a trie of all patterns whose missing transitions
+	are then filled in (breadth first) from each state's failure state, giving a complete DFA. Each
+	state's outputs include those of its failure state, so every rule ending at a position is found
+	without following failure links while scanning. Also builds the prefilter tables.
+	*/
+void SignatureEngine::Compile()
+{
+	// byte classes: one per distinct byte used by any pattern, plus class 0 for all other bytes
+	memset(m_classOf, 0, sizeof(m_classOf));
+	m_numClasses = 1;
+	for (size_t r = 0; r < m_patterns.size(); r++)
+	{
+		for (size_t i = 0; i < m_patterns[r].length(); i++)
+		{
+			u_char b = m_patterns[r][i];
+			if (m_classOf[b] == 0)
+			{
+				m_classOf[b] = m_numClasses++;
+			}
+		}
+	}
+
+	// build the trie
+	uint32_t nc = m_numClasses;
+	vector<vector<uint32_t> > outputs(1);
+	m_delta.assign(nc, NO_STATE);
+
+	for (size_t r = 0; r < m_patterns.size(); r++)
+	{
+		uint32_t state = 0;
+		for (size_t i = 0; i < m_patterns[r].length(); i++)
+		{
+			uint32_t c = m_classOf[(u_char)m_patterns[r][i]];
+			if (m_delta[state * nc + c] == NO_STATE)
+			{
+				m_delta[state * nc + c] = outputs.size();
+				m_delta.resize(m_delta.size() + nc, NO_STATE);
+				outputs.push_back(vector<uint32_t>());
+			}
+			state = m_delta[state * nc + c];
+		}
+		outputs[state].push_back(r);
+	}
+
+	// compute failure states breadth first, completing the transition table as we go
+	vector<uint32_t> fail(outputs.size(), 0);
+	queue<uint32_t> bfs;
+
+	for (uint32_t c = 0; c < nc; c++)
+	{
+		if (m_delta[c] == NO_STATE)
+		{
+			m_delta[c] = 0;
+		}
+		else
+		{
+			bfs.push(m_delta[c]);
+		}
+	}
+
+	while (!bfs.empty())
+	{
+		uint32_t state = bfs.front();
+		bfs.pop();
+
+		for (uint32_t c = 0; c < nc; c++)
+		{
+			uint32_t& next = m_delta[state * nc + c];
+			uint32_t failNext = m_delta[fail[state] * nc + c];
+
+			if (next == NO_STATE)
+			{
+				next = failNext;
+			}
+			else
+			{
+				fail[next] = failNext;
+				outputs[next].insert(outputs[next].end(), outputs[failNext].begin(), outputs[failNext].end());
+				bfs.push(next);
+			}
+		}
+	}
+
+	// flatten the outputs
+	m_outStart.assign(1, 0);
+	m_outputs.clear();
+	for (size_t s = 0; s < outputs.size(); s++)
+	{
+		m_outputs.insert(m_outputs.end(), outputs[s].begin(), outputs[s].end());
+		m_outStart.push_back(m_outputs.size());
+	}
+
+	// prefilter tables
+	m_pairs.assign(65536 / 64, 0);
+	memset(m_first, 0, sizeof(m_first));
+	m_firstBytes.clear();
+
+	for (size_t r = 0; r < m_patterns.size(); r++)
+	{
+		u_char a = m_patterns[r][0];
+
+		if (!m_first[a])
+		{
+			m_first[a] = true;
+			m_firstBytes.push_back(a);
+		}
+
+		for (uint32_t b = 0; b < 256; b++)
+		{
+			// a one byte pattern may be followed by anything
+			if (m_patterns[r].length() == 1 || (u_char)m_patterns[r][1] == b)
+			{
+				uint32_t pair = (uint32_t)a << 8 | b;
+				m_pairs[pair >> 6] |= (uint64_t)1 << (pair & 63);
+			}
+		}
+	}
+
+	m_hits.assign(m_patterns.size(), 0);
+	m_lastMatch.assign(m_patterns.size(), 0);
+}
+
+
+/** Skips over payload bytes that cannot start a match. When the patterns start with at most
+	MAX_SIMD_FIRST_BYTES distinct bytes, 16 bytes at a time are compared against them (SSE2) and
+	only the positions that hit are checked against the pair bitmap.
+
+	@param data The payload
+	@param i Position to start from
+	@param len Length of the payload
+
+	@return The first position at or after i that passes the prefilter, or len if there is none
+	*/
+size_t SignatureEngine::NextCandidate(const u_char* data, size_t i, size_t len) const
+{
+#ifdef __SSE2__
+	size_t numFirst = m_firstBytes.size();
+	if (numFirst <= MAX_SIMD_FIRST_BYTES)
+	{
+		__m128i needles[MAX_SIMD_FIRST_BYTES];
+		for (size_t k = 0; k < numFirst; k++)
+		{
+			needles[k] = _mm_set1_epi8((char)m_firstBytes[k]);
+		}
+
+		for (; i + 16 <= len; i += 16)
+		{
+			__m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+			__m128i hits = _mm_setzero_si128();
+			for (size_t k = 0; k < numFirst; k++)
+			{
+				hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[k]));
+			}
+
+			for (int mask = _mm_movemask_epi8(hits); mask != 0; mask &= mask - 1)
+			{
+				size_t j = i + __builtin_ctz(mask);
+				if (IsCandidate(data, j, len))
+				{
+					return j;
+				}
+			}
+		}
+	}
+#endif
+
+	while (i < len && !IsCandidate(data, i, len))
+	{
+		i++;
+	}
+	return i;
+}
+
+
+SignatureEngine::SignatureEngine()
+{
+	memset(m_classOf, 0, sizeof(m_classOf));
+	memset(m_first, 0, sizeof(m_first));
+	m_numClasses = 1;
+	m_scanned = 0;
+	m_matchedPayloads = 0;
+}
+
+
+/** Rule files contain one rule per line: a name (no spaces) followed by its pattern, e.g.
+
+		passwd-read		/etc/passwd
+		nop-sled		|90 90 90 90 90 90 90 90|
+
+	Blank lines and lines starting with '#' are ignored. See ParsePattern() for the pattern syntax.
+
+	@param filename Name of the rule file
+
+	@return TRUE if all rules were loaded and compiled and FALSE otherwise (error printed to console)
+	*/
+bool SignatureEngine::LoadRules(const string& filename)
+{
+	ifstream fs(filename.c_str());
+	if (!fs)
+	{
+		cout << "Error: couldn't open signature file " << filename << endl;
+		return false;
+	}
+
+	m_names.clear();
+	m_patterns.clear();
+
+	string line;
+	int lineNum = 0;
+	while (getline(fs, line))
+	{
+		lineNum++;
+
+		if (!line.empty() && line[line.length() - 1] == '\r')
+		{
+			line.erase(line.length() - 1);
+		}
+
+		size_t nameStart = line.find_first_not_of(" \t");
+		if (nameStart == string::npos || line[nameStart] == '#')
+		{
+			continue;
+		}
+
+		size_t nameEnd = line.find_first_of(" \t", nameStart);
+		size_t patternStart = (nameEnd == string::npos) ? string::npos : line.find_first_not_of(" \t", nameEnd);
+		size_t patternEnd = line.find_last_not_of(" \t");
+
+		string pattern;
+		if (patternStart == string::npos ||
+			!ParsePattern(line.substr(patternStart, patternEnd - patternStart + 1), pattern))
+		{
+			cout << "Error: invalid signature on line " << lineNum << " of " << filename << endl;
+			return false;
+		}
+
+		m_names.push_back(line.substr(nameStart, nameEnd - nameStart));
+		m_patterns.push_back(pattern);
+	}
+
+	if (m_patterns.empty())
+	{
+		cout << "Error: no signatures in " << filename << endl;
+		return false;
+	}
+
+	Compile();
+	return true;
+}
+
+
+/** Runs the automaton over the payload once, counting every rule that matches anywhere in it. While
+	the automaton is in its root state the prefilter skips ahead to the next possible match.
+
+	@param data The payload
+	@param len Length of the payload in bytes
+
+	@return Number of distinct rules that matched the payload
+	*/
+int SignatureEngine::Scan(const u_char* data, size_t len)
+{
+	uint32_t state = 0;
+	return Scan(state, data, len);
+}
+
+
+/** Continues the automaton from STATE over the next bytes of a stream, so a pattern split across
+	segments matches in the segment that completes it. Rules are counted at most once per call, i.e.
+	once per segment.
+
+	@param[in,out] streamState Automaton state the stream's last bytes left (0 at the start of a stream), updated
+	@param data The stream's next bytes
+	@param len Number of bytes
+
+	@return Number of distinct rules that matched in (or were completed by) the bytes
+	*/
+int SignatureEngine::Scan(uint32_t& streamState, const u_char* data, size_t len)
+{
+	if (m_patterns.empty())
+	{
+		return 0;
+	}
+
+	m_scanned++;
+
+	int matched = 0;
+	uint32_t state = streamState;
+	size_t i = 0;
+
+	while (i < len)
+	{
+		if (state == 0)
+		{
+			i = NextCandidate(data, i, len);
+			if (i == len)
+			{
+				break;
+			}
+		}
+
+		state = m_delta[state * m_numClasses + m_classOf[data[i++]]];
+
+		for (uint32_t k = m_outStart[state]; k < m_outStart[state + 1]; k++)
+		{
+			uint32_t rule = m_outputs[k];
+			if (m_lastMatch[rule] != m_scanned)
+			{
+				m_lastMatch[rule] = m_scanned;
+				m_hits[rule]++;
+				matched++;
+			}
+		}
+	}
+
+	streamState = state;
+
+	if (matched > 0)
+	{
+		m_matchedPayloads++;
+	}
+
+	return matched;
+}
+
+
+void SignatureEngine::ResetSliceCounters()
+{
+	for (size_t r = 0; r < m_hits.size(); r++)
+	{
+		m_hits[r] = 0;
+	}
+	m_matchedPayloads = 0;
+}
@@ -0,0 +1,126 @@
+#ifndef SIGNATURE_ENGINE_H
+#define SIGNATURE_ENGINE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+
+using namespace std;
+
+
+/** @brief Matches packet payloads against a set of byte pattern signatures in a single pass
+
+	Rules are loaded from a rule file (see LoadRules()) and compiled into an Aho-Corasick automaton,
+	stored as a dense DFA: every state has a transition for every byte class, so scanning costs one
+	table lookup per payload byte regardless of the number of rules. Bytes that appear in no pattern
+	share a single class, which keeps each state's row small and the whole table cache friendly.
+
+	Most payload bytes cannot start a match, so while the automaton is in its root state, Scan() skips
+	ahead with a prefilter: a bitmap of the first two bytes of every pattern (and, when the patterns
+	start with only a few distinct bytes, an SSE2 comparison of 16 bytes at a time against them). The
+	automaton only runs from positions the prefilter lets through.
+
+	Matches are counted per rule (at most once per payload) until ResetSliceCounters() is called. A TCP
+	stream can be scanned a segment at a time, the automaton's state carried from one segment to the
+	next, so patterns split across segments still match (see TcpReassembler).
+	*/
+class SignatureEngine
+{
+
+private:
+
+	/** Rule names, indexed by rule id */
+	vector<string> m_names;
+
+	/** Rule patterns, indexed by rule id */
+	vector<string> m_patterns;
+
+	/** Byte -> byte class */
+	uint16_t m_classOf[256];
+
+	/** Number of byte classes (row length of m_delta) */
+	uint32_t m_numClasses;
+
+	/** Transition table: next state = m_delta[state * m_numClasses + class] (state 0 is the root) */
+	vector<uint32_t> m_delta;
+
+	/** Rule ids matched on entering each state are m_outputs[m_outStart[state]...m_outStart[state + 1]) */
+	vector<uint32_t> m_outStart;
+	vector<uint32_t> m_outputs;
+
+	/** Bit (a << 8 | b) is set if a pattern may start with bytes a, b */
+	vector<uint64_t> m_pairs;
+
+	/** m_first[a] is TRUE if a pattern starts with byte a */
+	bool m_first[256];
+
+	/** Distinct first bytes of all patterns (used by the SIMD prefilter when there are few enough) */
+	vector<u_char> m_firstBytes;
+
+	/** Number of payloads matched by each rule this slice */
+	vector<unsigned long long> m_hits;
+
+	/** Payload number each rule last matched in (so a rule is counted once per payload) */
+	vector<unsigned long long> m_lastMatch;
+
+	/** Number of payloads scanned (including those before this slice) */
+	unsigned long long m_scanned;
+
+	/** Number of payloads that matched at least one rule this slice */
+	unsigned long long m_matchedPayloads;
+
+
+	/** @brief Parses a rule pattern (text with |hex| blocks) into bytes */
+	static bool ParsePattern(const string& text, string& pattern);
+
+	/** @brief Compiles m_patterns into the automaton and prefilter */
+	void Compile();
+
+	/** @brief Returns TRUE if a pattern may start at data[i] */
+	bool IsCandidate(const u_char* data, size_t i, size_t len) const
+	{
+		if (i + 1 == len)
+		{
+			return m_first[data[i]];
+		}
+		uint32_t pair = (uint32_t)data[i] << 8 | data[i + 1];
+		return (m_pairs[pair >> 6] >> (pair & 63)) & 1;
+	}
+
+	/** @brief Returns the first position at or after i where a pattern may start (or len) */
+	size_t NextCandidate(const u_char* data, size_t i, size_t len) const;
+
+
+public:
+
+	/** @brief Constructor (no rules) */
+	SignatureEngine();
+
+	/** @brief Loads and compiles the rules in filename, returning FALSE on error */
+	bool LoadRules(const string& filename);
+
+	/** @brief Scans a payload for all rules, returning the number of rules it matched */
+	int Scan(const u_char* data, size_t len);
+
+	/** @brief Scans the next bytes of a stream, continuing from (and updating) the automaton state its last bytes left */
+	int Scan(uint32_t& streamState, const u_char* data, size_t len);
+
+	/** @brief Returns the number of rules loaded */
+	size_t NumRules() const { return m_names.size(); }
+
+	/** @brief Returns the name of a rule */
+	const string& RuleName(size_t rule) const { return m_names[rule]; }
+
+	/** @brief Returns the number of payloads a rule matched this slice */
+	unsigned long long GetHits(size_t rule) const { return m_hits[rule]; }
+
+	/** @brief Returns the number of payloads that matched any rule this slice */
+	unsigned long long GetMatchedPayloads() const { return m_matchedPayloads; }
+
+	/** @brief Resets the per-slice match counts */
+	void ResetSliceCounters();
+
+};
+
+#endif
@@ -0,0 +1,43 @@
+#include "slice_clock.h"
+
+
+
+/** Samples the wall clock and the monotonic clock together once, so that later slice deadlines
+	can be computed on the monotonic clock (immune to wall clock adjustments while running).
+
+	@param timeslice Length of a timeslice in seconds
+	*/
+SliceClock::SliceClock(double timeslice)
+{
+	m_sliceUsecs = (long long)(timeslice * 1000000.0);
+
+	m_steadyBase = chrono::steady_clock::now();
+	m_wallBaseUsecs = chrono::duration_cast<chrono::microseconds>(
+							chrono::system_clock::now().time_since_epoch()).count();
+}
+
+
+/** @return Index of the slice containing the current wall clock time
+	*/
+long long SliceClock::CurrentSlice() const
+{
+	chrono::microseconds elapsed = chrono::duration_cast<chrono::microseconds>(
+										chrono::steady_clock::now() - m_steadyBase);
+
+	return SliceOf(m_wallBaseUsecs + elapsed.count());
+}
+
+
+/** The deadline is computed from the absolute slice index rather than by adding the timeslice
+	to the previous deadline, so rounding never accumulates.
+
+	@param slice Index of the slice
+
+	@return Monotonic time point at which slice ends (i.e. slice+1 begins)
+	*/
+chrono::steady_clock::time_point SliceClock::Deadline(long long slice) const
+{
+	long long offset = SliceStart(slice + 1) - m_wallBaseUsecs;
+
+	return m_steadyBase + chrono::microseconds(offset);
+}
@@ -0,0 +1,58 @@
+#ifndef SLICE_CLOCK_H
+#define SLICE_CLOCK_H
+
+#include <chrono>
+#include <sys/time.h>
+
+using namespace std;
+
+
+/** @brief Maps timestamps onto timeslices aligned to the Unix epoch
+
+	Slice n covers [n * timeslice, (n+1) * timeslice) seconds since the epoch, so every watchdog
+	running with the same timeslice uses the same slice boundaries regardless of when it started.
+	Packets are assigned to slices by their pcap timestamp via SliceOf(). Deadline() converts a
+	slice boundary to an absolute point on the monotonic clock so the report loop can sleep_until()
+	it without accumulating drift from the time spent generating and sending reports.
+	*/
+class SliceClock
+{
+
+private:
+
+	/** Length of a timeslice in microseconds */
+	long long m_sliceUsecs;
+
+	/** Monotonic time at which m_wallBaseUsecs was sampled */
+	chrono::steady_clock::time_point m_steadyBase;
+
+	/** Wall clock time (usecs since the epoch) sampled together with m_steadyBase */
+	long long m_wallBaseUsecs;
+
+
+public:
+
+	/** @brief Constructor */
+	explicit SliceClock(double timeslice = 1.0);
+
+	/** @brief Returns the index of the slice containing a timestamp (usecs since the epoch) */
+	long long SliceOf(long long usecs) const { return usecs / m_sliceUsecs; }
+
+	/** @brief Returns the index of the slice containing a pcap timestamp */
+	long long SliceOf(const timeval& ts) const { return SliceOf((long long)ts.tv_sec * 1000000 + ts.tv_usec); }
+
+	/** @brief Returns the start of a slice in usecs since the epoch */
+	long long SliceStart(long long slice) const { return slice * m_sliceUsecs; }
+
+	/** @brief Returns the index of the slice containing the current wall clock time */
+	long long CurrentSlice() const;
+
+	/** @brief Returns the monotonic time at which a slice ends */
+	chrono::steady_clock::time_point Deadline(long long slice) const;
+
+	/** @brief Returns the length of a slice in microseconds */
+	long long SliceUsecs() const { return m_sliceUsecs; }
+
+};
+
+#endif
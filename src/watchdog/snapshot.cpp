@@ -0,0 +1,227 @@
+#include "snapshot.h"
+#include "cpu_affinity.h"
+
+#include <iostream>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#define SNAPSHOT_VERSION 3
+
+
+
+/** @param sliceUsecs Length of a timeslice in microseconds
+	@param slice Last slice reported before the snapshot
+	*/
+SnapshotWriter::SnapshotWriter(long long sliceUsecs, long long slice)
+{
+	SnapshotHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "WDSS", 4);
+	header.version = SNAPSHOT_VERSION;
+	header.sliceUsecs = sliceUsecs;
+	header.slice = slice;
+	Put(header);
+}
+
+
+/** @param[out] data The snapshot's bytes
+	*/
+void SnapshotWriter::Finish(vector<char>& data)
+{
+	((SnapshotHeader*)&m_data[0])->size = m_data.size();
+	data.swap(m_data);
+	m_data.clear();
+}
+
+
+SnapshotReader::SnapshotReader()
+{
+	m_map = NULL;
+	m_mapSize = 0;
+	m_pos = 0;
+}
+
+
+SnapshotReader::~SnapshotReader()
+{
+	if (m_map != NULL)
+	{
+		munmap(m_map, m_mapSize);
+	}
+}
+
+
+/** Maps the file read only and checks its header. Reading then starts with the first value after
+	the header.
+
+	@param filename Name of a snapshot file written by a Checkpointer
+
+	@return TRUE if the snapshot was mapped, FALSE if it doesn't exist (silently) or is invalid (error
+			printed to console)
+	*/
+bool SnapshotReader::Open(const string& filename)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(SnapshotHeader))
+	{
+		cout << "Error: invalid snapshot " << filename << endl;
+		close(fd);
+		return false;
+	}
+
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		cout << "Error: couldn't map snapshot " << filename << endl;
+		return false;
+	}
+
+	const SnapshotHeader* header = (const SnapshotHeader*)map;
+	if (memcmp(header->magic, "WDSS", 4) != 0 || header->version != SNAPSHOT_VERSION ||
+		header->size != (uint64_t)st.st_size)
+	{
+		cout << "Error: invalid snapshot " << filename << endl;
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	if (m_map != NULL)
+	{
+		munmap(m_map, m_mapSize);
+	}
+
+	m_map = map;
+	m_mapSize = st.st_size;
+	m_pos = 0;
+	Take(sizeof(SnapshotHeader));
+
+	return true;
+}
+
+
+/** @param[out] text The string read
+
+	@return TRUE if the string was read and FALSE if the snapshot ends first
+	*/
+bool SnapshotReader::GetString(string& text)
+{
+	size_t len;
+	const char* data = GetArray<char>(len);
+	if (data == NULL)
+	{
+		return false;
+	}
+
+	text.assign(data, len);
+	return true;
+}
+
+
+/** @param data The snapshot's bytes
+
+	@return TRUE if the snapshot replaced the file and FALSE otherwise (error printed to console)
+	*/
+bool Checkpointer::Write(const vector<char>& data)
+{
+	string tmpfile = m_filename + ".tmp";
+	FILE* pFile = fopen(tmpfile.c_str(), "wb");
+	if (pFile == NULL)
+	{
+		cout << "Error: couldn't write snapshot " << tmpfile << endl;
+		return false;
+	}
+
+	bool ok = fwrite(data.data(), 1, data.size(), pFile) == data.size();
+	ok = (fflush(pFile) == 0) && ok;
+	ok = (fsync(fileno(pFile)) == 0) && ok;
+	ok = (fclose(pFile) == 0) && ok;
+
+	if (!ok || rename(tmpfile.c_str(), m_filename.c_str()) == -1)
+	{
+		cout << "Error: couldn't write snapshot " << m_filename << endl;
+		unlink(tmpfile.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+
+void Checkpointer::WriteLoop()
+{
+	unique_lock<mutex> lock(m_mtx);
+
+	while (1)
+	{
+		m_cv.wait(lock, [this] { return m_stop || !m_pending.empty(); });
+		if (m_pending.empty())
+		{
+			return; // (stopped)
+		}
+
+		vector<char> data;
+		data.swap(m_pending);
+		lock.unlock();
+
+		Write(data);
+
+		lock.lock();
+	}
+}
+
+
+/** @param filename Name of the snapshot file (replaced by each snapshot written)
+	*/
+Checkpointer::Checkpointer(const string& filename)
+{
+	m_filename = filename;
+	m_stop = false;
+
+	m_thread = thread(&Checkpointer::WriteLoop, this);
+}
+
+
+Checkpointer::~Checkpointer()
+{
+	m_mtx.lock();
+	m_stop = true;
+	m_mtx.unlock();
+	m_cv.notify_one();
+
+	m_thread.join();
+}
+
+
+/** @param cpus The CPUs the writer thread may run on
+
+	@return TRUE if the affinity was set
+	*/
+bool Checkpointer::SetAffinity(const vector<int>& cpus)
+{
+	return SetThreadAffinity(m_thread, cpus);
+}
+
+
+/** @param[in,out] snapshot The snapshot to write (emptied)
+	*/
+void Checkpointer::Save(SnapshotWriter& snapshot)
+{
+	vector<char> data;
+	snapshot.Finish(data);
+
+	m_mtx.lock();
+	m_pending.swap(data);
+	m_mtx.unlock();
+	m_cv.notify_one();
+}
@@ -0,0 +1,236 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <string.h>
+#include <stdint.h>
+
+using namespace std;
+
+
+/** @brief Header of a binary snapshot file (see SnapshotWriter)
+
+	The header is followed by the values written by the analyzer, in native byte order. Every value and
+	array starts on an 8 byte boundary, so arrays can be used in place in the mapped file.
+	*/
+struct SnapshotHeader
+{
+	/** "WDSS" */
+	char magic[4];
+
+	/** SNAPSHOT_VERSION */
+	uint32_t version;
+
+	/** Total size of the snapshot in bytes (to detect a truncated file) */
+	uint64_t size;
+
+	/** Length of a timeslice in microseconds when the snapshot was taken */
+	int64_t sliceUsecs;
+
+	/** Last slice reported before the snapshot was taken */
+	int64_t slice;
+};
+
+
+/** @brief Serializes analyzer state into an in-memory snapshot
+
+	Values are appended in order (and must be read back in the same order by a SnapshotReader). Only
+	trivially copyable types may be written. Building the snapshot is just a series of memcpy()s, so
+	it can be done while the analyzer is locked and the result written out by a Checkpointer.
+	*/
+class SnapshotWriter
+{
+
+private:
+
+	vector<char> m_data;
+
+	/** @brief Appends len bytes, padded to the next 8 byte boundary */
+	void Append(const void* data, size_t len)
+	{
+		size_t offset = m_data.size();
+		m_data.resize(offset + ((len + 7) & ~(size_t)7), 0);
+		memcpy(&m_data[offset], data, len);
+	}
+
+
+public:
+
+	/** @brief Constructor, starts a snapshot of state as of the end of slice */
+	SnapshotWriter(long long sliceUsecs, long long slice);
+
+	/** @brief Appends a value */
+	template <class T>
+	void Put(const T& value) { Append(&value, sizeof(T)); }
+
+	/** @brief Appends an array, preceded by its number of elements */
+	template <class T>
+	void PutArray(const T* values, size_t count)
+	{
+		Put((uint64_t)count);
+		Append(values, count * sizeof(T));
+	}
+
+	/** @brief Appends a string, preceded by its length */
+	void PutString(const string& text) { PutArray(text.data(), text.length()); }
+
+	/** @brief Completes the snapshot and hands over its bytes (the writer is empty afterwards) */
+	void Finish(vector<char>& data);
+
+};
+
+
+/** @brief Memory maps a snapshot file and reads its values back in the order they were written
+
+	Arrays are returned as pointers into the mapping, so restoring even a large table costs no more
+	than touching its pages. Every read is checked against the size of the file; once a read fails,
+	all further reads fail too.
+	*/
+class SnapshotReader
+{
+
+private:
+
+	/** The mapped file (NULL if none) */
+	void* m_map;
+
+	/** Size of the mapping in bytes */
+	size_t m_mapSize;
+
+	/** Offset of the next value */
+	size_t m_pos;
+
+
+	SnapshotReader(const SnapshotReader&);
+	SnapshotReader& operator=(const SnapshotReader&);
+
+	/** @brief Returns the next len bytes (moving past their padding), or NULL if the file is too short */
+	const char* Take(size_t len)
+	{
+		size_t padded = (len + 7) & ~(size_t)7;
+		if (m_map == NULL || padded < len || m_mapSize - m_pos < padded)
+		{
+			m_pos = m_mapSize;
+			return NULL;
+		}
+
+		const char* data = (const char*)m_map + m_pos;
+		m_pos += padded;
+		return data;
+	}
+
+
+public:
+
+	/** @brief Constructor (no file mapped) */
+	SnapshotReader();
+
+	/** @brief Destructor, unmaps the file */
+	~SnapshotReader();
+
+	/** @brief Maps a snapshot file, returning FALSE if it doesn't exist or is invalid */
+	bool Open(const string& filename);
+
+	/** @brief Returns the header of the mapped snapshot */
+	const SnapshotHeader& Header() const { return *(const SnapshotHeader*)m_map; }
+
+	/** @brief Reads a value, returning FALSE if the snapshot ends first */
+	template <class T>
+	bool Get(T& value)
+	{
+		const char* data = Take(sizeof(T));
+		if (data != NULL)
+		{
+			memcpy(&value, data, sizeof(T));
+		}
+		return data != NULL;
+	}
+
+	/** @brief Reads an array in place, returning NULL if the snapshot ends first */
+	template <class T>
+	const T* GetArray(size_t& count)
+	{
+		uint64_t n;
+		if (!Get(n) || n > m_mapSize / sizeof(T))
+		{
+			m_pos = m_mapSize;
+			return NULL;
+		}
+
+		count = n;
+		return (const T*)Take(count * sizeof(T));
+	}
+
+	/** @brief Reads a string, returning FALSE if the snapshot ends first */
+	bool GetString(string& text);
+
+};
+
+
+/** @brief Writes snapshots to a file on a background thread
+
+	Save() only queues the snapshot, so the caller never waits for the disk. If snapshots are saved
+	faster than they can be written, only the latest is kept. Each snapshot is written to a temporary
+	file that is then renamed over the previous one, so a crash mid-write leaves the last complete
+	snapshot in place.
+	*/
+class Checkpointer
+{
+
+private:
+
+	/** Name of the snapshot file */
+	string m_filename;
+
+	/** Writer thread state */
+	thread m_thread;
+	mutex m_mtx;
+	condition_variable m_cv;
+	vector<char> m_pending;		// snapshot waiting to be written (empty if none)
+	bool m_stop;
+
+
+	Checkpointer(const Checkpointer&);
+	Checkpointer& operator=(const Checkpointer&);
+
+	/** @brief Writes a snapshot to the file, returning FALSE on error */
+	bool Write(const vector<char>& data);
+
+	/** @brief Writer thread, writes queued snapshots until stopped */
+	void WriteLoop();
+
+
+public:
+
+	/** @brief Constructor, starts the writer thread */
+	explicit Checkpointer(const string& filename);
+
+	/** @brief Destructor, writes any queued snapshot and stops the writer thread */
+	~Checkpointer();
+
+	/** @brief Restricts the writer thread to the given CPUs, returning FALSE on error */
+	bool SetAffinity(const vector<int>& cpus);
+
+	/** @brief Queues a completed snapshot to be written (replacing any snapshot not yet written) */
+	void Save(SnapshotWriter& snapshot);
+
+};
+
+
+/** @brief Returns a 64-bit FNV-1a hash of text (to tell snapshots of different configurations apart) */
+inline uint64_t SnapshotHash(const string& text)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < text.length(); i++)
+	{
+		hash = (hash ^ (unsigned char)text[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+#endif
@@ -0,0 +1,452 @@
+#include "tcp_reassembler.h"
+
+#include <string.h>
+#include <netinet/in.h>
+
+#include "network_protocols.h"
+
+
+#define USECS_PER_TICK 1000000		// the expiry wheel ticks once per second of capture time
+
+#define MAX_STREAM_SEGMENTS 32		// max out of order segments buffered per stream
+#define STREAM_TIMEOUT 60			// secs before an idle stream is forgotten
+#define STREAM_TIMEOUT_SHORT 10		// secs before an idle stream that sent no payload yet (e.g. only a SYN) or a FIN is forgotten
+
+
+const uint32_t TcpReassembler::NONE;
+const uint32_t TcpReassembler::SEGMENT_BYTES;
+
+
+/** @param key The stream's 4-tuple
+
+	@return 32-bit hash of key
+	*/
+uint32_t TcpReassembler::Hash(const StreamKey& key)
+{
+	return FlowHash(make_tuple(key.src_ip, key.dst_ip, key.src_port, key.dst_port, (u_char)IPPROTO_TCP));
+}
+
+
+/** Probes m_index (linear probing) starting at the key's hash.
+
+	@param key The stream's 4-tuple
+
+	@return Index into m_index of the slot holding key's stream id, or of the empty slot it would be inserted into
+	*/
+uint32_t TcpReassembler::FindSlot(const StreamKey& key) const
+{
+	uint32_t i = Hash(key) & m_indexMask;
+
+	while (m_index[i] != NONE && !(m_streams[m_index[i]].key == key))
+	{
+		i = (i + 1) & m_indexMask;
+	}
+
+	return i;
+}
+
+
+/** Removes the stream from m_index using backward shift deletion (see FlowTable::Remove()), after
+	returning its buffered segments to the pool and cancelling its timer.
+
+	@param id The stream to remove
+	*/
+void TcpReassembler::Remove(uint32_t id)
+{
+	Stream& stream = m_streams[id];
+
+	FreeSegments(stream);
+	m_wheel.Cancel(id);
+
+	// remove from the hash table, shifting back any entries that probed past this slot
+	uint32_t i = FindSlot(stream.key);
+	uint32_t j = i;
+	while (1)
+	{
+		j = (j + 1) & m_indexMask;
+		if (m_index[j] == NONE)
+		{
+			break;
+		}
+
+		uint32_t home = Hash(m_streams[m_index[j]].key) & m_indexMask;
+
+		// entry at j can fill the hole at i only if its home slot is not within (i, j]
+		if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j)))
+		{
+			m_index[i] = m_index[j];
+			i = j;
+		}
+	}
+	m_index[i] = NONE;
+
+	m_freeStreams.push_back(id);
+	m_activeStreams--;
+}
+
+
+/** @param stream The stream whose segments are freed
+	*/
+void TcpReassembler::FreeSegments(Stream& stream)
+{
+	while (stream.segments != NONE)
+	{
+		uint32_t id = stream.segments;
+		stream.segments = m_segments[id].next;
+		m_bufferedBytes -= m_segments[id].len;
+		m_freeSegments.push_back(id);
+	}
+	stream.numSegments = 0;
+}
+
+
+/** Called by AddPacket() for a segment that starts after the next byte the stream expects. The
+	segment is inserted into the stream's list in sequence order (a segment starting where a buffered
+	one does is a retransmission and is ignored). If the stream is at MAX_STREAM_SEGMENTS or the pool
+	is empty, the segment is dropped and the stream skips its gap so its buffers drain.
+
+	@param stream The segment's stream
+	@param seq Sequence number of the segment's first byte
+	@param data The segment's payload
+	@param len Number of payload bytes
+	*/
+void TcpReassembler::Buffer(Stream& stream, uint32_t seq, const u_char* data, uint32_t len)
+{
+	uint32_t prev = NONE;
+	uint32_t next = stream.segments;
+	while (next != NONE && SeqBefore(m_segments[next].seq, seq))
+	{
+		prev = next;
+		next = m_segments[next].next;
+	}
+
+	if (next != NONE && m_segments[next].seq == seq)
+	{
+		return;
+	}
+
+	if (len > SEGMENT_BYTES || stream.numSegments >= MAX_STREAM_SEGMENTS || m_freeSegments.empty())
+	{
+		m_drops++;
+		SkipGap(stream);
+		return;
+	}
+
+	uint32_t id = m_freeSegments.back();
+	m_freeSegments.pop_back();
+
+	Segment& segment = m_segments[id];
+	segment.seq = seq;
+	segment.len = len;
+	segment.next = next;
+	memcpy(&m_segmentData[(size_t)id * SEGMENT_BYTES], data, len);
+
+	if (prev == NONE)
+	{
+		stream.segments = id;
+	}
+	else
+	{
+		m_segments[prev].next = id;
+	}
+
+	stream.numSegments++;
+	m_bufferedBytes += len;
+	m_copiedBytes += len;
+}
+
+
+/** The bytes between the next byte expected and the first buffered segment are given up on, so the
+	segments NextChunk() hands over next don't continue the inspector's state.
+
+	@param stream The stream (nothing is done if it has no buffered segments)
+	*/
+void TcpReassembler::SkipGap(Stream& stream)
+{
+	if (stream.segments == NONE)
+	{
+		return;
+	}
+
+	stream.nextSeq = m_segments[stream.segments].seq;
+	stream.inspectorState = 0;
+	m_gaps++;
+}
+
+
+/** @param stream The stream
+
+	@return Number of seconds the stream may be idle before it is expired
+	*/
+uint32_t TcpReassembler::IdleTimeout(const Stream& stream) const
+{
+	return (stream.closing || !stream.hasData) ? STREAM_TIMEOUT_SHORT : STREAM_TIMEOUT;
+}
+
+
+/** Called by m_wheel when a stream's timer fires. As in FlowTable::OnExpire(), the timer is only set
+	again if the stream was active since it was set (or its timeout grew as it started carrying
+	payload), otherwise the stream is removed.
+
+	@param id The stream whose timer fired
+	@param now The current tick
+	*/
+void TcpReassembler::OnExpire(uint32_t id, uint64_t now)
+{
+	Stream& stream = m_streams[id];
+	uint64_t expiry = stream.lastSeen / USECS_PER_TICK + IdleTimeout(stream);
+
+	if (expiry > now)
+	{
+		m_wheel.Schedule(id, expiry);
+	}
+	else
+	{
+		Remove(id);
+	}
+}
+
+
+/** Initializes an empty reassembler. All memory (for maxStreams streams and numSegments buffers of
+	SEGMENT_BYTES) is allocated up front.
+
+	@param maxStreams Maximum number of streams tracked at once
+	@param numSegments Number of pooled out of order segment buffers
+	*/
+TcpReassembler::TcpReassembler(uint32_t maxStreams, uint32_t numSegments)
+	: m_streams(maxStreams), m_wheel(maxStreams, 0), m_segments(numSegments),
+	  m_segmentData((size_t)numSegments * SEGMENT_BYTES)
+{
+	uint32_t indexSize = 1;
+	while (indexSize < maxStreams * 2)
+	{
+		indexSize <<= 1;
+	}
+	m_index.assign(indexSize, NONE);
+	m_indexMask = indexSize - 1;
+
+	m_freeStreams.reserve(maxStreams);
+	for (uint32_t i = maxStreams; i > 0; i--)
+	{
+		m_freeStreams.push_back(i - 1);
+	}
+
+	m_freeSegments.reserve(numSegments);
+	for (uint32_t i = numSegments; i > 0; i--)
+	{
+		m_freeSegments.push_back(i - 1);
+	}
+
+	m_current = NONE;
+	m_pending = NULL;
+	m_pendingLen = 0;
+	m_pendingGap = false;
+	m_delivered = NONE;
+
+	m_activeStreams = 0;
+	m_bufferedBytes = 0;
+	ResetSliceCounters();
+}
+
+
+/** Expires idle streams (as of the packet's capture time), then finds the packet's stream. A stream
+	is created by a SYN, or by the first payload of a connection seen mid-way (starting at that
+	payload, so any earlier segment arriving after it is taken for a retransmission). Streams that
+	carried no payload yet are expired sooner, so a SYN flood doesn't hold the table for long. A SYN
+	restarts the stream at its sequence number and a RST forgets it.
+
+	The packet's payload is then, by its sequence number:
+	- dropped, if every byte of it was already delivered (a retransmission)
+	- made the next chunk (less any bytes already delivered), if it holds the next byte expected
+	- otherwise copied into a buffer until the bytes before it arrive (see Buffer())
+
+	@param p PacketInfo struct storing all relevent metadata from a TCP packet
+
+	@return TRUE if the packet was added (call NextChunk() for the bytes it made deliverable), or FALSE if
+			its stream isn't tracked because the table is full
+	*/
+bool TcpReassembler::AddPacket(const PacketInfo& p)
+{
+	if (m_delivered != NONE)
+	{
+		m_freeSegments.push_back(m_delivered);
+		m_delivered = NONE;
+	}
+	m_current = NONE;
+	m_pending = NULL;
+	m_pendingLen = 0;
+	m_pendingGap = false;
+
+	uint64_t now = p.ts_usecs / USECS_PER_TICK;
+	m_wheel.Advance(now, [this, now](uint32_t id) { OnExpire(id, now); });
+
+	StreamKey key;
+	key.src_ip = p.src_ip;
+	key.dst_ip = p.dst_ip;
+	key.src_port = p.src_port;
+	key.dst_port = p.dst_port;
+
+	// (a SYN takes up the first sequence number, the payload starts after it)
+	uint32_t seq = p.tcp_seq + ((p.tcp_flags & TH_SYN) ? 1 : 0);
+
+	uint32_t slot = FindSlot(key);
+	uint32_t id = m_index[slot];
+
+	if (id == NONE)
+	{
+		if ((p.tcp_len == 0 && !(p.tcp_flags & TH_SYN)) || (p.tcp_flags & TH_RST))
+		{
+			return true;
+		}
+
+		if (m_freeStreams.empty())
+		{
+			m_drops++;
+			return false;
+		}
+
+		id = m_freeStreams.back();
+		m_freeStreams.pop_back();
+		m_index[slot] = id;
+
+		Stream& stream = m_streams[id];
+		stream.key = key;
+		stream.nextSeq = seq;
+		stream.inspectorState = 0;
+		stream.segments = NONE;
+		stream.numSegments = 0;
+		stream.closing = false;
+		stream.hasData = false;
+
+		m_activeStreams++;
+	}
+
+	if (p.tcp_flags & TH_RST)
+	{
+		Remove(id);
+		return true;
+	}
+
+	Stream& stream = m_streams[id];
+	stream.lastSeen = p.ts_usecs;
+
+	if (p.tcp_flags & TH_SYN)
+	{
+		FreeSegments(stream);
+		stream.nextSeq = seq;
+		stream.inspectorState = 0;
+	}
+
+	// (re)arm the expiry timer when the stream is new or starts closing
+	if (!m_wheel.IsScheduled(id) || ((p.tcp_flags & TH_FIN) && !stream.closing))
+	{
+		stream.closing = stream.closing || (p.tcp_flags & TH_FIN);
+		m_wheel.Schedule(id, now + IdleTimeout(stream));
+	}
+
+	m_current = id;
+
+	uint32_t end = seq + p.tcp_len;
+	if (p.tcp_len == 0 || !SeqBefore(stream.nextSeq, end))
+	{
+		return true;
+	}
+	stream.hasData = true;
+
+	if (!SeqBefore(stream.nextSeq, seq))
+	{
+		uint32_t skip = stream.nextSeq - seq;
+		if (skip < (uint32_t)p.payload_len)
+		{
+			m_pending = p.payload + skip;
+			m_pendingLen = p.payload_len - skip;
+		}
+
+		m_pendingGap = (p.payload_len < p.tcp_len);
+		stream.nextSeq = end;
+	}
+	else if (p.payload_len == p.tcp_len)
+	{
+		Buffer(stream, seq, p.payload, p.payload_len);
+	}
+	else
+	{
+		m_drops++; // (a cut short segment can't fill its place in the stream)
+	}
+
+	return true;
+}
+
+
+/** Returns the last packet's in-order bytes first, then each buffered segment that has become
+	contiguous with the bytes delivered (trimmed of any bytes already delivered). The segment returned
+	is only freed on the next call, so its bytes stay valid until then.
+
+	@param[out] data The chunk's bytes
+	@param[out] len Number of bytes in the chunk
+
+	@return TRUE if a chunk was returned, FALSE if the packet made no more bytes deliverable
+	*/
+bool TcpReassembler::NextChunk(const u_char*& data, size_t& len)
+{
+	if (m_delivered != NONE)
+	{
+		m_freeSegments.push_back(m_delivered);
+		m_delivered = NONE;
+	}
+
+	if (m_current == NONE)
+	{
+		return false;
+	}
+
+	if (m_pending != NULL)
+	{
+		data = m_pending;
+		len = m_pendingLen;
+		m_pending = NULL;
+		return true;
+	}
+
+	Stream& stream = m_streams[m_current];
+
+	if (m_pendingGap)
+	{
+		stream.inspectorState = 0;
+		m_gaps++;
+		m_pendingGap = false;
+	}
+
+	while (stream.segments != NONE && !SeqBefore(stream.nextSeq, m_segments[stream.segments].seq))
+	{
+		uint32_t id = stream.segments;
+		Segment& segment = m_segments[id];
+
+		stream.segments = segment.next;
+		stream.numSegments--;
+		m_bufferedBytes -= segment.len;
+
+		uint32_t end = segment.seq + segment.len;
+		if (SeqBefore(stream.nextSeq, end))
+		{
+			uint32_t skip = stream.nextSeq - segment.seq;
+			data = &m_segmentData[(size_t)id * SEGMENT_BYTES] + skip;
+			len = segment.len - skip;
+			stream.nextSeq = end;
+			m_delivered = id;
+			return true;
+		}
+
+		m_freeSegments.push_back(id); // (all of it was delivered already)
+	}
+
+	return false;
+}
+
+
+void TcpReassembler::ResetSliceCounters()
+{
+	m_copiedBytes = 0;
+	m_gaps = 0;
+	m_drops = 0;
+}
@@ -0,0 +1,208 @@
+#ifndef TCP_REASSEMBLER_H
+#define TCP_REASSEMBLER_H
+
+#include "packet_info.h"
+#include "timer_wheel.h"
+#include "large_pages.h"
+
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+
+/** @brief Reassembles the payloads of TCP streams into in-order bytes, in bounded memory
+
+	Each direction of a TCP connection is a stream, keyed by its 4-tuple. Streams live in a fixed size
+	pool indexed by an open addressing hash table and idle ones are expired by a TimerWheel ticking
+	once per second of capture time (as in FlowTable), so the packet path never allocates.
+
+	A stream tracks the sequence number of the next byte it expects. A segment holding it is handed
+	to the caller in place (trimmed of any bytes already delivered), so in-order traffic is never
+	copied. Segments beyond it are copied into SEGMENT_BYTES buffers from a shared pool and kept in a
+	list sorted by sequence number, up to a cap per stream. Once the missing bytes arrive, the buffered
+	segments they make contiguous are handed over after them.
+
+	Bytes that can't be delivered in order are skipped rather than waited for: when a stream reaches
+	its cap (or the pool runs out) while a segment is missing, the stream jumps to its first buffered
+	segment, and a payload cut short by the capture leaves a hole where its missing bytes were. Each
+	gap resets the stream's inspector state (see InspectorState()), so no match spans a gap.
+
+	Usage: AddPacket() for every TCP packet, then NextChunk() until it returns FALSE to get the bytes
+	the packet made deliverable. A chunk is only valid until the next call to either.
+
+	The cost is reported per slice: bytes held in buffers (memory), bytes copied into them (the only
+	work beyond inspecting the bytes once), gaps skipped, and segments or streams that could not be
+	reassembled.
+	*/
+class TcpReassembler
+{
+
+private:
+
+	/** Marks an empty hash table slot or the end of a segment list */
+	static const uint32_t NONE = 0xffffffff;
+
+	/** Size of a pooled segment buffer (out of order segments larger than this aren't buffered) */
+	static const uint32_t SEGMENT_BYTES = 2048;
+
+	/** @brief Directional 4-tuple of a stream */
+	struct StreamKey
+	{
+		uint32_t src_ip, dst_ip;
+		u_short src_port, dst_port;
+
+		bool operator==(const StreamKey& rhs) const
+		{
+			return src_ip == rhs.src_ip && dst_ip == rhs.dst_ip && src_port == rhs.src_port && dst_port == rhs.dst_port;
+		}
+	};
+
+	/** @brief A single stream */
+	struct Stream
+	{
+		StreamKey key;
+
+		/** Sequence number of the next byte to deliver */
+		uint32_t nextSeq;
+
+		/** State of the inspector the stream's bytes are handed to (0 at the start and after a gap) */
+		uint32_t inspectorState;
+
+		/** First buffered segment, in sequence order (NONE if none) */
+		uint32_t segments;
+
+		/** Number of buffered segments */
+		uint32_t numSegments;
+
+		/** TRUE once a FIN was seen (the stream is expired sooner) */
+		bool closing;
+
+		/** TRUE once the stream carried payload (until then it is expired sooner) */
+		bool hasData;
+
+		/** Capture time (usecs since the epoch) of the most recent packet */
+		long long lastSeen;
+	};
+
+	/** @brief A buffered out of order segment (its bytes are in m_segmentData) */
+	struct Segment
+	{
+		uint32_t seq;
+		uint32_t len;
+
+		/** Next segment of the same stream (NONE if last) */
+		uint32_t next;
+	};
+
+	/** Pool of streams (indexed by stream id) */
+	vector<Stream, LargePageAllocator<Stream> > m_streams;
+
+	/** Open addressing hash table of stream ids (linear probing) */
+	vector<uint32_t, LargePageAllocator<uint32_t> > m_index;
+
+	/** m_index.size() - 1 (the size is a power of two) */
+	uint32_t m_indexMask;
+
+	/** Stack of unused stream ids */
+	vector<uint32_t> m_freeStreams;
+
+	/** Expiry timers (one per stream id, one tick per second) */
+	TimerWheel m_wheel;
+
+	/** Pool of segments, their buffers (SEGMENT_BYTES each) and a stack of unused segment ids */
+	vector<Segment> m_segments;
+	vector<u_char, LargePageAllocator<u_char> > m_segmentData;
+	vector<uint32_t> m_freeSegments;
+
+	/** Stream of the last packet added (NONE if it wasn't reassembled) */
+	uint32_t m_current;
+
+	/** In-order bytes of the last packet added, not yet returned by NextChunk() (NULL if none) */
+	const u_char* m_pending;
+	size_t m_pendingLen;
+
+	/** TRUE if the last packet added was cut short by the capture (a gap follows its bytes) */
+	bool m_pendingGap;
+
+	/** Segment returned by the last NextChunk() call, freed by the next call (NONE if none) */
+	uint32_t m_delivered;
+
+	/** Number of streams currently tracked */
+	uint32_t m_activeStreams;
+
+	/** Number of payload bytes currently buffered */
+	unsigned long long m_bufferedBytes;
+
+	/** Number of bytes copied into buffers this slice */
+	unsigned long long m_copiedBytes;
+
+	/** Number of gaps skipped this slice */
+	unsigned long long m_gaps;
+
+	/** Number of segments (or new streams) that could not be reassembled this slice */
+	unsigned long long m_drops;
+
+
+	/** @brief Returns the slot in m_index holding the stream with this key (or the empty slot where it belongs) */
+	uint32_t FindSlot(const StreamKey& key) const;
+
+	/** @brief Frees a stream's buffered segments, removes it from the table and returns its id to the free list */
+	void Remove(uint32_t id);
+
+	/** @brief Returns a stream's buffered segments to the pool */
+	void FreeSegments(Stream& stream);
+
+	/** @brief Copies an out of order segment into a buffer of its stream's list */
+	void Buffer(Stream& stream, uint32_t seq, const u_char* data, uint32_t len);
+
+	/** @brief Moves a stream past its missing bytes to its first buffered segment */
+	void SkipGap(Stream& stream);
+
+	/** @brief Returns the idle timeout (in seconds) of a stream */
+	uint32_t IdleTimeout(const Stream& stream) const;
+
+	/** @brief Called by m_wheel when a stream's timer fires */
+	void OnExpire(uint32_t id, uint64_t now);
+
+	static uint32_t Hash(const StreamKey& key);
+
+	/** @brief Returns TRUE if sequence number a comes before b (modulo 2^32) */
+	static bool SeqBefore(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; }
+
+
+public:
+
+	/** @brief Constructor */
+	TcpReassembler(uint32_t maxStreams, uint32_t numSegments);
+
+	/** @brief Adds a TCP packet to its stream, returning FALSE if it can't be reassembled (inspect it on its own) */
+	bool AddPacket(const PacketInfo& p);
+
+	/** @brief Returns the next in-order bytes the last packet added made deliverable, FALSE once there are none */
+	bool NextChunk(const u_char*& data, size_t& len);
+
+	/** @brief Returns the inspector state of the last packet's stream (to be updated as its chunks are inspected) */
+	uint32_t& InspectorState() { return m_streams[m_current].inspectorState; }
+
+	/** @brief Resets the per-slice counters (bytes copied, gaps, drops) */
+	void ResetSliceCounters();
+
+	/** @brief Returns the number of streams currently tracked */
+	uint32_t GetActiveStreams() const { return m_activeStreams; }
+
+	/** @brief Returns the number of payload bytes currently buffered */
+	unsigned long long GetBufferedBytes() const { return m_bufferedBytes; }
+
+	/** @brief Returns the number of bytes copied into buffers this slice */
+	unsigned long long GetCopiedBytes() const { return m_copiedBytes; }
+
+	/** @brief Returns the number of gaps skipped this slice */
+	unsigned long long GetGaps() const { return m_gaps; }
+
+	/** @brief Returns the number of segments or new streams that could not be reassembled this slice */
+	unsigned long long GetDrops() const { return m_drops; }
+
+};
+
+#endif
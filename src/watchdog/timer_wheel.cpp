@@ -0,0 +1,176 @@
+#include "timer_wheel.h"
+
+
+const uint32_t TimerWheel::NONE;
+
+
+/** Places the timer in level 0 if it expires within SLOTS ticks, otherwise in the lowest level whose
+	range covers it. Timers already due are placed in the current tick's slot, and timers beyond
+	the range of the wheel are clamped to its last slot.
+
+	@param id The timer to link (its expiry must already be set)
+	*/
+void TimerWheel::Link(uint32_t id)
+{
+	Node& node = m_nodes[id];
+
+	if (node.expiry < m_now)
+	{
+		node.expiry = m_now;
+	}
+
+	uint64_t delta = node.expiry - m_now;
+	uint64_t maxDelta = ((uint64_t)1 << (SLOT_BITS * LEVELS)) - 1;
+	if (delta > maxDelta)
+	{
+		node.expiry = m_now + maxDelta;
+		delta = maxDelta;
+	}
+
+	int level = 0;
+	while (level < LEVELS - 1 && delta >= ((uint64_t)1 << (SLOT_BITS * (level + 1))))
+	{
+		level++;
+	}
+
+	uint32_t slot = level * SLOTS + ((node.expiry >> (SLOT_BITS * level)) & (SLOTS - 1));
+
+	node.slot = slot;
+	node.prev = NONE;
+	node.next = m_heads[slot];
+	if (node.next != NONE)
+	{
+		m_nodes[node.next].prev = id;
+	}
+	m_heads[slot] = id;
+}
+
+
+/** @param id The timer to unlink (must be scheduled)
+	*/
+void TimerWheel::Unlink(uint32_t id)
+{
+	Node& node = m_nodes[id];
+
+	if (node.prev != NONE)
+	{
+		m_nodes[node.prev].next = node.next;
+	}
+	else
+	{
+		m_heads[node.slot] = node.next;
+	}
+
+	if (node.next != NONE)
+	{
+		m_nodes[node.next].prev = node.prev;
+	}
+
+	node.slot = NONE;
+}
+
+
+/** Called when the index of level-1 wraps to 0. Re-links every timer in the current slot of level,
+	which places each of them in a lower level now that they are closer to expiring. If the current
+	slot of this level is also 0, the level above is cascaded as well.
+
+	@param level The level to cascade (1 or higher)
+	*/
+void TimerWheel::Cascade(int level)
+{
+	uint32_t index = (m_now >> (SLOT_BITS * level)) & (SLOTS - 1);
+
+	if (index == 0 && level + 1 < LEVELS)
+	{
+		Cascade(level + 1);
+	}
+
+	uint32_t slot = level * SLOTS + index;
+	uint32_t id = m_heads[slot];
+	m_heads[slot] = NONE;
+
+	while (id != NONE)
+	{
+		uint32_t next = m_nodes[id].next;
+		Link(id);
+		id = next;
+	}
+}
+
+
+/** Cascades higher levels if needed, then detaches the list of timers expiring at the current
+	tick and moves m_now forward by one tick (so timers rescheduled by the caller for a tick that has
+	already passed fire on the next tick).
+
+	@return Head of the detached list of expired timers (linked through Node::next)
+	*/
+uint32_t TimerWheel::TakeCurrentSlot()
+{
+	uint32_t index = m_now & (SLOTS - 1);
+
+	if (index == 0)
+	{
+		Cascade(1);
+	}
+
+	uint32_t id = m_heads[index];
+	m_heads[index] = NONE;
+	m_now++;
+
+	return id;
+}
+
+
+/** Initializes an empty wheel able to hold timers with ids in [0, capacity).
+
+	@param capacity Number of timer ids
+	@param now The current tick
+	*/
+TimerWheel::TimerWheel(uint32_t capacity, uint64_t now)
+{
+	Node node;
+	node.next = NONE;
+	node.prev = NONE;
+	node.slot = NONE;
+	node.expiry = 0;
+	m_nodes.assign(capacity, node);
+
+	for (int i = 0; i < LEVELS * SLOTS; i++)
+	{
+		m_heads[i] = NONE;
+	}
+
+	m_now = now;
+	m_count = 0;
+}
+
+
+/** @param id The timer to schedule
+	@param expiry Tick at which it should fire
+	*/
+void TimerWheel::Schedule(uint32_t id, uint64_t expiry)
+{
+	if (m_nodes[id].slot != NONE)
+	{
+		Unlink(id);
+	}
+	else
+	{
+		m_count++;
+	}
+
+	m_nodes[id].expiry = expiry;
+	Link(id);
+}
+
+
+/** @param id The timer to cancel
+	*/
+void TimerWheel::Cancel(uint32_t id)
+{
+	if (m_nodes[id].slot != NONE)
+	{
+		Unlink(id);
+		m_count--;
+	}
+}
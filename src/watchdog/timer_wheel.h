@@ -0,0 +1,135 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+
+/** @brief Hierarchical timer wheel for expiring a fixed population of timers in amortized O(1)
+
+	Timers are identified by an integer id in [0, capacity) (e.g. an index into the caller's entry
+	pool) and are kept in intrusive doubly linked lists, so Schedule() and Cancel() are O(1) and
+	allocate nothing. The wheel has LEVELS levels of SLOTS slots; level 0 has one slot per tick and
+	each higher level covers SLOTS times the range of the level below. Timers in higher levels are
+	cascaded down as time advances, so each timer is touched at most LEVELS times before it fires.
+	*/
+class TimerWheel
+{
+
+private:
+
+	/** Number of levels in the wheel */
+	static const int LEVELS = 4;
+
+	/** log2 of the number of slots per level */
+	static const int SLOT_BITS = 6;
+
+	/** Number of slots per level */
+	static const int SLOTS = 1 << SLOT_BITS;
+
+	/** Marks the end of a list / an unscheduled timer */
+	static const uint32_t NONE = 0xffffffff;
+
+	/** @brief A single timer, linked into one slot of the wheel */
+	struct Node
+	{
+		/** Next timer in the same slot */
+		uint32_t next;
+
+		/** Previous timer in the same slot */
+		uint32_t prev;
+
+		/** Slot the timer is linked into (level * SLOTS + slot), or NONE if not scheduled */
+		uint32_t slot;
+
+		/** Tick at which the timer fires */
+		uint64_t expiry;
+	};
+
+	/** One node per timer id */
+	vector<Node> m_nodes;
+
+	/** Head of the list of timers in each slot */
+	uint32_t m_heads[LEVELS * SLOTS];
+
+	/** The next tick to be processed (all timers expiring before it have fired) */
+	uint64_t m_now;
+
+	/** Number of timers currently scheduled */
+	uint32_t m_count;
+
+
+	/** @brief Links a timer into the slot matching its expiry */
+	void Link(uint32_t id);
+
+	/** @brief Unlinks a timer from its slot */
+	void Unlink(uint32_t id);
+
+	/** @brief Moves all timers in the current slot of a level down to lower levels */
+	void Cascade(int level);
+
+	/** @brief Detaches and returns the list of timers in the current level 0 slot, and moves to the next tick */
+	uint32_t TakeCurrentSlot();
+
+
+public:
+
+	/** @brief Constructor */
+	TimerWheel(uint32_t capacity, uint64_t now);
+
+	/** @brief Schedules (or reschedules) timer id to fire at tick expiry */
+	void Schedule(uint32_t id, uint64_t expiry);
+
+	/** @brief Cancels timer id if it is scheduled */
+	void Cancel(uint32_t id);
+
+	/** @brief Returns TRUE if timer id is scheduled */
+	bool IsScheduled(uint32_t id) const { return m_nodes[id].slot != NONE; }
+
+	/** @brief Returns the next tick to be processed */
+	uint64_t Now() const { return m_now; }
+
+	/** @brief Returns the number of timers currently scheduled */
+	uint32_t Count() const { return m_count; }
+
+	/** @brief Fires every timer expiring at or before tick now, calling onExpire(id) for each */
+	template <class Callback>
+	void Advance(uint64_t now, Callback onExpire);
+
+};
+
+
+/** Processes ticks up to and including now. Each expired timer is unscheduled before onExpire(id)
+	is called, so the callback may Schedule() it again (e.g. if its entry was used since it was
+	scheduled) or leave it unscheduled. While no timers are scheduled the wheel jumps straight to now.
+
+	@param now The current tick
+	@param onExpire Function object called with the id of each expired timer
+	*/
+template <class Callback>
+void TimerWheel::Advance(uint64_t now, Callback onExpire)
+{
+	while (m_now <= now)
+	{
+		if (m_count == 0)
+		{
+			m_now = now + 1;
+			break;
+		}
+
+		uint32_t id = TakeCurrentSlot();
+
+		while (id != NONE)
+		{
+			uint32_t next = m_nodes[id].next;
+			m_nodes[id].slot = NONE;
+			m_count--;
+			onExpire(id);
+			id = next;
+		}
+	}
+}
+
+#endif
@@ -3,14 +3,75 @@
 #include <sstream>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <netinet/in.h>
 
 
+#define FLOW_TABLE_SIZE (1 << 18)		// max number of flows tracked across timeslices
+#define SYN_FLOOD_THRESHOLD 256			// min number of half-open connections for a synflood alert
+#define NEW_FLOW_THRESHOLD 1000			// min number of new flows in a slice for a newflows alert
+#define GROUP_MIN_PACKETS 1000			// min number of packets to a prefix group in a slice for a prefix alert
+#define SCAN_TABLE_SIZE 4096			// max number of sources tracked by the scan detector at once
+#define PORT_SCAN_THRESHOLD 100			// min number of distinct dst ports probed by a source in a slice for a portscan alert
+#define HOST_SWEEP_THRESHOLD 100		// min number of distinct dst hosts probed by a source in a slice for a hostsweep alert
+#define ENTROPY_MIN_PACKETS 1000		// min number of packets in a slice for its entropy to be checked and baselined
+#define ENTROPY_WARMUP_SLICES 8			// number of slices baselined before an entropy alert
+#define ENTROPY_MIN_SHIFT 1.0			// min change (bits) of a distribution's entropy from its baseline for an entropy alert
+#define ENTROPY_REBASELINE_SLICES 60	// number of consecutive entropy alerts after which the shifted distribution becomes the baseline
+#define MAX_LISTED_SCANNERS 8			// max number of scanning sources named in a report
+#define REASSEMBLY_STREAMS (1 << 16)	// max number of TCP streams (directions) reassembled at once
+#define REASSEMBLY_SEGMENTS 4096		// number of pooled buffers for out of order TCP segments (2KB each)
+#define MAX_LISTED_SIGNATURES 8			// max number of matched signatures named in a report
+#define MAX_LISTED_BLOCKED 8			// max number of blocklisted addresses named in a report
+#define DEFAULT_ALERT_FACTOR 3.0		// alert when a value is more than this many times its previous value
 
-/** @param msg The message to be written to m_logfile and console. 
+
+
+/** @param addr IPv4 address in host byte order
+
+	@return addr in dot-quad notation
+	*/
+string IpToString(uint32_t addr)
+{
+	in_addr in;
+	in.s_addr = htonl(addr);
+	return string(inet_ntoa(in));
+}
+
+
+/** @param protocol IP protocol number
+
+	@return 'TCP', 'UDP', 'ICMP', 'IP' or 'unknown'
+	*/
+string ProtocolToString(u_char protocol)
+{
+	switch (protocol)
+	{
+		case IPPROTO_TCP:
+			return "TCP";
+		case IPPROTO_UDP:
+			return "UDP";
+		case IPPROTO_ICMP:
+			return "ICMP";
+		case IPPROTO_IP:
+			return "IP";
+		default:
+			return "unknown";
+	}
+}
+
+
+/** @param msg The message to be written to m_logfile and console (nothing is written if m_logfile is empty).
 	*/
-void TrafficAnalyzer::LogMessage(const string& msg) const
+void TrafficAnalyzerBase::LogMessage(const string& msg) const
 {
-	fstream fs; 
+	if (m_logfile.empty())
+	{
+		return;
+	}
+
+	fstream fs;
 	fs.open(m_logfile, fstream::out | fstream::app);
 	fs << msg << endl;
 	fs.close();
@@ -19,123 +80,346 @@ void TrafficAnalyzer::LogMessage(const string& msg) const
 }
 
 
-/** Called internally by GenerateReport() method. Checks trafficData against data from the
-	previous report (stored in member variable m_prevData) to see if traffic is anomolous. 
-	If trafficData has more than 3x as many packets, alerts, or flows as m_prevData, an 
-	an alert is detected and alertFlags are set accordingly (indicating whether the 
-	alert was due to packets, bytes, and/or flows).
+/** Initializes the configuration independent state of a TrafficAnalyzer.
 
-	@param[in] trafficData The traffic data to scan for anomolous data
-	@param[out] alertFlags An array of three bools (whose indices correspond to the AlertType enum)
-				that are set to TRUE if an alert was detected for that category (e.g. packets/bytes/flows)
-	
-	@return TRUE if an alert was detected and FALSE otherwise 
+	@param logfile Name of the logfile that relevent info will be logged to ("" to log nothing)
 	*/
-bool TrafficAnalyzer::CheckAlert(const TrafficData& trafficData, bool alertFlags[3]) const
+TrafficAnalyzerBase::TrafficAnalyzerBase(const string& logfile)
+	: m_flowTable(FLOW_TABLE_SIZE),
+	  m_scanDetector(SCAN_TABLE_SIZE, PORT_SCAN_THRESHOLD, HOST_SWEEP_THRESHOLD),
+	  m_entropy(ENTROPY_MIN_PACKETS, ENTROPY_WARMUP_SLICES, ENTROPY_MIN_SHIFT, ENTROPY_REBASELINE_SLICES)
 {
-	alertFlags[PACKETS] = trafficData.packets > (m_prevData.packets * 3);
-	alertFlags[BYTES] = trafficData.bytes > (m_prevData.bytes * 3);
-	alertFlags[FLOWS] = trafficData.flows.size() > (m_prevData.flows.size() * 3);
+	m_logfile = logfile;
+	m_reportsGenerated = 0;
+	m_lastReportAlerted = false;
+	m_prevHalfOpen = 0;
+	m_prevNewFlows = 0;
+	m_portScans = 0;
+	m_hostSweeps = 0;
+	m_portScanners.reserve(MAX_LISTED_SCANNERS);
+	m_hostSweepers.reserve(MAX_LISTED_SCANNERS);
+	m_blockedAddrs.reserve(MAX_LISTED_BLOCKED);
+	m_blockedPackets = 0;
+	m_sampleRate = 1;
+	m_nextSampleRate = 1;
+	m_alertFactor = DEFAULT_ALERT_FACTOR;
+	m_groupMinPackets = GROUP_MIN_PACKETS;
+}
+
 
-	return alertFlags[PACKETS] || alertFlags[BYTES] || alertFlags[FLOWS];
+/** The TCP reassembler is only allocated once signatures are loaded, as they're the only inspector
+	of its streams.
+
+	@param filename Name of the rule file
+
+	@return TRUE if the rules were loaded and FALSE otherwise (error printed to console)
+	*/
+bool TrafficAnalyzerBase::LoadSignatures(const string& filename)
+{
+	if (!m_signatures.LoadRules(filename))
+	{
+		return false;
+	}
+
+	if (!m_reassembler)
+	{
+		m_reassembler.reset(new TcpReassembler(REASSEMBLY_STREAMS, REASSEMBLY_SEGMENTS));
+	}
+	return true;
 }
 
 
-/** Initializes TrafficAnalyzer instance with number of watchdogs to connect to and the name of file to log to. 
-	
-	@param logfile Name of the logfile that relevent info will be logged to 
+/** Called by AddPacketToDetectors() (on the capture thread) as soon as a source crosses a scan
+	threshold. The source is only remembered, to be logged and named in the report at the end of the
+	slice (at most MAX_LISTED_SCANNERS per category), so a scan from many sources costs no file I/O on
+	the packet path.
+
+	@param src_ip The scanning source (host byte order)
+	@param scan SCAN_PORTS or SCAN_HOSTS
 	*/
-TrafficAnalyzer::TrafficAnalyzer(const string& logfile)
+void TrafficAnalyzerBase::OnScan(uint32_t src_ip, ScanAlert scan)
 {
-	m_logfile = logfile;
-	m_reportsGenerated = 0;
+	vector<uint32_t>& listed = (scan == SCAN_PORTS) ? m_portScanners : m_hostSweepers;
+	unsigned long long& count = (scan == SCAN_PORTS) ? m_portScans : m_hostSweeps;
+
+	count++;
+	if (listed.size() < MAX_LISTED_SCANNERS)
+	{
+		listed.push_back(src_ip);
+	}
 }
 
 
-/** Adds a packet to be processed. First determines the flow of the packet, then 
-	adds the packet to the TrafficMap instance corresponding the packets destination. 
+/** Called by AddPacketToDetectors() for every packet to or from a blocklisted address. The address
+	is remembered so it can be named in the report (at most MAX_LISTED_BLOCKED distinct addresses).
 
-	@param p PacketInfo struct storing all relevent metadata from a packet
+	@param addr The blocklisted address (host byte order)
 	*/
-void TrafficAnalyzer::AddPacket(const PacketInfo& p)
+void TrafficAnalyzerBase::OnBlocked(uint32_t addr)
 {
-	flow_t flow = make_tuple(p.src_ip, p.dst_ip, p.src_port, p.dst_port, p.protocol);
+	m_blockedPackets++;
 
-	// Add packet info to traffic map using dst as key (keep track of traffic data per dst)
-	m_dstTrafficMap[p.dst_ip].AddPacketData(p.size, flow);
+	if (m_blockedAddrs.size() < MAX_LISTED_BLOCKED &&
+		find(m_blockedAddrs.begin(), m_blockedAddrs.end(), addr) == m_blockedAddrs.end())
+	{
+		m_blockedAddrs.push_back(addr);
+	}
+}
+
+
+/** @param[out] report Stream the list is appended to (e.g. "10.0.0.1,10.0.0.2")
+	@param sources The addresses to list
+	*/
+static void AppendSources(ostream& report, const vector<uint32_t>& sources)
+{
+	for (size_t i = 0; i < sources.size(); i++)
+	{
+		report << (i ? "," : "") << IpToString(sources[i]);
+	}
 }
 
 
-/** To be called at the end of each timeslice. Sums data from all packets added (via AddPacket() method)
-	since the last call to GenerateReport(). The total traffic data for this time slice is then
-	checked for alerts (via CheckAlert() method) and a report is generated and returned. 
+/** Called by GenerateReport() at the end of each timeslice. Appends the results of the detectors
+	that do not depend on the analyzer's metrics to the report as 'name=value' tokens, and checks them
+	for alerts. Like the metrics, a detector alerts when its value is more than m_alertFactor times
+	its value from the previous timeslice, but only once it also exceeds a minimum threshold:
+
+	- synflood: the number of half-open TCP connections (SYN without a completed handshake)
+	- newflows: the number of flows seen for the first time this slice
+
+	Both include the connection attempts (SYNs) the flow table had no room to track, so a flood that
+	fills the table keeps counting. When sampling, each flow counts for the sample rate it was added
+	at (see FlowTable), so a change of rate doesn't by itself move either count. The table's own state
+	follows, not scaled when sampling: flows tracked at the end of the slice, and flows expired and
+	packets of untracked new flows during it (e.g. " activeflows=5200 expiredflows=310 droppedflows=0").
+
+	Any source that crossed a scan threshold this slice (see OnScan()) raises a portscan/hostsweep alert,
+	and the sources are named in the report and logged with their estimated number of distinct ports or
+	hosts (e.g. "alert portscan 10.0.0.1 (~1180 ports)"). The number of sources the scan detector evicted
+	to make room for others is always reported (" scanevictions=0"): a scan distributed over more sources
+	than the detector tracks churns its table instead of crossing a threshold.
+
+	The entropy (bits) of the source address, destination address, source port and destination port
+	distributions is always reported (e.g. " entropy=9.12/3.40/10.05/2.21"). A distribution whose entropy
+	moved away from its baseline by much more than usual raises an entropy alert naming it, with '+' if
+	it spread out and '-' if it concentrated (e.g. " entropyalert=srcip+,dstip-" for a DDoS, see
+	EntropyEstimator).
 
-	Before returning, the m_dstTrafficMap member variable is cleared out and the traffic data totals
-	are saved into the m_prevData member variable.
+	When signatures are loaded, the number of payloads that matched any of them is reported, and any
+	match raises a signature alert naming the most matched rules with their counts. The TCP reassembler's
+	costs follow (not scaled when sampling, as they are this watchdog's own): streams tracked and bytes
+	buffered at the end of the slice, bytes copied into buffers, gaps skipped and segments or streams
+	that couldn't be reassembled during it, e.g.
+	" streams=120 streambuf=2920 streamcopied=8760 streamgaps=1 streamdrops=0".
 
-	@return The traffic report for all packets added since last call to GenerateReport()
+	When a blocklist is loaded, the number of packets to or from blocklisted addresses is reported, and
+	any such packet raises a blocklist alert naming the addresses.
+
+	@param[out] report Stream the detector results are appended to (e.g. " newflows=10 halfopen=2 portscans=1 portscan=10.0.0.1")
+	@param[out] alertLog Stream the names of any detectors that alerted are appended to (e.g. " synflood portscan")
+
+	@return TRUE if any detector alerted and FALSE otherwise
 	*/
-string TrafficAnalyzer::GenerateReport()
+bool TrafficAnalyzerBase::ReportDetectors(ostream& report, ostream& alertLog)
 {
-	int reportId = ++m_reportsGenerated;
+	bool alert = false;
 
-	// sum all of our traffic data and determine dst w/ most packets, bytes, flows.
-	TrafficData totalData;
-	string dstWithMostPackets, dstWithMostBytes, dstWithMostFlows;
-	int mostPackets=0, mostBytes=0, mostFlows=0;
+	// (already estimates of all traffic when sampling, each flow weighted by the sample rate it was added at)
+	unsigned long long halfOpen = m_flowTable.GetHalfOpen() + m_flowTable.GetDroppedSyns();
+	unsigned long long newFlows = m_flowTable.GetNewFlows() + m_flowTable.GetDroppedSyns();
 
-	for (auto it = m_dstTrafficMap.begin(); it != m_dstTrafficMap.end(); it++)
+	report << " newflows=" << newFlows << " halfopen=" << halfOpen;
+	report << " activeflows=" << m_flowTable.GetActiveFlows() << " expiredflows=" << m_flowTable.GetExpiredFlows();
+	report << " droppedflows=" << m_flowTable.GetDroppedFlows();
+
+	if (halfOpen >= SYN_FLOOD_THRESHOLD && halfOpen > m_prevHalfOpen * m_alertFactor)
 	{
-		TrafficData data = it->second;
+		alertLog << " synflood";
+		alert = true;
+	}
+
+	if (newFlows >= NEW_FLOW_THRESHOLD && newFlows > m_prevNewFlows * m_alertFactor)
+	{
+		alertLog << " newflows";
+		alert = true;
+	}
 
-		totalData += data;
+	report << " portscans=" << m_portScans << " hostsweeps=" << m_hostSweeps;
 
-		if (data.packets > mostPackets)
+	report << " scanevictions=" << m_scanDetector.GetEvictions();
+
+	if (m_portScans > 0)
+	{
+		report << " portscan=";
+		AppendSources(report, m_portScanners);
+		alertLog << " portscan";
+		alert = true;
+
+		for (size_t i = 0; i < m_portScanners.size(); i++)
 		{
-			dstWithMostPackets = it->first;
-			mostPackets = data.packets;
+			// (the estimate is 0 if the source was evicted since)
+			uint32_t estimate = m_scanDetector.EstimatePorts(m_portScanners[i]);
+			ostringstream oss;
+			oss << "alert portscan " << IpToString(m_portScanners[i]);
+			if (estimate > 0)
+			{
+				oss << " (~" << estimate << " ports)";
+			}
+			LogMessage(oss.str());
 		}
-		if (data.bytes > mostBytes)
+	}
+
+	if (m_hostSweeps > 0)
+	{
+		report << " hostsweep=";
+		AppendSources(report, m_hostSweepers);
+		alertLog << " hostsweep";
+		alert = true;
+
+		for (size_t i = 0; i < m_hostSweepers.size(); i++)
 		{
-			dstWithMostBytes = it->first;
-			mostBytes = data.bytes;
+			// (the estimate is 0 if the source was evicted since)
+			uint32_t estimate = m_scanDetector.EstimateHosts(m_hostSweepers[i]);
+			ostringstream oss;
+			oss << "alert hostsweep " << IpToString(m_hostSweepers[i]);
+			if (estimate > 0)
+			{
+				oss << " (~" << estimate << " hosts)";
+			}
+			LogMessage(oss.str());
 		}
-		if (data.flows.size() > (unsigned)mostFlows)
+	}
+
+	int shifts[NUM_ENTROPY_FEATURES];
+	bool entropyAlert = m_entropy.EndSlice(m_alertFactor, shifts);
+
+	ostringstream entropies;
+	entropies.setf(ios::fixed);
+	entropies.precision(2);
+	for (int f = 0; f < NUM_ENTROPY_FEATURES; f++)
+	{
+		entropies << (f ? "/" : "") << m_entropy.Entropy((EntropyFeature)f);
+	}
+	report << " entropy=" << entropies.str();
+
+	if (entropyAlert)
+	{
+		report << " entropyalert=";
+		bool first = true;
+		for (int f = 0; f < NUM_ENTROPY_FEATURES; f++)
 		{
-			dstWithMostFlows = it->first;
-			mostFlows = data.flows.size();
+			if (shifts[f] != 0)
+			{
+				report << (first ? "" : ",") << EntropyEstimator::FeatureName((EntropyFeature)f) << (shifts[f] > 0 ? "+" : "-");
+				first = false;
+			}
 		}
+		alertLog << " entropy";
+		alert = true;
 	}
 
-	// assemble report string and log 
-	ostringstream ossReport;
-	bool alertFlags[3] = {false};
-	
-	if (CheckAlert(totalData, alertFlags))	// checks if alert triggered of and what type(s)
+	if (m_signatures.NumRules() > 0)
 	{
-		ostringstream ossAlertLog; // (e.g. "alert packets flows")
-		ossAlertLog << "alert";
-		ossReport << "alert ";
-		if (alertFlags[PACKETS]) ossAlertLog << " packets";
-		if (alertFlags[BYTES]) ossAlertLog << " bytes";
-		if (alertFlags[FLOWS]) ossAlertLog << " flows";
-		LogMessage(ossAlertLog.str()); // log alert
+		report << " sigmatches=" << m_signatures.GetMatchedPayloads();
+
+		if (m_signatures.GetMatchedPayloads() > 0)
+		{
+			// name the most matched rules (e.g. " sig=passwd-read:3,nop-sled:1")
+			vector<pair<unsigned long long, size_t> > matched;
+			for (size_t r = 0; r < m_signatures.NumRules(); r++)
+			{
+				if (m_signatures.GetHits(r) > 0)
+				{
+					matched.push_back(make_pair(m_signatures.GetHits(r), r));
+				}
+			}
+			sort(matched.rbegin(), matched.rend());
+
+			report << " sig=";
+			for (size_t i = 0; i < matched.size() && i < MAX_LISTED_SIGNATURES; i++)
+			{
+				report << (i ? "," : "") << m_signatures.RuleName(matched[i].second) << ":" << matched[i].first;
+			}
+
+			alertLog << " signature";
+			alert = true;
+		}
+
+		m_signatures.ResetSliceCounters();
+
+		if (m_reassembler)
+		{
+			report << " streams=" << m_reassembler->GetActiveStreams() << " streambuf=" << m_reassembler->GetBufferedBytes();
+			report << " streamcopied=" << m_reassembler->GetCopiedBytes() << " streamgaps=" << m_reassembler->GetGaps();
+			report << " streamdrops=" << m_reassembler->GetDrops();
+			m_reassembler->ResetSliceCounters();
+		}
 	}
 
-	ossReport << "report " << reportId << " ";
-	ossReport << totalData.packets << " " << totalData.bytes << " " << totalData.flows.size();
+	if (m_blocklist)
+	{
+		report << " blocked=" << m_blockedPackets;
 
-	// append ip address of dst that triggered alert
-	if (alertFlags[PACKETS]) ossReport << " " << dstWithMostPackets;
-	else if (alertFlags[BYTES]) ossReport << " " << dstWithMostBytes;
-	else if (alertFlags[FLOWS]) ossReport << " " << dstWithMostFlows;
+		if (m_blockedPackets > 0)
+		{
+			report << " blockhit=";
+			AppendSources(report, m_blockedAddrs);
+			alertLog << " blocklist";
+			alert = true;
+		}
 
-	LogMessage(ossReport.str()); // log report
+		m_blockedAddrs.clear();
+		m_blockedPackets = 0;
+	}
+
+	m_prevHalfOpen = halfOpen;
+	m_prevNewFlows = newFlows;
+	m_flowTable.ResetSliceCounters();
+
+	m_scanDetector.NewSlice();
+	m_portScanners.clear();
+	m_hostSweepers.clear();
+	m_portScans = 0;
+	m_hostSweeps = 0;
 
-	// update previous traffic data for next time and clear out current data
-	m_prevData = totalData;
-	m_dstTrafficMap.clear();
-	
-	return ossReport.str();
+	return alert;
 }
 
+
+/** Called by SaveState(). Writes the previous half-open and new flow counts, the flow table, then the
+	entropy baselines.
+
+	@param[out] snapshot Snapshot the state is appended to
+	*/
+void TrafficAnalyzerBase::SaveDetectors(SnapshotWriter& snapshot) const
+{
+	snapshot.Put((uint64_t)m_prevHalfOpen);
+	snapshot.Put((uint64_t)m_prevNewFlows);
+	m_flowTable.Save(snapshot);
+	m_entropy.Save(snapshot);
+}
+
+
+/** Called by LoadState() before any packet is added, once the rest of the snapshot is known to be
+	valid. Nothing is restored unless the detectors' whole state could be read: the flows are only
+	added to the flow table once the entropy baselines (the last value saved) have been loaded.
+
+	@param snapshot Snapshot positioned at the detectors' state (see SaveDetectors())
+
+	@return TRUE if the state was restored and FALSE if the snapshot ended first
+	*/
+bool TrafficAnalyzerBase::LoadDetectors(SnapshotReader& snapshot)
+{
+	uint64_t prevHalfOpen, prevNewFlows;
+	FlowTable::SavedFlows flows;
+	if (!snapshot.Get(prevHalfOpen) || !snapshot.Get(prevNewFlows) || !FlowTable::Read(snapshot, flows) ||
+		!m_entropy.Load(snapshot))
+	{
+		return false;
+	}
+
+	m_flowTable.Load(flows);
+	m_prevHalfOpen = prevHalfOpen;
+	m_prevNewFlows = prevNewFlows;
+	return true;
+}
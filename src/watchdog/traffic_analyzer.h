@@ -1,155 +1,361 @@
 #ifndef TRAFFIC_ANALYZER_H
 #define TRAFFIC_ANALYZER_H
 
+#include "arena.h"
+#include "packet_info.h"
+#include "metrics.h"
+#include "flow_table.h"
+#include "scan_detector.h"
+#include "entropy_estimator.h"
+#include "signature_engine.h"
+#include "tcp_reassembler.h"
+#include "blocklist.h"
+#include "prefix_table.h"
+#include "snapshot.h"
+
 #include <string>
 #include <map>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
 #include <vector>
-#include <tuple>
+#include <memory>
+#include <functional>
+#include <typeinfo>
+#include <netinet/in.h>
 
 using namespace std;
 
 
-/** @brief 5-tuple of src_ip, dst_ip, src_port, dst_port, and protocol */
-typedef tuple<string, string, int, int, string> flow_t;
+/** @brief Configuration independent part of TrafficAnalyzer (logging, report count, arena and detectors)
 
-/** @brief Category of alerts */
-enum AlertType { PACKETS, BYTES, FLOWS };
+	Holds the detectors that do not depend on the aggregation key or metrics, such as the persistent
+	FlowTable, the ScanDetector, the EntropyEstimator, the SignatureEngine and the Blocklist. Their
+	per-slice results are appended to each report by ReportDetectors().
+	*/
+class TrafficAnalyzerBase
+{
 
+protected:
 
-/** @brief Stores all relevant metadata for a single packet */
-struct PacketInfo
-{
-	/** Size of packet in bytes */
-	int size; 		
+	/** The name of the file to log to */
+	string m_logfile;
 
-	/** Source IP address in dot-quad notation */
-	string src_ip; 
+	/** Number of reports that have been generated */
+	int m_reportsGenerated;
 
-	/** Destination IP address in dot-quad notation */	
-	string dst_ip; 	
+	/** TRUE if the last report generated was an alert */
+	bool m_lastReportAlerted;
 
-	/** Source port number (0 if packet protocol is not TCP/UDP) */
-	int src_port; 
+	/** Key named by the last report as having triggered its alert ("" if none) */
+	string m_lastAlertKey;
 
-	/** Destination port number (0 if packet protocol is not TCP/UDP) */
-	int dst_port; 
+	/** What raised the last report's alert, as logged (e.g. " packets synflood", "" if it wasn't an alert) */
+	string m_lastAlertCauses;
 
-	/** Protocol ('TCP', 'UDP', 'ICMP', 'IP') */
-	string protocol; 
-};
+	/** Tokens of the last report following its totals and key (e.g. " newflows=10 halfopen=0") */
+	string m_lastReportDetails;
 
+	/** Backing memory for all per-timeslice state, released at the end of each GenerateReport() */
+	Arena m_arena;
 
-/** @brief Used by the watchdogs to handle all processing of packet data
+	/** Flows tracked across timeslices (with TCP state) */
+	FlowTable m_flowTable;
 
-	Takes packets as input via AddPacket() method, then generates a report via the GenerateReport() 
-	method. Packet data is stored within a TrafficData struct (declared as a private member
-	within TrafficAnalyzer). Packet data is accumulated per destination and stored within the m_dstTrafficMap 
-	(that is, there is one TrafficData instance per destination IP Address containing the total sum of 
-	bytes/packets/flows for all packets added with that destination IP). This allows TrafficAnalyzer to easily 
-	determine the offending destination IP in the event that an alert is detected. 
+	/** Number of half-open TCP connections at the end of the previous timeslice */
+	unsigned long long m_prevHalfOpen;
 
-	Once the GenerateReport() method is called (at the end of each timeslice), a report is generated with all 
-	data within the m_dstTrafficMap and saved to the m_prevData member variable. The m_dstTrafficMap is then cleared.
-	*/
-class TrafficAnalyzer
-{
+	/** Number of new flows in the previous timeslice */
+	unsigned long long m_prevNewFlows;
 
-private:
+	/** Per source distinct port/host sketches */
+	ScanDetector m_scanDetector;
+
+	/** Sources that crossed the port scan threshold this timeslice (the first few only) */
+	vector<uint32_t> m_portScanners;
+
+	/** Sources that crossed the host sweep threshold this timeslice (the first few only) */
+	vector<uint32_t> m_hostSweepers;
+
+	/** Number of port scans/host sweeps detected this timeslice (including those not listed above) */
+	unsigned long long m_portScans, m_hostSweeps;
+
+	/** Entropy of the src/dst address and port distributions, with their baselines */
+	EntropyEstimator m_entropy;
+
+	/** Payload signatures (no rules unless LoadSignatures() is called) */
+	SignatureEngine m_signatures;
+
+	/** Reassembles TCP payloads for m_signatures (NULL unless LoadSignatures() is called) */
+	unique_ptr<TcpReassembler> m_reassembler;
+
+	/** Known-bad addresses (NULL unless SwapBlocklist() is called) */
+	shared_ptr<const Blocklist> m_blocklist;
 
-	/** @brief Internal struct within TrafficAnaluyzer containing a number of packets/bytes and list of flows */
-	struct TrafficData
+	/** Blocklisted addresses seen this timeslice (the first few only) */
+	vector<uint32_t> m_blockedAddrs;
+
+	/** Number of packets to or from a blocklisted address this timeslice */
+	unsigned long long m_blockedPackets;
+
+	/** Only 1 in m_sampleRate flows (a power of two) are analyzed this timeslice */
+	uint32_t m_sampleRate;
+
+	/** Sample rate to switch to at the start of the next timeslice */
+	uint32_t m_nextSampleRate;
+
+	/** A metric, group or detector alerts when its value is more than this many times its previous value */
+	double m_alertFactor;
+
+	/** A prefix group only alerts when it received at least this many packets this timeslice */
+	unsigned long long m_groupMinPackets;
+
+
+	/** @brief Constructor (an empty logfile name makes the analyzer silent) **/
+	TrafficAnalyzerBase(const string& logfile);
+
+	/** @brief Appends a message to m_logfile and console (unless silent) */
+	void LogMessage(const string& msg) const;
+
+	/** @brief Returns TRUE if the packet's flow is in the sample (always TRUE when not sampling) */
+	bool IsSampled(const PacketInfo& p) const
 	{
-		/** Number of packets added */
-		int packets;
+		if (m_sampleRate == 1)
+		{
+			return true;
+		}
+
+		// order the endpoints so both directions of a flow are sampled together
+		flow_t flow = (p.src_ip < p.dst_ip || (p.src_ip == p.dst_ip && p.src_port <= p.dst_port)) ?
+			make_tuple(p.src_ip, p.dst_ip, (u_short)p.src_port, (u_short)p.dst_port, p.protocol) :
+			make_tuple(p.dst_ip, p.src_ip, (u_short)p.dst_port, (u_short)p.src_port, p.protocol);
 
-		/** Sum of the size of all packets added (in bytes) */	
-		int bytes;
+		return (FlowHash(flow) & (m_sampleRate - 1)) == 0;
+	}
 
-		/** List of unique flows added */
-		vector<flow_t> flows; 
+	/** @brief Logs and records a scan the moment the ScanDetector detects it */
+	void OnScan(uint32_t src_ip, ScanAlert scan);
 
-		/** @brief Constructor
-			Initializes packets and bytes to 0.
-			*/
-		TrafficData()
+	/** @brief Records a packet to or from a blocklisted address */
+	void OnBlocked(uint32_t addr);
+
+	/** @brief Adds a packet to all detectors **/
+	void AddPacketToDetectors(const PacketInfo& p)
+	{
+		m_flowTable.AddPacket(p, m_sampleRate);
+
+		ScanAlert scan = m_scanDetector.AddPacket(p);
+		if (scan != SCAN_NONE)
 		{
-			packets = 0;
-			bytes = 0;
+			OnScan(p.src_ip, scan);
 		}
 
-		/** @brief Adds packet data to the existing counts 
-			
-			Increments packet count and adds packet size to the bytes count, then adds
-			the packet's flow to the list of flows if it does not already exist within the flows list.
+		m_entropy.AddPacket(p);
 
-			@param size size of the packet in bytes.
-			@param flow the packet's flow.
-			*/
-		void AddPacketData(int size, flow_t flow)
+		// TCP payloads are scanned as streams, so signatures split across segments match
+		if (m_reassembler && p.protocol == IPPROTO_TCP && m_reassembler->AddPacket(p))
 		{
-			packets++;
-			bytes += size;
+			const u_char* data;
+			size_t len;
+			while (m_reassembler->NextChunk(data, len))
+			{
+				m_signatures.Scan(m_reassembler->InspectorState(), data, len);
+			}
+		}
+		else if (p.payload_len > 0)
+		{
+			m_signatures.Scan(p.payload, p.payload_len);
+		}
 
-			// add flow to flows list if an entry doesnt already exist
-			for (unsigned int i = 0; i < flows.size(); i++)	
+		if (m_blocklist && !p.ipv6)
+		{
+			if (m_blocklist->Contains(p.src_ip))
 			{
-				if (flows[i] == flow)
-				{
-					return;
-				}	
+				OnBlocked(p.src_ip);
+			}
+			else if (m_blocklist->Contains(p.dst_ip))
+			{
+				OnBlocked(p.dst_ip);
 			}
-			flows.push_back(flow);
 		}
+	}
 
-		/** Overload of the addition assignment operator, adds packet and byte counts of rhs to this, and
-			concatenates rhs's flows list to this flows list.
+	/** @brief Appends detector results to a report and checks them for alerts **/
+	bool ReportDetectors(ostream& report, ostream& alertLog);
 
-			@param rhs the right hand side TrafficData instance to add to this
+	/** @brief Appends the detectors' baselines and tracked flows to a snapshot **/
+	void SaveDetectors(SnapshotWriter& snapshot) const;
 
-			@return reference to the sum of this += rhs 
-			*/
-		TrafficData& operator+=(const TrafficData& rhs)
-		{
-			this->packets += rhs.packets;
-			this->bytes += rhs.bytes;
+	/** @brief Restores the detectors' baselines and tracked flows from a snapshot, returning FALSE if it is invalid **/
+	bool LoadDetectors(SnapshotReader& snapshot);
 
-			this->flows.insert(this->flows.end(), rhs.flows.begin(), rhs.flows.end());
 
-			return *this;
-		}
+public:
 
-		/**	Overload of the addition operator (see operator+= overload for explanation)
+	/** @brief Loads the payload signatures in a rule file (see SignatureEngine::LoadRules()) and starts reassembling TCP streams **/
+	bool LoadSignatures(const string& filename);
 
-			@param rhs the right hand side addend to be summed with this
+	/** @brief Replaces the blocklist, handing back the previous one (so it can be released outside any lock) **/
+	void SwapBlocklist(shared_ptr<const Blocklist>& blocklist) { m_blocklist.swap(blocklist); }
 
-			@return the sum of this + rhs
-			*/
-		const TrafficData operator+(const TrafficData& rhs) const
-		{
-			return TrafficData(*this) += rhs;
-		}
-	};
+	/** @brief Returns the number of chunks the per-timeslice arena has requested from malloc **/
+	unsigned long long GetArenaMallocCalls() const { return m_arena.MallocCalls(); }
 
-	/** The name of the file to log to */
-	string m_logfile;	
-
-	/** Total traffic data for this timeslice (seperated and mapped by dst) */
-	map<string, TrafficData> m_dstTrafficMap;	
-	
-	/** Total accumulated traffic data from the previous timeslice */
-	TrafficData m_prevData;	
-	
-	/** Number of reports that have been generated */
-	int m_reportsGenerated;						
+	/** @brief Returns the size in bytes of the per-timeslice arena **/
+	size_t GetArenaCapacity() const { return m_arena.Capacity(); }
 
+	/** @brief Caps the memory used by per-timeslice state (0 = unlimited), see TrafficAnalyzer **/
+	void SetMemoryBudget(size_t bytes) { m_arena.SetBudget(bytes); }
+
+	/** @brief Analyzes only 1 in rate flows (a power of two) from the next timeslice on, see TrafficAnalyzer **/
+	void SetSampleRate(uint32_t rate) { m_nextSampleRate = rate; }
+
+	/** @brief Sets how many times its previous value a metric, group or detector must exceed to alert (3 by default) **/
+	void SetAlertFactor(double factor) { m_alertFactor = factor; }
+
+	/** @brief Returns TRUE if the last report generated was an alert **/
+	bool LastReportAlerted() const { return m_lastReportAlerted; }
+
+	/** @brief Returns the key that triggered the last report's alert, as formatted in the report ("" if none) **/
+	const string& LastAlertKey() const { return m_lastAlertKey; }
+
+	/** @brief Returns the names of what raised the last report's alert (e.g. " packets synflood", "" if none) **/
+	const string& LastAlertCauses() const { return m_lastAlertCauses; }
+
+	/** @brief Returns the tokens of the last report that follow its totals and key **/
+	const string& LastReportDetails() const { return m_lastReportDetails; }
+
+};
+
+
+/** @brief Used by the watchdogs to handle all processing of packet data
+
+	Takes packets as input via AddPacket() method, then generates a report via the GenerateReport()
+	method. Packet data is accumulated per aggregation key and stored within the m_trafficMap (that is,
+	there is one TrafficData instance per key containing the State of every metric for all packets
+	added with that key). This allows TrafficAnalyzer to easily determine the offending key (e.g.
+	destination IP Address) in the event that an alert is detected.
+
+	The aggregation key and the set of metrics are template parameters: KeyPolicy is one of the key
+	extractors in metrics.h (DstKey, SrcKey, DstPortKey, ProtocolKey) and Metrics is a list of metric
+	policies (e.g. PacketCount, ByteCount, FlowCount). Each deployment's configuration is therefore
+	specialized and inlined at compile time with no virtual dispatch on the packet path.
+
+	Once the GenerateReport() method is called (at the end of each timeslice), a report is generated with all
+	data within the m_trafficMap and the metric totals are saved to the m_prevData member variable. The
+	m_trafficMap is then cleared.
+
+	If prefix groups are loaded (LoadPrefixes()), each packet is also added to the TrafficData of the group
+	with the longest prefix containing its destination, so that traffic spread over many hosts of a subnet
+	is totalled and checked for alerts as a whole. Group totals are appended to the report.
+
+	All per-timeslice state (map nodes and metric States) is allocated from m_arena, which is released in a
+	single Reset() at the end of GenerateReport(). Once the arena has grown to fit the busiest timeslice,
+	AddPacket() makes no calls to malloc.
+
+	The arena may be given a memory budget (SetMemoryBudget()) so that a flood of packets to random keys
+	can't exhaust memory. Once the budget is reached the analyzer is degraded for the rest of the slice:
+	keys that already have an entry keep exact counts, while packets of new keys are added to one of
+	TAIL_BUCKETS buckets (by hash of the key), so the totals still include all traffic. Unique flow
+	counts that outgrow their table turn into sketches (see FlowSet). The heaviest keys of each slice
+	are given entries at the start of the next, so heavy keys stay exact even if the budget is reached
+	early in the slice. Degraded reports carry " degraded=1" and the totals of the tail buckets.
+
+	Each report lists the TOP_KEYS heaviest keys of the slice by the first metric, then a bound on the
+	first metric of any key not listed (the heaviest key left out, or the heaviest tail bucket when
+	degraded), e.g. " top=10.0.0.5:1200,10.0.0.7:800 topfloor=35". The desman merges these lists into a global view of the
+	heaviest keys across all watchdogs (see TopKSummary).
+
+	To shed load, the analyzer can be told to analyze only 1 in N flows (SetSampleRate()). Sampling is by
+	a hash of the flow's 5-tuple, so a sampled flow is seen in full (both directions) and per-flow state
+	stays consistent. Metric totals and flow based detector counts are then scaled up by N (so they
+	remain estimates of the whole traffic) and the report carries " sample=N". The rate only changes at
+	slice boundaries, so every report is scaled by the rate its packets were sampled at.
+
+	The state carried from one slice to the next (the previous totals of the metrics, prefix groups and
+	detectors, the heaviest keys and the tracked flows) can be saved to a snapshot (SaveState()) and
+	restored into a new analyzer (LoadState()). A restarted watchdog then compares its first slice
+	against the last slices before the restart rather than against zero.
+	*/
+template <class KeyPolicy, class... Metrics>
+class TrafficAnalyzer : public TrafficAnalyzerBase
+{
+
+private:
+
+	/** Number of metrics tracked */
+	static const int NUM_METRICS = sizeof...(Metrics);
+
+	/** Number of sketch buckets new keys are counted in once the memory budget is reached */
+	static const int TAIL_BUCKETS = 64;
+
+	/** Number of heaviest keys of each slice that are kept exact in the next slice */
+	static const size_t HEAVY_KEYS = 32;
+
+	/** Number of heaviest keys of each slice listed in the report (less than HEAVY_KEYS) */
+	static const size_t TOP_KEYS = 16;
+
+	/** @brief Internal type containing the State of every metric for a single key */
+	typedef MetricSet<Metrics...> TrafficData;
+
+	/** @brief Aggregation key type */
+	typedef typename KeyPolicy::key_type Key;
+
+	/** @brief Key to traffic data map, allocated from the per-timeslice arena */
+	typedef map<Key, TrafficData, less<Key>, ArenaAllocator<pair<const Key, TrafficData> > > TrafficMap;
+
+	/** Total traffic data for this timeslice (seperated and mapped by key) */
+	TrafficMap m_trafficMap;
+
+	/** Metric totals from the previous timeslice */
+	unsigned long long m_prevData[NUM_METRICS];
+
+	/** CIDR groups that destinations are also aggregated by (none unless LoadPrefixes() is called) */
+	PrefixTable m_prefixes;
+
+	/** Traffic data per prefix group for this timeslice (NULL until the group's first packet, allocated from m_arena) */
+	vector<TrafficData*> m_groupData;
+
+	/** Metric totals per prefix group from the previous timeslice (NUM_METRICS per group) */
+	vector<unsigned long long> m_prevGroupData;
+
+	/** Packets per prefix group this timeslice (sampled, checked against m_groupMinPackets) */
+	vector<unsigned long long> m_groupPackets;
+
+	/** TAIL_BUCKETS traffic data buckets for keys first seen after the memory budget was reached
+		(NULL while not degraded, allocated from m_arena) */
+	TrafficData* m_tail;
+
+	/** Keys with the most traffic in the previous timeslice (given exact entries at the start of each slice) */
+	vector<Key> m_heavyKeys;
+
+	/** Key named by the last report as having triggered its alert (valid if m_hasAlertKey) */
+	Key m_alertKey;
+	bool m_hasAlertKey;
 
-	/** @brief Appends a message to m_logfile and console */
-	void LogMessage(const string& msg) const;
 
 	/** @brief Checks traffic data to see if an alert has been generated */
-	bool CheckAlert(const TrafficData& trafficData, bool alertFlags[3]) const;
+	bool CheckAlert(const unsigned long long totalData[], bool alertFlags[]) const;
+
+	/** @brief Appends per prefix group totals to a report and checks them for alerts */
+	bool ReportGroups(ostream& report, ostream& alertLog);
 
-	
+	/** @brief Adds a packet whose key has no entry to its tail bucket (used once over the memory budget) */
+	void AddPacketToTail(const Key& key, const PacketInfo& p);
+
+	/** @brief Returns a hash of the key and metrics, identifying the configuration a snapshot belongs to */
+	static uint64_t ConfigHash()
+	{
+		const char* names[NUM_METRICS];
+		TrafficData::Names(names);
+
+		string config = typeid(KeyPolicy).name();
+		for (int i = 0; i < NUM_METRICS; i++)
+		{
+			config += string(" ") + names[i];
+		}
+		return SnapshotHash(config);
+	}
 
 
 public:
@@ -157,13 +363,550 @@ public:
 	/** @brief Constructor **/
 	TrafficAnalyzer(const string& logfile);
 
+	/** @brief Loads CIDR groups to aggregate destinations by (see PrefixTable::Load()) **/
+	bool LoadPrefixes(const string& filename);
+
 	/** @brief Adds packet to be processed **/
 	void AddPacket(const PacketInfo& p);
 
 	/** @brief Generates and returns a report about all traffic data since last call to GenerateReport() **/
 	string GenerateReport();
 
+	/** @brief Appends the state carried between slices to a snapshot **/
+	void SaveState(SnapshotWriter& snapshot) const;
+
+	/** @brief Restores the state carried between slices from a snapshot (before any packet is added) **/
+	bool LoadState(SnapshotReader& snapshot);
+
+	/** @brief Returns the metric totals of the last report **/
+	void GetLastTotals(vector<unsigned long long>& totals) const { totals.assign(m_prevData, m_prevData + NUM_METRICS); }
+
+	/** @brief Returns a filter matching the packets of the key that triggered the last report's alert
+		(empty if that report named no key) **/
+	function<bool(const PacketInfo&)> AlertKeyFilter() const
+	{
+		if (!m_hasAlertKey)
+		{
+			return nullptr;
+		}
+
+		Key key = m_alertKey;
+		return [key](const PacketInfo& p) { return KeyPolicy::Extract(p) == key; };
+	}
 
 };
 
-#endif
\ No newline at end of file
+
+
+/** Called internally by GenerateReport() method. Checks totalData against data from the
+	previous report (stored in member variable m_prevData) to see if traffic is anomolous.
+	If any metric in totalData is more than m_alertFactor (3 by default) times its value in m_prevData, an alert is detected
+	and alertFlags are set accordingly (indicating which metrics caused the alert).
+
+	@param[in] totalData The metric totals to scan for anomolous data (one per metric, in metric order)
+	@param[out] alertFlags An array of bools (whose indices correspond to the Metrics list)
+				that are set to TRUE if an alert was detected for that metric (e.g. packets/bytes/flows)
+
+	@return TRUE if an alert was detected and FALSE otherwise
+	*/
+template <class KeyPolicy, class... Metrics>
+bool TrafficAnalyzer<KeyPolicy, Metrics...>::CheckAlert(const unsigned long long totalData[], bool alertFlags[]) const
+{
+	bool alert = false;
+
+	for (int i = 0; i < NUM_METRICS; i++)
+	{
+		alertFlags[i] = totalData[i] > (m_prevData[i] * m_alertFactor);
+		alert = alert || alertFlags[i];
+	}
+
+	return alert;
+}
+
+
+/** Called internally by GenerateReport() method. Appends the metric totals of every prefix group that
+	saw traffic this timeslice to the report (e.g. " prefix:customers=120/9800/14"), checking each group
+	for alerts the same way as the overall totals (any metric more than m_alertFactor times its value in the previous
+	timeslice). Alerted groups are named in the report (e.g. " prefixalert=customers"). A group is only checked
+	once it received at least m_groupMinPackets packets in the timeslice, so a group that was idle doesn't
+	alert on its first few packets; its totals still become the baseline for the next timeslice.
+
+	@param[out] report Stream the group totals are appended to
+	@param[out] alertLog Stream " prefix" is appended to if any group alerted
+
+	@return TRUE if any group alerted and FALSE otherwise
+	*/
+template <class KeyPolicy, class... Metrics>
+bool TrafficAnalyzer<KeyPolicy, Metrics...>::ReportGroups(ostream& report, ostream& alertLog)
+{
+	ostringstream ossAlerted;
+
+	for (size_t g = 0; g < m_groupData.size(); g++)
+	{
+		unsigned long long data[NUM_METRICS] = {0};
+		bool alert = false;
+
+		if (m_groupData[g] != NULL)
+		{
+			m_groupData[g]->Values(data);
+			for (int i = 0; i < NUM_METRICS; i++)
+			{
+				data[i] *= m_sampleRate;
+			}
+
+			report << " prefix:" << m_prefixes.GroupName(g) << "=";
+			for (int i = 0; i < NUM_METRICS; i++)
+			{
+				report << (i ? "/" : "") << data[i];
+			}
+		}
+
+		bool checked = m_groupPackets[g] * m_sampleRate >= m_groupMinPackets;
+		for (int i = 0; i < NUM_METRICS; i++)
+		{
+			alert = alert || (checked && data[i] > m_prevGroupData[g * NUM_METRICS + i] * m_alertFactor);
+			m_prevGroupData[g * NUM_METRICS + i] = data[i];
+		}
+
+		if (alert)
+		{
+			ossAlerted << (ossAlerted.tellp() > 0 ? "," : "") << m_prefixes.GroupName(g);
+		}
+
+		m_groupData[g] = NULL; // (its memory is released with the rest of m_arena)
+		m_groupPackets[g] = 0;
+	}
+
+	if (ossAlerted.tellp() > 0)
+	{
+		report << " prefixalert=" << ossAlerted.str();
+		alertLog << " prefix";
+		return true;
+	}
+
+	return false;
+}
+
+
+/** Called internally by AddPacket() method once the memory budget is reached. The first call in a
+	timeslice allocates the tail buckets, which is the only allocation made while degraded (besides
+	the minimum table of a FlowSet).
+
+	@param key The packet's aggregation key (which has no entry in m_trafficMap)
+	@param p PacketInfo struct storing all relevent metadata from a packet
+	*/
+template <class KeyPolicy, class... Metrics>
+void TrafficAnalyzer<KeyPolicy, Metrics...>::AddPacketToTail(const Key& key, const PacketInfo& p)
+{
+	if (m_tail == NULL)
+	{
+		m_tail = (TrafficData*)m_arena.Allocate(TAIL_BUCKETS * sizeof(TrafficData), alignof(TrafficData));
+		for (int i = 0; i < TAIL_BUCKETS; i++)
+		{
+			new (&m_tail[i]) TrafficData(m_arena);
+		}
+	}
+
+	// fibonacci hashing: the top bits of key * 2^64/phi select the bucket
+	uint64_t hash = (uint64_t)key * 0x9e3779b97f4a7c15ULL;
+	m_tail[hash >> 58].Add(p); // (TAIL_BUCKETS = 2^6)
+}
+
+
+/** Initializes TrafficAnalyzer instance with the name of file to log to.
+
+	@param logfile Name of the logfile that relevent info will be logged to
+	*/
+template <class KeyPolicy, class... Metrics>
+TrafficAnalyzer<KeyPolicy, Metrics...>::TrafficAnalyzer(const string& logfile)
+	: TrafficAnalyzerBase(logfile),
+	  m_trafficMap(less<Key>(), ArenaAllocator<pair<const Key, TrafficData> >(m_arena)),
+	  m_tail(NULL),
+	  m_alertKey(),
+	  m_hasAlertKey(false)
+{
+	for (int i = 0; i < NUM_METRICS; i++)
+	{
+		m_prevData[i] = 0;
+	}
+}
+
+
+/** @param filename Name of the prefix group file
+
+	@return TRUE if the groups were loaded and FALSE otherwise (error printed to console)
+	*/
+template <class KeyPolicy, class... Metrics>
+bool TrafficAnalyzer<KeyPolicy, Metrics...>::LoadPrefixes(const string& filename)
+{
+	if (!m_prefixes.Load(filename))
+	{
+		return false;
+	}
+
+	m_groupData.assign(m_prefixes.NumGroups(), NULL);
+	m_prevGroupData.assign(m_prefixes.NumGroups() * NUM_METRICS, 0);
+	m_groupPackets.assign(m_prefixes.NumGroups(), 0);
+	return true;
+}
+
+
+/** Adds a packet to be processed. Extracts the packet's aggregation key, then adds the
+	packet to the State of every metric in the TrafficData instance corresponding to that key.
+	New map entries and metric States are allocated from m_arena.
+
+	@param p PacketInfo struct storing all relevent metadata from a packet
+	*/
+template <class KeyPolicy, class... Metrics>
+void TrafficAnalyzer<KeyPolicy, Metrics...>::AddPacket(const PacketInfo& p)
+{
+	if (!IsSampled(p))
+	{
+		return;
+	}
+
+	Key key = KeyPolicy::Extract(p);
+
+	// Add packet info to traffic map (keep track of traffic data per key)
+	auto it = m_trafficMap.lower_bound(key);
+	if (it == m_trafficMap.end() || it->first != key)
+	{
+		if (m_arena.OverBudget())
+		{
+			AddPacketToTail(key, p);
+		}
+		else
+		{
+			it = m_trafficMap.emplace_hint(it, piecewise_construct,
+									forward_as_tuple(key), forward_as_tuple(m_arena));
+			it->second.Add(p);
+		}
+	}
+	else
+	{
+		it->second.Add(p);
+	}
+
+	// Add packet info to its destination's prefix group (if any)
+	if (!m_groupData.empty() && !p.ipv6)
+	{
+		int group = m_prefixes.Lookup(p.dst_ip);
+		if (group >= 0)
+		{
+			TrafficData*& pData = m_groupData[group];
+			if (pData == NULL)
+			{
+				pData = new (m_arena.Allocate(sizeof(TrafficData), alignof(TrafficData))) TrafficData(m_arena);
+			}
+			pData->Add(p);
+			m_groupPackets[group]++;
+		}
+	}
+
+	AddPacketToDetectors(p);
+}
+
+
+/** To be called at the end of each timeslice. Sums every metric over all packets added (via AddPacket()
+	method) since the last call to GenerateReport(). The metric totals for this time slice are then
+	checked for alerts (via CheckAlert() method) and a report is generated and returned.
+
+	Before returning, the m_trafficMap member variable is cleared out, the metric totals
+	are saved into the m_prevData member variable and m_arena is released. The heaviest keys are then
+	given (empty) entries again, so they are counted exactly next slice even if it is degraded.
+
+	@return The traffic report for all packets added since last call to GenerateReport()
+	*/
+template <class KeyPolicy, class... Metrics>
+string TrafficAnalyzer<KeyPolicy, Metrics...>::GenerateReport()
+{
+	int reportId = ++m_reportsGenerated;
+
+	// sum all of our traffic data and determine the key with the highest value of each metric.
+	unsigned long long totalData[NUM_METRICS] = {0};
+	unsigned long long mostData[NUM_METRICS] = {0};
+	Key keyWithMost[NUM_METRICS] = {};
+	vector<pair<unsigned long long, Key> > heaviest; // (first metric, key) of every key with traffic
+	heaviest.reserve(m_trafficMap.size());
+
+	for (auto it = m_trafficMap.begin(); it != m_trafficMap.end(); it++)
+	{
+		unsigned long long data[NUM_METRICS];
+		it->second.Values(data);
+
+		if (data[0] > 0)
+		{
+			heaviest.push_back(make_pair(data[0], it->first));
+		}
+
+		for (int i = 0; i < NUM_METRICS; i++)
+		{
+			totalData[i] += data[i];
+
+			if (data[i] > mostData[i])
+			{
+				keyWithMost[i] = it->first;
+				mostData[i] = data[i];
+			}
+		}
+	}
+
+	// scale the totals up to estimates of all traffic when only 1 in m_sampleRate flows were analyzed
+	for (int i = 0; i < NUM_METRICS; i++)
+	{
+		totalData[i] *= m_sampleRate;
+	}
+
+	// keys beyond the memory budget only count towards the totals
+	unsigned long long tailData[NUM_METRICS] = {0};
+	unsigned long long tailMost = 0; // (the first metric of the heaviest tail bucket)
+	if (m_tail != NULL)
+	{
+		for (int b = 0; b < TAIL_BUCKETS; b++)
+		{
+			unsigned long long data[NUM_METRICS];
+			m_tail[b].Values(data);
+
+			for (int i = 0; i < NUM_METRICS; i++)
+			{
+				tailData[i] += data[i] * m_sampleRate;
+				totalData[i] += data[i] * m_sampleRate;
+			}
+			tailMost = max(tailMost, data[0] * m_sampleRate);
+		}
+	}
+
+	// the heaviest keys (by the first metric), listed in the report and kept exact next slice
+	size_t numHeavy = min(heaviest.size(), (size_t)HEAVY_KEYS);
+	partial_sort(heaviest.begin(), heaviest.begin() + numHeavy, heaviest.end(),
+				greater<pair<unsigned long long, Key> >());
+
+	// assemble report string and log
+	ostringstream ossReport;
+	ostringstream ossAlertLog; // (e.g. "alert packets flows")
+	ostringstream ossGroups; // prefix group totals (e.g. " prefix:customers=120/9800/14")
+	ostringstream ossDetectors; // detector results (e.g. " newflows=10 halfopen=2")
+	bool alertFlags[NUM_METRICS] = {false};
+
+	bool alert = CheckAlert(totalData, alertFlags);	// checks if alert triggered of and what type(s)
+	if (alert)
+	{
+		const char* names[NUM_METRICS];
+		TrafficData::Names(names);
+
+		for (int i = 0; i < NUM_METRICS; i++)
+		{
+			if (alertFlags[i]) ossAlertLog << " " << names[i];
+		}
+	}
+
+	if (ReportGroups(ossGroups, ossAlertLog))
+	{
+		alert = true;
+	}
+
+	if (ReportDetectors(ossDetectors, ossAlertLog))
+	{
+		alert = true;
+	}
+
+	if (alert)
+	{
+		ossReport << "alert ";
+		LogMessage("alert" + ossAlertLog.str()); // log alert
+	}
+
+	ossReport << "report " << reportId;
+	for (int i = 0; i < NUM_METRICS; i++)
+	{
+		ossReport << " " << totalData[i];
+	}
+
+	// append key (e.g. ip address of dst) that triggered alert, in metric order of precedence
+	m_lastReportAlerted = alert;
+	m_lastAlertCauses = ossAlertLog.str();
+	m_lastAlertKey = "";
+	m_hasAlertKey = false;
+	for (int i = 0; i < NUM_METRICS; i++)
+	{
+		if (alertFlags[i])
+		{
+			m_lastAlertKey = KeyPolicy::Format(keyWithMost[i]);
+			ossReport << " " << m_lastAlertKey;
+			m_alertKey = keyWithMost[i];
+			m_hasAlertKey = true;
+			break;
+		}
+	}
+
+	ostringstream ossDetails; // everything after the totals and key
+	if (m_sampleRate > 1)
+	{
+		ossDetails << " sample=" << m_sampleRate;
+	}
+
+	if (m_tail != NULL)
+	{
+		ossDetails << " degraded=1 tail=";
+		for (int i = 0; i < NUM_METRICS; i++)
+		{
+			ossDetails << (i ? "/" : "") << tailData[i];
+		}
+	}
+
+	// the top keys, and a bound on the first metric of any key not listed (see TopKSummary in the desman)
+	size_t numTop = min(numHeavy, (size_t)TOP_KEYS);
+	if (numTop > 0)
+	{
+		ossDetails << " top=";
+		for (size_t i = 0; i < numTop; i++)
+		{
+			ossDetails << (i ? "," : "") << KeyPolicy::Format(heaviest[i].second) << ":" << heaviest[i].first * m_sampleRate;
+		}
+
+		unsigned long long unlisted = (heaviest.size() > numTop) ? heaviest[numTop].first * m_sampleRate : 0;
+		ossDetails << " topfloor=" << max(unlisted, tailMost);
+	}
+
+	ossDetails << ossGroups.str();
+	ossDetails << ossDetectors.str();
+
+	m_lastReportDetails = ossDetails.str();
+	ossReport << m_lastReportDetails;
+
+	LogMessage(ossReport.str()); // log report
+
+	// update previous traffic data for next time and clear out current data
+	for (int i = 0; i < NUM_METRICS; i++)
+	{
+		m_prevData[i] = totalData[i];
+	}
+
+	// remember the heaviest keys so they stay exact next slice
+	m_heavyKeys.clear();
+	for (size_t i = 0; i < numHeavy; i++)
+	{
+		m_heavyKeys.push_back(heaviest[i].second);
+	}
+
+	m_trafficMap.clear();
+	m_tail = NULL;
+	m_arena.Reset();
+	m_sampleRate = m_nextSampleRate;
+
+	for (size_t i = 0; i < m_heavyKeys.size(); i++)
+	{
+		m_trafficMap.emplace(piecewise_construct, forward_as_tuple(m_heavyKeys[i]), forward_as_tuple(m_arena));
+	}
+
+	return ossReport.str();
+}
+
+
+/** Writes the configuration hash, the previous totals, the previous totals of each prefix group (by
+	group name), the heaviest keys and then the detectors' state (see SaveDetectors()). To be called
+	between slices.
+
+	@param[out] snapshot Snapshot the state is appended to
+	*/
+template <class KeyPolicy, class... Metrics>
+void TrafficAnalyzer<KeyPolicy, Metrics...>::SaveState(SnapshotWriter& snapshot) const
+{
+	snapshot.Put(ConfigHash());
+	snapshot.PutArray(m_prevData, NUM_METRICS);
+
+	snapshot.Put((uint64_t)m_prefixes.NumGroups());
+	for (size_t g = 0; g < m_prefixes.NumGroups(); g++)
+	{
+		snapshot.PutString(m_prefixes.GroupName(g));
+		snapshot.PutArray(&m_prevGroupData[g * NUM_METRICS], NUM_METRICS);
+	}
+
+	snapshot.PutArray(m_heavyKeys.data(), m_heavyKeys.size());
+
+	SaveDetectors(snapshot);
+}
+
+
+/** Prefix groups are matched by name, so groups added to or removed from the prefix file since the
+	snapshot start from zero (or are ignored). Nothing is restored unless the whole snapshot is valid
+	and was taken with the same key and metrics. Must be called after LoadPrefixes() and before any
+	packet is added.
+
+	@param snapshot Snapshot positioned after its header
+
+	@return TRUE if the state was restored and FALSE otherwise (error printed to console)
+	*/
+template <class KeyPolicy, class... Metrics>
+bool TrafficAnalyzer<KeyPolicy, Metrics...>::LoadState(SnapshotReader& snapshot)
+{
+	uint64_t config;
+	if (!snapshot.Get(config) || config != ConfigHash())
+	{
+		cout << "Error: snapshot was taken with a different key or metrics\n";
+		return false;
+	}
+
+	size_t count;
+	const unsigned long long* prevData = snapshot.GetArray<unsigned long long>(count);
+	if (prevData == NULL || count != NUM_METRICS)
+	{
+		cout << "Error: invalid snapshot\n";
+		return false;
+	}
+
+	uint64_t numGroups = 0;
+	vector<unsigned long long> prevGroupData(m_prevGroupData.size(), 0);
+	bool valid = snapshot.Get(numGroups);
+
+	for (uint64_t i = 0; valid && i < numGroups; i++)
+	{
+		string name;
+		const unsigned long long* data;
+		valid = snapshot.GetString(name) && (data = snapshot.GetArray<unsigned long long>(count)) != NULL &&
+				count == NUM_METRICS;
+
+		for (size_t g = 0; valid && g < m_prefixes.NumGroups(); g++)
+		{
+			if (m_prefixes.GroupName(g) == name)
+			{
+				copy(data, data + NUM_METRICS, &prevGroupData[g * NUM_METRICS]);
+			}
+		}
+	}
+
+	const Key* heavyKeys = valid ? snapshot.GetArray<Key>(count) : NULL;
+	if (heavyKeys == NULL || count > HEAVY_KEYS || !LoadDetectors(snapshot))
+	{
+		cout << "Error: invalid snapshot\n";
+		return false;
+	}
+
+	copy(prevData, prevData + NUM_METRICS, m_prevData);
+	m_prevGroupData.swap(prevGroupData);
+
+	m_heavyKeys.assign(heavyKeys, heavyKeys + count);
+	for (size_t i = 0; i < m_heavyKeys.size(); i++)
+	{
+		m_trafficMap.emplace(piecewise_construct, forward_as_tuple(m_heavyKeys[i]), forward_as_tuple(m_arena));
+	}
+
+	return true;
+}
+
+
+
+/** Aggregation key and metrics compiled into the watchdog. Override at build time, e.g.
+	make WDFLAGS='-DWATCHDOG_KEY=DstPortKey -DWATCHDOG_METRICS="PacketCount, FlowCount"' */
+#ifndef WATCHDOG_KEY
+#define WATCHDOG_KEY DstKey
+#endif
+
+#ifndef WATCHDOG_METRICS
+#define WATCHDOG_METRICS PacketCount, ByteCount, FlowCount
+#endif
+
+/** @brief The TrafficAnalyzer configuration used by the watchdog */
+typedef TrafficAnalyzer<WATCHDOG_KEY, WATCHDOG_METRICS> WatchdogAnalyzer;
+
+#endif